@@ -17,6 +17,7 @@
 #include "c4BlobStore.h"
 #include "BlobStore.hh"
 #include "Database.hh"
+#include "MappedFile.hh"
 #include <libb64/decode.h>
 
 
@@ -35,6 +36,8 @@ static SeekableReadStream* internal(C4ReadStream* s)        {return (SeekableRea
 static inline C4ReadStream* external(SeekableReadStream* s) {return (C4ReadStream*)s;}
 static BlobWriteStream* internal(C4WriteStream* s)          {return (BlobWriteStream*)s;}
 static inline C4WriteStream* external(BlobWriteStream* s)   {return (C4WriteStream*)s;}
+static MappedFile* internal(C4BlobMapping* m)               {return (MappedFile*)m;}
+static inline C4BlobMapping* external(MappedFile* m)        {return (C4BlobMapping*)m;}
 
 
 bool c4blob_keyFromString(C4Slice str, C4BlobKey* outKey) noexcept {
@@ -63,6 +66,7 @@ C4BlobStore* c4blob_openStore(C4Slice dirPath,
         BlobStore::Options options = {};
         options.create = (flags & kC4DB_Create) != 0;
         options.writeable = !(flags & kC4DB_ReadOnly);
+        options.packSmallBlobs = true;
         if (key) {
             options.encryptionAlgorithm = (EncryptionAlgorithm)key->algorithm;
             options.encryptionKey = alloc_slice(key->bytes, sizeof(key->bytes));
@@ -114,15 +118,23 @@ C4SliceResult c4blob_getContents(C4BlobStore* store, C4BlobKey key, C4Error* out
 
 C4StringResult c4blob_getFilePath(C4BlobStore* store, C4BlobKey key, C4Error* outError) noexcept {
     try {
-        auto path = store->get(internal(key)).path();
-        if (!path.exists()) {
+        auto blob = store->get(internal(key));
+        if (!blob.exists()) {
             recordError(LiteCoreDomain, kC4ErrorNotFound, outError);
             return {nullptr, 0};
         } else if (store->isEncrypted()) {
             recordError(LiteCoreDomain, kC4ErrorWrongFormat, outError);
             return {nullptr, 0};
         }
-        return sliceResult((string)path);
+        if (blob.isPacked()) {
+            // Small blobs live in shared pack files; move this one into a file of its own:
+            if (!store->options().writeable) {
+                recordError(LiteCoreDomain, kC4ErrorUnsupported, outError);
+                return {nullptr, 0};
+            }
+            store->unpack(blob.key());
+        }
+        return sliceResult((string)blob.path());
     } catchError(outError)
     return {nullptr, 0};
 }
@@ -191,6 +203,32 @@ void c4stream_close(C4ReadStream* stream) noexcept {
 }
 
 
+#pragma mark - MAPPED READS:
+
+
+C4BlobMapping* c4blob_openMapped(C4BlobStore* store, C4BlobKey key, C4Error* outError) noexcept {
+    try {
+        if (store->isEncrypted()) {
+            recordError(LiteCoreDomain, kC4ErrorUnsupported, outError);
+            return nullptr;
+        }
+        unique_ptr<MappedFile> mapping = store->get(internal(key)).map();
+        return external(mapping.release());
+    } catchError(outError)
+    return nullptr;
+}
+
+
+C4Slice c4blob_mappedContents(C4BlobMapping* mapping) noexcept {
+    return internal(mapping)->contents();
+}
+
+
+void c4blob_closeMapped(C4BlobMapping* mapping) noexcept {
+    delete internal(mapping);
+}
+
+
 #pragma mark - STREAMING WRITES:
 
 
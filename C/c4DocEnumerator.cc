@@ -97,7 +97,7 @@ struct C4DocEnumerator: InstanceCounted {
     bool getDocInfo(C4DocumentInfo *outInfo) {
         if (!_e)
             return false;
-        outInfo->docID = _e.record().key();
+        outInfo->docID = _e.record().keySlice();
         outInfo->revID = _docRevID;
         outInfo->flags = _docFlags;
         outInfo->sequence = _e.record().sequence();
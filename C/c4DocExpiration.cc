@@ -17,10 +17,8 @@
 #include "c4ExpiryEnumerator.h"
 #include "Database.hh"
 
-#include "Collatable.hh"
-#include "RecordEnumerator.hh"
 #include "KeyStore.hh"
-#include "varint.hh"
+#include <algorithm>
 #include <stdint.h>
 #include <ctime>
 
@@ -31,50 +29,16 @@ using namespace fleece;
 static bool c4doc_setExpirationInternal(C4Database *db, C4Slice docId, uint64_t timestamp, C4Error *outError)
 {
     return tryCatch<bool>(outError, [&]{
-        if (!db->defaultKeyStore().get(docId, kMetaOnly).exists()) {
+        WITH_LOCK(db);
+        KeyStore &docs = db->defaultKeyStore();
+        if (!docs.get(docId, kMetaOnly).exists()) {
             recordError(LiteCoreDomain, kC4ErrorNotFound, outError);
             return false;
         }
 
-        CollatableBuilder tsKeyBuilder;
-        tsKeyBuilder.beginArray();
-        tsKeyBuilder << (double)timestamp;
-        tsKeyBuilder << docId;
-        tsKeyBuilder.endArray();
-        slice tsKey = tsKeyBuilder.data();
-
-        alloc_slice tsValue(SizeOfVarInt(timestamp));
-        PutUVarInt((void *)tsValue.buf, timestamp);
-
-        Transaction &t = db->transaction();
-        KeyStore& expiry = db->getKeyStore("expiry");
-        Record existingDoc = expiry.get(docId);
-        if (existingDoc.exists()) {
-            // Previous entry found
-            if (existingDoc.body().compare(tsValue) == 0) {
-                // No change
-                return true;
-            }
-
-            // Remove old entry
-            uint64_t oldTimestamp;
-            CollatableBuilder oldTsKey;
-            GetUVarInt(existingDoc.body(), &oldTimestamp);
-            oldTsKey.beginArray();
-            oldTsKey << (double)oldTimestamp;
-            oldTsKey << docId;
-            oldTsKey.endArray();
-            expiry.del(oldTsKey, t);
-        }
-
-        if (timestamp == 0) {
-            expiry.del(tsKey, t);
-            expiry.del(docId, t);
-        } else {
-            expiry.set(tsKey, nullslice, t);
-            expiry.set(docId, tsValue, t);
-        }
-
+        // Expiration times are stored as signed integers; UINT64_MAX etc. mean "never"
+        auto expiration = (KeyStore::expiration_t)min(timestamp, (uint64_t)INT64_MAX);
+        docs.setExpiration(docId, expiration, db->transaction());
         return true;
     });
 }
@@ -86,20 +50,17 @@ bool c4doc_setExpiration(C4Database *db, C4Slice docId, uint64_t timestamp, C4Er
     }
 
     bool commit = c4doc_setExpirationInternal(db, docId, timestamp, outError);
-    return c4db_endTransaction(db, commit, outError);
+    bool ended = c4db_endTransaction(db, commit, outError);
+    if (ended && commit)
+        db->expirationChanged();        // Wake the purger thread, if any
+    return ended;
 }
 
 
 uint64_t c4doc_getExpiration(C4Database *db, C4Slice docID) noexcept {
-    KeyStore &expiryKvs = db->getKeyStore("expiry");
-    Record existing = expiryKvs.get(docID);
-    if (!existing.exists()) {
-        return 0;
-    }
-
-    uint64_t timestamp;
-    GetUVarInt(existing.body(), &timestamp);
-    return timestamp;
+    return tryCatch<uint64_t>(nullptr, [&]{
+        return (uint64_t)db->documentExpiration(docID);
+    });
 }
 
 
@@ -110,24 +71,21 @@ struct C4ExpiryEnumerator
 {
 public:
     C4ExpiryEnumerator(C4Database *database) :
-    _db(database),
-    _e(_db->getKeyStore("expiry"), nullslice, nullslice),
-    _reader(nullslice)
+    _db(database)
     {
         _endTimestamp = time(nullptr);
         reset();
     }
 
     bool next() {
-        if(!_e.next()) {
-            return false;
+        if (_next >= _page.size()) {
+            if (!_atStart && _page.size() < kPageSize)
+                return false;       // The last page was partial, so there are no more
+            loadPage();
+            if (_page.empty())
+                return false;
         }
-        
-        _reader = CollatableReader(_e.record().key());
-        _reader.skipTag();
-        _reader.readInt();
-        _current = _reader.readString();
-        
+        _current = _page[_next++].first;
         return true;
     }
     
@@ -136,26 +94,19 @@ public:
         return _current;
     }
     
-    slice key() const
-    {
-        return _e.record().key();
-    }
-    
     void reset()
     {
-        CollatableBuilder c;
-        c.beginArray();
-        c << (double)_endTimestamp;
-        c.beginMap();
-        c.endMap();
-        c.endArray();
-        _e = RecordEnumerator(_db->getKeyStore("expiry"), nullslice, c.data());
-        _reader = CollatableReader(nullslice);
+        _page.clear();
+        _next = 0;
+        _atStart = true;
+        _current = nullslice;
     }
 
     void close()
     {
-        _e.close();
+        _page.clear();
+        _next = 0;
+        _atStart = false;
     }
     
     C4Database *getDatabase() const
@@ -164,11 +115,30 @@ public:
     }
     
 private:
+    // Loads the next page of expired docIDs, resuming after the last one returned. (Paging by
+    // position, rather than by offset, is unaffected by docs being purged in the meantime.)
+    void loadPage()
+    {
+        KeyStore::expiration_t afterExpiration = INT64_MIN;
+        alloc_slice afterDocID;
+        if (!_page.empty()) {
+            afterExpiration = _page.back().second;
+            afterDocID = _page.back().first;
+        }
+        _page = _db->expiredDocumentsAfter(_endTimestamp, afterExpiration, afterDocID,
+                                           kPageSize);
+        _next = 0;
+        _atStart = false;
+    }
+
+    static const unsigned kPageSize = 100;
+
     Retained<Database> _db;
-    RecordEnumerator _e;
-    alloc_slice _current;
-    CollatableReader _reader;
-    uint64_t _endTimestamp;
+    vector<pair<alloc_slice, KeyStore::expiration_t>> _page;
+    size_t _next {0};
+    bool _atStart {true};
+    slice _current;
+    time_t _endTimestamp;
 };
 
 C4ExpiryEnumerator *c4db_enumerateExpired(C4Database *database, C4Error *outError) noexcept {
@@ -195,13 +165,11 @@ bool c4exp_purgeExpired(C4ExpiryEnumerator *e, C4Error *outError) noexcept {
     if (!c4db_beginTransaction(e->getDatabase(), outError))
         return false;
     bool commit = tryCatch(outError, [&]{
-        WITH_LOCK(e->getDatabase());
         e->reset();
-        Transaction &t = e->getDatabase()->transaction();
-        KeyStore& expiry = e->getDatabase()->getKeyStore("expiry");
         while(e->next()) {
-            expiry.del(e->key(), t);
-            expiry.del(e->docID(), t);
+            WITH_LOCK(e->getDatabase());        // (next() locks the database itself)
+            e->getDatabase()->defaultKeyStore().setExpiration(e->docID(), 0,
+                                                              e->getDatabase()->transaction());
         }
     });
     
@@ -218,3 +186,31 @@ void c4exp_close(C4ExpiryEnumerator *e) noexcept {
 void c4exp_free(C4ExpiryEnumerator *e) noexcept {
     delete e;
 }
+
+
+#pragma mark - PURGING:
+
+
+int64_t c4db_purgeExpiredDocs(C4Database *database, C4Error *outError) noexcept {
+    return tryCatch<int64_t>(outError, [&]{
+        int64_t total = 0;
+        unsigned n;
+        do {
+            n = database->purgeExpiredDocuments(Database::kExpirationPurgeBatchSize);
+            total += n;
+        } while (n > 0);
+        return total;
+    });
+}
+
+bool c4db_startExpirationPurger(C4Database *database, C4Error *outError) noexcept {
+    return tryCatch(outError, [&]{
+        database->startExpirationScheduler();
+    });
+}
+
+void c4db_stopExpirationPurger(C4Database *database) noexcept {
+    try {
+        database->stopExpirationScheduler();
+    } catchExceptions()
+}
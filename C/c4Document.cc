@@ -26,6 +26,8 @@
 #include "SecureRandomize.hh"
 #include "Fleece.hh"
 #include "Fleece.h"
+#include <algorithm>
+#include <unordered_set>
 
 
 void c4doc_free(C4Document *doc) noexcept {
@@ -245,14 +247,16 @@ C4Document* c4doc_getForPut(C4Database *database,
 }
 
 
-C4Document* c4doc_put(C4Database *database,
-                      const C4DocPutRequest *rq,
-                      size_t *outCommonAncestorIndex,
-                      C4Error *outError) noexcept
+// Common code of c4doc_put and c4doc_putBatch. Returns null and sets outError on failure, but
+// may also throw. `outInserted` is set to true if the request was applied, i.e. if the document
+// would need saving. `precomputedRevID` is an optional revID from generateRevIDs.
+static C4Document* putRevision(C4Database *database,
+                               const C4DocPutRequest *rq,
+                               slice precomputedRevID,
+                               int &commonAncestorIndex,
+                               bool *outInserted,
+                               C4Error *outError)
 {
-    if (!database->mustBeInTransaction(outError))
-        return nullptr;
-    int commonAncestorIndex;
     C4Document *doc = nullptr;
     try {
         if (rq->existingRevision) {
@@ -263,6 +267,8 @@ C4Document* c4doc_put(C4Database *database,
             if (!doc)
                 return nullptr;
             commonAncestorIndex = internal(doc)->putExistingRevision(*rq);
+            if (outInserted)
+                *outInserted = (commonAncestorIndex > 0);
 
         } else {
             // New revision:
@@ -276,17 +282,119 @@ C4Document* c4doc_put(C4Database *database,
                                   outError);
             if (!doc)
                 return nullptr;
-            commonAncestorIndex = internal(doc)->putNewRevision(*rq) ? 1 : 0;
+            bool inserted = internal(doc)->putNewRevision(*rq, precomputedRevID);
+            commonAncestorIndex = inserted ? 1 : 0;
+            if (outInserted)
+                *outInserted = inserted;
         }
+        return doc;
+    } catch (...) {
+        c4doc_free(doc);
+        throw;
+    }
+}
+
 
-        if (outCommonAncestorIndex)
+C4Document* c4doc_put(C4Database *database,
+                      const C4DocPutRequest *rq,
+                      size_t *outCommonAncestorIndex,
+                      C4Error *outError) noexcept
+{
+    if (!database->mustBeInTransaction(outError))
+        return nullptr;
+    try {
+        int commonAncestorIndex;
+        C4Document *doc = putRevision(database, rq, nullslice, commonAncestorIndex, nullptr,
+                                       outError);
+        if (doc && outCommonAncestorIndex)
             *outCommonAncestorIndex = commonAncestorIndex;
         return doc;
+    } catchError(outError)
+    return nullptr;
+}
 
-    } catchError(outError) {
-        c4doc_free(doc);
-        return nullptr;
+
+// Max number of documents c4doc_putBatch will save at once
+static const size_t kPutBatchSize = 1000;
+
+
+bool c4doc_putBatch(C4Database *database,
+                    const C4DocPutRequest requests[],
+                    size_t count,
+                    C4Document* outDocs[],
+                    C4Error *outError) noexcept
+{
+    if (!database->mustBeInTransaction(outError))
+        return false;
+    if (outDocs)
+        fill(&outDocs[0], &outDocs[count], nullptr);
+
+    vector<Document*> pending;                          // Docs inserted but not saved yet
+    unordered_set<slice, fleece::sliceHash> pendingIDs; // IDs of the pending docs
+    unsigned pendingDepth = 0;                          // maxRevTreeDepth of pending docs
+
+    // Saves the pending docs; if the caller doesn't want them, frees them.
+    auto flush = [&]() {
+        database->saveDocuments(pending, pendingDepth);
+        if (!outDocs) {
+            for (auto doc : pending)
+                delete doc;
+        }
+        pending.clear();
+        pendingIDs.clear();
+    };
+
+    try {
+        // Digest the new revisions' bodies up front, where it can be done in parallel:
+        auto revIDs = database->documentFactory().generateRevIDs(requests, count);
+
+        bool ok = true;
+        for (size_t i = 0; i < count; ++i) {
+            const C4DocPutRequest &rq = requests[i];
+            // A doc has to be saved before it's read again, and a batch has one maxRevTreeDepth:
+            if (pendingIDs.count(rq.docID) > 0
+                    || (rq.save && !pending.empty() && rq.maxRevTreeDepth != pendingDepth))
+                flush();
+
+            C4DocPutRequest unsavedRQ = rq;
+            unsavedRQ.save = false;
+            int commonAncestorIndex;
+            bool inserted = false;
+            auto doc = internal(putRevision(database, &unsavedRQ, revIDs[i],
+                                            commonAncestorIndex, &inserted, outError));
+            if (!doc) {
+                ok = false;
+                break;
+            }
+            if (outDocs)
+                outDocs[i] = doc;
+            if (rq.save && inserted) {
+                pending.push_back(doc);
+                pendingIDs.insert(doc->_docIDBuf);
+                pendingDepth = rq.maxRevTreeDepth;
+                if (pending.size() >= kPutBatchSize)
+                    flush();
+            } else if (!outDocs) {
+                delete doc;
+            }
+        }
+        if (ok) {
+            flush();
+            return true;
+        }
+    } catchError(outError)
+
+    // Failure:
+    if (outDocs) {
+        for (size_t i = 0; i < count; ++i) {
+            c4doc_free(outDocs[i]);
+            outDocs[i] = nullptr;
+        }
+    } else {
+        for (auto doc : pending)
+            delete doc;
     }
+    return false;
 }
 
 
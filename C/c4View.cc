@@ -164,6 +164,17 @@ void c4view_setDocumentType(C4View *view, C4Slice docType) noexcept {
 }
 
 
+bool c4view_setStoredReduce(C4View *view, bool storedReduce, C4Error *outError) noexcept {
+    return tryCatch<bool>(outError, [&]{
+        WITH_LOCK(view);
+        if (!view->checkNotBusy(outError))
+            return false;
+        view->_index.setStoredReduce(storedReduce);
+        return true;
+    });
+}
+
+
 void c4view_setOnCompactCallback(C4View *view, C4OnCompactCallback cb, void *context) noexcept {
     WITH_LOCK(view);
     view->_viewDB->setOnCompact([cb,context](bool compacting) {
@@ -230,6 +241,13 @@ void c4indexer_triggerOnView(C4Indexer *indexer, C4View *view) noexcept {
 }
 
 
+void c4indexer_setParallel(C4Indexer *indexer, bool parallel) noexcept {
+    try {
+        indexer->setParallel(parallel);
+    } catchExceptions()
+}
+
+
 C4DocEnumerator* c4indexer_enumerateDocuments(C4Indexer *indexer, C4Error *outError) noexcept {
     return tryCatch<C4DocEnumerator*>(outError, [&]{
         sequence startSequence;
@@ -260,7 +278,7 @@ C4DocEnumerator* c4indexer_enumerateDocuments(C4Indexer *indexer, C4Error *outEr
                 return true;
             // We're skipping this record because it's either purged or deleted, or its docType
             // doesn't match. But we do have to update the index to _remove_ it
-            indexer->skipDoc(rec.key(), rec.sequence());
+            indexer->skipDoc(rec.keySlice(), rec.sequence());
             return false;
         });
         return e;
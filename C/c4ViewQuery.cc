@@ -25,9 +25,15 @@
 #include "Query.hh"
 #include "Collatable.hh"
 #include "DocumentMeta.hh"
+#include "RecordEnumerator.hh"
+#include "SequenceTracker.hh"
+#include <algorithm>
 #include <math.h>
 #include <limits.h>
+#include <deque>
 #include <mutex>
+#include <unordered_map>
+#include <unordered_set>
 using namespace litecore;
 
 
@@ -82,6 +88,8 @@ static IndexEnumerator::Options convertOptions(const C4QueryOptions *c4options)
     options.inclusiveEnd = c4options->inclusiveEnd;
     if (c4options->reduce)
         options.reduce = new C4ReduceAdapter(c4options->reduce);    // must be freed afterwards
+    else if (c4options->builtInReduce != kC4NoReduce)
+        options.reduce = new BuiltInReduceFunction((BuiltInReduce)c4options->builtInReduce);
     options.groupLevel = c4options->groupLevel;
     return options;
 }
@@ -163,18 +171,22 @@ struct C4MapReduceEnumerator : public C4ViewQueryEnumInternal {
     C4MapReduceEnumerator(C4View *view,
                         Collatable startKey, slice startKeyDocID,
                         Collatable endKey, slice endKeyDocID,
-                        const IndexEnumerator::Options &options)
+                        const IndexEnumerator::Options &options,
+                        bool includeDocs)
     :C4ViewQueryEnumInternal(view),
      _reduce(options.reduce),
-     _enum(view->_index, startKey, startKeyDocID, endKey, endKeyDocID, options)
+     _enum(view->_index, startKey, startKeyDocID, endKey, endKeyDocID, options),
+     _includeDocs(includeDocs)
     { }
 
     C4MapReduceEnumerator(C4View *view,
                         vector<KeyRange> keyRanges,
-                        const IndexEnumerator::Options &options)
+                        const IndexEnumerator::Options &options,
+                        bool includeDocs)
     :C4ViewQueryEnumInternal(view),
      _reduce(options.reduce),
-     _enum(view->_index, keyRanges, options)
+     _enum(view->_index, keyRanges, options),
+     _includeDocs(includeDocs)
     { }
 
     virtual ~C4MapReduceEnumerator() {
@@ -182,6 +194,8 @@ struct C4MapReduceEnumerator : public C4ViewQueryEnumInternal {
     }
 
     virtual bool next() override {
+        if (_includeDocs)
+            return nextWithDoc();
         if (!_enum.next())
             return C4ViewQueryEnumInternal::next();
         key = asKeyReader(_enum.key());
@@ -193,11 +207,159 @@ struct C4MapReduceEnumerator : public C4ViewQueryEnumInternal {
 
     virtual void close() noexcept override {
         _enum.close();
+        _rows.clear();
     }
 
 private:
+    // An index row that's been read ahead, so its document can be fetched along with others'.
+    struct Row {
+        alloc_slice key, value, docID, revID;
+        sequence_t sequence;
+        C4DocumentFlags flags {0};
+        bool fetched {false};
+    };
+
+    // Max number of rows to read ahead when including docs
+    static const size_t kRowsPerPage = 100;
+
+    // Use a single scan if the docs' sequences are at least this dense; else look up each one
+    static const sequence_t kMaxSequenceGapToScan = 4;
+
+    bool nextWithDoc() {
+        if (_rows.empty() && !readPage())
+            return C4ViewQueryEnumInternal::next();
+        _row = move(_rows.front());
+        _rows.pop_front();
+        key = asKeyReader(CollatableReader(_row.key));
+        value = _row.value;
+        docID = _row.docID;
+        docSequence = _row.sequence;
+        revID = _row.revID;
+        docFlags = _row.flags;
+        return true;
+    }
+
+    // Reads the next page of rows from the index, then fetches the documents of the ones whose
+    // value is the placeholder for the entire doc.
+    bool readPage() {
+        vector<Row*> docRows;
+        while (_rows.size() < kRowsPerPage && _enum.next()) {
+            _rows.emplace_back();
+            Row &row = _rows.back();
+            row.key = _enum.key().data();
+            row.value = _enum.value();
+            row.docID = _enum.recordID();
+            row.sequence = _enum.sequence();
+            if (row.value == Index::kSpecialValue)
+                docRows.push_back(&row);
+        }
+        if (!docRows.empty())
+            fetchDocs(docRows);
+        return !_rows.empty();
+    }
+
+    // Loads the current revisions of the rows' docs in sequence order, instead of doing one
+    // random read per row. Each row's value becomes its doc's body.
+    void fetchDocs(vector<Row*> &rows) {
+        sort(rows.begin(), rows.end(), [](const Row *a, const Row *b) {
+            return a->sequence < b->sequence;
+        });
+        Database *db = _view->_sourceDB;
+        WITH_LOCK(db);
+        KeyStore &store = db->defaultKeyStore();
+        auto fleeceAccessor = db->dataFile()->fleeceAccessor();
+        auto readDoc = [&](Row *row, const Record &rec) {
+            DocumentMeta meta(rec);
+            slice body = rec.bodySlice();
+            row->value = fleeceAccessor ? fleeceAccessor(body) : body;
+            row->revID = db->documentFactory().revIDFromMeta(meta);
+            row->flags = (C4DocumentFlags)meta.flags;
+            row->fetched = true;
+        };
+
+        sequence_t minSeq = rows.front()->sequence, maxSeq = rows.back()->sequence;
+        if (maxSeq - minSeq < kMaxSequenceGapToScan * rows.size()) {
+            // Scan the sequence range once, merging it with the (sorted) rows. A doc may have
+            // emitted several rows, so they can share a sequence:
+            RecordEnumerator::Options options;
+            options.includeDeleted = true;
+            RecordEnumerator e(store, minSeq, maxSeq, options);
+            auto row = rows.begin();
+            while (row != rows.end() && e.next()) {
+                sequence_t seq = e.record().sequence();
+                for (; row != rows.end() && (*row)->sequence <= seq; ++row) {
+                    if ((*row)->sequence == seq && e.record().keySlice() == (*row)->docID)
+                        readDoc(*row, e.record());
+                }
+            }
+        } else {
+            for (Row *row : rows) {
+                store.get(row->sequence, kDefaultContent, [&](const Record &rec) {
+                    if (rec.exists() && rec.keySlice() == row->docID)
+                        readDoc(row, rec);
+                });
+            }
+        }
+
+        // A doc that's changed since it was indexed is no longer at the row's sequence:
+        for (Row *row : rows) {
+            if (!row->fetched) {
+                store.get(row->docID, kDefaultContent, [&](const Record &rec) {
+                    if (rec.exists())
+                        readDoc(row, rec);
+                });
+            }
+        }
+    }
+
     ReduceFunction *_reduce {nullptr};
     IndexEnumerator _enum;
+    bool _includeDocs;
+    deque<Row> _rows;           // Rows read ahead, with their docs
+    Row _row;                   // The current row (when including docs)
+};
+
+
+// Returns the rows of a built-in reduce query straight from the index's stored aggregates.
+struct C4StoredReduceEnumerator : public C4ViewQueryEnumInternal {
+    C4StoredReduceEnumerator(C4View *view, const C4QueryOptions *options)
+    :C4ViewQueryEnumInternal(view)
+    {
+        auto reduce = (BuiltInReduce)options->builtInReduce;
+        uint64_t skip = options->skip, limit = options->limit;
+        view->_index.readStoredAggregates(options->groupLevel,
+                                          ReduceAggregate::needsMinMax(reduce),
+                                          [&](slice key, const ReduceAggregate &aggregate) {
+            if (skip > 0) {
+                --skip;
+            } else if (limit > 0) {
+                --limit;
+                _rows.push_back({alloc_slice(key), aggregate.result(reduce)});
+            }
+        });
+    }
+
+    virtual bool next() override {
+        if (_pos >= _rows.size())
+            return C4ViewQueryEnumInternal::next();
+        auto &row = _rows[_pos++];
+        key = asKeyReader(CollatableReader(row.first));
+        value = row.second;
+        return true;
+    }
+
+    // Can this query be answered from the stored aggregates?
+    static bool canAnswer(C4View *view, const C4QueryOptions *options) {
+        return view->_index.storedReduce()
+            && options->builtInReduce != kC4NoReduce && !options->reduce
+            && options->groupLevel <= MapReduceIndex::kMaxStoredReduceGroupLevel
+            && !options->descending && !options->startKey && !options->endKey
+            && !options->keys && options->keysCount == 0;
+    }
+
+private:
+    vector<pair<alloc_slice, alloc_slice>> _rows;   // Reduced keys and values
+    size_t _pos {0};
 };
 
 
@@ -205,10 +367,12 @@ C4QueryEnumerator* c4view_query(C4View *view,
                                 const C4QueryOptions *c4options,
                                 C4Error *outError) noexcept
 {
-    return tryCatch<C4QueryEnumerator*>(outError, [&]{
+    return tryCatch<C4QueryEnumerator*>(outError, [&]() -> C4QueryEnumerator* {
         WITH_LOCK(view);
         if (!c4options)
             c4options = &kC4DefaultQueryOptions;
+        if (C4StoredReduceEnumerator::canAnswer(view, c4options))
+            return new C4StoredReduceEnumerator(view, c4options);
         IndexEnumerator::Options options = convertOptions(c4options);
 
         if (c4options->keysCount == 0 && c4options->keys == nullptr) {
@@ -220,7 +384,8 @@ C4QueryEnumerator* c4view_query(C4View *view,
                                            (c4options->endKey ? (Collatable)*c4options->endKey
                                                               : noKey),
                                            c4options->endKeyDocID,
-                                           options);
+                                           options,
+                                           c4options->includeDocs);
         } else {
             vector<KeyRange> keyRanges;
             for (size_t i = 0; i < c4options->keysCount; i++) {
@@ -228,7 +393,7 @@ C4QueryEnumerator* c4view_query(C4View *view,
                 if (key)
                     keyRanges.emplace_back(*key);
             }
-            return new C4MapReduceEnumerator(view, keyRanges, options);
+            return new C4MapReduceEnumerator(view, keyRanges, options, c4options->includeDocs);
         }
     });
 }
@@ -322,6 +487,7 @@ C4QueryEnumerator* c4query_run(C4Query *query,
         if (options) {
             qeOpts.skip = options->skip;
             qeOpts.limit = options->limit;
+            qeOpts.streaming = options->streaming;
         }
         qeOpts.paramBindings = encodedParameters;
         return new C4DBQueryEnumerator(query, &qeOpts);
@@ -369,6 +535,231 @@ C4SliceResult c4queryenum_fullTextMatched(C4QueryEnumerator *e,
 }
 
 
+#pragma mark LIVE QUERIES:
+
+
+// If more than this many documents changed, a live query re-runs the whole query instead of
+// re-running it on each changed document
+static const size_t kMaxIncrementalLiveQueryDocs = 100;
+
+
+struct c4LiveQuery : InstanceCounted {
+    c4LiveQuery(C4Query *query, C4Slice params, C4LiveQueryCallback callback, void *context)
+    :_database(query->database()),
+     _query(query),
+     _params(params),
+     _callback(callback),
+     _context(context),
+     _notifier(_database->sequenceTracker(),
+               [this](DatabaseChangeNotifier&) {dispatchCallback();})
+    { }
+
+
+    void dispatchCallback() {
+        if (_callback)
+            _callback(this, _context);
+    }
+
+
+    // Fills in up to maxChanges changes. Re-runs the query first if all the previously computed
+    // changes have been returned and the database has changed since the last run.
+    uint32_t getChanges(C4LiveQueryChange outChanges[], uint32_t maxChanges) {
+        _delivered.clear();     // invalidates the slices returned by the previous call
+        if (_pending.empty() && (!_hasRun || readDatabaseChanges()))
+            update();
+        uint32_t n;
+        for (n = 0; n < maxChanges && !_pending.empty(); ++n) {
+            _delivered.push_back(move(_pending.front()));
+            _pending.pop_front();
+            const Change &change = _delivered.back();
+            outChanges[n].type = change.type;
+            outChanges[n].index = change.index;
+            outChanges[n].docID = change.row.docID;
+            outChanges[n].docSequence = change.row.sequence;
+            outChanges[n].customColumns = change.row.columns;
+        }
+        return n;
+    }
+
+    Retained<Database> _database;
+
+private:
+    struct Row {
+        alloc_slice docID;
+        sequence_t sequence;
+        alloc_slice columns;
+    };
+
+    struct Change {
+        C4LiveQueryChangeType type;
+        uint32_t index;
+        Row row;
+    };
+
+
+    // Consumes the notifier's pending changes, remembering which docs changed (unless there are
+    // too many to re-query one by one.) Returns true if there were any.
+    bool readDatabaseChanges() {
+        lock_guard<mutex> lock(_notifier.tracker.mutex());
+        slice docIDs[100];
+        bool external, changed = false;
+        uint32_t n;
+        while ((n = _notifier.readChanges(docIDs, 100, external)) > 0) {
+            changed = true;
+            for (uint32_t i = 0; i < n && !_tooManyChanges; ++i) {
+                string docID = (string)docIDs[i];
+                if (_changedDocIDSet.insert(docID).second)
+                    _changedDocIDs.push_back(docID);
+                _tooManyChanges = (_changedDocIDs.size() > kMaxIncrementalLiveQueryDocs);
+            }
+        }
+        return changed;
+    }
+
+
+    // Runs the whole query.
+    vector<Row> allRows() {
+        QueryEnumerator::Options options;
+        options.paramBindings = _params;
+        vector<Row> rows;
+        for (QueryEnumerator e(_query->query(), &options); e.next(); )
+            rows.push_back({alloc_slice(e.recordID()), e.sequence(), e.getCustomColumns()});
+        return rows;
+    }
+
+
+    // Computes the new results from the previous ones, by re-running the query on only the
+    // changed docs. Their rows (if any) move to the end, as they would in a full run since
+    // saving a doc gives it a new rowid.
+    vector<Row> updatedRows() {
+        vector<Row> rows;
+        rows.reserve(_rows.size());
+        for (auto &row : _rows) {
+            if (_changedDocIDSet.find((string)row.docID) == _changedDocIDSet.end())
+                rows.push_back(row);
+        }
+        QueryEnumerator::Options options;
+        options.paramBindings = _params;
+        for (auto &docID : _changedDocIDs) {
+            options.onlyRecordID = slice(docID);
+            for (QueryEnumerator e(_query->query(), &options); e.next(); )
+                rows.push_back({alloc_slice(e.recordID()), e.sequence(), e.getCustomColumns()});
+        }
+        return rows;
+    }
+
+
+    // Identifies each row by its docID, plus an occurrence count in case a doc appears in more
+    // than one row. (Rows of aggregate queries have no docID, so they're identified by position.)
+    static vector<string> rowKeys(const vector<Row> &rows) {
+        unordered_map<string, unsigned> occurrences;
+        vector<string> keys;
+        keys.reserve(rows.size());
+        for (auto &row : rows) {
+            string key = row.docID ? (string)row.docID : string();
+            unsigned n = occurrences[key]++;
+            key.push_back('\0');
+            key += to_string(n);
+            keys.push_back(key);
+        }
+        return keys;
+    }
+
+
+    // Runs the query and appends the differences from the previous results to _pending.
+    void update() {
+        vector<Row> rows;
+        if (_hasRun && !_tooManyChanges && _query->query()->rowsAreIndependent())
+            rows = updatedRows();
+        else
+            rows = allRows();
+        _hasRun = true;
+        _changedDocIDs.clear();
+        _changedDocIDSet.clear();
+        _tooManyChanges = false;
+
+        auto oldKeys = rowKeys(_rows), newKeys = rowKeys(rows);
+        unordered_map<string, uint32_t> oldIndexes;
+        for (uint32_t i = 0; i < oldKeys.size(); ++i)
+            oldIndexes[oldKeys[i]] = i;
+
+        vector<bool> stillPresent(_rows.size(), false);
+        vector<Change> addedOrChanged;
+        for (uint32_t i = 0; i < rows.size(); ++i) {
+            auto found = oldIndexes.find(newKeys[i]);
+            if (found == oldIndexes.end()) {
+                addedOrChanged.push_back({kC4RowAdded, i, rows[i]});
+            } else {
+                const Row &old = _rows[found->second];
+                stillPresent[found->second] = true;
+                if (old.sequence != rows[i].sequence || old.columns != rows[i].columns)
+                    addedOrChanged.push_back({kC4RowChanged, i, rows[i]});
+            }
+        }
+        for (uint32_t i = 0; i < _rows.size(); ++i) {
+            if (!stillPresent[i])
+                _pending.push_back({kC4RowRemoved, i, _rows[i]});
+        }
+        _pending.insert(_pending.end(), addedOrChanged.begin(), addedOrChanged.end());
+        _rows = move(rows);
+    }
+
+
+    C4Query* const _query;
+    alloc_slice const _params;
+    C4LiveQueryCallback const _callback;
+    void* const _context;
+    bool _hasRun {false};
+    vector<string> _changedDocIDs;          // Docs changed since the last run, in order
+    unordered_set<string> _changedDocIDSet; // Same as _changedDocIDs, for lookup
+    bool _tooManyChanges {false};           // Too many changed docs to re-query individually
+    vector<Row> _rows;                      // Current query results
+    deque<Change> _pending;                 // Changes not yet returned by getChanges
+    vector<Change> _delivered;              // Changes returned by the last getChanges call
+public:
+    DatabaseChangeNotifier _notifier;
+    //NOTE: _notifier must be destructed before _database (see c4DatabaseObserver.)
+};
+
+
+C4LiveQuery* c4livequery_new(C4Query *query,
+                             C4Slice encodedParameters,
+                             C4LiveQueryCallback callback,
+                             void *context,
+                             C4Error *outError) noexcept
+{
+    return tryCatch<C4LiveQuery*>(outError, [&]{
+        WITH_LOCK(query->database());
+        lock_guard<mutex> lock(query->database()->sequenceTracker().mutex());
+        return new c4LiveQuery(query, encodedParameters, callback, context);
+    });
+}
+
+
+uint32_t c4livequery_getChanges(C4LiveQuery *liveQuery,
+                                C4LiveQueryChange outChanges[],
+                                uint32_t maxChanges,
+                                C4Error *outError) noexcept
+{
+    return tryCatch<uint32_t>(outError, [&]{
+        WITH_LOCK(liveQuery->_database);
+        uint32_t n = liveQuery->getChanges(outChanges, maxChanges);
+        if (n == 0)
+            clearError(outError);
+        return n;
+    });
+}
+
+
+void c4livequery_free(C4LiveQuery *liveQuery) noexcept {
+    if (liveQuery) {
+        WITH_LOCK(liveQuery->_database);
+        lock_guard<mutex> lock(liveQuery->_notifier.tracker.mutex());
+        delete liveQuery;
+    }
+}
+
+
 #pragma mark - INDEXES:
 
 
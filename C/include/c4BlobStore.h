@@ -87,7 +87,8 @@ extern "C" {
     /** Returns the path of the file that stores the blob, if possible. This call may fail with
         error kC4ErrorWrongFormat if the blob is encrypted (in which case the file would be
         unreadable by the caller) or with kC4ErrorUnsupported if for some implementation reason
-        the blob isn't stored as a standalone file.
+        the blob isn't stored as a standalone file. (A small blob kept in a shared pack file is
+        first moved into a file of its own, unless the store is read-only.)
         Thus, the caller MUST use this function only as an optimization, and fall back to reading
         the contents via the API if it fails.
         Also, it goes without saying that the caller MUST not modify the file! */
@@ -139,6 +140,29 @@ extern "C" {
     /** @} */
 
 
+    /** \name Memory-Mapped Reads
+        @{ */
+
+    /** A read-only memory mapping of a blob's contents. */
+    typedef struct c4BlobMapping C4BlobMapping;
+
+    /** Memory-maps a blob's contents, so they can be read (or handed to another API, like a
+        socket write) without being copied into a heap buffer first. Fails with
+        kC4ErrorUnsupported if the store is encrypted, since the stored data isn't plaintext;
+        use c4blob_getContents or a read stream instead.
+        Call c4blob_closeMapped when finished with it. */
+    C4BlobMapping* c4blob_openMapped(C4BlobStore*, C4BlobKey, C4Error*) C4API;
+
+    /** Returns the mapped contents of a blob. They remain valid until c4blob_closeMapped is
+        called. */
+    C4Slice c4blob_mappedContents(C4BlobMapping*) C4API;
+
+    /** Unmaps a blob's contents. (A NULL parameter is allowed.) */
+    void c4blob_closeMapped(C4BlobMapping*) C4API;
+
+    /** @} */
+
+
     /** \name Streamed Writes
         @{ */
 
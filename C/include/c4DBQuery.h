@@ -46,7 +46,12 @@ extern "C" {
         NOTE: Queries will run much faster if the appropriate properties are indexed.
         Indexes must be created explicitly by calling `c4db_createIndex`.
         @param query  The compiled query to run.
-        @param options  Query options; only `skip` and `limit` are currently recognized.
+        @param options  Query options; only `skip`, `limit` and `streaming` are currently
+                recognized. By default all the result rows are collected before this function
+                returns; with `streaming` set, rows are instead read from the database as
+                c4queryenum_next is called, so the first row is available much sooner and the
+                results don't have to fit in memory. A streaming enumerator should be freed
+                promptly, and the query must not be freed before it.
         @param encodedParameters  Optional JSON object whose keys correspond to the named
                 parameters in the query expression, and values correspond to the values to
                 bind. Any unbound parameters will be `null`.
@@ -72,6 +77,76 @@ extern "C" {
     /** @} */
 
 
+    //////// LIVE QUERIES:
+
+
+    /** \name Live Queries
+     @{ */
+
+
+    /** Opaque handle to a live query, which tracks changes to a query's results. */
+    typedef struct c4LiveQuery C4LiveQuery;
+
+    /** Callback invoked by a live query when the database changes in a way that may have changed
+        the query results. Like a database observer's callback, it's called _once_; it won't be
+        called again until `c4livequery_getChanges` has been called. It may be called on any
+        thread, and shouldn't call back into LiteCore. */
+    typedef void (*C4LiveQueryCallback)(C4LiveQuery *liveQuery, void *context);
+
+    /** Ways a result row can change. */
+    typedef C4_ENUM(uint8_t, C4LiveQueryChangeType) {
+        kC4RowAdded,            ///< Row is new in the results
+        kC4RowRemoved,          ///< Row is no longer in the results
+        kC4RowChanged,          ///< Row's document was updated, or its custom columns changed
+    };
+
+    /** Describes a change to one row of a live query's results. */
+    typedef struct {
+        C4LiveQueryChangeType type;
+        uint32_t index;             ///< Index in the new results (or the old, if it was removed)
+        C4String docID;             ///< ID of the row's document (null in aggregate queries)
+        C4SequenceNumber docSequence;
+        C4String customColumns;     ///< Fleece array of custom column values, or null
+    } C4LiveQueryChange;
+
+    /** Creates a live query. The query is run when `c4livequery_getChanges` is first called,
+        which reports all the result rows as added. After that, changes to the database are
+        batched until the next call to `c4livequery_getChanges`, which re-runs the query only if
+        there were changes, and returns only the rows that were added, removed or changed.
+        Unless the query sorts or aggregates, only the changed documents are re-queried.
+        @param query  The compiled query; it must not be freed before the live query.
+        @param encodedParameters  Optional JSON parameter bindings, as in `c4query_run`.
+        @param callback  Called when there may be new changes to get. May be NULL.
+        @param context  An arbitrary value that will be passed to the callback.
+        @param outError  On failure, will be set to the error status.
+        @return  The new live query, or NULL on failure. */
+    C4LiveQuery* c4livequery_new(C4Query *query,
+                                 C4String encodedParameters,
+                                 C4LiveQueryCallback callback,
+                                 void *context,
+                                 C4Error *outError) C4API;
+
+    /** Returns changes to the query results since the last call. Removed rows are listed first,
+        then added and changed rows in result order. If there are more than `maxChanges`, the
+        remainder will be returned by the next calls.
+        The memory pointed to by the C4String fields is valid until the next call, or until the
+        live query is freed.
+        @param liveQuery  The live query.
+        @param outChanges  An array that will be filled in with changes.
+        @param maxChanges  The capacity of the `outChanges` array.
+        @param outError  On failure, will be set to the error status.
+        @return  The number of changes written to `outChanges`; 0 if there are none or on error. */
+    uint32_t c4livequery_getChanges(C4LiveQuery *liveQuery,
+                                    C4LiveQueryChange outChanges[],
+                                    uint32_t maxChanges,
+                                    C4Error *outError) C4API;
+
+    /** Stops a live query and frees its resources. It is legal to pass NULL. */
+    void c4livequery_free(C4LiveQuery *liveQuery) C4API;
+
+    /** @} */
+
+
     //////// INDEXES:
 
 
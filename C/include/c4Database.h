@@ -33,6 +33,8 @@ extern "C" {
         kC4DB_AutoCompact   = 4,    ///< Enable auto-compaction
         kC4DB_Bundled       = 8,    ///< Store db (and views) inside a directory
         kC4DB_SharedKeys    = 0x10, ///< Enable shared-keys optimization at creation time
+        kC4DB_SeparateRevBodies = 0x20, ///< Store non-current revision bodies outside the rev tree
+        kC4DB_CompressBodies = 0x40, ///< Compress large document bodies, at creation time
     };
 
     /** Document versioning system (also determines database storage schema) */
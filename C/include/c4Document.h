@@ -251,6 +251,25 @@ extern "C" {
                           size_t *outCommonAncestorIndex,
                           C4Error *outError) C4API;
 
+    /** Inserts multiple revisions, as though c4doc_put were called on each request in turn,
+        but writes the documents to the database in batches, which is much faster when
+        importing large numbers of documents. Must be called within a transaction.
+        As with c4doc_put, a document is only saved if its request's `save` flag is true.
+        @param database  The database to add the revisions to.
+        @param requests  An array of put requests.
+        @param count  The number of requests.
+        @param outDocs  If non-NULL, an array of `count` pointers that will be set to the
+                    resulting documents, which the caller must free. If NULL, the documents
+                    are freed after being saved.
+        @param outError  On failure, error information will be stored here.
+        @return  True on success. On failure some of the requests may already have been
+                    applied, so the transaction should be aborted. */
+    bool c4doc_putBatch(C4Database *database,
+                        const C4DocPutRequest requests[],
+                        size_t count,
+                        C4Document* outDocs[],
+                        C4Error *outError) C4API;
+
     /** Generates the revision ID for a new document revision.
         @param body  The (JSON) body of the revision, exactly as it'll be stored.
         @param parentRevID  The revID of the parent revision, or null if there's none.
@@ -51,6 +51,24 @@ extern "C" {
     void c4exp_free(C4ExpiryEnumerator *e) C4API;
 
 
+    /** Purges all documents whose expiration time has passed, along with their expiration
+        entries. Works in batches, each in its own short transaction, so other writers aren't
+        locked out for long; the purged docs are reported to observers a batch at a time.
+        @param database  The database.
+        @param outError  Error will be stored here on failure.
+        @return  The number of expired documents processed, or -1 on failure. */
+    int64_t c4db_purgeExpiredDocs(C4Database *database, C4Error *outError) C4API;
+
+    /** Starts a background thread that purges documents as they expire, in the same way as
+        c4db_purgeExpiredDocs. It sleeps until the next expiration time, and is woken by
+        c4doc_setExpiration calls on this database handle. It's stopped automatically when the
+        database is closed or freed. */
+    bool c4db_startExpirationPurger(C4Database *database, C4Error *outError) C4API;
+
+    /** Stops the background purger thread, if one is running, and waits for it to exit. */
+    void c4db_stopExpirationPurger(C4Database *database) C4API;
+
+
     /** @} */
 #ifdef __cplusplus
     }
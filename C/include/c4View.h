@@ -105,6 +105,12 @@ extern "C" {
         documentType matches will be indexed by this view. */
     void c4view_setDocumentType(C4View*, C4String docType) C4API;
 
+    /** Enables or disables stored reduce. If enabled, the view keeps running totals of its
+        rows' values at group levels 0 and 1, so that queries using a built-in reduce at those
+        levels don't have to read every row. Enabling it on a view whose index was built
+        without it invalidates the index. */
+    bool c4view_setStoredReduce(C4View*, bool storedReduce, C4Error *outError) C4API;
+
     /** Registers a callback to be invoked when the view's index db starts or finishes compacting.
         May be called on a background thread, so be careful of thread safety. */
     void c4view_setOnCompactCallback(C4View*, C4OnCompactCallback, void *context) C4API;
@@ -137,6 +143,13 @@ extern "C" {
         Typically this is used when the indexing occurs because this view is being queried. */
     void c4indexer_triggerOnView(C4Indexer *indexer, C4View *view) C4API;
 
+    /** Makes the indexer write each view's index on its own background thread, so that
+        multiple views are updated concurrently. Documents are still enumerated (and their
+        bodies decoded) only once, on the calling thread; c4indexer_emit just queues the rows.
+        Errors that occur while writing an index are reported by a later call to c4indexer_emit
+        or c4indexer_end. Must be called before any documents are enumerated. */
+    void c4indexer_setParallel(C4Indexer *indexer, bool parallel) C4API;
+
     /** Creates an enumerator that will return all the documents that need to be (re)indexed.
         Returns NULL if no indexing is needed; you can distinguish this from an error by looking
         at the C4Error. */
@@ -227,6 +240,18 @@ extern "C" {
     } C4ReduceFunction;
 
 
+    /** Reduce functions built into LiteCore. Values that are JSON numbers are aggregated;
+        other values are only counted as rows. */
+    typedef C4_ENUM(uint32_t, C4BuiltInReduce) {
+        kC4NoReduce,
+        kC4ReduceCount,         ///< Number of rows
+        kC4ReduceSum,           ///< Sum of the numeric values
+        kC4ReduceMin,           ///< Minimum numeric value, or null
+        kC4ReduceMax,           ///< Maximum numeric value, or null
+        kC4ReduceStats,         ///< Object with "sum", "count", "min", "max" and "sumsqr"
+    };
+
+
     /** Options for view queries. */
     typedef struct {
         uint64_t skip;          ///< Number of initial rows to skip
@@ -246,6 +271,14 @@ extern "C" {
 
         const C4ReduceFunction *reduce; ///< Reduce function, or NULL for no reducing
         uint32_t groupLevel;            ///< Key grouping level, or 0 for no grouping
+
+        bool streaming;         ///< Expression queries only: return rows as they're found,
+                                ///< instead of running the query to completion first
+
+        bool includeDocs;       ///< Map/reduce only: if a row's value is the entire doc ("*"),
+                                ///< return the doc's current body, revID and flags instead
+
+        C4BuiltInReduce builtInReduce;  ///< Built-in reduce to use if `reduce` is NULL
     } C4QueryOptions;
 
 
@@ -275,7 +308,7 @@ extern "C" {
         C4KeyReader key;                     ///< Encoded emitted key
         C4String value;                       ///< Encoded emitted value
 
-        // Expression-based only:
+        // Expression-based, or map/reduce with `includeDocs`:
         C4String revID;
         C4DocumentFlags docFlags;
 
@@ -251,6 +251,102 @@ N_WAY_TEST_CASE_METHOD(BlobStoreTest, "write blobs of many sizes", "[blob][C]")
 }
 
 
+N_WAY_TEST_CASE_METHOD(BlobStoreTest, "packed blobs", "[blob][C]") {
+    // Small blobs go into shared pack files; they should act just like blobs in files.
+    C4Error error;
+    vector<C4BlobKey> keys;
+    char buf[100];
+    for (int i = 0; i < 50; i++) {
+        sprintf(buf, "This is small blob #%d", i);
+        C4BlobKey key;
+        REQUIRE(c4blob_create(store, c4str(buf), &key, &error));
+        keys.push_back(key);
+    }
+    string bigBlob(100000, 'x');
+    C4BlobKey bigKey;
+    REQUIRE(c4blob_create(store, {bigBlob.data(), bigBlob.size()}, &bigKey, &error));
+
+    for (int i = 0; i < 50; i++) {
+        sprintf(buf, "This is small blob #%d", i);
+        C4SliceResult contents = c4blob_getContents(store, keys[i], &error);
+        REQUIRE(contents.buf != nullptr);
+        CHECK(string((char*)contents.buf, contents.size) == string(buf));
+        c4slice_free(contents);
+        if (!encrypted)
+            CHECK(c4blob_getSize(store, keys[i]) == (int64_t)strlen(buf));
+    }
+    C4SliceResult contents = c4blob_getContents(store, bigKey, &error);
+    CHECK(contents.size == bigBlob.size());
+    c4slice_free(contents);
+
+    // Streaming reads within a packed blob:
+    C4ReadStream *reader = c4blob_openReadStream(store, keys[7], &error);
+    REQUIRE(reader);
+    CHECK(c4stream_getLength(reader, &error) == (int64_t)strlen("This is small blob #7"));
+    REQUIRE(c4stream_seek(reader, 8, &error));
+    char readBuf[100];
+    size_t n = c4stream_read(reader, readBuf, sizeof(readBuf), &error);
+    CHECK(string(readBuf, n) == "small blob #7");
+    c4stream_close(reader);
+
+    // Delete some:
+    for (int i = 0; i < 50; i += 2)
+        REQUIRE(c4blob_delete(store, keys[i], &error));
+    CHECK(c4blob_getSize(store, keys[0]) == -1);
+    contents = c4blob_getContents(store, keys[0], &error);
+    CHECK(contents.buf == nullptr);
+    contents = c4blob_getContents(store, keys[1], &error);
+    CHECK(string((char*)contents.buf, contents.size) == "This is small blob #1");
+    c4slice_free(contents);
+
+    // Asking for a packed blob's file moves it into one:
+    if (!encrypted) {
+        C4SliceResult p = c4blob_getFilePath(store, keys[3], &error);
+        REQUIRE(p.buf != nullptr);
+        FILE *f = fopen(string((char*)p.buf, p.size).c_str(), "r");
+        REQUIRE(f);
+        n = fread(readBuf, 1, sizeof(readBuf), f);
+        fclose(f);
+        CHECK(string(readBuf, n) == "This is small blob #3");
+        c4slice_free(p);
+        contents = c4blob_getContents(store, keys[3], &error);
+        CHECK(string((char*)contents.buf, contents.size) == "This is small blob #3");
+        c4slice_free(contents);
+    }
+}
+
+
+N_WAY_TEST_CASE_METHOD(BlobStoreTest, "mapped blobs", "[blob][C]") {
+    C4Error error;
+    C4BlobKey smallKey, bigKey;
+    REQUIRE(c4blob_create(store, C4STR("This is a small blob"), &smallKey, &error));
+    string bigBlob(100000, 'x');
+    bigBlob.replace(70000, 5, "HELLO");
+    REQUIRE(c4blob_create(store, {bigBlob.data(), bigBlob.size()}, &bigKey, &error));
+
+    C4BlobMapping *mapping = c4blob_openMapped(store, smallKey, &error);
+    if (encrypted) {
+        CHECK(mapping == nullptr);
+        CHECK(error.code == kC4ErrorUnsupported);
+        return;
+    }
+    REQUIRE(mapping);
+    C4Slice contents = c4blob_mappedContents(mapping);
+    CHECK(string((char*)contents.buf, contents.size) == "This is a small blob");
+    c4blob_closeMapped(mapping);
+
+    mapping = c4blob_openMapped(store, bigKey, &error);
+    REQUIRE(mapping);
+    contents = c4blob_mappedContents(mapping);
+    CHECK(string((char*)contents.buf, contents.size) == bigBlob);
+    CHECK(string((char*)contents.buf + 70000, 5) == "HELLO");
+    c4blob_closeMapped(mapping);
+    c4blob_closeMapped(nullptr); // this should be a no-op, not a crash
+
+    CHECK(c4blob_openMapped(store, bogusKey, &error) == nullptr);
+}
+
+
 N_WAY_TEST_CASE_METHOD(BlobStoreTest, "write blob and cancel", "[blob][C]") {
     // Write the blob:
     C4Error error;
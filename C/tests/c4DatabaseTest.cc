@@ -11,9 +11,13 @@
 #include "c4DocEnumerator.h"
 #include "c4ExpiryEnumerator.h"
 #include "c4BlobStore.h"
+#include "c4Observer.h"
 #include <cmath>
 #include <errno.h>
 #include <iostream>
+#include <chrono>
+#include <thread>
+#include <vector>
 
 #include "sqlite3.h"
 
@@ -403,6 +407,93 @@ N_WAY_TEST_CASE_METHOD(C4DatabaseTest, "Database Expired", "[Database][C]") {
     REQUIRE(expiredCount == 0);
 }
 
+N_WAY_TEST_CASE_METHOD(C4DatabaseTest, "Database ExpiredPaging", "[Database][C]")
+{
+    // More expired docs than fit in one page of the enumerator:
+    char docID[20];
+    C4Error err;
+    time_t past = time(nullptr) - 10;
+    for (unsigned i = 0; i < 250; i++) {
+        sprintf(docID, "exp-%03u", i);
+        createRev(c4str(docID), kRevID, kBody);
+        REQUIRE(c4doc_setExpiration(db, c4str(docID), past - (i % 3), &err));
+    }
+
+    // Purging docs as they're enumerated mustn't make the enumerator skip any:
+    auto e = c4db_enumerateExpired(db, &err);
+    REQUIRE(e != nullptr);
+    int expiredCount = 0;
+    while (c4exp_next(e, nullptr)) {
+        C4SliceResult existingDocID = c4exp_getDocID(e);
+        {
+            TransactionHelper t(db);
+            REQUIRE(c4db_purgeDoc(db, {existingDocID.buf, existingDocID.size}, &err));
+        }
+        c4slice_free(existingDocID);
+        expiredCount++;
+    }
+    c4exp_free(e);
+    CHECK(expiredCount == 250);
+    CHECK(c4db_getDocumentCount(db) == 0);
+}
+
+static std::string legacyExpiryBody(uint64_t timestamp) {
+    std::string body;       // varint
+    while (timestamp >= 0x80) {
+        body += (char)((timestamp & 0x7F) | 0x80);
+        timestamp >>= 7;
+    }
+    body += (char)timestamp;
+    return body;
+}
+
+N_WAY_TEST_CASE_METHOD(C4DatabaseTest, "Database LegacyExpirationReadOnly", "[Database][C]")
+{
+    // Simulate expirations stored by an older version, in the "expiry" KeyStore:
+    C4Error err;
+    time_t past = time(nullptr) - 10, future = time(nullptr) + 1000;
+    createRev(C4STR("old"), kRevID, kBody);
+    createRev(C4STR("new"), kRevID, kBody);
+    {
+        TransactionHelper t(db);
+        std::string body = legacyExpiryBody(past);
+        REQUIRE(c4raw_put(db, C4STR("expiry"), C4STR("old"), kC4SliceNull,
+                          {body.data(), body.size()}, &err));
+        body = legacyExpiryBody(future);
+        REQUIRE(c4raw_put(db, C4STR("expiry"), C4STR("new"), kC4SliceNull,
+                          {body.data(), body.size()}, &err));
+    }
+
+    // A read-only database can't upgrade them, but should still report them:
+    auto config = *c4db_getConfig(db);
+    REQUIRE(c4db_close(db, &err));
+    c4db_free(db);
+    auto roConfig = config;
+    roConfig.flags = (C4DatabaseFlags)((roConfig.flags | kC4DB_ReadOnly) & ~kC4DB_Create);
+    db = c4db_open(databasePath(), &roConfig, &err);
+    REQUIRE(db);
+    CHECK(c4doc_getExpiration(db, C4STR("old")) == (uint64_t)past);
+    CHECK(c4doc_getExpiration(db, C4STR("new")) == (uint64_t)future);
+    CHECK(c4db_nextDocExpiration(db) == (uint64_t)past);
+    auto e = c4db_enumerateExpired(db, &err);
+    REQUIRE(e != nullptr);
+    REQUIRE(c4exp_next(e, nullptr));
+    C4SliceResult expiredID = c4exp_getDocID(e);
+    CHECK(expiredID == C4STR("old"));
+    c4slice_free(expiredID);
+    CHECK(!c4exp_next(e, nullptr));
+    c4exp_free(e);
+
+    // Opening it writeable upgrades them:
+    REQUIRE(c4db_close(db, &err));
+    c4db_free(db);
+    db = c4db_open(databasePath(), &config, &err);
+    REQUIRE(db);
+    CHECK(c4doc_getExpiration(db, C4STR("old")) == (uint64_t)past);
+    CHECK(c4doc_getExpiration(db, C4STR("new")) == (uint64_t)future);
+    CHECK(c4db_nextDocExpiration(db) == (uint64_t)past);
+}
+
 N_WAY_TEST_CASE_METHOD(C4DatabaseTest, "Database CancelExpire", "[Database][C]")
 {
     C4Slice docID = C4STR("expire_me");
@@ -426,9 +517,82 @@ N_WAY_TEST_CASE_METHOD(C4DatabaseTest, "Database CancelExpire", "[Database][C]")
     REQUIRE(expiredCount == 0);
 }
 
+static void purgedDocObserverCallback(C4DocumentObserver*, C4String docID,
+                                      C4SequenceNumber sequence, void *context)
+{
+    CHECK(std::string((char*)docID.buf, docID.size) == "exp-042");
+    auto purged = (std::pair<int, C4SequenceNumber>*)context;
+    ++purged->first;
+    purged->second = sequence;
+}
+
+N_WAY_TEST_CASE_METHOD(C4DatabaseTest, "Database PurgeExpiredDocs", "[Database][C]")
+{
+    // More expired docs than fit in one purge batch:
+    char docID[20];
+    C4Error err;
+    time_t past = time(nullptr) - 10;
+    for (unsigned i = 0; i < 250; i++) {
+        sprintf(docID, "exp-%03u", i);
+        createRev(c4str(docID), kRevID, kBody);
+        REQUIRE(c4doc_setExpiration(db, c4str(docID), past, &err));
+    }
+    createRev(C4STR("keep_me"), kRevID, kBody);
+    REQUIRE(c4doc_setExpiration(db, C4STR("keep_me"), time(nullptr) + 1000, &err));
+
+    std::pair<int, C4SequenceNumber> purged {0, 0};
+    auto docObserver = c4docobs_create(db, C4STR("exp-042"), purgedDocObserverCallback,
+                                       &purged);
+    CHECK(c4db_purgeExpiredDocs(db, &err) == 250);
+    CHECK(purged.first == 1);
+    CHECK(purged.second == c4db_getLastSequence(db));   // (purging doesn't add a sequence)
+    c4docobs_free(docObserver);
+    CHECK(c4db_getDocumentCount(db) == 1);
+    auto doc = c4doc_get(db, C4STR("exp-042"), true, &err);
+    CHECK(doc == nullptr);
+    doc = c4doc_get(db, C4STR("keep_me"), true, &err);
+    CHECK(doc != nullptr);
+    c4doc_free(doc);
+    CHECK(c4doc_getExpiration(db, C4STR("exp-042")) == 0);
+    CHECK(c4db_purgeExpiredDocs(db, &err) == 0);
+
+    // Now let the background purger do it:
+    REQUIRE(c4db_startExpirationPurger(db, &err));
+    REQUIRE(c4doc_setExpiration(db, C4STR("keep_me"), time(nullptr) + 1, &err));
+    for (int i = 0; i < 40 && c4db_getDocumentCount(db) > 0; i++)
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    CHECK(c4db_getDocumentCount(db) == 0);
+    c4db_stopExpirationPurger(db);
+}
+
 N_WAY_TEST_CASE_METHOD(C4DatabaseTest, "Database BlobStore", "[Database][C]")
 {
     C4Error err;
     C4BlobStore *blobs = c4db_getBlobStore(db, &err);
     REQUIRE(blobs != nullptr);
+
+    // Compacting the database rewrites sparse blob pack files:
+    std::vector<C4BlobKey> keys;
+    char buf[100];
+    for (int i = 0; i < 100; i++) {
+        sprintf(buf, "Blob number %d", i);
+        C4BlobKey key;
+        REQUIRE(c4blob_create(blobs, c4str(buf), &key, &err));
+        keys.push_back(key);
+    }
+    for (int i = 0; i < 100; i++) {
+        if (i % 10 != 0)
+            REQUIRE(c4blob_delete(blobs, keys[i], &err));
+    }
+    REQUIRE(c4db_compact(db, &err));
+    for (int i = 0; i < 100; i++) {
+        C4SliceResult contents = c4blob_getContents(blobs, keys[i], &err);
+        if (i % 10 == 0) {
+            sprintf(buf, "Blob number %d", i);
+            CHECK(std::string((char*)contents.buf, contents.size) == std::string(buf));
+        } else {
+            CHECK(contents.buf == nullptr);
+        }
+        c4slice_free(contents);
+    }
 }
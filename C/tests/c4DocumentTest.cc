@@ -344,3 +344,92 @@ N_WAY_TEST_CASE_METHOD(C4Test, "Document Put", "[Database][C]") {
 
     c4doc_free(doc);
 }
+
+
+N_WAY_TEST_CASE_METHOD(C4Test, "Document PutBatch", "[Database][C]") {
+    C4Error error;
+    TransactionHelper t(db);
+
+    static const unsigned kNumDocs = 10;
+    C4Slice kExpectedRevID = isRevTrees() ? C4STR("1-c10c25442d9fe14fa3ca0db4322d7f1e43140fab")
+                                          : C4STR("1@*");
+    char docIDs[kNumDocs][20];
+    for (unsigned i = 0; i < kNumDocs; ++i)
+        sprintf(docIDs[i], "doc-%03u", i);
+
+    // The last request updates the first doc again, so it has to see the first one's save:
+    C4DocPutRequest rqs[kNumDocs + 1] = {};
+    for (unsigned i = 0; i <= kNumDocs; ++i) {
+        rqs[i].docID = c4str(docIDs[i % kNumDocs]);
+        rqs[i].body = kBody;
+        rqs[i].save = true;
+    }
+    rqs[kNumDocs].body = C4STR("{\"ok\":\"go\"}");
+    rqs[kNumDocs].history = &kExpectedRevID;
+    rqs[kNumDocs].historyCount = 1;
+
+    C4Document* docs[kNumDocs + 1];
+    REQUIRE(c4doc_putBatch(db, rqs, kNumDocs + 1, docs, &error));
+    for (unsigned i = 0; i < kNumDocs; ++i) {
+        REQUIRE(docs[i] != nullptr);
+        CHECK(docs[i]->docID == rqs[i].docID);
+        CHECK(docs[i]->sequence == i + 1);
+        CHECK(docs[i]->flags == (C4DocumentFlags)kExists);
+        CHECK(docs[i]->revID == kExpectedRevID);
+        c4doc_free(docs[i]);
+    }
+    REQUIRE(docs[kNumDocs] != nullptr);
+    CHECK(docs[kNumDocs]->sequence == kNumDocs + 1);
+    if (isRevTrees())
+        CHECK(docs[kNumDocs]->revID == C4STR("2-32c711b29ea3297e27f3c28c8b066a68e1bb3f7b"));
+    c4doc_free(docs[kNumDocs]);
+
+    CHECK(c4db_getDocumentCount(db) == kNumDocs);
+    CHECK(c4db_getLastSequence(db) == kNumDocs + 1);
+
+    auto doc = c4doc_get(db, rqs[3].docID, true, &error);
+    REQUIRE(doc != nullptr);
+    CHECK(doc->revID == kExpectedRevID);
+    CHECK(doc->sequence == 4);
+    c4doc_free(doc);
+
+    // Without outDocs:
+    rqs[0].docID = C4STR("another");
+    REQUIRE(c4doc_putBatch(db, rqs, 1, nullptr, &error));
+    CHECK(c4db_getDocumentCount(db) == kNumDocs + 1);
+}
+
+
+N_WAY_TEST_CASE_METHOD(C4Test, "Document PutBatch LargeBodies", "[Database][C]") {
+    if (!isRevTrees())
+        return;
+    C4Error error;
+    TransactionHelper t(db);
+
+    // Enough data that the revIDs get digested on multiple threads:
+    static const unsigned kNumDocs = 16;
+    static const size_t kBodySize = 300000;
+    string bodies[kNumDocs];
+    char docIDs[kNumDocs][20];
+    C4DocPutRequest rqs[kNumDocs] = {};
+    for (unsigned i = 0; i < kNumDocs; ++i) {
+        sprintf(docIDs[i], "doc-%03u", i);
+        bodies[i] = string(kBodySize, (char)('a' + i));
+        rqs[i].docID = c4str(docIDs[i]);
+        rqs[i].body = {bodies[i].data(), bodies[i].size()};
+        rqs[i].save = true;
+    }
+    rqs[kNumDocs - 1].revFlags = kRevDeleted;
+
+    C4Document* docs[kNumDocs];
+    REQUIRE(c4doc_putBatch(db, rqs, kNumDocs, docs, &error));
+    for (unsigned i = 0; i < kNumDocs; ++i) {
+        REQUIRE(docs[i] != nullptr);
+        C4SliceResult expected = c4doc_generateRevID(rqs[i].body, kC4SliceNull,
+                                                     (rqs[i].revFlags & kRevDeleted) != 0);
+        C4Slice expectedRevID = {expected.buf, expected.size};
+        CHECK(docs[i]->revID == expectedRevID);
+        c4slice_free(expected);
+        c4doc_free(docs[i]);
+    }
+}
@@ -8,6 +8,8 @@
 
 #include "c4Test.hh"
 #include "c4DBQuery.h"
+#include "c4Document+Fleece.h"
+#include <algorithm>
 #include <iostream>
 
 using namespace std;
@@ -48,13 +50,14 @@ public:
     }
 
     std::vector<std::string> run(uint64_t skip =0, uint64_t limit =UINT64_MAX,
-                                 const char *bindings =nullptr)
+                                 const char *bindings =nullptr, bool streaming =false)
     {
         REQUIRE(query);
         std::vector<std::string> docIDs;
         C4QueryOptions options = kC4DefaultQueryOptions;
         options.skip = skip;
         options.limit = limit;
+        options.streaming = streaming;
         C4Error error;
         auto e = c4query_run(query, &options, c4str(bindings), &error);
         INFO("c4query_run got error " << error.domain << "/" << error.code);
@@ -94,6 +97,33 @@ N_WAY_TEST_CASE_METHOD(QueryTest, "DB Query", "[Query][C]") {
 }
 
 
+N_WAY_TEST_CASE_METHOD(QueryTest, "DB Query streaming", "[Query][C]") {
+    compile(json5("['=', ['.', 'contact', 'address', 'state'], 'CA']"));
+    auto expected = run();
+    CHECK(run(0, UINT64_MAX, nullptr, true) == expected);
+    CHECK(run(1, 4, nullptr, true) == (vector<string>{"0000015", "0000036", "0000043", "0000053"}));
+
+    // Two streaming enumerators on the same query at once:
+    C4QueryOptions options = kC4DefaultQueryOptions;
+    options.streaming = true;
+    C4Error error;
+    auto e1 = c4query_run(query, &options, kC4SliceNull, &error);
+    REQUIRE(e1);
+    REQUIRE(c4queryenum_next(e1, &error));
+    auto e2 = c4query_run(query, &options, kC4SliceNull, &error);
+    REQUIRE(e2);
+    vector<string> docIDs1 {string((const char*)e1->docID.buf, e1->docID.size)}, docIDs2;
+    while (c4queryenum_next(e2, &error))
+        docIDs2.push_back(string((const char*)e2->docID.buf, e2->docID.size));
+    while (c4queryenum_next(e1, &error))
+        docIDs1.push_back(string((const char*)e1->docID.buf, e1->docID.size));
+    c4queryenum_free(e1);
+    c4queryenum_free(e2);
+    CHECK(docIDs1 == expected);
+    CHECK(docIDs2 == expected);
+}
+
+
 N_WAY_TEST_CASE_METHOD(QueryTest, "DB Query sorted", "[Query][C]") {
     compile(json5("['=', ['.', 'contact', 'address', 'state'], 'CA']"),
             json5("[['.', 'name', 'last']]"));
@@ -169,6 +199,134 @@ N_WAY_TEST_CASE_METHOD(QueryTest, "Delete indexed doc", "[Query][C]") {
 }
 
 
+static void liveQueryCallback(C4LiveQuery *liveQuery, void *context) {
+    ++*(int*)context;
+}
+
+
+N_WAY_TEST_CASE_METHOD(QueryTest, "DB Live query", "[Query][C]") {
+    compile(json5("['=', ['.', 'contact', 'address', 'state'], 'CA']"));
+    int callbacks = 0;
+    C4Error error;
+    C4LiveQuery *live = c4livequery_new(query, kC4SliceNull, liveQueryCallback, &callbacks, &error);
+    REQUIRE(live);
+
+    C4LiveQueryChange changes[20];
+    auto getChanges = [&]() {
+        vector<string> result;
+        uint32_t n = c4livequery_getChanges(live, changes, 20, &error);
+        CHECK(error.code == 0);
+        for (uint32_t i = 0; i < n; ++i)
+            result.push_back(string("+-*"[changes[i].type], 1) + toString(changes[i].docID));
+        return result;
+    };
+
+    auto putDoc = [&](const char *docID, const char *json, C4RevisionFlags flags) {
+        TransactionHelper t(db);
+        C4Document *doc = c4doc_get(db, c4str(docID), true, &error);
+        REQUIRE(doc);
+        C4SliceResult body = {};
+        if (json)
+            body = c4db_encodeJSON(db, c4str(json), &error);
+        C4DocPutRequest rq = {};
+        rq.docID = c4str(docID);
+        rq.body = {body.buf, body.size};
+        rq.history = &doc->revID;
+        rq.historyCount = 1;
+        rq.revFlags = flags;
+        rq.save = true;
+        C4Document *updatedDoc = c4doc_put(db, &rq, nullptr, &error);
+        REQUIRE(updatedDoc != nullptr);
+        c4doc_free(doc);
+        c4doc_free(updatedDoc);
+        c4slice_free(body);
+    };
+
+    // Initially all rows are added:
+    CHECK(getChanges() == (vector<string>{"+0000001", "+0000015", "+0000036", "+0000043", "+0000053", "+0000064", "+0000072", "+0000073"}));
+    CHECK(changes[7].index == 7);
+    CHECK(getChanges().empty());
+
+    putDoc("0000002", "{\"contact\":{\"address\":{\"state\":\"CA\"}}}", 0);
+    CHECK(callbacks == 1);
+    CHECK(getChanges() == (vector<string>{"+0000002"}));
+
+    putDoc("0000001", nullptr, kRevDeleted);
+    CHECK(callbacks == 2);
+    CHECK(getChanges() == (vector<string>{"-0000001"}));
+    CHECK(changes[0].index == 0);
+
+    putDoc("0000002", "{\"contact\":{\"address\":{\"state\":\"CA\"}}, \"x\":1}", 0);
+    putDoc("0000003", "{\"contact\":{\"address\":{\"state\":\"NY\"}}}", 0);
+    CHECK(callbacks == 3);      // only notified once until changes are read
+    CHECK(getChanges() == (vector<string>{"*0000002"}));
+
+    // A doc updated so it no longer matches is removed (the query is re-run on just that doc):
+    putDoc("0000015", "{\"contact\":{\"address\":{\"state\":\"NY\"}}}", 0);
+    CHECK(getChanges() == (vector<string>{"-0000015"}));
+    CHECK(changes[0].index == 0);
+
+    c4livequery_free(live);
+}
+
+
+N_WAY_TEST_CASE_METHOD(QueryTest, "DB Live query order", "[Query][C]") {
+    // Live queries whose rows aren't in storage order must still report rows where a full
+    // run of the query puts them:
+    C4Error error;
+    const char *newFirstName;
+    SECTION("ORDER BY") {
+        compile(json5("['=', ['.', 'contact', 'address', 'state'], 'CA']"),
+                json5("[['.name.first']]"));
+        newFirstName = "A";
+    }
+    SECTION("Index scan") {
+        REQUIRE(c4db_createIndex(db, C4STR("[[\".name.first\"]]"), kC4ValueIndex,
+                                 nullptr, &error));
+        compile(json5("['>', ['.name.first'], 'M']"));
+        newFirstName = "Ma";
+    }
+    auto expected = run();
+    REQUIRE(expected.size() > 2);
+
+    int callbacks = 0;
+    C4LiveQuery *live = c4livequery_new(query, kC4SliceNull, liveQueryCallback, &callbacks, &error);
+    REQUIRE(live);
+    C4LiveQueryChange changes[100];
+    CHECK(c4livequery_getChanges(live, changes, 100, &error) == expected.size());
+
+    // Update the first doc in the results, so it stays first (in storage order it'd be last):
+    {
+        TransactionHelper t(db);
+        C4Document *doc = c4doc_get(db, c4str(expected[0].c_str()), true, &error);
+        REQUIRE(doc);
+        string json = string("{\"name\":{\"first\":\"") + newFirstName
+                        + "\"},\"contact\":{\"address\":{\"state\":\"CA\"}}}";
+        C4SliceResult body = c4db_encodeJSON(db, c4str(json.c_str()), &error);
+        C4DocPutRequest rq = {};
+        rq.docID = c4str(expected[0].c_str());
+        rq.body = {body.buf, body.size};
+        rq.history = &doc->revID;
+        rq.historyCount = 1;
+        rq.save = true;
+        C4Document *updatedDoc = c4doc_put(db, &rq, nullptr, &error);
+        REQUIRE(updatedDoc != nullptr);
+        c4doc_free(doc);
+        c4doc_free(updatedDoc);
+        c4slice_free(body);
+    }
+    CHECK(callbacks == 1);
+    auto rerun = run();
+    REQUIRE(rerun.size() == expected.size());
+    REQUIRE(c4livequery_getChanges(live, changes, 100, &error) == 1);
+    CHECK(toString(changes[0].docID) == expected[0]);
+    CHECK(changes[0].index == (uint32_t)(find(rerun.begin(), rerun.end(), expected[0])
+                                         - rerun.begin()));
+    CHECK(changes[0].index == 0);
+    c4livequery_free(live);
+}
+
+
 N_WAY_TEST_CASE_METHOD(QueryTest, "Full-text query", "[Query][C]") {
     C4Error err;
     REQUIRE(c4db_createIndex(db, C4STR("[[\".contact.address.street\"]]"), kC4FullTextIndex, nullptr, &err));
@@ -162,6 +162,120 @@ N_WAY_TEST_CASE_METHOD(C4ViewTest, "View QueryIndex", "[View][C]") {
 }
 
 
+N_WAY_TEST_CASE_METHOD(C4ViewTest, "View ParallelIndex", "[View][C]") {
+    char docID[20];
+    for (int i = 1; i <= 100; i++) {
+        sprintf(docID, "doc-%03d", i);
+        createRev(c4str(docID), kRevID, kBody);
+    }
+
+    C4Error error;
+    c4view_deleteByName(db, c4str("otherview"), nullptr);
+    C4View *otherView = c4view_open(db, kC4SliceNull, c4str("otherview"), c4str("1"),
+                                    c4db_getConfig(db), &error);
+    REQUIRE(otherView);
+
+    C4View* views[2] = {view, otherView};
+    C4Indexer* ind = c4indexer_begin(db, views, 2, &error);
+    REQUIRE(ind);
+    c4indexer_setParallel(ind, true);
+
+    C4DocEnumerator* e = c4indexer_enumerateDocuments(ind, &error);
+    REQUIRE(e);
+    C4Document *doc;
+    while (nullptr != (doc = c4enum_nextDocument(e, &error))) {
+        for (unsigned v = 0; v < 2; ++v) {
+            REQUIRE(c4indexer_shouldIndexDocument(ind, v, doc));
+            // View 0 emits one row per doc, view 1 emits two:
+            C4Key *keys[2] = {c4key_new(), c4key_new()};
+            C4Slice values[2] = {c4str("1234"), c4str("5678")};
+            c4key_addString(keys[0], doc->docID);
+            c4key_addNumber(keys[1], doc->sequence);
+            REQUIRE(c4indexer_emit(ind, doc, v, v + 1, keys, values, &error));
+            c4key_free(keys[0]);
+            c4key_free(keys[1]);
+        }
+        c4doc_free(doc);
+    }
+    REQUIRE(error.code == 0);
+    c4enum_free(e);
+    REQUIRE(c4indexer_end(ind, true, &error));
+
+    CHECK(c4view_getTotalRows(view) == (C4SequenceNumber)100);
+    CHECK(c4view_getLastSequenceIndexed(view) == (C4SequenceNumber)100);
+    CHECK(c4view_getTotalRows(otherView) == (C4SequenceNumber)200);
+    CHECK(c4view_getLastSequenceIndexed(otherView) == (C4SequenceNumber)100);
+
+    // Nothing is left to index:
+    ind = c4indexer_begin(db, views, 2, &error);
+    REQUIRE(ind);
+    c4indexer_setParallel(ind, true);
+    CHECK(c4indexer_enumerateDocuments(ind, &error) == nullptr);
+    CHECK(error.code == 0);
+    REQUIRE(c4indexer_end(ind, false, &error));
+
+    REQUIRE(c4view_delete(otherView, &error));
+    c4view_free(otherView);
+}
+
+
+N_WAY_TEST_CASE_METHOD(C4ViewTest, "View QueryIncludeDocs", "[View][C]") {
+    // More docs than fit in one read-ahead page; the even-numbered ones emit the entire doc:
+    static const int kNumDocs = 250;
+    char docID[20];
+    for (int i = 1; i <= kNumDocs; i++) {
+        sprintf(docID, "doc-%03d", i);
+        createRev(c4str(docID), kRevID, kBody);
+    }
+    C4Error error;
+    C4Indexer* ind = c4indexer_begin(db, &view, 1, &error);
+    REQUIRE(ind);
+    C4DocEnumerator* e = c4indexer_enumerateDocuments(ind, &error);
+    REQUIRE(e);
+    C4Document *doc;
+    while (nullptr != (doc = c4enum_nextDocument(e, &error))) {
+        C4Key *key = c4key_new();
+        c4key_addString(key, doc->docID);
+        C4Slice value = (doc->sequence % 2 == 0) ? c4str("*") : c4str("1234");
+        REQUIRE(c4indexer_emit(ind, doc, 0, 1, &key, &value, &error));
+        c4key_free(key);
+        c4doc_free(doc);
+    }
+    REQUIRE(error.code == 0);
+    c4enum_free(e);
+    REQUIRE(c4indexer_end(ind, true, &error));
+
+    // Update a doc without reindexing, so its row's sequence is out of date:
+    C4Slice kUpdatedBody = c4str("{\"updated\":true}");
+    createRev(c4str("doc-010"), kRev2ID, kUpdatedBody);
+
+    C4QueryOptions options = kC4DefaultQueryOptions;
+    options.includeDocs = true;
+    auto query = c4view_query(view, &options, &error);
+    REQUIRE(query);
+    int i = 0;
+    while (c4queryenum_next(query, &error)) {
+        ++i;
+        sprintf(docID, "doc-%03d", i);
+        REQUIRE(query->docID == c4str(docID));
+        REQUIRE(query->docSequence == (C4SequenceNumber)i);
+        if (i % 2 == 0) {
+            CHECK(query->value == (i == 10 ? kUpdatedBody : kBody));
+            C4Document *curDoc = c4doc_get(db, query->docID, true, &error);
+            REQUIRE(curDoc);
+            CHECK(query->revID == curDoc->revID);
+            c4doc_free(curDoc);
+        } else {
+            CHECK(query->value == c4str("1234"));
+            CHECK(query->revID == kC4SliceNull);
+        }
+    }
+    c4queryenum_free(query);
+    REQUIRE(error.code == 0);
+    CHECK(i == kNumDocs);
+}
+
+
 
 #pragma mark - GROUP / REDUCE:
 
@@ -212,6 +326,89 @@ TEST_CASE_METHOD(C4ViewTest, "View ReduceAll", "[View][C]") {
 }
 
 
+// Indexes each doc "doc-NN" as key ["even"|"odd", NN] with value NN.
+static void indexParity(C4Database *db, C4View *view) {
+    C4Error error;
+    C4Indexer* ind = c4indexer_begin(db, &view, 1, &error);
+    REQUIRE(ind);
+    C4DocEnumerator* e = c4indexer_enumerateDocuments(ind, &error);
+    if (e) {
+        C4Document *doc;
+        while (nullptr != (doc = c4enum_nextDocument(e, &error))) {
+            int n = atoi(std::string((char*)doc->docID.buf + 4, doc->docID.size - 4).c_str());
+            C4Key *key = c4key_new();
+            c4key_beginArray(key);
+            c4key_addString(key, c4str(n % 2 ? "odd" : "even"));
+            c4key_addNumber(key, n);
+            c4key_endArray(key);
+            char value[10];
+            sprintf(value, "%d", n);
+            C4Slice valueSlice = c4str(value);
+            REQUIRE(c4indexer_emit(ind, doc, 0, 1, &key, &valueSlice, &error));
+            c4key_free(key);
+            c4doc_free(doc);
+        }
+        REQUIRE(error.code == 0);
+        c4enum_free(e);
+    }
+    REQUIRE(c4indexer_end(ind, true, &error));
+}
+
+// Runs a built-in reduce query and returns its rows as "key=value" lines.
+static std::string reduceRows(C4View *view, C4BuiltInReduce reduce, unsigned groupLevel) {
+    C4QueryOptions options = kC4DefaultQueryOptions;
+    options.builtInReduce = reduce;
+    options.groupLevel = groupLevel;
+    C4Error error;
+    auto e = c4view_query(view, &options, &error);
+    REQUIRE(e);
+    std::string result;
+    while (c4queryenum_next(e, &error)) {
+        result += toJSON(e->key) + "=" + std::string((char*)e->value.buf, e->value.size) + "\n";
+    }
+    REQUIRE(error.code == 0);
+    c4queryenum_free(e);
+    return result;
+}
+
+
+N_WAY_TEST_CASE_METHOD(C4ViewTest, "View StoredReduce", "[View][C]") {
+    C4Error error;
+    REQUIRE(c4view_setStoredReduce(view, true, &error));
+    char docID[20];
+    for (int i = 1; i <= 10; i++) {
+        sprintf(docID, "doc-%02d", i);
+        createRev(c4str(docID), kRevID, kBody);
+    }
+    indexParity(db, view);
+
+    CHECK(reduceRows(view, kC4ReduceCount, 0) == "null=10\n");
+    CHECK(reduceRows(view, kC4ReduceSum, 0) == "null=55\n");
+    CHECK(reduceRows(view, kC4ReduceStats, 0) ==
+          "null={\"sum\":55,\"count\":10,\"min\":1,\"max\":10,\"sumsqr\":385}\n");
+    CHECK(reduceRows(view, kC4ReduceSum, 1) == "[\"even\"]=30\n[\"odd\"]=25\n");
+    CHECK(reduceRows(view, kC4ReduceMax, 1) == "[\"even\"]=10\n[\"odd\"]=9\n");
+
+    // Delete the docs holding the extreme values, so min and max have to be recomputed:
+    createRev(c4str("doc-01"), kRev2ID, kC4SliceNull, kRevDeleted);
+    createRev(c4str("doc-10"), kRev2ID, kC4SliceNull, kRevDeleted);
+    indexParity(db, view);
+
+    CHECK(reduceRows(view, kC4ReduceSum, 0) == "null=44\n");    // doesn't need min/max
+    std::string stats = reduceRows(view, kC4ReduceStats, 0);
+    CHECK(stats == "null={\"sum\":44,\"count\":8,\"min\":2,\"max\":9,\"sumsqr\":284}\n");
+    std::string mins = reduceRows(view, kC4ReduceMin, 1);
+    CHECK(mins == "[\"even\"]=2\n[\"odd\"]=3\n");
+    std::string maxes = reduceRows(view, kC4ReduceMax, 1);
+
+    // Results must match those computed by scanning the index rows:
+    REQUIRE(c4view_setStoredReduce(view, false, &error));
+    CHECK(reduceRows(view, kC4ReduceStats, 0) == stats);
+    CHECK(reduceRows(view, kC4ReduceMin, 1) == mins);
+    CHECK(reduceRows(view, kC4ReduceMax, 1) == maxes);
+}
+
+
 #pragma mark - PURGING:
 
 
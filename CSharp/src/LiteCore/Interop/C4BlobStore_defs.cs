@@ -46,4 +46,8 @@ namespace LiteCore.Interop
     public unsafe struct C4ReadStream
     {
     }
+
+    public unsafe struct C4BlobMapping
+    {
+    }
 }
\ No newline at end of file
@@ -107,6 +107,15 @@ namespace LiteCore.Interop
         [DllImport(Constants.DllName, CallingConvention = CallingConvention.Cdecl)]
         public static extern void c4stream_close(C4ReadStream* stream);
 
+        [DllImport(Constants.DllName, CallingConvention = CallingConvention.Cdecl)]
+        public static extern C4BlobMapping* c4blob_openMapped(C4BlobStore* store, C4BlobKey key, C4Error* outError);
+
+        [DllImport(Constants.DllName, CallingConvention = CallingConvention.Cdecl)]
+        public static extern C4Slice c4blob_mappedContents(C4BlobMapping* mapping);
+
+        [DllImport(Constants.DllName, CallingConvention = CallingConvention.Cdecl)]
+        public static extern void c4blob_closeMapped(C4BlobMapping* mapping);
+
         [DllImport(Constants.DllName, CallingConvention = CallingConvention.Cdecl)]
         public static extern C4WriteStream* c4blob_openWriteStream(C4BlobStore* store, C4Error* outError);
 
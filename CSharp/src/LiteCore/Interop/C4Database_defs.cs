@@ -36,6 +36,8 @@ namespace LiteCore.Interop
         AutoCompact   = 4,
         Bundled       = 8,
         SharedKeys    = 0x10,
+        SeparateRevBodies = 0x20,
+        CompressBodies = 0x40,
     }
 
     public enum C4EncryptionAlgorithm : uint
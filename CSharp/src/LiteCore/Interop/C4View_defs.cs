@@ -28,7 +28,15 @@ using LiteCore.Util;
 
 namespace LiteCore.Interop
 {
-
+    public enum C4BuiltInReduce : uint
+    {
+        None,
+        Count,
+        Sum,
+        Min,
+        Max,
+        Stats,
+    }
 
     public unsafe struct C4View
     {
@@ -50,6 +58,9 @@ namespace LiteCore.Interop
         private UIntPtr _keysCount;
         public C4ReduceFunction* reduce;
         public uint groupLevel;
+        private byte _streaming;
+        private byte _includeDocs;
+        public C4BuiltInReduce builtInReduce;
 
         public bool descending
         {
@@ -100,6 +111,26 @@ namespace LiteCore.Interop
                 _keysCount = (UIntPtr)value;
             }
         }
+
+        public bool streaming
+        {
+            get {
+                return Convert.ToBoolean(_streaming);
+            }
+            set {
+                _streaming = Convert.ToByte(value);
+            }
+        }
+
+        public bool includeDocs
+        {
+            get {
+                return Convert.ToBoolean(_includeDocs);
+            }
+            set {
+                _includeDocs = Convert.ToByte(value);
+            }
+        }
     }
 
     public unsafe struct C4QueryEnumerator
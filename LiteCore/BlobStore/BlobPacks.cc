@@ -0,0 +1,358 @@
+//
+//  BlobPacks.cc
+//  LiteCore
+//
+//  Copyright © 2017 Couchbase. All rights reserved.
+//
+
+#include "BlobPacks.hh"
+#include "DataFile.hh"
+#include "KeyStore.hh"
+#include "MappedFile.hh"
+#include "Record.hh"
+#include "RecordEnumerator.hh"
+#include "Stream.hh"
+#include "Error.hh"
+#include "Logging.hh"
+#include "varint.hh"
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <set>
+#include <vector>
+#include <errno.h>
+#include <stdio.h>
+
+using namespace std;
+using namespace fleece;
+
+namespace litecore {
+
+    extern LogDomain BlobLog;
+
+    // Key in the index's info KeyStore of the number of the pack being appended to:
+    static const slice kCurrentPackKey = "currentPack"_sl;
+
+    // Key in the index's info KeyStore that's written just to take the index's write lock:
+    static const slice kLockKey = "lock"_sl;
+
+
+    /** Reads a range of a pack file as though it were a file of its own. */
+    class PackedBlobReadStream : public virtual SeekableReadStream {
+    public:
+        PackedBlobReadStream(const FilePath &pack, uint64_t offset, uint64_t length)
+        :_file(pack),
+         _start(offset),
+         _length(length)
+        {
+            _file.seek(_start);
+        }
+
+        uint64_t getLength() const override         {return _length;}
+
+        void seek(uint64_t pos) override {
+            _pos = min(pos, _length);
+            _file.seek(_start + _pos);
+        }
+
+        size_t read(void *dst, size_t count) override {
+            count = (size_t)min((uint64_t)count, _length - _pos);
+            size_t bytesRead = _file.read(dst, count);
+            _pos += bytesRead;
+            return bytesRead;
+        }
+
+        void close() override                       {_file.close();}
+
+    private:
+        FileReadStream _file;
+        uint64_t const _start, _length;
+        uint64_t _pos {0};
+    };
+
+
+#pragma mark - LIFECYCLE:
+
+
+    static FilePath indexPath(const FilePath &dir) {
+        auto factory = DataFile::factoryNamed(string());
+        return dir["packs"].withExtension(factory->filenameExtension());
+    }
+
+
+    /*static*/ bool BlobPacks::existIn(const FilePath &dir) {
+        return indexPath(dir).exists();
+    }
+
+
+    BlobPacks::BlobPacks(const FilePath &dir, bool writeable)
+    :_dir(dir)
+    {
+        DataFile::Options options = DataFile::Options::defaults;
+        options.keyStores.sequences = options.keyStores.softDeletes = false;
+        options.create = options.writeable = writeable;
+        // Compaction deletes packs once their blobs' new locations are committed, so a commit
+        // must never be rolled back by a crash:
+        options.durableCommits = true;
+        _index.reset(DataFile::factoryNamed(string())->openFile(indexPath(dir), &options));
+    }
+
+
+    BlobPacks::~BlobPacks()
+    { }
+
+
+    FilePath BlobPacks::packPath(uint32_t pack) const {
+        char name[32];
+        sprintf(name, "pack-%05u.blobpack", pack);
+        return _dir[name];
+    }
+
+
+#pragma mark - INDEX:
+
+
+    // The index maps each blobKey to its Location, encoded as three varints.
+    /*static*/ alloc_slice BlobPacks::encodeLocation(const Location &loc) {
+        alloc_slice body(SizeOfVarInt(loc.pack) + SizeOfVarInt(loc.offset)
+                         + SizeOfVarInt(loc.length));
+        auto dst = (uint8_t*)body.buf;
+        dst += PutUVarInt(dst, loc.pack);
+        dst += PutUVarInt(dst, loc.offset);
+        PutUVarInt(dst, loc.length);
+        return body;
+    }
+
+
+    /*static*/ BlobPacks::Location BlobPacks::decodeLocation(slice body) {
+        Location loc;
+        uint64_t pack;
+        size_t n = GetUVarInt(body, &pack);
+        if (n == 0 || pack == 0 || pack > UINT32_MAX)
+            error::_throw(error::CorruptData);
+        loc.pack = (uint32_t)pack;
+        body.moveStart(n);
+        n = GetUVarInt(body, &loc.offset);
+        if (n == 0)
+            error::_throw(error::CorruptData);
+        body.moveStart(n);
+        if (GetUVarInt(body, &loc.length) == 0)
+            error::_throw(error::CorruptData);
+        return loc;
+    }
+
+
+    BlobPacks::Location BlobPacks::find(const blobKey &key) {
+        lock_guard<mutex> lock(_mutex);
+        return _find(key);
+    }
+
+
+    BlobPacks::Location BlobPacks::_find(const blobKey &key) {
+        Record rec = _index->defaultKeyStore().get(key);
+        if (!rec.exists())
+            return Location();
+        return decodeLocation(rec.body());
+    }
+
+
+    bool BlobPacks::remove(const blobKey &key) {
+        lock_guard<mutex> lock(_mutex);
+        Transaction t(*_index);
+        bool removed = _index->defaultKeyStore().del(key, t);
+        t.commit();
+        return removed;
+    }
+
+
+#pragma mark - PACK FILES:
+
+
+    // Takes the index's write lock at the start of a transaction, by writing to it before
+    // reading anything. Until the transaction ends, other BlobPacks instances on the same
+    // directory can't append to a pack, start a new one, or compact.
+    void BlobPacks::lockIndex(Transaction &t) {
+        _index->getKeyStore(DataFile::kInfoKeyStoreName).set(kLockKey, nullslice, t);
+    }
+
+
+    uint32_t BlobPacks::currentPack() {
+        auto &info = _index->getKeyStore(DataFile::kInfoKeyStoreName);
+        return (uint32_t)info.get(kCurrentPackKey).bodyAsUInt();
+    }
+
+
+    uint32_t BlobPacks::startNewPack(Transaction &t) {
+        KeyStore &info = _index->getKeyStore(DataFile::kInfoKeyStoreName);
+        Record rec = info.get(kCurrentPackKey);
+        uint32_t pack = (uint32_t)rec.bodyAsUInt() + 1;
+        rec.setBodyAsUInt(pack);
+        info.write(rec, t);
+        return pack;
+    }
+
+
+    // Appends data to the current pack, moving on to a new one if it's full. Must be called in
+    // a transaction on the index that's called lockIndex, so no other BlobPacks instance can
+    // append at once.
+    BlobPacks::Location BlobPacks::append(slice data, Transaction &t) {
+        Location loc;
+        loc.pack = currentPack();
+        int64_t size = loc.pack ? packPath(loc.pack).dataSize() : -1;
+        if (loc.pack == 0 || (size > 0 && (uint64_t)size + data.size > kMaxPackSize)) {
+            loc.pack = startNewPack(t);
+            size = packPath(loc.pack).dataSize();
+        }
+        loc.offset = max(size, (int64_t)0);
+        loc.length = data.size;
+
+        FileWriteStream out(packPath(loc.pack), "ab");
+        out.write(data);
+        out.close();
+        return loc;
+    }
+
+
+    // Forces data appended to a pack onto the disk. This has to happen before the index
+    // transaction that refers to the data commits.
+    void BlobPacks::syncPack(uint32_t pack) {
+        FileWriteStream out(packPath(pack), "ab");
+        out.sync();
+        out.close();
+    }
+
+
+    alloc_slice BlobPacks::readData(const Location &loc) const {
+        return PackedBlobReadStream(packPath(loc.pack), loc.offset, loc.length).readAll();
+    }
+
+
+    static bool isMissingFile(const error &x) {
+        return x.domain == error::POSIX && x.code == ENOENT;
+    }
+
+
+    // Looks up the blob and opens its pack with `open`. If another BlobPacks instance compacts
+    // away the pack in between, the blob has been moved to a newer pack, so look it up again.
+    // (Holding _mutex keeps this instance from compacting meanwhile.)
+    template <class T>
+    static unique_ptr<T> openPacked(mutex &mut, function<BlobPacks::Location()> find,
+                                    function<T*(const BlobPacks::Location&)> open)
+    {
+        for (int attempt = 0; ; ++attempt) {
+            lock_guard<mutex> lock(mut);
+            BlobPacks::Location loc = find();
+            if (!loc)
+                return nullptr;
+            try {
+                return unique_ptr<T>{open(loc)};
+            } catch (const error &x) {
+                if (attempt > 0 || !isMissingFile(x))
+                    throw;
+            }
+        }
+    }
+
+
+    unique_ptr<SeekableReadStream> BlobPacks::read(const blobKey &key) {
+        return openPacked<SeekableReadStream>(_mutex, [&]{return _find(key);},
+                                              [&](const Location &loc) {
+            return new PackedBlobReadStream(packPath(loc.pack), loc.offset, loc.length);
+        });
+    }
+
+
+    unique_ptr<MappedFile> BlobPacks::map(const blobKey &key) {
+        return openPacked<MappedFile>(_mutex, [&]{return _find(key);},
+                                      [&](const Location &loc) {
+            return new MappedFile(packPath(loc.pack), loc.offset, loc.length);
+        });
+    }
+
+
+    void BlobPacks::add(const blobKey &key, slice data) {
+        lock_guard<mutex> lock(_mutex);
+        Transaction t(*_index);
+        lockIndex(t);
+        KeyStore &store = _index->defaultKeyStore();
+        if (store.get(key, kMetaOnly).exists()) {
+            t.abort();                              // already packed
+            return;
+        }
+        Location loc = append(data, t);
+        syncPack(loc.pack);
+        store.set(key, encodeLocation(loc), t);
+        t.commit();
+    }
+
+
+#pragma mark - COMPACTION:
+
+
+    unsigned BlobPacks::compact() {
+        lock_guard<mutex> lock(_mutex);
+        // One transaction covers reading the index, listing the packs and rewriting them, so no
+        // other BlobPacks instance can append a blob that this would then miss.
+        Transaction t(*_index);
+        lockIndex(t);
+        uint32_t current = currentPack();
+
+        // Find each pack's live blobs:
+        map<uint32_t, vector<pair<alloc_slice, Location>>> blobsByPack;
+        map<uint32_t, uint64_t> liveBytes;
+        {
+            RecordEnumerator e(_index->defaultKeyStore());
+            while (e.next()) {
+                Location loc = decodeLocation(e.record().body());
+                blobsByPack[loc.pack].emplace_back(e.record().key(), loc);
+                liveBytes[loc.pack] += loc.length;
+            }
+        }
+
+        // Pick the sparse packs. The current pack (or any newer one) is never picked, since it's
+        // still being appended to:
+        vector<uint32_t> sparse;
+        _dir["pack-"].forEachMatch([&](const FilePath &file) {
+            unsigned pack;
+            if (sscanf(file.fileName().c_str(), "pack-%u.blobpack", &pack) != 1 || pack == 0)
+                return;
+            auto size = file.dataSize();
+            if (pack < current && liveBytes[pack] < (uint64_t)size / 2)
+                sparse.push_back(pack);
+        });
+
+        KeyStore &store = _index->defaultKeyStore();
+        set<uint32_t> written;
+        for (auto pack : sparse) {
+            LogTo(BlobLog, "Compacting blob pack %u (%llu of %lld bytes in use)",
+                  pack, (unsigned long long)liveBytes[pack],
+                  (long long)packPath(pack).dataSize());
+            for (auto &blob : blobsByPack[pack]) {
+                Location loc = append(readData(blob.second), t);
+                store.set(blob.first, encodeLocation(loc), t);
+                written.insert(loc.pack);
+            }
+        }
+        for (auto pack : written)
+            syncPack(pack);
+
+        // Delete the rewritten packs only once the copies are on disk and their new locations
+        // are committed (durably; see the constructor), so a failed commit or a crash can't
+        // lose them. No other instance will touch them afterwards: nothing in the index refers
+        // to them, and they're older than the current pack so nobody appends to them. Readers
+        // that looked up an old location retry (see openPacked.)
+        t.commit();
+        unsigned deleted = 0;
+        for (auto pack : sparse) {
+            try {
+                packPath(pack).del();
+                ++deleted;
+            } catch (const exception &x) {
+                // It may still be open by a reader (on Windows); the next compact will retry.
+                Warn("BlobPacks: couldn't delete pack %u: %s", pack, x.what());
+            }
+        }
+        return deleted;
+    }
+
+}
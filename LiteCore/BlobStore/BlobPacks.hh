@@ -0,0 +1,92 @@
+//
+//  BlobPacks.hh
+//  LiteCore
+//
+//  Copyright © 2017 Couchbase. All rights reserved.
+//
+
+#pragma once
+#include "Base.hh"
+#include "BlobStore.hh"
+#include "FilePath.hh"
+#include <memory>
+#include <mutex>
+
+namespace litecore {
+    class DataFile;
+    class MappedFile;
+    class Record;
+    class Transaction;
+
+
+    /** The pack-file tier of a BlobStore. Small blobs are appended to shared, append-only
+        "pack" files instead of each getting a file of its own. An index maps each packed blob's
+        key to its pack, offset and length; it's a small database in the store's directory.
+        The data stored for a blob is exactly what its own file would contain (i.e. encrypted,
+        if the store is.) All methods are thread-safe. */
+    class BlobPacks {
+    public:
+        /** Where a packed blob's data is. */
+        struct Location {
+            uint32_t pack   {0};        ///< Pack number, or 0 if the blob isn't packed
+            uint64_t offset {0};        ///< Byte offset of the data in the pack file
+            uint64_t length {0};        ///< Length of the data
+
+            explicit operator bool() const      {return pack != 0;}
+        };
+
+        /** Blobs larger than this (before encryption) get their own files. */
+        static const size_t kMaxPackedBlobSize = 32 * 1024;
+
+        /** A pack file grows to about this size before a new one is started. */
+        static const uint64_t kMaxPackSize = 16 * 1024 * 1024;
+
+        /** Is there a pack index in this directory? */
+        static bool existIn(const FilePath &dir);
+
+        /** Opens, or creates if writeable, the pack index in `dir`. */
+        BlobPacks(const FilePath &dir, bool writeable);
+        ~BlobPacks();
+
+        /** Looks up a packed blob; the result is false if it isn't packed. */
+        Location find(const blobKey&);
+
+        /** Returns a stream that reads a packed blob's data, or null if it isn't packed.
+            The blob is looked up each time, since compaction may have moved it. */
+        std::unique_ptr<SeekableReadStream> read(const blobKey&);
+
+        /** Memory-maps a packed blob's data, or returns null if it isn't packed. */
+        std::unique_ptr<MappedFile> map(const blobKey&);
+
+        /** Appends a blob's data to the current pack and indexes it. Does nothing if the blob
+            is already packed. */
+        void add(const blobKey&, slice data);
+
+        /** Removes a blob from the index. Its data stays in the pack until it's compacted.
+            Returns false if the blob wasn't packed. */
+        bool remove(const blobKey&);
+
+        /** Rewrites packs in which less than half the data still belongs to indexed blobs,
+            copying their live blobs into the current pack, then deletes them. The current pack
+            itself is left alone until a newer one replaces it. Returns the number of packs
+            deleted. */
+        unsigned compact();
+
+    private:
+        FilePath packPath(uint32_t pack) const;
+        Location _find(const blobKey&);
+        void lockIndex(Transaction&);
+        uint32_t currentPack();
+        uint32_t startNewPack(Transaction&);
+        Location append(slice data, Transaction&);
+        void syncPack(uint32_t pack);
+        alloc_slice readData(const Location&) const;
+        static Location decodeLocation(slice);
+        static alloc_slice encodeLocation(const Location&);
+
+        FilePath const              _dir;
+        std::unique_ptr<DataFile>   _index;         // Maps blobKey -> Location
+        std::mutex                  _mutex;
+    };
+
+}
@@ -14,9 +14,11 @@
 //  and limitations under the License.
 
 #include "BlobStore.hh"
+#include "BlobPacks.hh"
 #include "FilePath.hh"
 #include "Error.hh"
 #include "EncryptedStream.hh"
+#include "MappedFile.hh"
 #include "Logging.hh"
 #include <stdint.h>
 #include <stdio.h>
@@ -89,11 +91,18 @@ namespace litecore {
     :_path(store.dir(), key.filename()),
      _key(key),
      _store(store)
-    { }
+    {
+        auto packs = store.packs(false);
+        if (packs) {
+            auto loc = packs->find(key);
+            _pack = loc.pack;
+            _packLength = loc.length;
+        }
+    }
 
 
     int64_t Blob::contentLength() const {
-        int64_t length = path().dataSize();
+        int64_t length = isPacked() ? (int64_t)_packLength : path().dataSize();
         if (length >= 0 && _store.options().encryptionAlgorithm != kNoEncryption)
             length -= EncryptedReadStream::kFileSizeOverhead;
         return length;
@@ -102,7 +111,11 @@ namespace litecore {
 
 
     unique_ptr<SeekableReadStream> Blob::read() const {
-        SeekableReadStream *reader = new FileReadStream(_path);
+        SeekableReadStream *reader = nullptr;
+        if (isPacked())
+            reader = _store.packs(false)->read(_key).release();
+        if (!reader)
+            reader = new FileReadStream(_path);     // (it may have been unpacked since)
         auto &options = _store.options();
         if (options.encryptionAlgorithm != kNoEncryption) {
             reader = new EncryptedReadStream(shared_ptr<SeekableReadStream>(reader),
@@ -113,14 +126,46 @@ namespace litecore {
     }
 
 
+    unique_ptr<MappedFile> Blob::map() const {
+        if (_store.isEncrypted())
+            error::_throw(error::UnsupportedOperation);     // the file isn't plaintext
+        if (isPacked()) {
+            auto mapped = _store.packs(false)->map(_key);
+            if (mapped)
+                return mapped;
+        }
+        return unique_ptr<MappedFile>{new MappedFile(_path)};
+    }
+
+
+    void Blob::del() {
+        if (isPacked()) {
+            _store.packs(false)->remove(_key);
+            _pack = 0;
+        }
+        _path.del();
+    }
+
+
 #pragma mark - BLOB WRITING:
 
 
+    // Data is kept in memory until it grows too large to go in a pack file; only then does it
+    // get written to a temporary file, which install() moves into place.
     BlobWriteStream::BlobWriteStream(BlobStore &store)
-    :_store(store)
+    :_store(store),
+     _buffering(store.options().packSmallBlobs)
     {
+        if (!_buffering)
+            openTempFile();
+        sha1_begin(&_sha1ctx);
+    }
+
+
+    void BlobWriteStream::openTempFile() {
         FILE *file;
-        _tmpPath = store.dir()["incoming_"].mkTempFile(&file);
+        _tmpPath = _store.dir()["incoming_"].mkTempFile(&file);
+        _hasTempFile = true;
         _writer = shared_ptr<WriteStream> {new FileWriteStream(file)};
         auto &options = _store.options();
         if (options.encryptionAlgorithm != kNoEncryption) {
@@ -128,12 +173,11 @@ namespace litecore {
                                                                     options.encryptionAlgorithm,
                                                                     options.encryptionKey)};
         }
-        sha1_begin(&_sha1ctx);
     }
 
 
     BlobWriteStream::~BlobWriteStream() {
-        if (!_installed) {
+        if (!_installed && _hasTempFile) {
             try {
                 _tmpPath.del();
             } catch (...) {
@@ -147,8 +191,20 @@ namespace litecore {
 
     void BlobWriteStream::write(slice data) {
         Assert(!_computedKey, "Attempted to write after computing digest");
-        _writer->write(data);
         sha1_add(&_sha1ctx, data.buf, data.size);
+        if (_buffering) {
+            if (_buffer.size() + data.size <= BlobPacks::kMaxPackedBlobSize) {
+                _buffer.append((const char*)data.buf, data.size);
+                return;
+            }
+            // Too big to pack, so switch to a file:
+            openTempFile();
+            _writer->write(slice(_buffer));
+            _buffer.clear();
+            _buffer.shrink_to_fit();
+            _buffering = false;
+        }
+        _writer->write(data);
     }
 
     void BlobWriteStream::close() {
@@ -169,6 +225,11 @@ namespace litecore {
 
     Blob BlobWriteStream::install() {
         close();
+        if (_buffering) {
+            _store.addToPack(computeKey(), slice(_buffer));
+            _installed = true;
+            return Blob(_store, computeKey());
+        }
         Blob blob(_store, computeKey());
         _tmpPath.setReadOnly(true);
         _tmpPath.moveTo(blob.path());
@@ -180,7 +241,18 @@ namespace litecore {
 #pragma mark - BLOBSTORE:
 
 
-    const BlobStore::Options BlobStore::Options::defaults = {true, true};
+    // WriteStream that collects what's written to it in memory.
+    class BlobMemoryWriteStream : public WriteStream {
+    public:
+        void write(slice data) override     {_data.append((const char*)data.buf, data.size);}
+        void close() override               { }
+        const string& data() const          {return _data;}
+    private:
+        string _data;
+    };
+
+
+    const BlobStore::Options BlobStore::Options::defaults = {true, true, true};
 
 
     BlobStore::BlobStore(const FilePath &dir, const Options *options)
@@ -197,10 +269,91 @@ namespace litecore {
     }
 
 
+    BlobStore::~BlobStore()
+    { }
+
+
+    void BlobStore::deleteStore() {
+        {
+            lock_guard<mutex> lock(_packsMutex);
+            _packs.reset();
+        }
+        _dir.delRecursive();
+    }
+
+
     Blob BlobStore::put(slice data) {
         BlobWriteStream stream(*this);
         stream.write(data);
         return stream.install();
     }
 
+
+#pragma mark - PACK FILES:
+
+
+    // Opens the pack index if there is one, or creates it if `create` is true.
+    BlobPacks* BlobStore::packs(bool create) const {
+        lock_guard<mutex> lock(_packsMutex);
+        if (!_packs && (BlobPacks::existIn(_dir) || (create && _options.writeable)))
+            _packs.reset(new BlobPacks(_dir, _options.writeable));
+        return _packs.get();
+    }
+
+
+    // Adds a small blob to a pack file, unless the store already has it.
+    void BlobStore::addToPack(const blobKey &key, slice data) {
+        if (get(key).exists())
+            return;
+        alloc_slice encrypted;
+        if (isEncrypted()) {
+            // Packed data is encrypted exactly as the blob's own file would be:
+            auto output = make_shared<BlobMemoryWriteStream>();
+            EncryptedWriteStream writer(output, _options.encryptionAlgorithm,
+                                        _options.encryptionKey);
+            writer.write(data);
+            writer.close();
+            encrypted = alloc_slice(slice(output->data()));
+            data = encrypted;
+        }
+        auto p = packs(true);
+        if (!p)
+            error::_throw(error::NotWriteable);
+        p->add(key, data);
+    }
+
+
+    void BlobStore::unpack(const blobKey &key) {
+        Blob blob = get(key);
+        if (!blob.isPacked())
+            return;
+        alloc_slice stored;
+        {
+            auto reader = packs(false)->read(key);
+            if (!reader)
+                return;
+            stored = reader->readAll();
+        }
+        FILE *file;
+        FilePath tmpPath = _dir["incoming_"].mkTempFile(&file);
+        try {
+            FileWriteStream out(file);
+            out.write(stored);
+            out.close();
+            tmpPath.setReadOnly(true);
+            tmpPath.moveTo(blob.path());
+        } catch (...) {
+            tmpPath.del();
+            throw;
+        }
+        packs(false)->remove(key);
+    }
+
+
+    void BlobStore::compactPacks() {
+        auto p = packs(false);
+        if (p)
+            p->compact();
+    }
+
 }
@@ -11,6 +11,9 @@
 #include "FilePath.hh"
 #include "Stream.hh"
 #include "SecureDigest.hh"
+#include <memory>
+#include <mutex>
+#include <string>
 
 #if !SECURE_DIGEST_AVAILABLE
 #error No SHA digest API configured (See SecureDigest.hh)
@@ -18,7 +21,9 @@
 
 namespace litecore {
     class BlobStore;
+    class BlobPacks;
     class FilePath;
+    class MappedFile;
 
 
     /** A raw SHA-1 digest used as the unique identifier of a blob. */
@@ -38,20 +43,29 @@ namespace litecore {
     };
 
 
-    /** Represents a blob stored in a BlobStore. */
+    /** Represents a blob stored in a BlobStore: either in a file of its own, or (if it's small)
+        in a pack file shared with other blobs. */
     class Blob {
     public:
-        bool exists() const             {return _path.exists();}
+        bool exists() const             {return isPacked() || _path.exists();}
 
         blobKey key() const             {return _key;}
+
+        /** The path of the blob's own file. A packed blob doesn't have one; use
+            BlobStore::unpack to give it one. */
         FilePath path() const           {return _path;}
+        bool isPacked() const           {return _pack != 0;}
         int64_t contentLength() const;      // An overestimate, if blob is encrypted
 
         alloc_slice contents() const    {return read()->readAll();}
 
         std::unique_ptr<SeekableReadStream> read() const;
 
-        void del()                      {_path.del();}
+        /** Memory-maps the blob's data, so it can be read without copying it. Only possible if
+            the store isn't encrypted; otherwise throws UnsupportedOperation. */
+        std::unique_ptr<MappedFile> map() const;
+
+        void del();
 
     private:
         friend class BlobStore;
@@ -62,6 +76,10 @@ namespace litecore {
         FilePath _path;
         const blobKey _key;
         const BlobStore &_store;
+        // If it's packed: its pack and length when this was created. (read and map look up its
+        // location again, since compacting the packs may have moved it.)
+        uint32_t _pack {0};
+        uint64_t _packLength {0};
     };
 
 
@@ -83,9 +101,14 @@ namespace litecore {
         Blob install();
 
     private:
+        void openTempFile();
+
         BlobStore &_store;
         FilePath _tmpPath;
         std::shared_ptr<WriteStream> _writer;
+        std::string _buffer;            // Holds the data while it's small enough to be packed
+        bool _buffering;                // Still writing to _buffer instead of a temp file?
+        bool _hasTempFile {false};
         sha1Context _sha1ctx;
         blobKey _key;
         bool _computedKey {false};
@@ -99,6 +122,7 @@ namespace litecore {
         struct Options {
             bool create         :1;     ///< Should the store be created if it doesn't exist?
             bool writeable      :1;     ///< If false, opened read-only
+            bool packSmallBlobs :1;     ///< Store small blobs in shared pack files?
             EncryptionAlgorithm encryptionAlgorithm;
             alloc_slice encryptionKey;
             
@@ -106,6 +130,7 @@ namespace litecore {
         };
 
         BlobStore(const FilePath &dir, const Options* =nullptr);
+        ~BlobStore();
 
         const FilePath& dir() const                 {return _dir;}
         const Options& options() const              {return _options;}
@@ -114,7 +139,7 @@ namespace litecore {
         uint64_t count() const;
         uint64_t totalSize() const;
 
-        void deleteStore()                          {_dir.delRecursive();}
+        void deleteStore();
 
         bool has(const blobKey &key) const          {return get(key).exists();}
 
@@ -123,9 +148,23 @@ namespace litecore {
 
         Blob put(slice data);
 
+        /** Moves a packed blob into a file of its own, so it has a path(). */
+        void unpack(const blobKey&);
+
+        /** Rewrites pack files that are mostly free space (from deleted blobs.) */
+        void compactPacks();
+
     private:
+        friend class Blob;
+        friend class BlobWriteStream;
+
+        BlobPacks* packs(bool create) const;
+        void addToPack(const blobKey&, slice data);
+
         FilePath const          _dir;                           // Location
         Options                 _options;                       // Option/capability flags
+        mutable std::unique_ptr<BlobPacks> _packs;              // Pack files, once opened
+        mutable std::mutex      _packsMutex;
     };
 
 }
@@ -19,6 +19,9 @@
 #include "PlatformIO.hh"
 #include <errno.h>
 #include <memory>
+#ifdef _MSC_VER
+#include <io.h>
+#endif
 
 namespace litecore {
     using namespace std;
@@ -94,4 +97,16 @@ namespace litecore {
         checkErr(_file);
     }
 
+
+    void FileWriteStream::sync() {
+        if (fflush(_file) != 0)
+            error::_throwErrno();
+#ifdef _MSC_VER
+        if (_commit(_fileno(_file)) != 0)
+#else
+        if (fsync(fileno(_file)) != 0)
+#endif
+            error::_throwErrno();
+    }
+
 }
@@ -21,10 +21,15 @@
 #include "Collatable.hh"
 #include "CASRevisionStore.hh"
 #include "DocumentMeta.hh"
+#include "VersionedDocument.hh"
 #include "SequenceTracker.hh"
 #include "Fleece.hh"
 #include "BlobStore.hh"
 #include "forestdb_endian.h"
+#include "varint.hh"
+#include <algorithm>
+#include <chrono>
+#include <ctime>
 
 
 namespace c4Internal {
@@ -39,6 +44,12 @@ namespace c4Internal {
 #pragma mark - LIFECYCLE:
 
 
+    // KeyStore::TombstoneTest for document records; lets the KeyStore count live docs.
+    static bool isDeletedDocMeta(slice meta) {
+        return !!(DocumentMeta(meta).flags & DocumentFlags::kDeleted);
+    }
+
+
     Database* Database::newDatabase(const string &pathStr, C4DatabaseConfig config) {
         FilePath path = (config.flags & kC4DB_Bundled)
                             ? findOrCreateBundle(pathStr, config)
@@ -99,6 +110,7 @@ namespace c4Internal {
         }
         options.create = (config.flags & kC4DB_Create) != 0;
         options.writeable = (config.flags & kC4DB_ReadOnly) == 0;
+        options.compressBodies = (config.flags & kC4DB_CompressBodies) != 0;
 
         options.encryptionAlgorithm = (EncryptionAlgorithm)config.encryptionKey.algorithm;
         if (options.encryptionAlgorithm != kNoEncryption) {
@@ -154,19 +166,94 @@ namespace c4Internal {
         }
         _documentFactory.reset(factory);
         _db->setRecordFleeceAccessor(factory->fleeceAccessor());
+        _db->defaultKeyStore().setTombstoneTest(&isDeletedDocMeta);
+
+        if (config.versioning == kC4RevisionTrees) {
+            // Once a database has separately-stored revision bodies, keep using that layout:
+            auto names = _db->allKeyStoreNames();
+            _separateRevBodies = (config.flags & kC4DB_SeparateRevBodies)
+                || find(names.begin(), names.end(), VersionedDocument::kRevBodyStoreName)
+                        != names.end();
+        }
+
+        if (!(config.flags & kC4DB_ReadOnly))
+            upgradeExpirations();
 }
 
 
     Database::~Database() {
+        stopExpirationScheduler();
         Assert(_transactionLevel == 0);
     }
 
 
+    // Older versions kept expiration times in an "expiry" KeyStore, as a [timestamp, docID]
+    // Collatable key per doc plus a docID -> varint(timestamp) record. This moves them into the
+    // default KeyStore's expiration table and deletes the old KeyStore.
+    void Database::upgradeExpirations() {
+        auto names = _db->allKeyStoreNames();
+        if (find(names.begin(), names.end(), "expiry") == names.end())
+            return;
+        KeyStore &expiry = _db->getKeyStore("expiry");
+        Transaction t(*_db);
+        {
+            RecordEnumerator e(expiry);
+            while (e.next()) {
+                slice body = e.record().body();
+                uint64_t timestamp;
+                if (body.buf && GetUVarInt(body, &timestamp) > 0 && timestamp > 0) {
+                    auto expiration = (KeyStore::expiration_t)min(timestamp, (uint64_t)INT64_MAX);
+                    defaultKeyStore().setExpiration(e.record().key(), expiration, t);
+                }
+            }
+        }
+        expiry.deleteKeyStore(t);
+        t.commit();
+    }
+
+
+    // A database opened read-only may still have the old "expiry" KeyStore, since it couldn't
+    // be upgraded. Its presence means no expirations have been moved into the new table, since
+    // upgradeExpirations deletes it in the same transaction.
+    KeyStore* Database::legacyExpiryStore() {
+        if (!(config.flags & kC4DB_ReadOnly))
+            return nullptr;
+        auto names = _db->allKeyStoreNames();
+        if (find(names.begin(), names.end(), "expiry") == names.end())
+            return nullptr;
+        return &_db->getKeyStore("expiry");
+    }
+
+
+    // Reads all the docID -> expiration records from the legacy "expiry" KeyStore, sorted by
+    // time and then docID. (Only used on legacy read-only databases, so not optimized.)
+    vector<pair<alloc_slice, KeyStore::expiration_t>> Database::legacyExpirations() {
+        vector<pair<alloc_slice, KeyStore::expiration_t>> result;
+        KeyStore *expiry = legacyExpiryStore();
+        if (!expiry)
+            return result;
+        RecordEnumerator e(*expiry);
+        while (e.next()) {
+            slice body = e.record().body();
+            uint64_t timestamp;
+            if (body.buf && GetUVarInt(body, &timestamp) > 0 && timestamp > 0)
+                result.emplace_back(alloc_slice(e.record().key()),
+                                    (KeyStore::expiration_t)min(timestamp, (uint64_t)INT64_MAX));
+        }
+        sort(result.begin(), result.end(), [](const pair<alloc_slice, KeyStore::expiration_t> &a,
+                                               const pair<alloc_slice, KeyStore::expiration_t> &b) {
+            return a.second != b.second ? a.second < b.second : a.first.compare(b.first) < 0;
+        });
+        return result;
+    }
+
+
 #pragma mark - HOUSEKEEPING:
 
 
     void Database::close() {
         mustNotBeInTransaction();
+        stopExpirationScheduler();
         WITH_LOCK(this);
         _db->close();
     }
@@ -174,6 +261,7 @@ namespace c4Internal {
 
     void Database::deleteDatabase() {
         mustNotBeInTransaction();
+        stopExpirationScheduler();
         WITH_LOCK(this);
         if (config.flags & kC4DB_Bundled) {
             FilePath bundle = path().dir();
@@ -215,6 +303,9 @@ namespace c4Internal {
         mustNotBeInTransaction();
         WITH_LOCK(this);
         dataFile()->compact();
+        // Also rewrite the blob pack files that are mostly deleted blobs:
+        if ((config.flags & kC4DB_Bundled) && path().subdirectoryNamed("Attachments").exists())
+            blobStore()->compactPacks();
     }
 
 
@@ -255,30 +346,132 @@ namespace c4Internal {
 
     uint64_t Database::countDocuments() {
         WITH_LOCK(this);
-        RecordEnumerator::Options opts;
-        opts.contentOptions = kMetaOnly;
-
-        uint64_t count = 0;
-        for (RecordEnumerator e(defaultKeyStore(), nullslice, nullslice, opts); e.next(); ) {
-            DocumentMeta meta(e.record());
-            if (!(meta.flags & DocumentFlags::kDeleted))
-                ++count;
-        }
-        return count;
+        return defaultKeyStore().liveRecordCount();
     }
 
 
     time_t Database::nextDocumentExpirationTime() {
         WITH_LOCK(this);
-        KeyStore& expiryKvs = getKeyStore("expiry");
-        RecordEnumerator e(expiryKvs);
-        if(e.next() && e.record().body() == nullslice) {
-            // Look for an entry with a null body (otherwise, its key is simply a doc ID)
-            CollatableReader r(e.record().key());
-            r.beginArray();
-            return (time_t)r.readInt();
+        if (legacyExpiryStore()) {
+            auto expirations = legacyExpirations();
+            return expirations.empty() ? 0 : (time_t)expirations[0].second;
+        }
+        return (time_t)defaultKeyStore().nextExpiration();
+    }
+
+
+    KeyStore::expiration_t Database::documentExpiration(slice docID) {
+        WITH_LOCK(this);
+        if (KeyStore *expiry = legacyExpiryStore()) {
+            Record rec = expiry->get(docID);
+            slice body = rec.body();
+            uint64_t timestamp;
+            if (!body.buf || GetUVarInt(body, &timestamp) == 0)
+                return 0;
+            return (KeyStore::expiration_t)min(timestamp, (uint64_t)INT64_MAX);
+        }
+        return defaultKeyStore().getExpiration(docID);
+    }
+
+
+    vector<pair<alloc_slice, KeyStore::expiration_t>>
+    Database::expiredDocumentsAfter(KeyStore::expiration_t now,
+                                    KeyStore::expiration_t afterExpiration, slice afterDocID,
+                                    unsigned limit)
+    {
+        WITH_LOCK(this);
+        if (legacyExpiryStore()) {
+            vector<pair<alloc_slice, KeyStore::expiration_t>> page;
+            for (auto &exp : legacyExpirations()) {
+                if (page.size() >= limit || exp.second > now)
+                    break;
+                if (exp.second > afterExpiration
+                        || (exp.second == afterExpiration && exp.first.compare(afterDocID) > 0))
+                    page.push_back(exp);
+            }
+            return page;
+        }
+        return defaultKeyStore().expiredKeysAfter(now, afterExpiration, afterDocID, limit);
+    }
+
+
+    unsigned Database::purgeExpiredDocuments(unsigned maxDocs) {
+        vector<alloc_slice> docIDs;
+        beginTransaction();
+        try {
+            WITH_LOCK(this);
+            docIDs = defaultKeyStore().expiredKeys(time(nullptr), maxDocs);
+            for (auto &docID : docIDs)
+                _purgeDocument(docID);      // also clears its expiration
+        } catch (...) {
+            endTransaction(false);
+            throw;
+        }
+        endTransaction(true);
+        return (unsigned)docIDs.size();
+    }
+
+
+    void Database::startExpirationScheduler() {
+        lock_guard<mutex> lock(_expiryMutex);
+        if (_expiryThread.joinable())
+            return;
+        _stopExpiry = _expiryChanged = false;
+        _expiryThread = thread([this]{runExpirationScheduler();});
+    }
+
+
+    void Database::stopExpirationScheduler() {
+        {
+            lock_guard<mutex> lock(_expiryMutex);
+            if (!_expiryThread.joinable())
+                return;
+            _stopExpiry = true;
+        }
+        _expiryCond.notify_all();
+        _expiryThread.join();
+    }
+
+
+    void Database::expirationChanged() {
+        {
+            lock_guard<mutex> lock(_expiryMutex);
+            _expiryChanged = true;
+        }
+        _expiryCond.notify_all();
+    }
+
+
+    void Database::runExpirationScheduler() {
+        unique_lock<mutex> lock(_expiryMutex);
+        while (!_stopExpiry) {
+            _expiryChanged = false;
+            time_t next = 0;
+            lock.unlock();
+            try {
+                next = nextDocumentExpirationTime();
+                if (next > 0 && next <= time(nullptr)) {
+                    // Purge one batch, then loop to look at the next deadline. Letting go of the
+                    // transaction between batches gives other writers a chance to get in.
+                    if (purgeExpiredDocuments(kExpirationPurgeBatchSize) > 0) {
+                        this_thread::yield();
+                        lock.lock();
+                        continue;
+                    }
+                    next = 0;
+                }
+            } catch (const exception &x) {
+                Warn("Expiration purger failed: %s", x.what());
+                next = 0;       // Don't retry until something changes
+            }
+            lock.lock();
+
+            auto wakeUp = [this]{return _stopExpiry || _expiryChanged;};
+            if (next > 0)
+                _expiryCond.wait_until(lock, chrono::system_clock::from_time_t(next), wakeUp);
+            else
+                _expiryCond.wait(lock, wakeUp);
         }
-        return 0;
     }
 
 
@@ -430,7 +623,21 @@ namespace c4Internal {
     
     bool Database::purgeDocument(slice docID) {
         WITH_LOCK(this);
-        return defaultKeyStore().del(docID, transaction());
+        return _purgeDocument(docID);
+    }
+
+
+    bool Database::_purgeDocument(slice docID) {
+        defaultKeyStore().setExpiration(docID, 0, transaction());
+        if (_separateRevBodies) {
+            VersionedDocument doc(defaultKeyStore(), docID);
+            doc.purgeSeparateRevBodies(transaction());
+        }
+        if (!defaultKeyStore().del(docID, transaction()))
+            return false;
+        lock_guard<mutex> lock(_sequenceTracker->mutex());
+        _sequenceTracker->documentPurged(alloc_slice(docID));
+        return true;
     }
 
 
@@ -464,4 +671,41 @@ namespace c4Internal {
         _sequenceTracker->documentChanged(doc->_docIDBuf, doc->sequence);
     }
 
+
+    void Database::saved(const vector<Document*> &docs) {
+        if (docs.empty())
+            return;
+        WITH_LOCK(this);
+        lock_guard<mutex> lock(_sequenceTracker->mutex());
+        for (auto doc : docs)
+            _sequenceTracker->documentChanged(doc->_docIDBuf, doc->sequence);
+    }
+
+
+    void Database::saveDocuments(const vector<Document*> &docs, unsigned maxRevTreeDepth) {
+        vector<Record> records;
+        vector<Document*> writtenDocs;
+        records.reserve(docs.size());
+        writtenDocs.reserve(docs.size());
+        for (auto doc : docs) {
+            Record rec;
+            if (doc->prepareSave(rec, maxRevTreeDepth)) {
+                records.push_back(move(rec));
+                writtenDocs.push_back(doc);
+            }
+        }
+        if (records.empty())
+            return;
+        {
+            WITH_LOCK(this);
+            defaultKeyStore().setMany(records, transaction());
+        }
+        vector<Document*> changedDocs;
+        for (size_t i = 0; i < records.size(); ++i) {
+            if (writtenDocs[i]->finishSave(records[i]))
+                changedDocs.push_back(writtenDocs[i]);
+        }
+        saved(changedDocs);
+    }
+
 }
@@ -13,6 +13,8 @@
 #include "c4Document.h"
 #include "DataFile.hh"
 #include "FilePath.hh"
+#include <condition_variable>
+#include <thread>
 
 
 #if C4DB_THREADSAFE
@@ -56,9 +58,39 @@ namespace c4Internal {
         sequence_t lastSequence()       {WITH_LOCK(this); return defaultKeyStore().lastSequence();}
         time_t nextDocumentExpirationTime();
 
+        /** Returns a document's expiration time, or 0 if it has none. */
+        KeyStore::expiration_t documentExpiration(slice docID);
+
+        /** Pages through the documents whose expiration time is at or before `now`; see
+            KeyStore::expiredKeysAfter. */
+        std::vector<std::pair<alloc_slice, KeyStore::expiration_t>>
+            expiredDocumentsAfter(KeyStore::expiration_t now,
+                                  KeyStore::expiration_t afterExpiration, slice afterDocID,
+                                  unsigned limit);
+
+        /** Purges up to `maxDocs` documents whose expiration time has passed, and removes their
+            expiration entries, in a single transaction. The purged docs are reported to the
+            SequenceTracker together. Returns the number of expiration entries processed. */
+        unsigned purgeExpiredDocuments(unsigned maxDocs);
+
+        /** Starts a background thread that sleeps until the next document expiration time, then
+            purges the expired documents in batches of kExpirationPurgeBatchSize, each in its
+            own short transaction. Does nothing if it's already running. */
+        void startExpirationScheduler();
+        /** Stops the background expiration thread, waiting for it to exit. */
+        void stopExpirationScheduler();
+        /** Tells the expiration thread (if any) to re-check the next expiration time. */
+        void expirationChanged();
+
+        static const unsigned kExpirationPurgeBatchSize = 100;
+
         uint32_t maxRevTreeDepth();
         void setMaxRevTreeDepth(uint32_t depth);
 
+        /** True if revision-tree documents store their non-current revision bodies in a
+            separate KeyStore (kC4DB_SeparateRevBodies, or a database that already does.) */
+        bool separateRevBodies() const                      {return _separateRevBodies;}
+
         void rekey(const C4EncryptionKey *newKey);
 
         void compact();
@@ -102,6 +134,11 @@ namespace c4Internal {
     public:
         // should be private, but called from Document
         void saved(Document*);
+        void saved(const vector<Document*>&);
+
+        /** Writes the pending changes of a batch of Documents (see Document::prepareSave) with
+            a single KeyStore::setMany call, then registers them with the SequenceTracker. */
+        void saveDocuments(const vector<Document*>&, unsigned maxRevTreeDepth);
 
         // these should be private, but are also used by c4View
         static DataFile* newDataFile(const FilePath &path,
@@ -119,6 +156,11 @@ namespace c4Internal {
         Database(const FilePath &path,
                  const C4DatabaseConfig &config);
         static FilePath findOrCreateBundle(const string &path, C4DatabaseConfig &config);
+        void upgradeExpirations();
+        KeyStore* legacyExpiryStore();
+        std::vector<std::pair<alloc_slice, KeyStore::expiration_t>> legacyExpirations();
+        bool _purgeDocument(slice docID);
+        void runExpirationScheduler();
 
         unique_ptr<DataFile>        _db;                    // Underlying DataFile
         Transaction*                _transaction {nullptr}; // Current Transaction, or null
@@ -133,6 +175,14 @@ namespace c4Internal {
         unique_ptr<SequenceTracker> _sequenceTracker;       // Doc change tracker/notifier
         unique_ptr<BlobStore>       _blobStore;
         uint32_t                    _maxRevTreeDepth {0};
+        bool                        _separateRevBodies {false};
+
+        // Background expiration purger (see startExpirationScheduler):
+        thread                      _expiryThread;
+        mutex                       _expiryMutex;           // Guards the two flags below
+        condition_variable          _expiryCond;
+        bool                        _stopExpiry {false};    // Tells the thread to exit
+        bool                        _expiryChanged {false}; // Expiration times were changed
     };
 
 
@@ -151,6 +201,13 @@ namespace c4Internal {
         virtual alloc_slice revIDFromMeta(const DocumentMeta&) =0;
         virtual DataFile::FleeceAccessor fleeceAccessor() const {return nullptr;}
 
+        /** Generates, all at once, the revIDs that a batch of new-revision put requests would
+            get, assuming each one's parent is the one in its history. Requests whose ID can't
+            be predicted get a null slice. */
+        virtual vector<alloc_slice> generateRevIDs(const C4DocPutRequest[], size_t count) {
+            return vector<alloc_slice>(count);
+        }
+
     private:
         Database* const _db;
     };
@@ -164,6 +221,7 @@ namespace c4Internal {
         Document* newDocumentInstance(const Record&) override;
         alloc_slice revIDFromMeta(const DocumentMeta&) override;
         DataFile::FleeceAccessor fleeceAccessor() const override;
+        vector<alloc_slice> generateRevIDs(const C4DocPutRequest[], size_t count) override;
     };
 
 
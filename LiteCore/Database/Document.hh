@@ -104,7 +104,19 @@ namespace c4Internal {
         }
 
         virtual int32_t putExistingRevision(const C4DocPutRequest&) =0;
-        virtual bool putNewRevision(const C4DocPutRequest&) =0;
+        /** Adds a new revision as a child of the selected one. If `precomputedRevID` is non-null
+            it's a revID (from DocumentFactory::generateRevIDs) to use if the request's parent
+            turns out to be the selected revision. */
+        virtual bool putNewRevision(const C4DocPutRequest&, slice precomputedRevID) =0;
+
+        /** Batch saving, used by Database::saveDocuments. If the document has unsaved changes,
+            fills in the Record to be written and returns true. Implementations that write
+            changes immediately can just return false. */
+        virtual bool prepareSave(Record&, unsigned maxRevTreeDepth)    {return false;}
+
+        /** Called after the Record from prepareSave was written. Returns true if the document's
+            sequence changed. */
+        virtual bool finishSave(const Record&)                         {return false;}
 
         virtual int32_t purgeRevision(C4Slice revID) {
             error::_throw(error::Unimplemented);
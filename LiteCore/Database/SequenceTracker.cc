@@ -150,6 +150,12 @@ namespace litecore {
     }
 
 
+    void SequenceTracker::documentPurged(const alloc_slice &docID) {
+        Assert(inTransaction());
+        _documentChanged(docID, _lastSequence);
+    }
+
+
     void SequenceTracker::addExternalTransaction(const SequenceTracker &other) {
         Assert(!inTransaction());
         Assert(other.inTransaction());
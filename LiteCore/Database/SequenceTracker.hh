@@ -49,6 +49,11 @@ namespace litecore {
 
         void documentsChanged(const std::vector<const Entry*>&);
 
+        /** Document implementation calls this when a document is purged. Purging doesn't
+            allocate a sequence, so the change is recorded at the current lastSequence (which
+            keeps the entries in sequence order), and observers are notified of that. */
+        void documentPurged(const alloc_slice &docID);
+
         /** Copy the other tracker's transaction's changes into myself as committed & external */
         void addExternalTransaction(const SequenceTracker &from);
 
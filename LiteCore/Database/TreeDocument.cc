@@ -54,6 +54,7 @@ namespace c4Internal {
 
 
         void init() {
+            _versionedDoc.setSeparateRevBodies(_db->separateRevBodies());
             docID = _docIDBuf = _versionedDoc.docID();
             flags = (C4DocumentFlags)_versionedDoc.flags();
             if (_versionedDoc.exists())
@@ -97,7 +98,7 @@ namespace c4Internal {
             if (!_versionedDoc.revsAvailable()) {
                 WITH_LOCK(_db);
                 _versionedDoc.read();
-                selectRevision(_versionedDoc.currentRevision());
+                selectCurrentRevision();
             }
         }
 
@@ -105,16 +106,28 @@ namespace c4Internal {
             if (!revisionsLoaded())
                 Warn("c4doc_hasRevisionBody called on doc loaded without kC4IncludeBodies");
             WITH_LOCK(database());
-            return _selectedRev && _selectedRev->isBodyAvailable();
+            if (_selectedRevIsRawCurrent)
+                return selectedRev.body.buf != nullptr;
+            auto rev = selectedRevision();
+            return rev && rev->isBodyAvailable();
         }
 
         bool loadSelectedRevBodyIfAvailable() override {
             loadRevisions();
+            if (!selectedRev.body.buf) {
+                auto rev = selectedRevision();
+                if (rev && rev->hasExternalBody()) {
+                    WITH_LOCK(_db);
+                    _loadedBody = _versionedDoc.readBodyOfRevision(rev);
+                    selectedRev.body = _loadedBody;
+                }
+            }
             return selectedRev.body.buf != nullptr;
         }
 
         bool selectRevision(const Rev *rev) noexcept {   // doesn't throw
             _selectedRev = rev;
+            _selectedRevIsRawCurrent = false;
             _loadedBody = nullslice;
             if (rev) {
                 _selectedRevIDBuf = rev->revID.expanded();
@@ -143,12 +156,44 @@ namespace c4Internal {
             return true;
         }
 
+        // Fast path for a doc that was just read: fills in selectedRev straight from the encoded
+        // rev tree, without expanding it. _selectedRev is looked up later if it's needed.
+        void selectRawCurrentRevision() noexcept {
+            auto raw = _versionedDoc.rawTree();
+            if (raw.count() == 0) {
+                selectRevision(nullptr);
+                return;
+            }
+            auto rev = raw.currentRevision();
+            _selectedRev = nullptr;
+            _selectedRevIsRawCurrent = true;
+            _loadedBody = nullslice;
+            _selectedRevIDBuf = rev.revID.expanded();
+            selectedRev.revID = _selectedRevIDBuf;
+            selectedRev.flags = (C4RevisionFlags)rev.flags;
+            selectedRev.sequence = rev.sequence;
+            selectedRev.body = rev.body;
+        }
+
+        // The selected Rev, expanding the rev tree if necessary.
+        const Rev* selectedRevision() {
+            if (_selectedRevIsRawCurrent) {
+                _selectedRev = _versionedDoc.currentRevision();
+                _selectedRevIsRawCurrent = false;
+            }
+            return _selectedRev;
+        }
+
         bool selectCurrentRevision() noexcept override { // doesn't throw
             if (_versionedDoc.revsAvailable()) {
-                selectRevision(_versionedDoc.currentRevision());
+                if (_versionedDoc.isExpanded())
+                    selectRevision(_versionedDoc.currentRevision());
+                else
+                    selectRawCurrentRevision();
                 return true;
             } else {
                 _selectedRev = nullptr;
+                _selectedRevIsRawCurrent = false;
                 Document::selectCurrentRevision();
                 return false;
             }
@@ -157,7 +202,7 @@ namespace c4Internal {
         bool selectParentRevision() noexcept override {
             if (!revisionsLoaded())
                 Warn("Trying to access revision tree of doc loaded without kC4IncludeBodies");
-            if (_selectedRev)
+            if (selectedRevision())
                 selectRevision(_selectedRev->parent());
             return _selectedRev != nullptr;
         }
@@ -165,7 +210,7 @@ namespace c4Internal {
         bool selectNextRevision() noexcept override {    // does not throw
             if (!revisionsLoaded())
                 Warn("Trying to access revision tree of doc loaded without kC4IncludeBodies");
-            if (_selectedRev)
+            if (selectedRevision())
                 selectRevision(_selectedRev->next());
             return _selectedRev != nullptr;
         }
@@ -173,7 +218,7 @@ namespace c4Internal {
         bool selectNextLeafRevision(bool includeDeleted) noexcept override {
             if (!revisionsLoaded())
                 Warn("Trying to access revision tree of doc loaded without kC4IncludeBodies");
-            auto rev = _selectedRev;
+            auto rev = selectedRevision();
             if (!rev)
                 return false;
             do {
@@ -192,7 +237,7 @@ namespace c4Internal {
         }
 
         bool removeSelectedRevBody() noexcept override {
-            if (!_selectedRev)
+            if (!selectedRevision())
                 return false;
             _versionedDoc.removeBody(_selectedRev);
             return true;
@@ -206,11 +251,28 @@ namespace c4Internal {
                 WITH_LOCK(_db);
                 _versionedDoc.save(_db->transaction());
             }
-            selectedRev.flags &= ~kRevNew;
-            if (_versionedDoc.sequence() > sequence) {
-                sequence = _versionedDoc.sequence();
+            if (updateSequenceAfterSave())
                 _db->saved(this);
-            }
+        }
+
+        virtual bool prepareSave(Record &rec, unsigned maxRevTreeDepth) override {
+            if (maxRevTreeDepth == 0)
+                maxRevTreeDepth = _db->maxRevTreeDepth();
+            _versionedDoc.prune(maxRevTreeDepth);
+            return _versionedDoc.prepareSave(rec, _db->transaction());
+        }
+
+        virtual bool finishSave(const Record &rec) override {
+            _versionedDoc.finishSave(rec);
+            return updateSequenceAfterSave();
+        }
+
+        bool updateSequenceAfterSave() {
+            selectedRev.flags &= ~kRevNew;
+            if (_versionedDoc.sequence() <= sequence)
+                return false;
+            sequence = _versionedDoc.sequence();
+            return true;
         }
 
         int32_t purgeRevision(C4Slice revID) override {
@@ -228,11 +290,12 @@ namespace c4Internal {
         }
 
         virtual int32_t putExistingRevision(const C4DocPutRequest&) override;
-        virtual bool putNewRevision(const C4DocPutRequest&) override;
+        virtual bool putNewRevision(const C4DocPutRequest&, slice precomputedRevID) override;
             
         public:
             VersionedDocument _versionedDoc;
             const Rev *_selectedRev;
+            bool _selectedRevIsRawCurrent {false};  // Selected current rev before expanding tree
     };
 
 
@@ -283,6 +346,21 @@ namespace c4Internal {
     static bool sGenerateOldStyleRevIDs = false;
 
 
+#if SECURE_DIGEST_AVAILABLE
+    // Adds the (length-prefixed) parent rev ID, deletion flag, and revision body to a digest.
+    static void addRevIDDigestInput(sha1Context *ctx, C4Slice body, C4Slice parentRevID,
+                                    bool deleted)
+    {
+        uint8_t revLen = (uint8_t)min((unsigned long)parentRevID.size, 255ul);
+        sha1_add(ctx, &revLen, 1);
+        sha1_add(ctx, parentRevID.buf, revLen);
+        uint8_t delByte = deleted;
+        sha1_add(ctx, &delByte, 1);
+        sha1_add(ctx, body.buf, body.size);
+    }
+#endif
+
+
     static revidBuffer generateDocRevID(C4Slice body, C4Slice parentRevID, bool deleted) {
     #if SECURE_DIGEST_AVAILABLE
         uint8_t digestBuf[20];
@@ -304,12 +382,7 @@ namespace c4Internal {
             // SHA-1 digest:
             sha1Context ctx;
             sha1_begin(&ctx);
-            uint8_t revLen = (uint8_t)min((unsigned long)parentRevID.size, 255ul);
-            sha1_add(&ctx, &revLen, 1);
-            sha1_add(&ctx, parentRevID.buf, revLen);
-            uint8_t delByte = deleted;
-            sha1_add(&ctx, &delByte, 1);
-            sha1_add(&ctx, body.buf, body.size);
+            addRevIDDigestInput(&ctx, body, parentRevID, deleted);
             sha1_end(&ctx, digestBuf);
             digest = slice(digestBuf, 20);
         }
@@ -327,14 +400,66 @@ namespace c4Internal {
     }
 
 
-    bool TreeDocument::putNewRevision(const C4DocPutRequest &rq) {
+    vector<alloc_slice> TreeDocumentFactory::generateRevIDs(const C4DocPutRequest requests[],
+                                                            size_t count)
+    {
+        vector<alloc_slice> revIDs(count);
+    #if SECURE_DIGEST_AVAILABLE
+        if (sGenerateOldStyleRevIDs)
+            return revIDs;
+        // Only new revisions have generated IDs; assume each one's parent is the one it names:
+        auto parentOf = [&](size_t i) {
+            return requests[i].historyCount == 1 ? requests[i].history[0] : kC4SliceNull;
+        };
+        vector<size_t> which;
+        size_t totalBytes = 0;
+        for (size_t i = 0; i < count; ++i) {
+            if (!requests[i].existingRevision && requests[i].historyCount <= 1) {
+                which.push_back(i);
+                totalBytes += requests[i].body.size;
+            }
+        }
+        if (which.size() < 2)
+            return revIDs;
+
+        vector<uint8_t> digests(20 * which.size());
+        sha1_batch(which.size(), totalBytes, [&](size_t n, sha1Context *ctx) {
+            auto &rq = requests[which[n]];
+            addRevIDDigestInput(ctx, rq.body, parentOf(which[n]), (rq.revFlags & kRevDeleted) != 0);
+        }, digests.data());
+
+        for (size_t n = 0; n < which.size(); ++n) {
+            C4Slice parentRevID = parentOf(which[n]);
+            revidBuffer parentID;
+            unsigned generation = 1;
+            if (parentRevID.buf) {
+                // Leave a bad parent rev ID to be reported by putNewRevision:
+                if (!parentID.tryParse(parentRevID, false))
+                    continue;
+                generation = parentID.generation() + 1;
+            }
+            revidBuffer revID(generation, slice(&digests[20 * n], 20), kDigestType);
+            revIDs[which[n]] = alloc_slice(revID);
+        }
+    #endif
+        return revIDs;
+    }
+
+
+    bool TreeDocument::putNewRevision(const C4DocPutRequest &rq, slice precomputedRevID) {
         bool deletion = (rq.revFlags & kRevDeleted) != 0;
-        revidBuffer encodedRevID = generateDocRevID(rq.body, selectedRev.revID, deletion);
+        revidBuffer encodedRevID;
+        // A precomputed ID is only valid if it was derived from the actual parent revision:
+        C4Slice assumedParentID = (rq.historyCount == 1) ? rq.history[0] : kC4SliceNull;
+        if (precomputedRevID.buf && selectedRev.revID == assumedParentID)
+            encodedRevID = revid(precomputedRevID);
+        else
+            encodedRevID = generateDocRevID(rq.body, selectedRev.revID, deletion);
         int httpStatus;
         auto newRev = _versionedDoc.insert(encodedRevID,
                                            rq.body,
                                            (Rev::Flags)rq.revFlags,
-                                           _selectedRev,
+                                           selectedRevision(),
                                            rq.allowConflict,
                                            httpStatus);
         if (newRev) {
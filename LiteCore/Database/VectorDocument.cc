@@ -203,7 +203,7 @@ namespace c4Internal {
         }
 
 
-        virtual bool putNewRevision(const C4DocPutRequest &rq) override {
+        virtual bool putNewRevision(const C4DocPutRequest &rq, slice precomputedRevID) override {
             bool deletion = (rq.revFlags & kRevDeleted) != 0;
             bool hasAttachments = (rq.revFlags & kRevHasAttachments) != 0;
             Revision::BodyParams bodyParams {rq.body, rq.docType, deletion, hasAttachments};
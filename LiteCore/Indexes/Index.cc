@@ -19,6 +19,12 @@
 #include "Fleece.hh"
 #include "varint.hh"
 #include "Logging.hh"
+#include <algorithm>
+#include <ctype.h>
+#include <math.h>
+#include <set>
+#include <stdio.h>
+#include <stdlib.h>
 
 
 namespace litecore {
@@ -32,6 +38,19 @@ namespace litecore {
         return inclusiveEnd ? (key > end) : !(key < end);
     }
 
+    slice GroupedKeyPrefix(slice key, unsigned groupLevel) {
+        CollatableReader keyReader(key);
+        if (keyReader.peekTag() != CollatableTypes::kArray)
+            return key;
+        keyReader.skipTag();
+        for (unsigned level = 0; level < groupLevel; ++level) {
+            if (keyReader.atEnd())
+                break;
+            (void)keyReader.read();
+        }
+        return slice(key.buf, keyReader.data().buf);
+    }
+
     Index::Index(KeyStore &store)
     :_store(store),
      _userCount(0)
@@ -62,24 +81,84 @@ namespace litecore {
             hash = ((hash << 5) + hash) + value[i];
     }
 
+    // Decodes a record's key-list entry, as written by setKeysForDoc.
+    static void decodeKeysForDoc(slice body, std::vector<Collatable> &keys, uint32_t &hash) {
+        auto keyArray = Value::fromTrustedData(body)->asArray();
+        Array::iterator iter(keyArray);
+        hash = (uint32_t)iter->asUnsigned();
+        ++iter;
+        keys.reserve(iter.count());
+        for (; iter; ++iter) {
+            keys.push_back( Collatable::withData(iter->asData()) );
+        }
+    }
+
     void IndexWriter::getKeysForDoc(slice recordID, std::vector<Collatable> &keys, uint32_t &hash) {
         if (!_wasEmpty) {
             Record rec = _index._store.get(recordID);
             if (rec.body().size > 0) {
-                auto keyArray = Value::fromTrustedData(rec.body())->asArray();
-                Array::iterator iter(keyArray);
-                hash = (uint32_t)iter->asUnsigned();
-                ++iter;
-                keys.reserve(iter.count());
-                for (; iter; ++iter) {
-                    keys.push_back( Collatable::withData(iter->asData()) );
-                }
+                decodeKeysForDoc(rec.body(), keys, hash);
                 return;
             }
         }
         hash = kInitialHash;
     }
 
+    // How many other records getKeysForDocs' scan may pass over, per record it's looking for,
+    // before it gives up and looks up the rest individually:
+    static const size_t kMaxKeyListsSkippedPerRecord = 4;
+
+    // Equivalent to calling getKeysForDoc on each recordID. The key-list entries are keyed by
+    // the collatable record IDs, so they can be read with one scan of the range the IDs span,
+    // unless they turn out to be sparse in it.
+    void IndexWriter::getKeysForDocs(const std::vector<alloc_slice> &recordIDs,
+                                     std::vector<std::vector<Collatable>> &keys,
+                                     std::vector<uint32_t> &hashes)
+    {
+        size_t n = recordIDs.size();
+        keys.assign(n, std::vector<Collatable>());
+        hashes.assign(n, kInitialHash);
+        if (_wasEmpty || n == 0)
+            return;
+
+        std::vector<size_t> order(n);
+        for (size_t i = 0; i < n; ++i)
+            order[i] = i;
+        std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            return recordIDs[a].compare(recordIDs[b]) < 0;
+        });
+
+        size_t next = 0;
+        if (n > 1) {
+            RecordEnumerator e(_index._store, recordIDs[order.front()], recordIDs[order.back()]);
+            size_t skipped = 0;
+            bool complete = true;
+            while (next < n) {
+                if (!e.next())
+                    break;
+                slice key = e.record().key();
+                while (next < n && recordIDs[order[next]].compare(key) < 0)
+                    ++next;     // This record has no entry
+                if (next < n && recordIDs[order[next]] == key) {
+                    for (; next < n && recordIDs[order[next]] == key; ++next) {
+                        auto i = order[next];
+                        if (e.record().body().size > 0)
+                            decodeKeysForDoc(e.record().body(), keys[i], hashes[i]);
+                    }
+                } else if (++skipped > n * kMaxKeyListsSkippedPerRecord) {
+                    complete = false;
+                    break;
+                }
+            }
+            if (complete)
+                return;         // Any records not reached have no entries
+        }
+        for (; next < n; ++next) {
+            auto i = order[next];
+            getKeysForDoc(recordIDs[i], keys[i], hashes[i]);
+        }
+    }
+
     void IndexWriter::setKeysForDoc(slice recordID, const std::vector<Collatable> &keys, uint32_t hash) {
         if (keys.size() > 0) {
             _encoder.reset();
@@ -88,12 +167,24 @@ namespace litecore {
             for (auto &key : keys)
                 _encoder.writeData(key);
             _encoder.endArray();
-            _index._store.set(recordID, _encoder.extractOutput(), _transaction);
+            writeRow(recordID, nullslice, _encoder.extractOutput());
         } else if (!_wasEmpty) {
             _index._store.del(recordID, _transaction);
         }
     }
 
+    // Writes a row, or adds it to the batch being written by updateBatch.
+    void IndexWriter::writeRow(slice key, slice meta, slice value) {
+        if (_pendingWrites) {
+            _pendingWrites->emplace_back(key);
+            Record &rec = _pendingWrites->back();
+            rec.setMeta(meta);
+            rec.setBody(value);
+        } else {
+            _index._store.set(key, meta, value, _transaction);
+        }
+    }
+
     bool IndexWriter::update(slice recordID, sequence recordSequence,
                              const std::vector<Collatable> &keys,
                              const std::vector<alloc_slice> &values,
@@ -105,15 +196,81 @@ namespace litecore {
         CollatableBuilder collatableDocID;
         collatableDocID << recordID;
 
-        // Metadata of emitted rows contains rec sequence as varint:
-        uint8_t metaBuf[10];
-        slice meta(metaBuf, PutUVarInt(metaBuf, recordSequence));
-
         // Get the previously emitted keys:
-        std::vector<Collatable> oldStoredKeys, newStoredKeys;
+        std::vector<Collatable> oldStoredKeys;
         uint32_t oldStoredHash;
         getKeysForDoc(collatableDocID, oldStoredKeys, oldStoredHash);
 
+        return updateRows(collatableDocID, recordSequence, keys, values,
+                          oldStoredKeys, oldStoredHash, rowCount);
+    }
+
+    sequence IndexWriter::updateBatch(const std::vector<RecordRows> &records,
+                                      uint64_t &rowCount)
+    {
+        // Get all the records' previously emitted keys at once:
+        std::vector<alloc_slice> collatableDocIDs;
+        collatableDocIDs.reserve(records.size());
+        for (auto &rec : records) {
+            CollatableBuilder collatableDocID;
+            collatableDocID << rec.recordID;
+            collatableDocIDs.push_back(alloc_slice(collatableDocID.data()));
+        }
+        std::vector<std::vector<Collatable>> oldStoredKeys;
+        std::vector<uint32_t> oldStoredHashes;
+        getKeysForDocs(collatableDocIDs, oldStoredKeys, oldStoredHashes);
+
+        std::vector<Record> pendingWrites;
+        std::set<slice> updatedDocIDs;
+        auto flush = [&]{
+            if (!pendingWrites.empty())
+                _index._store.setMany(pendingWrites, _transaction);
+            pendingWrites.clear();
+            updatedDocIDs.clear();
+        };
+
+        sequence changedAt = 0;
+        try {
+            for (size_t i = 0; i < records.size(); ++i) {
+                auto &rec = records[i];
+                if (_wasEmpty && rec.keys.empty())
+                    continue;
+                slice docID = collatableDocIDs[i];
+                if (updatedDocIDs.count(docID) > 0) {
+                    // Record appears twice in the batch; its earlier rows have to be written
+                    // first, and its key list read again:
+                    _pendingWrites = nullptr;
+                    flush();
+                    oldStoredKeys[i].clear();
+                    getKeysForDoc(docID, oldStoredKeys[i], oldStoredHashes[i]);
+                }
+                _pendingWrites = &pendingWrites;
+                if (updateRows(docID, rec.recordSequence, rec.keys, rec.values,
+                               oldStoredKeys[i], oldStoredHashes[i], rowCount))
+                    changedAt = std::max(changedAt, rec.recordSequence);
+                updatedDocIDs.insert(docID);
+            }
+            _pendingWrites = nullptr;
+            flush();
+        } catch (...) {
+            _pendingWrites = nullptr;
+            throw;
+        }
+        return changedAt;
+    }
+
+    // Updates a record's rows, given the keys and values-hash it emitted last time.
+    bool IndexWriter::updateRows(slice collatableDocID, sequence recordSequence,
+                                 const std::vector<Collatable> &keys,
+                                 const std::vector<alloc_slice> &values,
+                                 const std::vector<Collatable> &oldStoredKeys,
+                                 uint32_t oldStoredHash,
+                                 uint64_t &rowCount)
+    {
+        // Metadata of emitted rows contains rec sequence as varint:
+        uint8_t metaBuf[10];
+        slice meta(metaBuf, PutUVarInt(metaBuf, recordSequence));
+
         // Compute a hash of the values and see whether it's the same as the previous values' hash:
         uint32_t newStoredHash = kInitialHash;
         for (auto &value : values) {
@@ -128,10 +285,42 @@ namespace litecore {
 
         bool keysChanged = false;
         int64_t rowsRemoved = 0, rowsAdded = 0;
+        std::vector<Collatable> newStoredKeys;
+
+        // Find how many of the old keys were emitted again, in the same order:
+        auto oldKey = oldStoredKeys.begin();
+        for (auto key = keys.begin(); key != keys.end(); ++key, ++oldKey) {
+            if (oldKey == oldStoredKeys.end() || !(*oldKey == *key))
+                break;
+        }
+        auto firstChangedOldKey = oldKey;
+
+        // If there are any old keys that weren't emitted this time, we need to delete those rows.
+        // (This is done first, since a row being deleted can have the same real key as one
+        // that's about to be added at a different position.)
+        for (; oldKey != oldStoredKeys.end(); ++oldKey) {
+            _realKey.reset();
+            _realKey.beginArray() << *oldKey << collatableDocID;
+            auto oldEmitIndex = oldKey - oldStoredKeys.begin();
+            if (oldEmitIndex > 0)
+                _realKey << oldEmitIndex;
+            _realKey.endArray();
+            if (_trackRowChanges) {
+                Record oldRow = _index._store.get(_realKey);
+                if (oldRow.exists())
+                    rowRemoved(*oldKey, oldRow.body());
+            }
+            bool deleted = _index._store.del(_realKey, _transaction);
+            if (!deleted) {
+                Warn("Failed to delete old emitted k/v pair");
+            }
+            ++rowsRemoved;
+            keysChanged = true;
+        }
 
         auto value = values.begin();
         unsigned emitIndex = 0;
-        auto oldKey = oldStoredKeys.begin();
+        oldKey = oldStoredKeys.begin();
         for (auto key = keys.begin(); key != keys.end(); ++key,++value,++emitIndex) {
             // Create a key for the index db by combining the emitted key, rec ID, and emit#:
             _realKey.reset();
@@ -141,21 +330,24 @@ namespace litecore {
             _realKey.endArray();
 
             // Is this a key that was previously emitted last time we indexed this record?
-            if (keysChanged || oldKey == oldStoredKeys.end() || !(*oldKey == *key)) {
+            if (oldKey == firstChangedOldKey) {
                 // no; note that the set of keys is different
                 keysChanged = true;
             } else {
                 // yes
                 ++oldKey;
-                if (valuesMightBeUnchanged) {
+                if (valuesMightBeUnchanged || _trackRowChanges) {
                     // read the old row so we can compare the value too:
                     Record oldRow = _index._store.get(_realKey);
                     if (oldRow.exists()) {
-                        if (oldRow.body() == *value) {
+                        if (valuesMightBeUnchanged && oldRow.body() == *value) {
                             LogTo(IndexLog, "Old k/v pair (%s, %s) unchanged",
                                 key->toJSON().c_str(), ((std::string)*value).c_str());
+                            newStoredKeys.push_back(*key);
                             continue;  // Value is unchanged, so this is a no-op; skip to next key!
                         }
+                        if (_trackRowChanges)
+                            rowRemoved(*key, oldRow.body());
                     } else {
                         Warn("Old emitted k/v pair unexpectedly missing");
                     }
@@ -166,27 +358,13 @@ namespace litecore {
             // Store the key & value:
             LogTo(IndexLog, "**** Index: realKey = %s  value = %s",
                 _realKey.toJSON().c_str(), (*value).hexString().c_str());
-            _index._store.set(_realKey, meta, *value, _transaction);
+            writeRow(_realKey, meta, *value);
+            if (_trackRowChanges)
+                rowAdded(*key, *value);
             newStoredKeys.push_back(*key);
             ++rowsAdded;
         }
 
-        // If there are any old keys that weren't emitted this time, we need to delete those rows:
-        for (; oldKey != oldStoredKeys.end(); ++oldKey) {
-            _realKey.reset();
-            _realKey.beginArray() << *oldKey << collatableDocID;
-            auto oldEmitIndex = oldKey - oldStoredKeys.begin();
-            if (oldEmitIndex > 0)
-                _realKey << oldEmitIndex;
-            _realKey.endArray();
-            bool deleted = _index._store.del(_realKey, _transaction);
-            if (!deleted) {
-                Warn("Failed to delete old emitted k/v pair");
-            }
-            ++rowsRemoved;
-            keysChanged = true;
-        }
-
         // Store the keys that were emitted for this rec, and the hash of the values:
         if (keysChanged)
             setKeysForDoc(collatableDocID, newStoredKeys, newStoredHash);
@@ -459,18 +637,150 @@ namespace litecore {
 
     // Set _groupedKey equal to the key or key-prefix that's being grouped on.
     void IndexEnumerator::computeGroupedKey() {
-        CollatableReader keyReader = key();
-        if (keyReader.peekTag() == CollatableTypes::kArray) {
-            keyReader.skipTag();
-            for (unsigned level = 0; level < _options.groupLevel; ++level) {
-                if (keyReader.atEnd())
-                    break;
-                (void)keyReader.read();
-            }
-            _groupedKey = alloc_slice(_key.buf, keyReader.data().buf);
+        _groupedKey = alloc_slice(GroupedKeyPrefix(_key, _options.groupLevel));
+    }
+
+
+#pragma mark - BUILT-IN REDUCE:
+
+
+    // Interprets an index value as a JSON number, if it is one.
+    // Is the value a JSON number? (strtod alone would also accept hex, "inf", leading spaces...)
+    static bool isJSONNumber(slice value) {
+        auto c = (const char*)value.buf, end = c + value.size;
+        auto digits = [&]{
+            auto start = c;
+            while (c < end && isdigit((unsigned char)*c))
+                ++c;
+            return c > start;
+        };
+        if (c < end && *c == '-')
+            ++c;
+        if (c < end && *c == '0')
+            ++c;
+        else if (!digits())
+            return false;
+        if (c < end && *c == '.') {
+            ++c;
+            if (!digits())
+                return false;
+        }
+        if (c < end && (*c == 'e' || *c == 'E')) {
+            ++c;
+            if (c < end && (*c == '+' || *c == '-'))
+                ++c;
+            if (!digits())
+                return false;
+        }
+        return c == end;
+    }
+
+    static bool numericValue(slice value, double &n) {
+        if (value.size == 0 || value.size > 64 || !isJSONNumber(value))
+            return false;
+        char buf[65];
+        memcpy(buf, value.buf, value.size);
+        buf[value.size] = '\0';
+        n = strtod(buf, nullptr);
+        return isfinite(n);
+    }
+
+    ReduceAggregate::ReduceAggregate(slice encoded) {
+        CollatableReader reader(encoded);
+        reader.beginArray();
+        count = (uint64_t)reader.readInt();
+        numericCount = (uint64_t)reader.readInt();
+        sum = reader.readDouble();
+        sumsqr = reader.readDouble();
+        if (numericCount > 0 && reader.peekTag() != CollatableReader::kEndSequence) {
+            minimum = reader.readDouble();
+            maximum = reader.readDouble();
         } else {
-            _groupedKey = _key;
+            resetMinMax();
+            minMaxStale = (numericCount > 0);   // min and max weren't stored since they're stale
         }
     }
 
+    alloc_slice ReduceAggregate::encode() const {
+        CollatableBuilder enc;
+        enc.beginArray();
+        enc << (double)count << (double)numericCount << sum << sumsqr;
+        if (numericCount > 0 && !minMaxStale)
+            enc << minimum << maximum;
+        enc.endArray();
+        return enc.extractOutput();
+    }
+
+    void ReduceAggregate::resetMinMax() {
+        minimum = INFINITY;
+        maximum = -INFINITY;
+        minMaxStale = false;
+    }
+
+    void ReduceAggregate::add(slice value) {
+        ++count;
+        double n;
+        if (numericValue(value, n)) {
+            ++numericCount;
+            sum += n;
+            sumsqr += n * n;
+            if (!minMaxStale) {
+                minimum = std::min(minimum, n);
+                maximum = std::max(maximum, n);
+            }
+        }
+    }
+
+    void ReduceAggregate::remove(slice value) {
+        --count;
+        double n;
+        if (numericValue(value, n)) {
+            if (--numericCount == 0) {
+                sum = sumsqr = 0;
+                resetMinMax();
+            } else {
+                sum -= n;
+                sumsqr -= n * n;
+                if (n <= minimum || n >= maximum)
+                    minMaxStale = true;     // Can't tell what the new min/max is
+            }
+        }
+    }
+
+    alloc_slice ReduceAggregate::result(BuiltInReduce reduce) const {
+        Assert(!minMaxStale || !needsMinMax(reduce));
+        char buf[200];
+        switch (reduce) {
+            case kCountReduce:
+                sprintf(buf, "%llu", (unsigned long long)count);
+                break;
+            case kSumReduce:
+                sprintf(buf, "%.16g", sum);
+                break;
+            case kMinReduce:
+            case kMaxReduce:
+                if (numericCount == 0)
+                    strcpy(buf, "null");
+                else
+                    sprintf(buf, "%.16g", (reduce == kMinReduce ? minimum : maximum));
+                break;
+            case kStatsReduce:
+                if (numericCount == 0)
+                    sprintf(buf, "{\"sum\":0,\"count\":0,\"min\":null,\"max\":null,\"sumsqr\":0}");
+                else
+                    sprintf(buf, "{\"sum\":%.16g,\"count\":%llu,\"min\":%.16g,\"max\":%.16g,\"sumsqr\":%.16g}",
+                            sum, (unsigned long long)numericCount, minimum, maximum, sumsqr);
+                break;
+            default:
+                error::_throw(error::InvalidParameter);
+        }
+        return alloc_slice(buf, strlen(buf));
+    }
+
+    slice BuiltInReduceFunction::reducedValue() {
+        _result = _aggregate.result(_reduce);
+        _aggregate = ReduceAggregate();
+        return _result;
+    }
+
 }
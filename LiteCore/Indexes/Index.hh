@@ -41,6 +41,12 @@ namespace litecore {
         bool operator== (const KeyRange &r)     {return start==r.start && end==r.end;}
     };
 
+
+    /** Returns the prefix of an index key that groups it at the given group level (>= 1):
+        the key's first `groupLevel` items if it's an array (without the array's end),
+        else the entire key. */
+    slice GroupedKeyPrefix(slice key, unsigned groupLevel);
+
     
     /** A key/value index, stored in a KeyStore. */
     class Index {
@@ -88,9 +94,45 @@ namespace litecore {
                     const std::vector<alloc_slice> &values,
                     uint64_t &rowCount);
 
+        /** A record's emitted keys and values, as passed to update(). */
+        struct RecordRows {
+            alloc_slice recordID;
+            sequence recordSequence;
+            std::vector<Collatable> keys;
+            std::vector<alloc_slice> values;
+        };
+
+        /** Updates the index entries for a batch of records, with the same effect as calling
+            update() on each in order. The records' previously emitted keys are read together,
+            and the new rows are written with a single KeyStore::setMany call.
+            Returns the latest sequence of a record whose rows changed, or 0 if none did. */
+        sequence updateBatch(const std::vector<RecordRows> &records,
+                             uint64_t &rowCount);
+
+    protected:
+        /** If set, rowAdded and rowRemoved are called for every row change. This requires
+            reading each old row before it's overwritten or deleted. */
+        void trackRowChanges(bool track)        {_trackRowChanges = track;}
+
+        /** Called when a row is added to the index. An overwritten row is removed, then added. */
+        virtual void rowAdded(Collatable key, slice value)     { }
+        /** Called when a row is removed from the index. */
+        virtual void rowRemoved(Collatable key, slice value)   { }
+
     private:
         void getKeysForDoc(slice recordID, std::vector<Collatable> &outKeys, uint32_t &outHash);
+        void getKeysForDocs(const std::vector<alloc_slice> &recordIDs,
+                            std::vector<std::vector<Collatable>> &outKeys,
+                            std::vector<uint32_t> &outHashes);
         void setKeysForDoc(slice recordID, const std::vector<Collatable> &keys, uint32_t hash);
+        bool updateRows(slice collatableDocID,
+                        sequence recordSequence,
+                        const std::vector<Collatable> &keys,
+                        const std::vector<alloc_slice> &values,
+                        const std::vector<Collatable> &oldStoredKeys,
+                        uint32_t oldStoredHash,
+                        uint64_t &rowCount);
+        void writeRow(slice key, slice meta, slice value);
 
         friend class Index;
         friend class MapReduceIndex;
@@ -100,6 +142,8 @@ namespace litecore {
         const bool      _wasEmpty;          // Was the index empty beforehand?
         fleece::Encoder _encoder;           // Reuseable encoder, an optimization for update()
         CollatableBuilder _realKey;         // Reuseable builder, an optimization for update()
+        bool            _trackRowChanges {false}; // Call rowAdded/rowRemoved?
+        std::vector<Record>* _pendingWrites {nullptr}; // Rows to setMany, during updateBatch()
     };
 
 
@@ -111,6 +155,54 @@ namespace litecore {
     };
 
 
+    /** Reduce functions built into LiteCore, whose results can be maintained incrementally. */
+    enum BuiltInReduce {
+        kNoReduce,
+        kCountReduce,       ///< Number of rows
+        kSumReduce,         ///< Sum of the numeric values
+        kMinReduce,         ///< Minimum numeric value, or null
+        kMaxReduce,         ///< Maximum numeric value, or null
+        kStatsReduce,       ///< JSON object with sum, count, min, max, sumsqr of numeric values
+    };
+
+
+    /** Running totals of a group of index rows' values, from which any BuiltInReduce result
+        can be produced. Values that are JSON numbers count as numeric; others are only
+        counted as rows. */
+    struct ReduceAggregate {
+        uint64_t count {0};             // Number of rows
+        uint64_t numericCount {0};      // Number of rows with numeric values
+        double sum {0}, sumsqr {0};
+        double minimum, maximum;
+        bool minMaxStale {false};       // Set if a removed value may have been the min or max;
+                                        // they're then recomputed from the rows when needed
+
+        ReduceAggregate()                       {resetMinMax();}
+        explicit ReduceAggregate(slice encoded);
+
+        void add(slice value);
+        void remove(slice value);
+        void resetMinMax();
+
+        alloc_slice encode() const;
+        static bool needsMinMax(BuiltInReduce r)    {return r >= kMinReduce;}
+        alloc_slice result(BuiltInReduce) const;    // Result as JSON
+    };
+
+
+    /** A ReduceFunction that computes a BuiltInReduce by scanning rows. */
+    class BuiltInReduceFunction : public ReduceFunction {
+    public:
+        explicit BuiltInReduceFunction(BuiltInReduce r)     :_reduce(r) { }
+        void operator() (CollatableReader key, slice value) override {_aggregate.add(value);}
+        slice reducedValue() override;
+    private:
+        BuiltInReduce const _reduce;
+        ReduceAggregate _aggregate;
+        alloc_slice _result;
+    };
+
+
     /** Index query enumerator. */
     class IndexEnumerator {
     public:
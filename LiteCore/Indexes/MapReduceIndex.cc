@@ -19,6 +19,12 @@
 #include "Fleece.hh"
 #include "Logging.hh"
 #include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <map>
+#include <mutex>
+#include <thread>
 
 namespace litecore {
     using namespace fleece;
@@ -56,6 +62,9 @@ namespace litecore {
             }
             if (reader.peekTag() != CollatableTypes::kEndSequence)
                 _lastPurgeCount = (uint64_t)reader.readInt();
+            _lastStoredReduce = false;
+            if (reader.peekTag() != CollatableTypes::kEndSequence)
+                _lastStoredReduce = (reader.readInt() != 0);
         }
         LogToAt(IndexLog, Debug, "MapReduceIndex<%p>: Read state (lastSeq=%llu, lastChanged=%llu, lastMapVersion='%s', indexType=%d, rowCount=%llu, lastPurgeCount=%llu)",
               this, (unsigned long long)_lastSequenceIndexed, (unsigned long long)_lastSequenceChangedAt, _lastMapVersion.c_str(), _indexType, (unsigned long long)_rowCount, (unsigned long long)_lastPurgeCount);
@@ -64,6 +73,7 @@ namespace litecore {
     void MapReduceIndex::saveState(Transaction& t) {
         Assert(&_store.dataFile() == &t.dataFile());
         _lastMapVersion = _mapVersion;
+        _lastStoredReduce = _storedReduce;
 
         CollatableBuilder stateKey;
         stateKey.addNull();
@@ -71,7 +81,7 @@ namespace litecore {
         CollatableBuilder state;
         state.beginArray();
         state << _lastSequenceIndexed << _lastSequenceChangedAt << _lastMapVersion << _indexType
-              << _rowCount << kCurFormatVersion << _lastPurgeCount;
+              << _rowCount << kCurFormatVersion << _lastPurgeCount << (int)_storedReduce;
         state.endArray();
 
         _stateReadAt = _store.set(stateKey, state, t).seq;
@@ -136,6 +146,7 @@ namespace litecore {
         _lastSequenceIndexed = _lastSequenceChangedAt = _lastPurgeCount = 0;
         _rowCount = 0;
         _stateReadAt = 0;
+        _lastStoredReduce = _storedReduce;  // (an empty index trivially has its aggregates)
     }
 
     void MapReduceIndex::erase() {
@@ -144,8 +155,84 @@ namespace litecore {
         _lastSequenceIndexed = _lastSequenceChangedAt = _lastPurgeCount = 0;
         _rowCount = 0;
         _stateReadAt = 0;
+        _lastStoredReduce = _storedReduce;
+    }
+
+    void MapReduceIndex::setStoredReduce(bool storedReduce) {
+        readState();
+        _storedReduce = storedReduce;
+        if (storedReduce && !_lastStoredReduce) {
+            LogToAt(IndexLog, Debug, "MapReduceIndex<%p>: Enabling stored reduce", this);
+            invalidate();   // existing rows aren't in any aggregates
+        }
+    }
+
+
+    // Stored-reduce aggregates are keyed by null, the group level, and the group's key prefix.
+    // That sorts them before all the rows (which are arrays) and keeps them apart from the
+    // state record (a bare null.)
+    alloc_slice MapReduceIndex::aggregateKey(unsigned groupLevel, slice groupPrefix) {
+        CollatableBuilder key;
+        key.addNull();
+        key << (double)groupLevel;
+        alloc_slice result(key.size() + groupPrefix.size);
+        memcpy((void*)result.buf, key.data().buf, key.size());
+        memcpy((uint8_t*)result.buf + key.size(), groupPrefix.buf, groupPrefix.size);
+        return result;
+    }
+
+
+    void MapReduceIndex::readStoredAggregates(unsigned groupLevel,
+                            bool needMinMax,
+                            function_ref<void(slice key, const ReduceAggregate&)> callback) const
+    {
+        Assert(_storedReduce && groupLevel <= kMaxStoredReduceGroupLevel);
+        alloc_slice keyPrefix = aggregateKey(groupLevel, nullslice);
+        for (RecordEnumerator e(_store, keyPrefix); e.next(); ) {
+            slice groupPrefix = e.record().key();
+            if (groupPrefix.size < keyPrefix.size
+                    || memcmp(groupPrefix.buf, keyPrefix.buf, keyPrefix.size) != 0)
+                break;
+            groupPrefix.moveStart(keyPrefix.size);
+            ReduceAggregate aggregate(e.record().body());
+            if (aggregate.minMaxStale && needMinMax)
+                aggregate = scanAggregate(groupPrefix);
+
+            // Turn the prefix into a key, the same way IndexEnumerator::createReducedRow does:
+            alloc_slice key(groupPrefix);
+            if (key.size == 0) {
+                uint8_t defaultKey[1] = {CollatableTypes::kNull};
+                key = slice(defaultKey, 1);
+            } else if (key[0] == CollatableTypes::kArray) {
+                uint8_t suffix[1] = {CollatableTypes::kEndSequence};
+                key.append(slice(suffix, 1));
+            }
+            callback(key, aggregate);
+        }
+    }
+
+
+    // Scans a group's rows to recompute its aggregate, when its old min or max was removed.
+    // A row's real key is an array beginning with its index key, so the group's rows are
+    // the ones whose real keys begin with '[' plus the group prefix.
+    ReduceAggregate MapReduceIndex::scanAggregate(slice groupPrefix) const {
+        CollatableBuilder rowPrefix;
+        rowPrefix.beginArray();
+        alloc_slice prefix(rowPrefix.size() + groupPrefix.size);
+        memcpy((void*)prefix.buf, rowPrefix.data().buf, rowPrefix.size());
+        memcpy((uint8_t*)prefix.buf + rowPrefix.size(), groupPrefix.buf, groupPrefix.size);
+
+        ReduceAggregate aggregate;
+        for (RecordEnumerator e(_store, prefix); e.next(); ) {
+            slice realKey = e.record().key();
+            if (realKey.size < prefix.size || memcmp(realKey.buf, prefix.buf, prefix.size) != 0)
+                break;
+            aggregate.add(e.record().body());
+        }
+        return aggregate;
     }
 
+
     alloc_slice MapReduceIndex::getSpecialEntry(slice recordID, sequence seq, unsigned entryID) const
     {
         // This data was written by emitSpecial
@@ -182,6 +269,8 @@ namespace litecore {
 
 
     // In charge of updating one view's index. Owned by a MapReduceIndexer.
+    // In parallel mode the rows are handed to a worker thread, which owns the index's
+    // Transaction until the writer is drained.
     class MapReduceIndexWriter: IndexWriter {
     public:
         MapReduceIndexWriter(MapReduceIndex &idx, Transaction *t)
@@ -189,42 +278,71 @@ namespace litecore {
          index(idx),
          _documentType(index.docType()),
          _transaction(t)
-        { }
+        {
+            trackRowChanges(idx.storedReduce());
+        }
+
+        ~MapReduceIndexWriter() {
+            stopWorker(false);
+        }
 
         MapReduceIndex & index;
 
+        void setParallel(bool parallel) {
+            Assert(!_worker.joinable());
+            _parallel = parallel;
+        }
+
         bool shouldIndexRecord(const Record& rec) const noexcept {
-            return rec.sequence() > index._lastSequenceIndexed;
+            // Once the worker is running, index._lastSequenceIndexed belongs to it
+            return rec.sequence() > (_worker.joinable() ? _queuedThrough
+                                                        : index._lastSequenceIndexed);
         }
 
         bool shouldIndexDocumentType(slice documentType) noexcept {
             return _documentType.buf == nullptr || _documentType == documentType;
         }
 
-        // Writes the given rows to the index.
-        bool indexRecord(slice recordID,
-                           sequence recordSequence,
-                           const std::vector<Collatable> &keys,
-                           const std::vector<alloc_slice> &values)
+        // Indexes the rows now, or queues them for the worker thread in parallel mode.
+        void addRecord(slice recordID,
+                       sequence recordSequence,
+                       const std::vector<Collatable> &keys,
+                       const std::vector<alloc_slice> &values)
         {
-            if (recordSequence <= index._lastSequenceIndexed)
-                return false;
-            _emitter.reset();
-            for (unsigned i = 0; i < keys.size(); ++i)
-                _emitter.emit(keys[i], values[i]);
-
-            index._lastSequenceIndexed = recordSequence;
-            if (update(recordID, recordSequence, _emitter.keys, _emitter.values, index._rowCount)) {
-                index._lastSequenceChangedAt = index._lastSequenceIndexed;
-                return true;
+            if (!_parallel) {
+                indexRecord(recordID, recordSequence, keys, values);
+                return;
             }
-            return false;
+            if (!_worker.joinable())
+                startWorker();
+            if (recordSequence <= _queuedThrough)
+                return;
+            _queuedThrough = recordSequence;
+
+            std::unique_lock<std::mutex> lock(_mutex);
+            _spaceAvailable.wait(lock, [&]{return _queue.size() < kMaxQueuedRecords || _error;});
+            if (_error)
+                std::rethrow_exception(_error);
+            _queue.push_back({alloc_slice(recordID), recordSequence, keys, values});
+            _workAvailable.notify_one();
+        }
+
+        // Waits for the worker thread to index everything queued, then takes back the
+        // Transaction and writes any rows still batched. Rethrows any exception thrown on
+        // the worker.
+        void drain() {
+            stopWorker(true);
+            if (_error)
+                std::rethrow_exception(_error);
+            flushBatch();
         }
 
         void finish(sequence finalSequence) {
+            drain();
             if (finalSequence > 0) {
                 index._lastSequenceIndexed = std::max(index._lastSequenceIndexed,
                                                       finalSequence);
+                saveAggregates();
                 index.saveState(*_transaction);
                 _transaction->commit();
             } else {
@@ -232,10 +350,144 @@ namespace litecore {
             }
         }
 
+    protected:
+        // Stored reduce: applies row changes to the aggregates of the rows' groups
+        virtual void rowAdded(Collatable key, slice value) override {
+            for (unsigned level = 0; level <= MapReduceIndex::kMaxStoredReduceGroupLevel; ++level)
+                aggregateForGroup(level, key).add(value);
+        }
+
+        virtual void rowRemoved(Collatable key, slice value) override {
+            for (unsigned level = 0; level <= MapReduceIndex::kMaxStoredReduceGroupLevel; ++level)
+                aggregateForGroup(level, key).remove(value);
+        }
+
     private:
+        static const size_t kMaxQueuedRecords = 1000;
+        static const size_t kRecordsPerBatch = 100;     // Records per call to updateBatch
+
+        ReduceAggregate& aggregateForGroup(unsigned groupLevel, slice indexKey) {
+            slice groupPrefix = groupLevel ? GroupedKeyPrefix(indexKey, groupLevel) : nullslice;
+            alloc_slice key = MapReduceIndex::aggregateKey(groupLevel, groupPrefix);
+            auto i = _aggregates.find(key);
+            if (i == _aggregates.end()) {
+                ReduceAggregate aggregate;
+                Record rec = index._store.get(key);
+                if (rec.exists())
+                    aggregate = ReduceAggregate(rec.body());
+                i = _aggregates.emplace(key, aggregate).first;
+            }
+            return i->second;
+        }
+
+
+        // Writes the changed aggregates to the index. (An aggregate whose min or max was
+        // removed is saved with them marked stale, to be recomputed at query time.)
+        void saveAggregates() {
+            for (auto &i : _aggregates) {
+                ReduceAggregate &aggregate = i.second;
+                if (aggregate.count > 0)
+                    index._store.set(i.first, aggregate.encode(), *_transaction);
+                else
+                    index._store.del(i.first, *_transaction);
+            }
+            _aggregates.clear();
+        }
+
+        typedef RecordRows QueuedRecord;
+
+        // Adds the given rows to the batch to be written to the index.
+        void indexRecord(slice recordID,
+                         sequence recordSequence,
+                         const std::vector<Collatable> &keys,
+                         const std::vector<alloc_slice> &values)
+        {
+            if (recordSequence <= index._lastSequenceIndexed)
+                return;
+            _emitter.reset();
+            for (unsigned i = 0; i < keys.size(); ++i)
+                _emitter.emit(keys[i], values[i]);
+
+            index._lastSequenceIndexed = recordSequence;
+            _batch.push_back({alloc_slice(recordID), recordSequence,
+                              _emitter.keys, _emitter.values});
+            if (_batch.size() >= kRecordsPerBatch)
+                flushBatch();
+        }
+
+        // Writes the batched rows to the index.
+        void flushBatch() {
+            if (_batch.empty())
+                return;
+            sequence changedAt = updateBatch(_batch, index._rowCount);
+            if (changedAt > 0)
+                index._lastSequenceChangedAt = std::max(index._lastSequenceChangedAt, changedAt);
+            _batch.clear();
+        }
+
+        void startWorker() {
+            _queuedThrough = index._lastSequenceIndexed;
+            _stopping = false;
+            _worker = std::thread([this]{runWorker();});
+        }
+
+        void stopWorker(bool finishQueue) {
+            if (!_worker.joinable())
+                return;
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _stopping = true;
+                if (!finishQueue)
+                    _queue.clear();
+                _workAvailable.notify_one();
+            }
+            _worker.join();
+            _transaction->moveToCurrentThread();
+        }
+
+        void runWorker() {
+            _transaction->moveToCurrentThread();
+            std::deque<QueuedRecord> batch;
+            std::unique_lock<std::mutex> lock(_mutex);
+            while (true) {
+                _workAvailable.wait(lock, [&]{return !_queue.empty() || _stopping;});
+                if (_queue.empty())
+                    return;
+                // Take the whole queue at once, so the producer isn't blocked while we write:
+                batch.swap(_queue);
+                _spaceAvailable.notify_one();
+                lock.unlock();
+                try {
+                    for (auto &rec : batch)
+                        indexRecord(rec.recordID, rec.recordSequence, rec.keys, rec.values);
+                    flushBatch();
+                    batch.clear();
+                    lock.lock();
+                } catch (...) {
+                    lock.lock();
+                    Warn("MapReduceIndexWriter: Exception on worker thread; abandoning index update");
+                    _error = std::current_exception();
+                    _queue.clear();
+                    _spaceAvailable.notify_all();
+                    return;
+                }
+            }
+        }
+
         alloc_slice const _documentType;
         Emitter _emitter;
+        std::vector<RecordRows> _batch;         // Rows not yet written by updateBatch
         std::unique_ptr<Transaction> _transaction;
+        std::map<alloc_slice, ReduceAggregate> _aggregates; // Stored-reduce aggregates being updated
+
+        bool _parallel {false};
+        sequence _queuedThrough {0};            // Latest sequence handed to the worker
+        std::thread _worker;
+        std::mutex _mutex;                      // Guards the members below
+        std::condition_variable _workAvailable, _spaceAvailable;
+        std::deque<QueuedRecord> _queue;
+        bool _stopping {false};
+        std::exception_ptr _error;
     };
 
     
@@ -249,6 +501,7 @@ namespace litecore {
     void MapReduceIndexer::addIndex(MapReduceIndex &index) {
         index.checkForPurge(); // has to be called before creating the transaction
         auto writer = new MapReduceIndexWriter(index, new Transaction(index.dataFile()));
+        writer->setParallel(_parallel);
         _writers.emplace_back(writer);
         if (index.docType().buf)
             _docTypes.insert(index.docType());
@@ -275,12 +528,22 @@ namespace litecore {
         return startSequence;
     }
 
+    void MapReduceIndexer::setParallel(bool parallel) {
+        _parallel = parallel;
+        for (auto &writer : _writers)
+            writer->setParallel(parallel);
+    }
+
     std::set<slice>* MapReduceIndexer::documentTypes() {
         return _allDocTypes ? nullptr : &_docTypes;
     }
 
 
     void MapReduceIndexer::finished(sequence seq) {
+        // Let every worker finish before committing anything, so an error in one index
+        // doesn't leave the others committed:
+        for (auto &writer : _writers)
+            writer->drain();
         for (auto writer = _writers.begin(); writer != _writers.end(); ++writer) {
             (*writer)->finish(seq);
         }
@@ -300,16 +563,16 @@ namespace litecore {
                                            const std::vector<Collatable> &keys,
                                            const std::vector<alloc_slice> &values)
     {
-        _writers[viewNumber]->indexRecord(recordID, recordSequence, keys, values);
+        _writers[viewNumber]->addRecord(recordID, recordSequence, keys, values);
     }
 
     void MapReduceIndexer::skipDoc(slice recordID, sequence recordSequence) {
         for (auto &writer : _writers)
-            writer->indexRecord(recordID, recordSequence, _noKeys, _noValues);
+            writer->addRecord(recordID, recordSequence, _noKeys, _noValues);
     }
 
     void MapReduceIndexer::skipDocInView(slice recordID, sequence recordSequence, unsigned viewNumber) {
-        _writers[viewNumber]->indexRecord(recordID, recordSequence, _noKeys, _noValues);
+        _writers[viewNumber]->addRecord(recordID, recordSequence, _noKeys, _noValues);
     }
 
 }
@@ -15,6 +15,7 @@
 
 #pragma once
 #include "Index.hh"
+#include "function_ref.hh"
 #include <set>
 #include <vector>
 
@@ -38,6 +39,25 @@ namespace litecore {
         void setDocumentType(slice docType)     {_documentType = docType;}
         alloc_slice docType() const        {return _documentType;}
 
+        /** Enables stored reduce: the index keeps a ReduceAggregate of its rows' values for
+            group levels 0 and 1, updated as the index is, so that built-in reduce queries at
+            those levels don't have to scan rows. Enabling it on an existing index that
+            doesn't have the aggregates invalidates the index. */
+        void setStoredReduce(bool storedReduce);
+        bool storedReduce() const               {return _storedReduce;}
+
+        /** The highest group level that stored reduce keeps aggregates for. */
+        static const unsigned kMaxStoredReduceGroupLevel = 1;
+
+        /** Calls the callback with the stored aggregate of every group of rows at the given
+            level, in key order. The key passed is the reduced row's key, as IndexEnumerator
+            would produce it. Requires storedReduce.
+            Removing a group's min or max row leaves its min and max unknown until the next
+            time they're asked for; if `needMinMax` is true, such groups' rows are scanned. */
+        void readStoredAggregates(unsigned groupLevel,
+                                  bool needMinMax,
+                                  function_ref<void(slice key, const ReduceAggregate&)>) const;
+
         /** The last source database sequence number to be indexed. */
         sequence lastSequenceIndexed() const;
 
@@ -63,6 +83,8 @@ namespace litecore {
         void deleted();
         void saveState(Transaction& t);
         alloc_slice getSpecialEntry(slice docID, sequence, unsigned fullTextID) const;
+        static alloc_slice aggregateKey(unsigned groupLevel, slice groupPrefix);
+        ReduceAggregate scanAggregate(slice groupPrefix) const;
 
         DataFile& _sourceDataFile;
         std::string _mapVersion, _lastMapVersion;
@@ -72,6 +94,7 @@ namespace litecore {
         uint64_t _lastPurgeCount {0};   // db lastPurgeCount when index was last built
         uint64_t _rowCount {0};
         alloc_slice _documentType;
+        bool _storedReduce {false}, _lastStoredReduce {false};
 
         friend class MapReduceIndexer;
         friend class MapReduceIndexWriter;
@@ -89,6 +112,13 @@ namespace litecore {
         /** If set, indexing will only occur if this index needs to be updated. */
         void triggerOnIndex(MapReduceIndex* index)  {_triggerIndex = index;}
 
+        /** If set, each index is written on its own background thread, so that different
+            indexes are updated concurrently while the caller goes on enumerating and mapping
+            records. Emitted rows are queued and applied in order; any error that occurs on a
+            background thread is rethrown by a later call to emitDocIntoView or finished.
+            Must be called before any records are emitted. */
+        void setParallel(bool parallel);
+
         /** Determines at which sequence indexing should start.
             Returns UINT64_MAX if no re-indexing is necessary. */
         sequence startingSequence();
@@ -128,6 +158,7 @@ namespace litecore {
         std::vector<std::unique_ptr<MapReduceIndexWriter>> _writers;
         MapReduceIndex* _triggerIndex {nullptr};
         sequence _latestDbSequence {0};
+        bool _parallel {false};
         bool _allDocTypes {false};
         std::set<slice> _docTypes;
 
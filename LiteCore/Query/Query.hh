@@ -16,10 +16,15 @@ namespace litecore {
     class QueryEnumerator {
     public:
         struct Options {
-            Options()           :skip(0), limit(UINT64_MAX) { }
+            Options()           :skip(0), limit(UINT64_MAX), streaming(false) { }
             uint64_t skip;
             uint64_t limit;
             slice paramBindings;
+            bool streaming;     ///< Read rows from the live query as they're requested,
+                                ///< instead of collecting all of them up front
+            slice onlyRecordID; ///< If non-null, only this record's rows are returned
+                                ///< (requires Query::rowsAreIndependent)
+
         };
 
         QueryEnumerator(Query*, const Options* =nullptr);
@@ -80,6 +85,12 @@ namespace litecore {
 
         virtual std::string explain()   {return "";}
 
+        /** True if each result row depends only on its own record (no aggregates, sorting or
+            nested queries) and the rows come out in storage order (no index is used), so the
+            query can be re-run on just the records that changed, using
+            QueryEnumerator::Options::onlyRecordID. */
+        virtual bool rowsAreIndependent() const     {return false;}
+
     protected:
         Query(KeyStore &keyStore) noexcept
         :_keyStore(keyStore)
@@ -145,6 +145,7 @@ namespace litecore {
         _ftsTables.clear();
         _1stCustomResultCol = 0;
         _isAggregateQuery = _aggregatesOK = false;
+        _rowsAreIndependent = true;
     }
 
 
@@ -223,7 +224,14 @@ namespace litecore {
         }
 
         // WHERE clause:
-        if (where) {
+        if (!_recordFilter.empty()) {
+            _sql << " WHERE " << _tableName << ".key = " << _recordFilter;
+            if (where) {
+                _sql << " AND (";
+                parseNode(where);
+                _sql << ")";
+            }
+        } else if (where) {
             _sql << " WHERE ";
             parseNode(where);
         }
@@ -245,7 +253,10 @@ namespace litecore {
         }
 
         // ORDER_BY clause:
-        writeSelectListClause(operands, "ORDER_BY"_sl, " ORDER BY ", true);
+        if (writeSelectListClause(operands, "ORDER_BY"_sl, " ORDER BY ", true) > 0)
+            _rowsAreIndependent = false;
+        if (_isAggregateQuery)
+            _rowsAreIndependent = false;
 
         // LIMIT, OFFSET clauses:
         // TODO: Use the ones from operands
@@ -584,6 +595,7 @@ namespace litecore {
             writeSelect(dict);
         } else {
             // Nested SELECT; use a fresh parser
+            _rowsAreIndependent = false;
             QueryParser nested(_tableName, _bodyColumnName);
             nested.parse(dict);
             _sql << nested.SQL();
@@ -35,6 +35,9 @@ namespace litecore {
         void setDefaultOffset(const std::string &o)                 {_defaultOffset = o;}
         void setDefaultLimit(const std::string &l)                  {_defaultLimit = l;}
 
+        /** Restricts the outer SELECT to the record whose key is bound to the given parameter. */
+        void setRecordFilter(const std::string &param)              {_recordFilter = param;}
+
         void parse(const fleece::Value*);
         void parseJSON(slice);
 
@@ -51,6 +54,11 @@ namespace litecore {
 
         bool isAggregateQuery() const                               {return _isAggregateQuery;}
 
+        /** True if each result row depends only on its own record, so that the query can be
+            re-run on just the records that changed (see setRecordFilter.) That isn't the case
+            if it aggregates, sorts, or has a nested SELECT. */
+        bool rowsAreIndependent() const                             {return _rowsAreIndependent;}
+
         static std::string expressionSQL(const fleece::Value*, const char *bodyColumnName = "body");
         std::string indexName(const fleece::Array *keys) const;
         std::string FTSIndexName(const fleece::Value *key) const;
@@ -108,6 +116,7 @@ namespace litecore {
         std::string _bodyColumnName;
         std::vector<std::string> _baseResultColumns;
         std::string _defaultOffset, _defaultLimit;
+        std::string _recordFilter;
         std::stringstream _sql;
         std::string _propertyPath;
         std::vector<const Operation*> _context;
@@ -117,6 +126,7 @@ namespace litecore {
         unsigned _1stCustomResultCol {0};
         bool _aggregatesOK {false};
         bool _isAggregateQuery {false};
+        bool _rowsAreIndependent {true};
     };
 
 }
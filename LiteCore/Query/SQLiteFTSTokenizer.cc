@@ -0,0 +1,335 @@
+//
+//  SQLiteFTSTokenizer.cc
+//  LiteCore
+//
+//  Copyright © 2017 Couchbase. All rights reserved.
+//
+
+// FTS tables tokenize (and stem) text as it's inserted, on the thread doing the insert. To get
+// that work off the writer, the "unicodesn" tokenizer is wrapped: FTSPretokenizer runs the real
+// tokenizer over a batch of texts on worker threads, and while it's in scope the wrapper replays
+// those results when the same texts are inserted on its thread. Text that wasn't pretokenized
+// (including query strings) goes straight to the real tokenizer, so the index is the same
+// either way.
+
+#include "SQLite_Internal.hh"
+#include "Error.hh"
+#include "Logging.hh"
+#include "SecureDigest.hh"
+#include <sqlite3.h>
+#include "fts3_tokenizer.h"
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <string.h>
+#include <thread>
+#include <unordered_map>
+
+using namespace std;
+
+namespace litecore {
+
+    static const char* const kTokenizerName = "unicodesn";
+
+    // Below this much text per thread, spawning threads costs more than it saves:
+    static const size_t kMinBytesPerThread = 64 * 1024;
+
+    static const unsigned kMaxThreads = 8;
+
+
+    // The tokens of one text, as produced by the real tokenizer
+    struct TokenList {
+        struct Token {
+            size_t offset, length;              // Location of the token string in `chars`
+            int startOffset, endOffset, position;
+        };
+        string chars;
+        vector<Token> tokens;
+    };
+
+    // Pretokenized texts, keyed by the tokenizer args and a digest of the text (see cacheKey)
+    typedef unordered_map<string, shared_ptr<const TokenList>> TokenCache;
+
+    static thread_local TokenCache tPretokenized;
+
+    // The real tokenizer module registered by register_unicodesn_tokenizer
+    static atomic<const sqlite3_tokenizer_module*> sRealModule {nullptr};
+
+
+    static string argsKey(int argc, const char * const *argv) {
+        string key;
+        for (int i = 0; i < argc; ++i) {
+            key += argv[i];
+            key += '\n';
+        }
+        return key;
+    }
+
+#if SECURE_DIGEST_AVAILABLE
+    // The cache is keyed by a SHA-1 digest of the text instead of the text itself, since the
+    // texts can be large and there's one entry per record.
+    static string cacheKey(const string &argsKey, const char *text, size_t length) {
+        uint8_t digest[20];
+        sha1Context ctx;
+        sha1_begin(&ctx);
+        sha1_add(&ctx, text, length);
+        sha1_end(&ctx, digest);
+        string key = argsKey;
+        key += '\0';
+        key.append((const char*)&length, sizeof(length));
+        key.append((const char*)digest, sizeof(digest));
+        return key;
+    }
+#endif
+
+
+#pragma mark - WRAPPER TOKENIZER:
+
+
+    struct WrapperTokenizer : public sqlite3_tokenizer {
+        sqlite3_tokenizer *real;
+        string argsKey;
+    };
+
+    struct WrapperCursor : public sqlite3_tokenizer_cursor {
+        sqlite3_tokenizer_cursor *real {nullptr};   // Real cursor, if not replaying
+        shared_ptr<const TokenList> replay;         // Pretokenized tokens, if replaying
+        size_t next {0};
+    };
+
+
+    static int wrapperCreate(int argc, const char * const *argv, sqlite3_tokenizer **ppTokenizer) {
+        sqlite3_tokenizer *real;
+        int rc = sRealModule.load()->xCreate(argc, argv, &real);
+        if (rc != SQLITE_OK)
+            return rc;
+        real->pModule = sRealModule;
+        auto tokenizer = new WrapperTokenizer;
+        tokenizer->real = real;
+        tokenizer->argsKey = argsKey(argc, argv);
+        *ppTokenizer = tokenizer;
+        return SQLITE_OK;
+    }
+
+    static int wrapperDestroy(sqlite3_tokenizer *pTokenizer) {
+        auto tokenizer = (WrapperTokenizer*)pTokenizer;
+        sRealModule.load()->xDestroy(tokenizer->real);
+        delete tokenizer;
+        return SQLITE_OK;
+    }
+
+    static int wrapperOpen(sqlite3_tokenizer *pTokenizer, const char *input, int nBytes,
+                           sqlite3_tokenizer_cursor **ppCursor)
+    {
+        auto tokenizer = (WrapperTokenizer*)pTokenizer;
+        auto cursor = new WrapperCursor;
+#if SECURE_DIGEST_AVAILABLE
+        if (!tPretokenized.empty() && input) {
+            size_t length = (nBytes < 0) ? strlen(input) : nBytes;
+            auto i = tPretokenized.find(cacheKey(tokenizer->argsKey, input, length));
+            if (i != tPretokenized.end())
+                cursor->replay = i->second;
+        }
+#endif
+        if (!cursor->replay) {
+            int rc = sRealModule.load()->xOpen(tokenizer->real, input, nBytes, &cursor->real);
+            if (rc != SQLITE_OK) {
+                delete cursor;
+                return rc;
+            }
+            cursor->real->pTokenizer = tokenizer->real;
+        }
+        *ppCursor = cursor;
+        return SQLITE_OK;
+    }
+
+    static int wrapperClose(sqlite3_tokenizer_cursor *pCursor) {
+        auto cursor = (WrapperCursor*)pCursor;
+        if (cursor->real)
+            sRealModule.load()->xClose(cursor->real);
+        delete cursor;
+        return SQLITE_OK;
+    }
+
+    static int wrapperNext(sqlite3_tokenizer_cursor *pCursor,
+                           const char **ppToken, int *pnBytes,
+                           int *piStartOffset, int *piEndOffset, int *piPosition)
+    {
+        auto cursor = (WrapperCursor*)pCursor;
+        if (cursor->real)
+            return sRealModule.load()->xNext(cursor->real, ppToken, pnBytes,
+                                             piStartOffset, piEndOffset, piPosition);
+        auto &tokens = cursor->replay->tokens;
+        if (cursor->next >= tokens.size())
+            return SQLITE_DONE;
+        auto &token = tokens[cursor->next++];
+        *ppToken = cursor->replay->chars.data() + token.offset;
+        *pnBytes = (int)token.length;
+        *piStartOffset = token.startOffset;
+        *piEndOffset = token.endOffset;
+        *piPosition = token.position;
+        return SQLITE_OK;
+    }
+
+    static const sqlite3_tokenizer_module kWrapperModule = {
+        0,
+        wrapperCreate,
+        wrapperDestroy,
+        wrapperOpen,
+        wrapperClose,
+        wrapperNext,
+    };
+
+
+    static int overrideTokenizer(sqlite3 *db) {
+        sqlite3_stmt *stmt;
+        int rc = sqlite3_prepare_v2(db, "SELECT fts3_tokenizer(?)", -1, &stmt, nullptr);
+        if (rc != SQLITE_OK)
+            return rc;
+        sqlite3_bind_text(stmt, 1, kTokenizerName, -1, SQLITE_STATIC);
+        const sqlite3_tokenizer_module *module = nullptr;
+        if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_bytes(stmt, 0) == sizeof(module))
+            memcpy(&module, sqlite3_column_blob(stmt, 0), sizeof(module));
+        sqlite3_finalize(stmt);
+        if (!module)
+            return SQLITE_ERROR;
+        if (module == &kWrapperModule)
+            return SQLITE_OK;
+        const sqlite3_tokenizer_module *expected = nullptr;
+        if (!sRealModule.compare_exchange_strong(expected, module))
+            Assert(expected == module);
+
+        rc = sqlite3_prepare_v2(db, "SELECT fts3_tokenizer(?, ?)", -1, &stmt, nullptr);
+        if (rc != SQLITE_OK)
+            return rc;
+        module = &kWrapperModule;
+        sqlite3_bind_text(stmt, 1, kTokenizerName, -1, SQLITE_STATIC);
+        sqlite3_bind_blob(stmt, 2, &module, sizeof(module), SQLITE_TRANSIENT);
+        sqlite3_step(stmt);
+        return sqlite3_finalize(stmt);
+    }
+
+
+    // Registers the wrapper in place of the real tokenizer. Must be called after
+    // register_unicodesn_tokenizer, on every connection.
+    // Two-argument fts3_tokenizer() is only enabled while doing so: it lets SQL install a
+    // tokenizer from a raw pointer, and queries are compiled from app-supplied expressions.
+    int RegisterFTSTokenizer(sqlite3 *db) {
+#ifdef SQLITE_DBCONFIG_ENABLE_FTS3_TOKENIZER
+        sqlite3_db_config(db, SQLITE_DBCONFIG_ENABLE_FTS3_TOKENIZER, 1, nullptr);
+#endif
+        int rc = overrideTokenizer(db);
+#ifdef SQLITE_DBCONFIG_ENABLE_FTS3_TOKENIZER
+        sqlite3_db_config(db, SQLITE_DBCONFIG_ENABLE_FTS3_TOKENIZER, 0, nullptr);
+#endif
+        return rc;
+    }
+
+
+#pragma mark - PRETOKENIZER:
+
+
+    // Tokenizes texts [begin, end) with a new instance of the real tokenizer.
+    // Also computes their cache keys, since digesting them is work too.
+    static void tokenizeRange(const vector<string> &args, const string &argsKey,
+                              const vector<slice> &texts, size_t begin, size_t end,
+                              vector<shared_ptr<const TokenList>> &results,
+                              vector<string> &keys)
+    {
+        vector<const char*> argv;
+        for (auto &arg : args)
+            argv.push_back(arg.c_str());
+        const sqlite3_tokenizer_module *module = sRealModule;
+        sqlite3_tokenizer *tokenizer;
+        if (module->xCreate((int)argv.size(), argv.data(), &tokenizer) != SQLITE_OK)
+            error::_throw(error::UnexpectedError);
+        tokenizer->pModule = module;
+
+        for (size_t i = begin; i < end; ++i) {
+            sqlite3_tokenizer_cursor *cursor;
+            if (module->xOpen(tokenizer, (const char*)texts[i].buf, (int)texts[i].size,
+                              &cursor) != SQLITE_OK)
+                continue;   // Leave it to be tokenized on insert
+            cursor->pTokenizer = tokenizer;
+            auto list = make_shared<TokenList>();
+            const char *token;
+            int length, start, endOffset, position;
+            while (module->xNext(cursor, &token, &length, &start, &endOffset, &position)
+                        == SQLITE_OK) {
+                list->tokens.push_back({list->chars.size(), (size_t)length,
+                                        start, endOffset, position});
+                list->chars.append(token, length);
+            }
+            module->xClose(cursor);
+            results[i] = list;
+            keys[i] = cacheKey(argsKey, (const char*)texts[i].buf, texts[i].size);
+        }
+        module->xDestroy(tokenizer);
+    }
+
+
+    void FTSPretokenizer::tokenize(const vector<string> &tokenizerArgs,
+                                   const vector<slice> &texts)
+    {
+#if SECURE_DIGEST_AVAILABLE
+        if (!sRealModule)
+            return;
+        size_t count = texts.size(), totalBytes = 0;
+        for (auto &text : texts)
+            totalBytes += text.size;
+        size_t nThreads = min({(size_t)max(thread::hardware_concurrency(), 1u),
+                               (size_t)kMaxThreads,
+                               totalBytes / kMinBytesPerThread,
+                               count});
+        if (nThreads <= 1)
+            return;     // Not worth it; the texts will be tokenized as they're inserted
+
+        vector<const char*> argv;
+        for (auto &arg : tokenizerArgs)
+            argv.push_back(arg.c_str());
+        string args = argsKey((int)argv.size(), argv.data());
+
+        vector<shared_ptr<const TokenList>> results(count);
+        vector<string> keys(count);
+        size_t perThread = (count + nThreads - 1) / nThreads;
+        vector<thread> threads;
+        vector<exception_ptr> errors(nThreads);
+        size_t begin = 0;
+        for (size_t t = 0; t < nThreads - 1 && begin < count; ++t, begin += perThread) {
+            size_t end = min(begin + perThread, count);
+            threads.emplace_back([&, t, begin, end] {
+                try {
+                    tokenizeRange(tokenizerArgs, args, texts, begin, end, results, keys);
+                } catch (...) {
+                    errors[t] = current_exception();
+                }
+            });
+        }
+        try {
+            tokenizeRange(tokenizerArgs, args, texts, begin, count, results, keys);
+        } catch (...) {
+            errors[nThreads - 1] = current_exception();
+        }
+        for (auto &t : threads)
+            t.join();
+        for (auto &error : errors) {
+            if (error)
+                rethrow_exception(error);
+        }
+
+        for (size_t i = 0; i < count; ++i) {
+            if (results[i] && tPretokenized.emplace(keys[i], results[i]).second)
+                _keys.push_back(move(keys[i]));
+        }
+        LogTo(SQL, "Pretokenized %zu texts (%zu bytes) on %zu threads",
+              count, totalBytes, nThreads);
+#endif
+    }
+
+
+    FTSPretokenizer::~FTSPretokenizer() {
+        for (auto &key : _keys)
+            tPretokenized.erase(key);
+    }
+
+}
@@ -57,7 +57,7 @@ enum {
 
 // Registered virtual-table instance that hangs onto the necessary per-database context info.
 struct FleeceVTab : public sqlite3_vtab {
-    fleeceFuncContext context;
+    fleeceFuncContext *context;     // Owned by the fl_each module, which outlives the vtab
 };
 
 
@@ -68,6 +68,7 @@ private:
     // Instance data:
     FleeceVTab* _vtab;                  // The virtual table
     alloc_slice _fleeceData;            // The root Fleece data
+    alloc_slice _decodedData;           // _fleeceData decompressed, if it was compressed
     alloc_slice _rootPath;              // The path string within the data, if any
     const Value *_container;            // The object being iterated (target of the path)
     valueType _containerType;           // The value type of _container
@@ -98,11 +99,11 @@ private:
         if( rc!=SQLITE_OK )
             return rc;
 
-        // Allocate a new FleeceVTab and copy the context into it:
+        // Allocate a new FleeceVTab and point it to the context:
         auto vtab = (FleeceVTab*) malloc(sizeof(FleeceVTab));
         if (!vtab)
             return SQLITE_NOMEM;
-        vtab->context = *(fleeceFuncContext*)aux;
+        vtab->context = (fleeceFuncContext*)aux;
         *outVtab = vtab;
         return SQLITE_OK;
     }
@@ -183,6 +184,7 @@ private:
 
     void reset() noexcept {
         _fleeceData = nullslice;
+        _decodedData = nullslice;
         _rootPath = nullslice;
         _container = nullptr;
         _containerType = kNull;
@@ -202,8 +204,16 @@ private:
         // Parse the Fleece data:
         _fleeceData = valueAsSlice(argv[0]);
         slice data = _fleeceData;
-        if (_vtab->context.accessor)
-            data = _vtab->context.accessor(data);
+        if (_vtab->context->bodyCodec != BodyCodec::kNone) {
+            try {
+                data = BodyCodec::decode(data, _decodedData);
+            } catch (...) {
+                Warn("Invalid document body in SQLite table");
+                return SQLITE_CORRUPT;
+            }
+        }
+        if (_vtab->context->accessor)
+            data = _vtab->context->accessor(data);
         _container = Value::fromTrustedData(data);
         if (!_container) {
             Warn("Invalid Fleece data in SQLite table");
@@ -213,7 +223,7 @@ private:
         // Evaluate the path, if there is one:
         if (idxNum == kPathIndex) {
             _rootPath = valueAsSlice(argv[1]);
-            int rc = evaluatePath(_rootPath, _vtab->context.sharedKeys, &_container);
+            int rc = evaluatePath(_rootPath, _vtab->context->sharedKeys, &_container);
             if (rc != SQLITE_OK)
                 return rc;
         }
@@ -246,7 +256,7 @@ private:
                 auto key = currentKey();
                 if (key && key->isInteger()) {
                     setResultTextFromSlice(ctx,
-                                           _vtab->context.sharedKeys->decode((int)key->asInt()));
+                                           _vtab->context->sharedKeys->decode((int)key->asInt()));
                 } else {
                     setResultFromValue(ctx, key);
                 }
@@ -375,15 +385,12 @@ public:
 constexpr sqlite3_module FleeceCursor::kEachModule;
 
 
-int RegisterFleeceEachFunctions(sqlite3 *db,
-                                DataFile::FleeceAccessor accessor,
-                                SharedKeys *sharedKeys)
-{
+int RegisterFleeceEachFunctions(sqlite3 *db, fleeceFuncContext *context) {
     return sqlite3_create_module_v2(db,
                                     "fl_each",
                                     &FleeceCursor::kEachModule,
-                                    new fleeceFuncContext{accessor, sharedKeys},
-                                    [](void *param){delete (fleeceFuncContext*)param;});
+                                    context->retain(),
+                                    &fleeceFuncContext::release);
 }
 
 
@@ -41,6 +41,33 @@ namespace litecore {
             if (sqlite3_value_subtype(arg) != kFleeceDataSubtype) {
                 // Pull the Fleece data out of a raw document body:
                 auto funcCtx = (fleeceFuncContext*)sqlite3_user_data(ctx);
+                if (funcCtx->bodyCodec != BodyCodec::kNone) {
+                    try {
+                        // A query calls these functions once per property it accesses, so reuse
+                        // the body decompressed by the previous call if it's from the same row:
+                        // SQLite passes that row's body at the same address. It can also reuse
+                        // that address for a later row, so the bytes are compared too, but only
+                        // when the address and size match.
+                        if (BodyCodec::isCompressed(fleece)
+                                && fleece.buf == funcCtx->scratchSourceArg
+                                && fleece == funcCtx->scratchSource) {
+                            fleece = funcCtx->scratch;
+                        } else {
+                            slice stored = fleece;
+                            fleece = BodyCodec::decode(stored, funcCtx->scratch);
+                            if (fleece.buf == funcCtx->scratch.buf) {
+                                funcCtx->scratchSource = alloc_slice(stored);
+                                funcCtx->scratchSourceArg = stored.buf;
+                            }
+                        }
+                    } catch (...) {
+                        funcCtx->scratchSource = nullslice;
+                        funcCtx->scratchSourceArg = nullptr;
+                        sqlite3_result_error(ctx, "invalid document body", -1);
+                        sqlite3_result_error_code(ctx, SQLITE_CORRUPT);
+                        return nullptr;
+                    }
+                }
                 if (funcCtx->accessor)
                     fleece = funcCtx->accessor(fleece);
             }
@@ -75,13 +102,54 @@ namespace litecore {
     }
 
 
-    static const Value* evaluatePath(sqlite3_context *ctx, slice path, const Value *val) noexcept {
-        auto sharedKeys = ((fleeceFuncContext*)sqlite3_user_data(ctx))->sharedKeys;
-        int rc = evaluatePath(path, sharedKeys, &val);
-        if (rc == SQLITE_OK)
-            return val;
-        sqlite3_result_error_code(ctx, rc);
-        return nullptr;
+    static void freeCompiledPath(void *path) {
+        delete (Path*)path;
+    }
+
+
+    // Evaluates the property path in argv[argIndex] starting from `val`. The path is compiled
+    // only once (resolving shared keys and array indexes) and attached to the argument as SQLite
+    // auxdata, which SQLite keeps for the life of the statement if the argument is a constant --
+    // as property paths in queries always are.
+    // On success replaces `val` with the value at the path (or nullptr if there is none.) If the
+    // path is invalid, sets an error result and returns false.
+    static bool evaluatePathArg(sqlite3_context *ctx, sqlite3_value **argv, int argIndex,
+                                const Value* &val) noexcept
+    {
+        auto path = (const Path*)sqlite3_get_auxdata(ctx, argIndex);
+        if (!path) {
+            slice pathStr = valueAsSlice(argv[argIndex]);
+            if (!pathStr.buf) {
+                sqlite3_result_error_code(ctx, SQLITE_FORMAT);
+                return false;
+            }
+            try {
+                auto sharedKeys = ((fleeceFuncContext*)sqlite3_user_data(ctx))->sharedKeys;
+                sqlite3_set_auxdata(ctx, argIndex, new Path((string)pathStr, sharedKeys),
+                                    &freeCompiledPath);
+            } catch (const error &error) {
+                WarnError("Invalid property path `%.*s` in query (err %d)",
+                          (int)pathStr.size, (char*)pathStr.buf, error.code);
+                sqlite3_result_error(ctx, "invalid property path", -1);
+                sqlite3_result_error_code(ctx, SQLITE_ERROR);
+                return false;
+            } catch (const bad_alloc&) {
+                sqlite3_result_error_code(ctx, SQLITE_NOMEM);
+                return false;
+            } catch (...) {
+                sqlite3_result_error(ctx, "invalid property path", -1);
+                sqlite3_result_error_code(ctx, SQLITE_ERROR);
+                return false;
+            }
+            // (If SQLite couldn't store the auxdata, it has already freed the Path.)
+            path = (const Path*)sqlite3_get_auxdata(ctx, argIndex);
+            if (!path) {
+                sqlite3_result_error_code(ctx, SQLITE_NOMEM);
+                return false;
+            }
+        }
+        val = path->eval(val);
+        return true;
     }
 
 
@@ -162,9 +230,9 @@ namespace litecore {
     static void fl_value(sqlite3_context* ctx, int argc, sqlite3_value **argv) noexcept {
         try {
             const Value *root = fleeceParam(ctx, argv[0]);
-            if (!root)
+            if (!root || !evaluatePathArg(ctx, argv, 1, root))
                 return;
-            setResultFromValue(ctx, evaluatePath(ctx, valueAsSlice(argv[1]), root));
+            setResultFromValue(ctx, root);
         } catch (const std::exception &x) {
             sqlite3_result_error(ctx, "fl_value: exception!", -1);
         }
@@ -174,28 +242,26 @@ namespace litecore {
     // fl_exists(fleeceData, propertyPath) -> 0/1
     static void fl_exists(sqlite3_context* ctx, int argc, sqlite3_value **argv) noexcept {
         const Value *root = fleeceParam(ctx, argv[0]);
-        if (!root)
+        if (!root || !evaluatePathArg(ctx, argv, 1, root))
             return;
-        const Value *val = evaluatePath(ctx, valueAsSlice(argv[1]), root);
-        sqlite3_result_int(ctx, (val ? 1 : 0));
+        sqlite3_result_int(ctx, (root ? 1 : 0));
     }
 
     
     // fl_type(fleeceData, propertyPath) -> int  (fleece::valueType, or -1 for no value)
     static void fl_type(sqlite3_context* ctx, int argc, sqlite3_value **argv) noexcept {
         const Value *root = fleeceParam(ctx, argv[0]);
-        if (!root)
+        if (!root || !evaluatePathArg(ctx, argv, 1, root))
             return;
-        setResultFromValueType(ctx, evaluatePath(ctx, valueAsSlice(argv[1]), root));
+        setResultFromValueType(ctx, root);
     }
 
     
     // fl_count(fleeceData, propertyPath) -> int
     static void fl_count(sqlite3_context* ctx, int argc, sqlite3_value **argv) noexcept {
-        const Value *root = fleeceParam(ctx, argv[0]);
-        if (!root)
+        const Value *val = fleeceParam(ctx, argv[0]);
+        if (!val || !evaluatePathArg(ctx, argv, 1, val) || !val)
             return;
-        const Value *val = evaluatePath(ctx, valueAsSlice(argv[1]), root);
         switch (val->type()) {
             case kArray:
                 sqlite3_result_int(ctx, val->asArray()->count());
@@ -217,10 +283,7 @@ namespace litecore {
             return;
         }
         const Value *root = fleeceParam(ctx, argv[0]);
-        if (!root)
-            return;
-        root = evaluatePath(ctx, valueAsSlice(argv[1]), root);
-        if (!root)
+        if (!root || !evaluatePathArg(ctx, argv, 1, root) || !root)
             return;
         const Array *array = root->asArray();
         if (!array) {
@@ -338,7 +401,8 @@ namespace litecore {
 
     int RegisterFleeceFunctions(sqlite3 *db,
                                 DataFile::FleeceAccessor accessor,
-                                fleece::SharedKeys *sharedKeys)
+                                fleece::SharedKeys *sharedKeys,
+                                BodyCodec::Type bodyCodec)
     {
         // Adapted from json1.c in SQLite source code
         int rc = SQLITE_OK;
@@ -368,15 +432,22 @@ namespace litecore {
             { "ceil",              1, unimplemented },
         };
 
+        // All the functions, and fl_each, share one context. (SQLite calls the release callback
+        // when a function is replaced, when the connection closes, or if registration fails.)
+        auto context = new fleeceFuncContext(accessor, sharedKeys, bodyCodec);
+        context->retain();
         for(i=0; i<sizeof(aFunc)/sizeof(aFunc[0]) && rc==SQLITE_OK; i++){
             rc = sqlite3_create_function_v2(db,
                                             aFunc[i].zName,
                                             aFunc[i].nArg,
                                             SQLITE_UTF8 | SQLITE_DETERMINISTIC,
-                                            new fleeceFuncContext{accessor, sharedKeys},
+                                            context->retain(),
                                             aFunc[i].xFunc, nullptr, nullptr,
-                                            [](void *param) {delete (fleeceFuncContext*)param;});
+                                            &fleeceFuncContext::release);
         }
+        if (rc == SQLITE_OK)
+            rc = RegisterFleeceEachFunctions(db, context);
+        fleeceFuncContext::release(context);
         return rc;
     }
     
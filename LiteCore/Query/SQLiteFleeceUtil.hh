@@ -8,6 +8,7 @@
 
 #pragma once
 #include "Base.hh"
+#include "BodyCodec.hh"
 #include "Fleece.hh"
 #include <sqlite3.h>
 
@@ -19,10 +20,28 @@ namespace litecore {
     static const int kFleecePointerSubtype  = 0x67;   // Blob contains a raw Value* (4 or 8 bytes)
 
 
-    // What the user_data of a registered function points to
+    // What the user_data of a registered function points to. A connection's functions all
+    // share one instance, so a row's body is decompressed only once however many of them
+    // read it.
     struct fleeceFuncContext {
         DataFile::FleeceAccessor accessor;
         fleece::SharedKeys *sharedKeys;
+        BodyCodec::Type bodyCodec;
+        alloc_slice scratch;            // Holds the latest decompressed body
+        alloc_slice scratchSource;      // The compressed body `scratch` was decoded from
+        const void *scratchSourceArg {nullptr}; // Where SQLite passed scratchSource to us
+        unsigned refCount {0};          // Number of registered functions/modules using this
+
+        fleeceFuncContext(DataFile::FleeceAccessor a, fleece::SharedKeys *sk, BodyCodec::Type bc)
+        :accessor(a), sharedKeys(sk), bodyCodec(bc) { }
+
+        // Used as the xDestroy callback of each registration
+        void* retain()                  {++refCount; return this;}
+        static void release(void *ctx)  {
+            auto self = (fleeceFuncContext*)ctx;
+            if (--self->refCount == 0)
+                delete self;
+        }
     };
 
 
@@ -41,6 +60,8 @@ namespace litecore {
 
     const fleece::Value* fleeceParam(sqlite3_context*, sqlite3_value *arg) noexcept;
 
+    int RegisterFleeceEachFunctions(sqlite3 *db, fleeceFuncContext*);
+
     int evaluatePath(slice path, fleece::SharedKeys*, const fleece::Value **pValue) noexcept;
 
     void setResultFromValue(sqlite3_context*, const fleece::Value*) noexcept;
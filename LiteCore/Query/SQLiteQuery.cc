@@ -18,6 +18,9 @@
 #include "Benchmark.hh"
 #include "SQLiteCpp/SQLiteCpp.h"
 #include <sqlite3.h>
+#include <atomic>
+#include <list>
+#include <mutex>
 #include <sstream>
 #include <iostream>
 
@@ -36,6 +39,22 @@ namespace litecore {
     };
 
 
+    // Maximum number of results cached per query, and the maximum size of a cached result
+    static const size_t kMaxCachedResults = 4;
+    static const size_t kMaxCachedResultSize = 1024 * 1024;
+
+
+    // Identifies the state of the database; if it's unchanged, a query's results are too.
+    struct ResultStamp {
+        int64_t dataVersion;        // Changes on commits by other connections
+        int64_t totalChanges;       // Changes on every write by this connection
+
+        bool operator== (const ResultStamp &s) const {
+            return dataVersion == s.dataVersion && totalChanges == s.totalChanges;
+        }
+    };
+
+
     class SQLiteQuery : public Query {
     public:
         SQLiteQuery(SQLiteKeyStore &keyStore, slice selectorExpression)
@@ -53,11 +72,46 @@ namespace litecore {
             
             _ftsTables = qp.ftsTablesUsed();
             for (auto ftsTable : _ftsTables) {
-                if (!keyStore.db().tableExists(ftsTable))
+                if (!keyStore.db().tableExists(ftsTable) || keyStore.indexIsBuilding(ftsTable))
                     error::_throw(error::LiteCore, error::NoSuchIndex);
             }
             _1stCustomResultColumn = qp.firstCustomResultColumn();
             _isAggregate = qp.isAggregateQuery();
+
+            if (qp.rowsAreIndependent() && _ftsTables.empty()
+                    && isPlainTableScan(keyStore, sql)) {
+                // Also generate the SQL to run the query on a single record (compiled on demand):
+                QueryParser fqp(keyStore.tableName());
+                fqp.setBaseResultColumns({"sequence", "key", "meta"});
+                fqp.setDefaultOffset("$offset");
+                fqp.setDefaultLimit("$limit");
+                fqp.setRecordFilter("$recordID");
+                fqp.parseJSON(selectorExpression);
+                _filteredSQL = fqp.SQL();
+            }
+        }
+
+
+        bool rowsAreIndependent() const override {
+            return !_filteredSQL.empty();
+        }
+
+
+        // Returns true if SQLite runs the query as a plain scan of the table, without an index
+        // or a temporary b-tree, so its rows come out in rowid order. Results computed by
+        // re-running the query on only the changed records (which get new rowids when saved)
+        // are in the same order only then.
+        static bool isPlainTableScan(SQLiteKeyStore &keyStore, const string &sql) {
+            unique_ptr<SQLite::Statement> plan(keyStore.compile("EXPLAIN QUERY PLAN " + sql));
+            int detailCol = plan->getColumnCount() - 1;
+            unsigned steps = 0;
+            while (plan->executeStep()) {
+                string detail = plan->getColumn(detailCol).getText();
+                if (++steps > 1 || detail.compare(0, 5, "SCAN ") != 0
+                                || detail.find("INDEX") != string::npos)
+                    return false;
+            }
+            return steps == 1;
         }
 
 
@@ -81,8 +135,8 @@ namespace litecore {
             // Now load the document and evaluate the expression:
             alloc_slice result;
             keyStore().get(recordID, kDefaultContent, [&](const Record &rec) {
-                if (rec.body() && rec.sequence() == seq) {
-                    slice fleeceData = rec.body();
+                if (rec.bodySlice() && rec.sequence() == seq) {
+                    slice fleeceData = rec.bodySlice();
                     auto accessor = keyStore().dataFile().fleeceAccessor();
                     if (accessor)
                         fleeceData = accessor(fleeceData);
@@ -120,13 +174,58 @@ namespace litecore {
         unsigned _1stCustomResultColumn;
         bool _isAggregate;
 
-        shared_ptr<SQLite::Statement> statement() {return _statement;}
+        // Returns a compiled statement for an enumerator's exclusive use. This is the query's
+        // own statement, unless that's still in use by another enumerator (a streaming one
+        // that hasn't finished), in which case it's a newly-compiled copy.
+        // If `filtered` is true, it's the statement that only matches the $recordID record.
+        shared_ptr<SQLite::Statement> checkOutStatement(bool filtered =false) {
+            auto &keyStore = (SQLiteKeyStore&)this->keyStore();
+            if (filtered) {
+                if (_filteredSQL.empty())
+                    error::_throw(error::InvalidParameter);
+                call_once(_filteredStatementOnce, [&]{
+                    _filteredStatement.reset(keyStore.compile(_filteredSQL));
+                });
+                if (!_filteredStatementInUse.exchange(true))
+                    return _filteredStatement;
+                return shared_ptr<SQLite::Statement>(keyStore.compile(_filteredSQL));
+            }
+            if (!_statementInUse.exchange(true))
+                return _statement;
+            LogTo(SQL, "Query statement is busy; compiling another for a concurrent enumerator");
+            return shared_ptr<SQLite::Statement>(keyStore.compile(_statement->getQuery()));
+        }
+
+        void returnStatement(const shared_ptr<SQLite::Statement> &statement) {
+            if (statement == _statement)
+                _statementInUse = false;
+            else if (statement == _filteredStatement)
+                _filteredStatementInUse = false;
+        }
+
+        alloc_slice cachedResult(const string &key, const ResultStamp&);
+        void cacheResult(const string &key, const ResultStamp&, alloc_slice recording);
 
     protected:
         QueryEnumerator::Impl* createEnumerator(const QueryEnumerator::Options *options) override;
 
     private:
+        bool getResultStamp(ResultStamp&);
+
+        struct CachedResult {
+            string key;                 // Encoded parameter bindings, skip and limit
+            ResultStamp stamp;          // State of the KeyStore when the query ran
+            alloc_slice recording;      // Rows, as recorded by fastForward()
+        };
+
         shared_ptr<SQLite::Statement> _statement;
+        atomic<bool> _statementInUse {false};
+        string _filteredSQL;                    // SQL restricted to one record, if possible
+        shared_ptr<SQLite::Statement> _filteredStatement;
+        once_flag _filteredStatementOnce;
+        atomic<bool> _filteredStatementInUse {false};
+        list<CachedResult> _resultCache;        // Most recently used first
+        mutex _resultCacheMutex;
     };
 
 
@@ -236,6 +335,8 @@ namespace litecore {
             enc.writeValue(_iter->asArray()->get(col));
         }
 
+        alloc_slice recording() const   {return _recording;}
+
     private:
         alloc_slice _recording;
         Array::iterator _iter;
@@ -245,30 +346,40 @@ namespace litecore {
 
 
     // Query enumerator that reads from the 'live' SQLite statement.
+    // It has exclusive use of the statement until it's destructed.
     class SQLiteQueryEnumImpl : public SQLiteBaseQueryEnumImpl {
     public:
         SQLiteQueryEnumImpl(SQLiteQuery &query, const QueryEnumerator::Options *options)
         :SQLiteBaseQueryEnumImpl(query)
-        ,_statement(query.statement())
+        ,_statement(query.checkOutStatement(options && options->onlyRecordID.buf))
         {
-            _statement->clearBindings();
-            long long offset = 0, limit = -1;
-            if (options) {
-                offset = options->skip;
-                if (options->limit <= INT64_MAX)
-                    limit = options->limit;
-                if (options->paramBindings.buf)
-                    bindParameters(options->paramBindings);
+            try {
+                _statement->clearBindings();
+                long long offset = 0, limit = -1;
+                if (options) {
+                    offset = options->skip;
+                    if (options->limit <= INT64_MAX)
+                        limit = options->limit;
+                    if (options->paramBindings.buf)
+                        bindParameters(options->paramBindings);
+                }
+                _statement->bind("$offset", offset);
+                _statement->bind("$limit", limit );
+                if (options && options->onlyRecordID.buf)
+                    _statement->bind("$recordID", options->onlyRecordID.buf,
+                                     (int)options->onlyRecordID.size);
+                LogStatement(*_statement);
+            } catch (...) {
+                _query.returnStatement(_statement);
+                throw;
             }
-            _statement->bind("$offset", offset);
-            _statement->bind("$limit", limit );
-            LogStatement(*_statement);
         }
 
         ~SQLiteQueryEnumImpl() {
             try {
                 _statement->reset();
             } catch (...) { }
+            _query.returnStatement(_statement);
         }
 
         void bindParameters(slice json) {
@@ -383,16 +494,83 @@ namespace litecore {
 
 
 
+#pragma mark - RESULT CACHE:
+
+
+    // Gets the current state of the KeyStore. Returns false if results can't be cached.
+    bool SQLiteQuery::getResultStamp(ResultStamp &stamp) {
+        auto &store = (SQLiteKeyStore&)keyStore();
+        // Inside a transaction the results may include uncommitted changes:
+        if (store.inTransaction())
+            return false;
+        // This has to be cheap, since it's checked on every run; counting records isn't.
+        store.db().getChangeStamp(stamp.dataVersion, stamp.totalChanges);
+        return true;
+    }
+
+
+    alloc_slice SQLiteQuery::cachedResult(const string &key, const ResultStamp &stamp) {
+        lock_guard<mutex> lock(_resultCacheMutex);
+        for (auto i = _resultCache.begin(); i != _resultCache.end(); ++i) {
+            if (i->key == key) {
+                if (!(i->stamp == stamp)) {
+                    _resultCache.erase(i);      // stale
+                    return alloc_slice();
+                }
+                _resultCache.splice(_resultCache.begin(), _resultCache, i);
+                return i->recording;
+            }
+        }
+        return alloc_slice();
+    }
+
+
+    void SQLiteQuery::cacheResult(const string &key, const ResultStamp &stamp,
+                                  alloc_slice recording)
+    {
+        if (recording.size > kMaxCachedResultSize)
+            return;
+        lock_guard<mutex> lock(_resultCacheMutex);
+        _resultCache.push_front({key, stamp, recording});
+        if (_resultCache.size() > kMaxCachedResults)
+            _resultCache.pop_back();
+    }
+
+
+    // The key a result is cached under: the parameter bindings, skip and limit.
+    static string resultCacheKey(const QueryEnumerator::Options *options) {
+        if (!options)
+            return string();
+        stringstream key;
+        key << options->skip << ' ' << options->limit << ' ';
+        key.write((const char*)options->paramBindings.buf, options->paramBindings.size);
+        return key.str();
+    }
+
+
     // The factory method that creates a SQLite QueryEnumerator::Impl.
     QueryEnumerator::Impl* SQLiteQuery::createEnumerator(const QueryEnumerator::Options *options) {
-        auto impl = new SQLiteQueryEnumImpl(*this, options);
-        if (false) {
-            return impl;
-        } else {
-            auto recording = impl->fastForward();
-            delete impl;
-            return recording;
+        if (options && (options->streaming || options->onlyRecordID.buf))
+            return new SQLiteQueryEnumImpl(*this, options);
+
+        // If the database hasn't changed since the same query last ran, replay that result:
+        ResultStamp stamp;
+        bool cacheable = getResultStamp(stamp);
+        string cacheKey;
+        if (cacheable) {
+            cacheKey = resultCacheKey(options);
+            alloc_slice recording = cachedResult(cacheKey, stamp);
+            if (recording) {
+                LogTo(SQL, "Replaying cached query result (%zu bytes)", recording.size);
+                return new SQLitePrerecordedQueryEnumImpl(*this, recording);
+            }
         }
+
+        unique_ptr<SQLiteQueryEnumImpl> live(new SQLiteQueryEnumImpl(*this, options));
+        auto result = live->fastForward();
+        if (cacheable)
+            cacheResult(cacheKey, stamp, result->recording());
+        return result;
     }
 
 
@@ -91,6 +91,8 @@ namespace litecore {
         uint8_t dstFlags = rev.flags & RawRevision::kPublicPersistentFlags;
         if (rev._body.size > 0)
             dstFlags |= RawRevision::kHasData;
+        else if (rev._externalBody)
+            dstFlags |= RawRevision::kHasExternalData;
         this->flags = (Rev::Flags)dstFlags;
 
         void *dstData = offsetby(&this->revID[0], rev.revID.size);
@@ -101,18 +103,13 @@ namespace litecore {
     }
 
     void RawRevision::copyTo(Rev &dst) const {
-        const void* end = this->next();
-        dst.revID.buf = (char*)this->revID;
-        dst.revID.size = this->revIDLen;
-        dst.flags = (Rev::Flags)(this->flags & RawRevision::kPublicPersistentFlags);
-        dst._parentIndex = ntohs(this->parentIndex);
-        const void *data = offsetby(&this->revID, this->revIDLen);
-        ptrdiff_t len = (uint8_t*)end-(uint8_t*)data;
-        data = offsetby(data, GetUVarInt(slice(data, len), &dst.sequence));
-        if (this->flags & RawRevision::kHasData)
-            dst._body = slice(data, end);
-        else
-            dst._body = nullslice;
+        auto rev = RawRevTree::parse(this);
+        dst.revID = rev.revID;
+        dst.flags = rev.flags;
+        dst._parentIndex = rev.parentIndex;
+        dst.sequence = rev.sequence;
+        dst._body = rev.body;
+        dst._externalBody = rev.externalBody;
     }
 
 
@@ -128,4 +125,75 @@ namespace litecore {
         }
     }
 
+
+#pragma mark - RAW REV TREE:
+
+
+    RawRevTree::RawRevTree(slice raw_tree, sequence curSeq)
+    :_raw(raw_tree),
+     _curSeq(curSeq)
+    {
+        // Walk the revs to validate their sizes, the same way decodeTree does:
+        if (raw_tree.size < sizeof(uint32_t))
+            error::_throw(error::CorruptRevisionData);
+        const RawRevision *rawRev = first();
+        unsigned count = 0;
+        for (; rawRev->isValid(); rawRev = rawRev->next())
+            ++count;
+        if (count > UINT16_MAX
+                || (uint8_t*)rawRev != (uint8_t*)raw_tree.end() - sizeof(uint32_t))
+            error::_throw(error::CorruptRevisionData);
+        _count = count;
+    }
+
+
+    RawRevTree::Revision RawRevTree::parse(const RawRevision *rawRev) {
+        Revision rev;
+        const void* end = rawRev->next();
+        rev.revID = revid(rawRev->revID, rawRev->revIDLen);
+        rev.flags = (Rev::Flags)(rawRev->flags & RawRevision::kPublicPersistentFlags);
+        rev.parentIndex = ntohs(rawRev->parentIndex);
+        const void *data = offsetby(&rawRev->revID, rawRev->revIDLen);
+        ptrdiff_t len = (uint8_t*)end-(uint8_t*)data;
+        data = offsetby(data, GetUVarInt(slice(data, len), &rev.sequence));
+        if (rawRev->flags & RawRevision::kHasData)
+            rev.body = slice(data, end);
+        else
+            rev.body = nullslice;
+        rev.externalBody = (rawRev->flags & RawRevision::kHasExternalData) != 0;
+        return rev;
+    }
+
+
+    RawRevTree::Revision RawRevTree::read(const RawRevision *rawRev) const {
+        Revision rev = parse(rawRev);
+        if (rev.sequence == 0)
+            rev.sequence = _curSeq;
+        return rev;
+    }
+
+
+    RawRevTree::Revision RawRevTree::currentRevision() const {
+        Assert(_count > 0);
+        return read(first());
+    }
+
+
+    bool RawRevTree::get(revid revID, Revision &outRev) const {
+        for (auto rawRev = first(); rawRev->isValid(); rawRev = rawRev->next()) {
+            if (slice(rawRev->revID, rawRev->revIDLen) == revID) {
+                outRev = read(rawRev);
+                return true;
+            }
+        }
+        return false;
+    }
+
+
+    void RawRevTree::forEach(function_ref<void(const Revision&)> fn) const {
+        for (auto rawRev = first(); rawRev->isValid(); rawRev = rawRev->next())
+            fn(read(rawRev));
+    }
+
+
 }
@@ -15,6 +15,8 @@
 
 namespace litecore {
 
+    class RawRevTree;
+
     // Layout of a single revision in encoded form. Rev tree is stored as a sequence of these
     // followed by a 32-bit zero.
     // Revs are stored in decending priority, with the current leaf rev(s) coming first.
@@ -33,6 +35,7 @@ namespace litecore {
         enum : uint8_t {
             kPublicPersistentFlags = (Rev::kLeaf | Rev::kDeleted | Rev::kHasAttachments
                                                  | Rev::kKeepBody),
+            kHasExternalData = 0x40, /**< Is the rev's data stored outside the tree? */
             kHasData = 0x80,  /**< Does this raw rev contain JSON/Fleece data? */
         };
 
@@ -66,6 +69,50 @@ namespace litecore {
         static size_t sizeToWrite(const Rev&);
         void copyTo(Rev &dst) const;
         RawRevision* copyFrom(const Rev &rev);
+
+        friend class RawRevTree;
+    };
+
+
+    /** A read-only view of an encoded rev tree (as produced by RevTree::encode) that reads
+        revisions in place, without allocating or decoding the whole tree. Use a RevTree if the
+        tree needs to be modified or navigated. */
+    class RawRevTree {
+    public:
+        /** A revision's metadata. The slices point into the encoded tree. */
+        struct Revision {
+            revid       revID;
+            sequence_t  sequence;
+            Rev::Flags  flags;
+            uint16_t    parentIndex;
+            slice       body;           // null if not stored, or stored externally
+            bool        externalBody;
+        };
+
+        /** Checks the structure of the encoded tree; throws CorruptRevisionData if invalid. */
+        RawRevTree(slice raw_tree, sequence curSeq);
+
+        unsigned count() const                  {return _count;}
+
+        /** The current revision, i.e. the first one. The tree must not be empty. */
+        Revision currentRevision() const;
+
+        /** Looks up a revision by ID. Returns false if it's not in the tree. */
+        bool get(revid, Revision &outRev) const;
+
+        /** Calls the function for each revision, in priority order. */
+        void forEach(function_ref<void(const Revision&)>) const;
+
+    private:
+        const RawRevision* first() const        {return (const RawRevision*)_raw.buf;}
+        Revision read(const RawRevision*) const;
+        static Revision parse(const RawRevision*);
+
+        slice const     _raw;
+        sequence const  _curSeq;
+        unsigned        _count {0};
+
+        friend class RawRevision;
     };
     
 }
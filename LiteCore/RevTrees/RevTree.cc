@@ -31,13 +31,29 @@
 namespace litecore {
     using namespace fleece;
 
-    RevTree::RevTree(slice raw_tree, sequence seq)
-    :_revs(RawRevision::decodeTree(raw_tree, this, seq))
-    {
+    RevTree::RevTree(slice raw_tree, sequence seq) {
+        decode(raw_tree, seq);
     }
 
     void RevTree::decode(litecore::slice raw_tree, sequence seq) {
-        _revs = RawRevision::decodeTree(raw_tree, this, seq);
+        (void)RawRevTree(raw_tree, seq);    // validates the encoding
+        _revs.clear();
+        invalidateIndex();
+        _rawTree = raw_tree;
+        _rawSequence = seq;
+        _rawPending = true;
+    }
+
+    RawRevTree RevTree::rawTree() const {
+        Assert(_rawPending);
+        return RawRevTree(_rawTree, _rawSequence);
+    }
+
+    void RevTree::_expand() const {
+        auto self = const_cast<RevTree*>(this);
+        self->_revs = RawRevision::decodeTree(_rawTree, self, _rawSequence);
+        self->_rawPending = false;
+        self->invalidateIndex();
     }
 
     alloc_slice RevTree::encode() {
@@ -63,17 +79,24 @@ namespace litecore {
 
     const Rev* RevTree::currentRevision() {
         Assert(!_unknown);
+        expand();
         sort();
         return _revs.size() == 0 ? nullptr : &_revs[0];
     }
 
     const Rev* RevTree::get(unsigned index) const {
         Assert(!_unknown);
+        expand();
         Assert(index < _revs.size());
         return &_revs[index];
     }
 
     const Rev* RevTree::get(revid revID) const {
+        expand();
+        if (useIndex()) {
+            auto i = _revIDIndex.find(revID);
+            return (i != _revIDIndex.end()) ? &_revs[i->second] : nullptr;
+        }
         for (auto &rev : _revs) {
             if (rev.revID == revID)
                 return &rev;
@@ -83,6 +106,11 @@ namespace litecore {
     }
 
     const Rev* RevTree::getBySequence(sequence seq) const {
+        expand();
+        if (useIndex()) {
+            auto i = _sequenceIndex.find(seq);
+            return (i != _sequenceIndex.end()) ? &_revs[i->second] : nullptr;
+        }
         for (auto &rev : _revs) {
             if (rev.sequence == seq)
                 return &rev;
@@ -91,7 +119,33 @@ namespace litecore {
         return nullptr;
     }
 
+    // Trees smaller than this are searched linearly; it's faster than hashing.
+    static const size_t kMinRevsToIndex = 16;
+
+    // Makes sure the lookup tables are up to date, if the tree is big enough to use them.
+    bool RevTree::useIndex() const {
+        if (_revs.size() < kMinRevsToIndex || _unknown)
+            return false;
+        if (!_indexValid) {
+            _revIDIndex.clear();
+            _sequenceIndex.clear();
+            _revIDIndex.reserve(_revs.size());
+            _sequenceIndex.reserve(_revs.size());
+            for (uint16_t i = 0; i < _revs.size(); ++i)
+                addToIndex(i);
+            _indexValid = true;
+        }
+        return true;
+    }
+
+    void RevTree::addToIndex(uint16_t index) const {
+        auto &rev = _revs[index];
+        _revIDIndex.emplace(rev.revID, index);
+        _sequenceIndex.emplace(rev.sequence, index);    // keeps the first rev with a sequence
+    }
+
     bool RevTree::hasConflict() const {
+        expand();
         if (_revs.size() < 2) {
             Assert(!_unknown);
             return false;
@@ -111,6 +165,7 @@ namespace litecore {
 
     std::vector<const Rev*> RevTree::currentRevisions() const {
         Assert(!_unknown);
+        expand();
         std::vector<const Rev*> cur;
         for (auto &rev : _revs) {
             if (rev.isLeaf())
@@ -144,7 +199,7 @@ namespace litecore {
     }
 
     bool RevTree::isBodyOfRevisionAvailable(const Rev* rev) const {
-        return rev->_body.buf != nullptr; // VersionedDocument overrides this
+        return rev->isBodyAvailable(); // VersionedDocument overrides this
     }
 
     alloc_slice RevTree::readBodyOfRevision(const Rev* rev) const {
@@ -172,6 +227,7 @@ namespace litecore {
                                 Rev::Flags revFlags)
     {
         Assert(!_unknown);
+        expand();
         // Allocate copies of the revID and data so they'll stay around:
         _insertedData.emplace_back(unownedRevID);
         revid revID = revid(_insertedData.back());
@@ -198,6 +254,7 @@ namespace litecore {
         if (!firstRev && newRev.revID > _revs[0].revID) {
             // If new rev is biggest, insert at start, so revs stay sorted
             _revs.insert(_revs.begin(), newRev);
+            invalidateIndex();      // all the indexes shifted
             for (auto &rev : _revs)
                 if (rev._parentIndex != Rev::kNoParent)
                     ++rev._parentIndex;
@@ -207,6 +264,8 @@ namespace litecore {
             if (!firstRev)
                 _sorted = false;
             _revs.push_back(newRev);
+            if (_indexValid)
+                addToIndex((uint16_t)(_revs.size() - 1));
             return &_revs.back();
         }
     }
@@ -307,14 +366,38 @@ namespace litecore {
 
     // Remove bodies of already-saved revs that are no longer leaves:
     void RevTree::removeNonLeafBodies() {
+        expand();
+        for (auto &rev : _revs) {
+            if ((rev._body.size > 0 || rev._externalBody)
+                    && !(rev.flags & (Rev::kLeaf | Rev::kNew | Rev::kKeepBody))) {
+                rev._body = nullslice;
+                rev._externalBody = false;
+            }
+        }
+    }
+
+    void RevTree::moveBodiesOutOfLine(function_ref<void(const Rev*)> storeBody) {
+        sort();
         for (auto &rev : _revs) {
-            if (rev._body.size > 0 && !(rev.flags & (Rev::kLeaf | Rev::kNew | Rev::kKeepBody)))
+            if (&rev == &_revs[0]) {
+                if (rev._externalBody) {
+                    _insertedData.push_back(readBodyOfRevision(&rev));
+                    rev._body = _insertedData.back();
+                    rev._externalBody = false;
+                    _changed = true;
+                }
+            } else if (rev._body.size > 0) {
+                storeBody(&rev);
                 rev._body = nullslice;
+                rev._externalBody = true;
+                _changed = true;
+            }
         }
     }
 
     unsigned RevTree::prune(unsigned maxDepth) {
         Assert(maxDepth > 0);
+        expand();
         if (_revs.size() <= maxDepth)
             return 0;
 
@@ -358,8 +441,10 @@ namespace litecore {
     }
 
     int RevTree::purgeAll() {
+        expand();
         int result = (int)_revs.size();
         _revs.resize(0);
+        invalidateIndex();
         _changed = true;
         return result;
     }
@@ -388,6 +473,7 @@ namespace litecore {
             }
         }
         _revs.resize(dst - &_revs[0]);
+        invalidateIndex();
         _changed = true;
     }
 
@@ -407,6 +493,7 @@ namespace litecore {
     }
 
     void RevTree::sort() {
+        expand();
         if (_sorted)
             return;
 
@@ -420,6 +507,7 @@ namespace litecore {
         }
 
         std::sort(_revs.begin(), _revs.end());
+        invalidateIndex();
 
         // oldToNew maps old array indexes to new (sorted) ones.
 		std::vector<uint16_t> oldToNew(_revs.size());
@@ -440,6 +528,7 @@ namespace litecore {
     }
 
     void RevTree::saved() {
+        expand();
         for (auto &rev : _revs)
             rev.clearFlag(Rev::kNew);
     }
@@ -452,6 +541,7 @@ namespace litecore {
     }
 
     void RevTree::dump(std::ostream& out) {
+        expand();
         int i = 0;
         for (auto &rev : _revs) {
             out << "\t" << (++i) << ": ";
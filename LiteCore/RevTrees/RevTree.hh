@@ -17,12 +17,14 @@
 #include "slice.hh"
 #include "RevID.hh"
 #include "DataFile.hh"
+#include <unordered_map>
 #include <vector>
 
 
 namespace litecore {
 
     class RevTree;
+    class RawRevTree;
 
     /** In-memory representation of a single revision's metadata. */
     class Rev {
@@ -32,7 +34,10 @@ namespace litecore {
         sequence_t      sequence;   /**< DB sequence number that this revision has/had */
 
         slice body() const          {return _body;}
-        bool isBodyAvailable() const{return _body.buf != nullptr;}
+        bool isBodyAvailable() const{return _body.buf != nullptr || _externalBody;}
+
+        /** True if the body isn't stored in the tree; RevTree::readBodyOfRevision fetches it. */
+        bool hasExternalBody() const{return _externalBody;}
 
         bool isLeaf() const         {return (flags & kLeaf) != 0;}
         bool isDeleted() const      {return (flags & kDeleted) != 0;}
@@ -61,10 +66,11 @@ namespace litecore {
         
         slice       _body;          /**< Revision body (JSON), or empty if not stored in this tree*/
         uint16_t    _parentIndex;   /**< Index in tree's rev[] array of parent revision, if any */
+        bool        _externalBody {false}; /**< Is the body stored outside the tree? */
 
         void addFlag(Flags f)       {flags = (Flags)(flags | f);}
         void clearFlag(Flags f)     {flags = (Flags)(flags & ~f);}
-        void removeBody()           {clearFlag(kKeepBody); _body = nullslice;}
+        void removeBody()           {clearFlag(kKeepBody); _body = nullslice; _externalBody = false;}
 #if DEBUG
         void dump(std::ostream&);
 #endif
@@ -80,18 +86,27 @@ namespace litecore {
         RevTree(slice raw_tree, sequence seq);
         virtual ~RevTree() { }
 
+        /** Prepares to read an encoded tree. The revisions aren't actually expanded into Revs
+            until they're first accessed; until then rawTree() gives cheaper read-only access.
+            The encoded data must remain valid as long as the RevTree is in use. */
         void decode(slice raw_tree, sequence seq);
 
+        /** True once the encoded tree (if any) has been expanded into Revs. */
+        bool isExpanded() const                         {return !_rawPending;}
+
+        /** A read-only view of the encoded tree. Only available while !isExpanded(). */
+        RawRevTree rawTree() const;
+
         alloc_slice encode();
 
-        size_t size() const                             {return _revs.size();}
+        size_t size() const                             {expand(); return _revs.size();}
         const Rev* get(unsigned index) const;
         const Rev* get(revid) const;
         const Rev* operator[](unsigned index) const {return get(index);}
         const Rev* operator[](revid revID) const    {return get(revID);}
         const Rev* getBySequence(sequence) const;
 
-        const std::vector<Rev>& allRevisions() const    {return _revs;}
+        const std::vector<Rev>& allRevisions() const    {expand(); return _revs;}
         const Rev* currentRevision();
         std::vector<const Rev*> currentRevisions() const;
         bool hasConflict() const;
@@ -126,19 +141,30 @@ namespace litecore {
 
         void saved();
 
+        virtual bool isBodyOfRevisionAvailable(const Rev*) const;
+        virtual alloc_slice readBodyOfRevision(const Rev*) const;
+
 #if DEBUG
         std::string dump();
 #endif
 
     protected:
-        virtual bool isBodyOfRevisionAvailable(const Rev*) const;
-        virtual alloc_slice readBodyOfRevision(const Rev*) const;
+        /** Moves the bodies of all non-current revisions out of the tree: `storeBody` is called
+            to save each one elsewhere, after which it's only reachable via readBodyOfRevision.
+            If the current revision's body had been moved out, it's brought back inline. */
+        void moveBodiesOutOfLine(function_ref<void(const Rev*)> storeBody);
+
 #if DEBUG
         virtual void dump(std::ostream&);
 #endif
 
     private:
         friend class Rev;
+        void expand() const                             {if (_rawPending) _expand();}
+        void _expand() const;
+        bool useIndex() const;
+        void addToIndex(uint16_t index) const;
+        void invalidateIndex()                          {_indexValid = false;}
         const Rev* _insert(revid, slice body, const Rev *parentRev, Rev::Flags);
         bool confirmLeaf(Rev* testRev);
         void compact();
@@ -147,6 +173,14 @@ namespace litecore {
         bool        _sorted {true};         // Are the revs currently sorted?
         std::vector<Rev> _revs;
         std::vector<alloc_slice> _insertedData;
+        slice       _rawTree;               // Encoded tree not yet expanded into _revs
+        sequence    _rawSequence {0};
+        bool        _rawPending {false};    // Does _rawTree need to be expanded?
+
+        // Lookup tables for get(revid) and getBySequence, built on demand for large trees:
+        mutable std::unordered_map<slice, uint16_t, fleece::sliceHash> _revIDIndex;
+        mutable std::unordered_map<sequence, uint16_t> _sequenceIndex;
+        mutable bool _indexValid {false};
     protected:
         bool _changed {false};
         bool _unknown {false};
@@ -14,9 +14,11 @@
 //  and limitations under the License.
 
 #include "VersionedDocument.hh"
+#include "RawRevTree.hh"
 #include "DocumentMeta.hh"
 #include "Error.hh"
 #include "varint.hh"
+#include <algorithm>
 #include <ostream>
 
 namespace litecore {
@@ -30,6 +32,8 @@ namespace litecore {
         bytes   type
     */
 
+    const std::string VersionedDocument::kRevBodyStoreName = "revbodies";
+
     VersionedDocument::VersionedDocument(KeyStore& db, slice docID)
     :_db(db), _rec(docID)
     {
@@ -54,6 +58,15 @@ namespace litecore {
         else if (_rec.bodySize() > 0)
             _unknown = true;        // i.e. rec was read as meta-only
 
+        _externalRevIDs.clear();
+        if (!_unknown && !isExpanded()) {
+            // (Reading the encoded tree directly avoids expanding it)
+            rawTree().forEach([&](const RawRevTree::Revision &rev) {
+                if (rev.externalBody)
+                    _externalRevIDs.emplace_back(rev.revID);
+            });
+        }
+
         if (_rec.exists()) {
             _meta.decode(_rec.meta());
         } else {
@@ -88,22 +101,91 @@ namespace litecore {
     }
 
     void VersionedDocument::save(Transaction& transaction) {
-        if (!_changed)
+        Record rec;
+        if (!prepareSave(rec, transaction))
             return;
+        _db.write(rec, transaction);
+        finishSave(rec);
+    }
+
+    bool VersionedDocument::prepareSave(Record &rec, Transaction &transaction) {
+        if (!_changed)
+            return false;
         updateMeta();
-        if (currentRevision()) {
+        rec.setKey(_rec.key());
+        bool exists = (currentRevision() != nullptr);
+        if (exists)
             removeNonLeafBodies();
+        saveSeparateRevBodies(transaction);
+        if (exists) {
             // Don't call _rec.setBody() because it'll invalidate all the pointers from Revisions
             // into the existing body buffer.
-            auto result = _db.set(_rec.key(), _rec.meta(), encode(), transaction);
-            _rec.updateSequence(result.seq);
+            rec.setMeta(_rec.meta());
+            rec.setBody(encode());
         } else {
-            _db.del(_rec.key(), transaction);
+            rec.setDeleted(true);
         }
+        return true;
+    }
+
+    void VersionedDocument::finishSave(const Record &rec) {
+        if (!rec.deleted())
+            _rec.updateSequence(rec.sequence());
         saved();
         _changed = false;
     }
 
+#pragma mark - SEPARATE REVISION BODIES:
+
+    KeyStore& VersionedDocument::revBodyStore() const {
+        return _db.dataFile().getKeyStore(kRevBodyStoreName);
+    }
+
+    // Key in revBodyStore is the docID, a zero byte, and the (compressed) revID.
+    alloc_slice VersionedDocument::revBodyKey(slice revID) const {
+        slice id = docID();
+        alloc_slice key(id.size + 1 + revID.size);
+        auto dst = (uint8_t*)key.buf;
+        memcpy(dst, id.buf, id.size);
+        dst[id.size] = 0;
+        memcpy(dst + id.size + 1, revID.buf, revID.size);
+        return key;
+    }
+
+    alloc_slice VersionedDocument::readBodyOfRevision(const Rev *rev) const {
+        if (!rev->hasExternalBody())
+            return RevTree::readBodyOfRevision(rev);
+        return revBodyStore().get(revBodyKey(rev->revID)).body();
+    }
+
+    void VersionedDocument::saveSeparateRevBodies(Transaction &t) {
+        if (_separateRevBodies && currentRevision()) {
+            moveBodiesOutOfLine([&](const Rev *rev) {
+                revBodyStore().set(revBodyKey(rev->revID), rev->body(), t);
+            });
+        }
+        if (_externalRevIDs.empty() && !_separateRevBodies)
+            return;
+
+        // Delete the stored bodies of revs that have been pruned, purged or compacted:
+        std::vector<alloc_slice> externalRevIDs;
+        for (auto &rev : allRevisions())
+            if (rev.hasExternalBody())
+                externalRevIDs.emplace_back(rev.revID);
+        for (auto &revID : _externalRevIDs) {
+            if (std::find(externalRevIDs.begin(), externalRevIDs.end(), revID)
+                    == externalRevIDs.end())
+                revBodyStore().del(revBodyKey(revID), t);
+        }
+        _externalRevIDs = std::move(externalRevIDs);
+    }
+
+    void VersionedDocument::purgeSeparateRevBodies(Transaction &t) {
+        for (auto &revID : _externalRevIDs)
+            revBodyStore().del(revBodyKey(revID), t);
+        _externalRevIDs.clear();
+    }
+
 #if DEBUG
     void VersionedDocument::dump(std::ostream& out) {
         out << "\"" << (std::string)docID() << "\" / " << (std::string)revID();
@@ -48,11 +48,32 @@ namespace litecore {
         slice docType() const       {return _meta.docType;}
         void setDocType(slice type) {_meta.docType = _docTypeBuf = type;}
 
+        /** The name of the KeyStore that holds revision bodies stored outside their trees. */
+        static const std::string kRevBodyStoreName;
+
+        /** If set, saving stores the bodies of non-current revisions in a separate KeyStore,
+            keyed by docID and revID, so the record itself only holds the tree metadata and the
+            current revision's body. Bodies already stored that way are readable either way. */
+        void setSeparateRevBodies(bool separate)    {_separateRevBodies = separate;}
+
+        alloc_slice readBodyOfRevision(const Rev*) const override;
+
         bool changed() const        {return _changed;}
         void save(Transaction& transaction);
 
+        /** The first half of save(): if there are changes, fills in `rec` with what needs to be
+            written (or marks it deleted) and returns true. After writing it, call finishSave.
+            Separately-stored revision bodies are written or deleted in the transaction. */
+        bool prepareSave(Record &rec, Transaction &transaction);
+
+        /** The second half of save(), called after the Record from prepareSave was written. */
+        void finishSave(const Record &rec);
+
         void updateMeta();
 
+        /** Deletes any separately-stored revision bodies of a document that's being purged. */
+        void purgeSeparateRevBodies(Transaction&);
+
 #if DEBUG
         std::string dump()          {return RevTree::dump();}
 #endif
@@ -63,11 +84,16 @@ namespace litecore {
 
     private:
         void decode();
+        KeyStore& revBodyStore() const;
+        alloc_slice revBodyKey(slice revID) const;
+        void saveSeparateRevBodies(Transaction&);
         VersionedDocument(const VersionedDocument&) = delete;
 
         KeyStore&       _db;
         Record          _rec;
         DocumentMeta    _meta;
         alloc_slice     _docTypeBuf;
+        bool            _separateRevBodies {false};
+        std::vector<alloc_slice> _externalRevIDs;   // Revs whose bodies are in revBodyStore
     };
 }
@@ -0,0 +1,84 @@
+//
+//  BodyCodec.cc
+//  LiteCore
+//
+//  Copyright © 2017 Couchbase. All rights reserved.
+//
+
+#include "BodyCodec.hh"
+#include "Error.hh"
+#include "snappy.h"
+#include <string>
+#include <string.h>
+
+using namespace std;
+
+namespace litecore {
+
+    // Tags at the start of a stored body:
+    enum : uint8_t {
+        kRawTag         = 0,
+        kSnappyTag      = 1,
+    };
+
+
+    alloc_slice BodyCodec::encode(slice body) {
+        if (!body.buf)
+            return alloc_slice();
+        if (body.size >= kMinCompressibleSize) {
+            string compressed;
+            snappy::Compress((const char*)body.buf, body.size, &compressed);
+            // Only keep the compressed form if it saves at least 1/8 of the size; otherwise
+            // it's not worth decompressing on every read:
+            if (compressed.size() <= body.size - body.size / 8) {
+                alloc_slice result(1 + compressed.size());
+                ((uint8_t*)result.buf)[0] = kSnappyTag;
+                memcpy((uint8_t*)result.buf + 1, compressed.data(), compressed.size());
+                return result;
+            }
+        }
+        alloc_slice result(1 + body.size);
+        ((uint8_t*)result.buf)[0] = kRawTag;
+        memcpy((uint8_t*)result.buf + 1, body.buf, body.size);
+        return result;
+    }
+
+
+    bool BodyCodec::isCompressed(slice stored) noexcept {
+        return stored.size > 0 && ((const uint8_t*)stored.buf)[0] == kSnappyTag;
+    }
+
+
+    slice BodyCodec::decode(slice stored, alloc_slice &scratch) {
+        if (!stored.buf)
+            return nullslice;
+        if (stored.size == 0)
+            error::_throw(error::CorruptData);
+        switch (((const uint8_t*)stored.buf)[0]) {
+            case kRawTag:
+                return slice((const uint8_t*)stored.buf + 1, stored.size - 1);
+            case kSnappyTag: {
+                auto data = (const char*)stored.buf + 1;
+                size_t size;
+                if (!snappy::GetUncompressedLength(data, stored.size - 1, &size))
+                    error::_throw(error::CorruptData);
+                scratch = alloc_slice(size);
+                if (!snappy::RawUncompress(data, stored.size - 1, (char*)scratch.buf))
+                    error::_throw(error::CorruptData);
+                return scratch;
+            }
+            default:
+                error::_throw(error::CorruptData);
+        }
+    }
+
+
+    alloc_slice BodyCodec::decodeCopy(slice stored) {
+        alloc_slice scratch;
+        slice body = decode(stored, scratch);
+        if (body.buf == scratch.buf)
+            return scratch;
+        return alloc_slice(body);
+    }
+
+}
@@ -0,0 +1,44 @@
+//
+//  BodyCodec.hh
+//  LiteCore
+//
+//  Copyright © 2017 Couchbase. All rights reserved.
+//
+
+#pragma once
+#include "Base.hh"
+
+namespace litecore {
+
+    /** Optional compression of record bodies. A DataFile's codec is chosen when the file is
+        created, and recorded in it. In a file that has a codec, every stored body begins with a
+        one-byte tag saying whether the rest of it is compressed; files without one (including
+        all files created by older versions) store bodies exactly as given. */
+    class BodyCodec {
+    public:
+        /** Codec IDs. These are persisted, so don't change their values. */
+        enum Type {
+            kNone   = 0,        ///< Bodies are stored as-is, untagged
+            kSnappy = 1,        ///< Bodies are tagged; large ones are compressed with Snappy
+        };
+
+        /** Bodies smaller than this aren't worth trying to compress. */
+        static const size_t kMinCompressibleSize = 256;
+
+        /** Returns the form in which a body is stored: tagged, and compressed if it's large
+            enough and compression actually makes it smaller. */
+        static alloc_slice encode(slice body);
+
+        /** Returns the original body, given its stored form. If it's not compressed, the result
+            points into `stored`; otherwise it's decompressed into `scratch`, which the result
+            points into. Throws CorruptData if the stored form is invalid. */
+        static slice decode(slice stored, alloc_slice &scratch);
+
+        /** Like decode, but always returns a heap block, copying the body if necessary. */
+        static alloc_slice decodeCopy(slice stored);
+
+        /** Does this stored body need to be decompressed? */
+        static bool isCompressed(slice stored) noexcept;
+    };
+
+}
@@ -46,6 +46,8 @@ namespace litecore {
             KeyStore::Capabilities keyStores;
             bool create         :1;     ///< Should the db be created if it doesn't exist?
             bool writeable      :1;     ///< If false, db is opened read-only
+            bool compressBodies :1;     ///< Compress large record bodies? (Set at creation)
+            bool durableCommits :1;     ///< Sync every commit to disk before it returns
             EncryptionAlgorithm encryptionAlgorithm;
             alloc_slice encryptionKey;
 
@@ -163,6 +165,9 @@ namespace litecore {
         /** Override to commit or abort a database transaction. */
         virtual void _endTransaction(Transaction*, bool commit) =0;
 
+        /** Override to be notified when a transaction continues on a different thread. */
+        virtual void _transactionMovedToThread(Transaction*)     { }
+
         /** Is this DataFile object currently in a transaction? */
         bool inTransaction() const                      {return _inTransaction;}
 
@@ -225,6 +230,11 @@ namespace litecore {
         void commit();
         void abort();
 
+        /** Declares that the calling thread will make the transaction's further changes.
+            A Transaction may be handed off between threads this way, but must never be used
+            by two threads at once. */
+        void moveToCurrentThread()          {_db._transactionMovedToThread(this);}
+
     private:
         friend class DataFile;
         friend class KeyStore;
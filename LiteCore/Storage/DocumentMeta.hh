@@ -27,7 +27,7 @@ namespace litecore {
         DocumentMeta()                      :flags() { }
         DocumentMeta(DocumentFlags, slice version, slice docType);
         DocumentMeta(slice meta);
-        DocumentMeta(const Record &rec)     :DocumentMeta(rec.meta()) { }
+        DocumentMeta(const Record &rec)     :DocumentMeta(rec.metaSlice()) { }
 
         void setFlag(DocumentFlags f)       {flags = (DocumentFlags)(flags | f);}
         void clearFlag(DocumentFlags f)     {flags = (DocumentFlags)(flags & ~f);}
@@ -45,11 +45,24 @@ namespace litecore {
         fn(get(seq, options));
     }
 
+    uint64_t KeyStore::liveRecordCount() const {
+        if (!_tombstoneTest)
+            return recordCount();
+        RecordEnumerator::Options opts;
+        opts.contentOptions = kMetaOnly;
+        uint64_t count = 0;
+        for (RecordEnumerator e(const_cast<KeyStore&>(*this), nullslice, nullslice, opts); e.next(); ) {
+            if (!_tombstoneTest(e->metaSlice()))
+                ++count;
+        }
+        return count;
+    }
+
     void KeyStore::readBody(Record &rec) const {
-        if (!rec.body()) {
+        if (!rec.bodySlice()) {
             Record fullDoc = rec.sequence() ? get(rec.sequence(), kDefaultContent)
                                               : get(rec.key(), kDefaultContent);
-            rec._body = fullDoc._body;
+            rec.setBody(fullDoc.body());
         }
     }
 
@@ -66,6 +79,11 @@ namespace litecore {
         }
     }
 
+    void KeyStore::setMany(vector<Record> &records, Transaction &t) {
+        for (auto &rec : records)
+            write(rec, t);
+    }
+
     bool KeyStore::del(slice key, Transaction &t) {
         LogTo(DBLog, "KeyStore(%s) del %s", _name.c_str(), logSlice(key));
         bool ok = _del(key, t);
@@ -86,6 +104,10 @@ namespace litecore {
         return del(rec.key(), t);
     }
 
+    void KeyStore::setExpiration(slice key, expiration_t, Transaction&) {
+        error::_throw(error::Unimplemented);
+    }
+
     void KeyStore::createIndex(slice expressionJSON, IndexType, const IndexOptions*) {
         error::_throw(error::Unimplemented);
     }
@@ -48,6 +48,18 @@ namespace litecore {
         virtual uint64_t recordCount() const =0;
         virtual sequence lastSequence() const =0;
 
+        /** Callback that returns true if a record's meta marks it as a deleted document, i.e. a
+            tombstone. Tombstones still count as records, but not as live records. */
+        typedef bool (*TombstoneTest)(slice meta);
+
+        /** Sets the TombstoneTest. This should be done right after opening, and consistently
+            every time the KeyStore is opened, since the counts may be persisted. */
+        void setTombstoneTest(TombstoneTest t)      {_tombstoneTest = t;}
+
+        /** The number of records that are neither deleted nor tombstones. The default
+            implementation scans all records; subclasses should do better. */
+        virtual uint64_t liveRecordCount() const;
+
         virtual void erase() =0;
 
         void deleteKeyStore(Transaction&);
@@ -57,6 +69,10 @@ namespace litecore {
         Record get(slice key, ContentOptions = kDefaultContent) const;
         virtual Record get(sequence, ContentOptions = kDefaultContent) const =0;
 
+        /** Looks up a record and passes it to the callback. The Record may be borrowed, i.e.
+            point into the storage engine's memory, so it's only valid during the callback;
+            copy it if you need it afterwards. The callback must not read from or write to this
+            KeyStore, since that may reuse the memory the Record points into. */
         virtual void get(slice key, ContentOptions, function_ref<void(const Record&)>);
         virtual void get(sequence, ContentOptions, function_ref<void(const Record&)>);
 
@@ -82,10 +98,43 @@ namespace litecore {
                                                         {return set(key, nullslice, value, t);}
         void write(Record&, Transaction&);
 
+        /** Writes a batch of records, as though write() were called on each one in order,
+            updating their sequences. Subclasses can override this to do it more efficiently. */
+        virtual void setMany(std::vector<Record> &records, Transaction&);
+
         bool del(slice key, Transaction&);
         bool del(sequence s, Transaction&);
         bool del(const Record&, Transaction&);
 
+        //////// EXPIRATION:
+
+        /** A record's expiration time, in seconds since the Unix epoch; 0 means none. */
+        typedef int64_t expiration_t;
+
+        /** Sets the time at which the record with this key expires, or clears it if 0. Doesn't
+            check whether the record exists. */
+        virtual void setExpiration(slice key, expiration_t, Transaction&);
+
+        /** Returns the record's expiration time, or 0 if it has none. */
+        virtual expiration_t getExpiration(slice key)               {return 0;}
+
+        /** Returns the earliest expiration time of any record, or 0 if none expire. */
+        virtual expiration_t nextExpiration()                       {return 0;}
+
+        /** Returns the keys of up to `limit` records whose expiration time is at or before
+            `now`, earliest first. */
+        virtual std::vector<alloc_slice> expiredKeys(expiration_t now,
+                                                     unsigned limit =UINT_MAX)
+                                                                    {return {};}
+
+        /** Pages through the records whose expiration time is at or before `now`: returns up to
+            `limit` of them, with their expiration times, ordered by time and then key, starting
+            after the position (`afterExpiration`, `afterKey`). To get the first page, pass
+            INT64_MIN and nullslice; for the next, pass the last item of the previous page. */
+        virtual std::vector<std::pair<alloc_slice, expiration_t>>
+            expiredKeysAfter(expiration_t now, expiration_t afterExpiration, slice afterKey,
+                             unsigned limit)                        {return {};}
+
         //////// INDEXING:
 
         enum IndexType {
@@ -130,6 +179,7 @@ namespace litecore {
         DataFile &          _db;            // The DataFile I'm contained in
         const std::string   _name;          // My name
         const Capabilities  _capabilities;  // Do I support sequences or soft deletes?
+        TombstoneTest       _tombstoneTest {nullptr};   // Identifies tombstones by their meta
 
     private:
         KeyStore(const KeyStore&) = delete;     // not copyable
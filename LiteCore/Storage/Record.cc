@@ -26,10 +26,20 @@ namespace litecore {
         setKey(key);
     }
 
+    // Returns an alloc_slice with the contents of `ref`, sharing `owned` if that's what it is.
+    static inline alloc_slice ownedCopy(const alloc_slice &owned, slice ref) {
+        if (ref.buf == owned.buf)
+            return owned;
+        return alloc_slice(ref);
+    }
+
     Record::Record(const Record &d)
-    :_key(d._key),
-     _meta(d._meta),
-     _body(d._body),
+    :_key(ownedCopy(d._key, d._keyRef)),
+     _meta(ownedCopy(d._meta, d._metaRef)),
+     _body(ownedCopy(d._body, d._bodyRef)),
+     _keyRef(_key),
+     _metaRef(_meta),
+     _bodyRef(_body),
      _bodySize(d._bodySize),
      _sequence(d._sequence),
      _offset(d._offset),
@@ -41,12 +51,59 @@ namespace litecore {
     :_key(move(d._key)),
      _meta(move(d._meta)),
      _body(move(d._body)),
+     _keyRef(d._keyRef),
+     _metaRef(d._metaRef),
+     _bodyRef(d._bodyRef),
      _bodySize(d._bodySize),
      _sequence(d._sequence),
      _offset(d._offset),
      _deleted(d._deleted),
      _exists(d._exists)
-    { }
+    {
+        d._keyRef = d._metaRef = d._bodyRef = nullslice;
+    }
+
+    Record& Record::operator= (const Record &d) {
+        if (&d != this) {
+            _key = ownedCopy(d._key, d._keyRef);
+            _meta = ownedCopy(d._meta, d._metaRef);
+            _body = ownedCopy(d._body, d._bodyRef);
+            _keyRef = _key;
+            _metaRef = _meta;
+            _bodyRef = _body;
+            _bodySize = d._bodySize;
+            _sequence = d._sequence;
+            _offset = d._offset;
+            _deleted = d._deleted;
+            _exists = d._exists;
+        }
+        return *this;
+    }
+
+    Record& Record::operator= (Record &&d) noexcept {
+        _key = move(d._key);
+        _meta = move(d._meta);
+        _body = move(d._body);
+        _keyRef = d._keyRef;
+        _metaRef = d._metaRef;
+        _bodyRef = d._bodyRef;
+        _bodySize = d._bodySize;
+        _sequence = d._sequence;
+        _offset = d._offset;
+        _deleted = d._deleted;
+        _exists = d._exists;
+        d._keyRef = d._metaRef = d._bodyRef = nullslice;
+        return *this;
+    }
+
+    // Copies a field into memory owned by this Record, if it's borrowed.
+    /*static*/ const alloc_slice& Record::adopt(alloc_slice &owned, slice &ref) {
+        if (ref.buf != owned.buf) {
+            owned = alloc_slice(ref);
+            ref = owned;
+        }
+        return owned;
+    }
 
     void Record::clearMetaAndBody() noexcept {
         setMeta(nullslice);
@@ -62,9 +119,9 @@ namespace litecore {
 
     uint64_t Record::bodyAsUInt() const noexcept {
         uint64_t count;
-        if (body().size < sizeof(count))
+        if (bodySlice().size < sizeof(count))
             return 0;
-        memcpy(&count, body().buf, sizeof(count));
+        memcpy(&count, bodySlice().buf, sizeof(count));
         return _endian_decode(count);
     }
 
@@ -19,17 +19,42 @@
 namespace litecore {
 
     /** The unit of storage in a DataFile: a key, metadata and body (all opaque blobs);
-        and some extra metadata like a deletion flag and a sequence number. */
+        and some extra metadata like a deletion flag and a sequence number.
+
+        A Record can be "borrowed": its key/meta/body may point directly into memory owned by
+        the storage engine (like a SQLite column), which is only valid until the enumerator or
+        callback that produced it moves on. The slice accessors (keySlice, etc.) never copy;
+        the alloc_slice accessors (key, etc.) copy borrowed data on demand, and copying or
+        assigning a Record always produces one that owns its data.
+
+        Records aren't thread-safe. In particular, the alloc_slice accessors of a borrowed Record
+        modify it (even though it's const), so a borrowed Record must only be used on the thread
+        that's running the callback or enumerator that produced it. A Record that owns its data
+        isn't modified by its const methods, so it can be read on several threads at once. */
     class Record {
     public:
         Record()                              { }
         explicit Record(slice key);
         Record(const Record&);
         Record(Record&&) noexcept;
-
-        const alloc_slice& key() const          {return _key;}
-        const alloc_slice& meta() const         {return _meta;}
-        const alloc_slice& body() const         {return _body;}
+        Record& operator= (const Record&);
+        Record& operator= (Record&&) noexcept;
+
+        const alloc_slice& key() const          {return adopt(_key, _keyRef);}
+        const alloc_slice& meta() const         {return adopt(_meta, _metaRef);}
+        const alloc_slice& body() const         {return adopt(_body, _bodyRef);}
+
+        /** Zero-copy accessors. If the record is borrowed, the result is only valid as long as
+            the record's source is. */
+        slice keySlice() const                  {return _keyRef;}
+        slice metaSlice() const                 {return _metaRef;}
+        slice bodySlice() const                 {return _bodyRef;}
+
+        /** True if any of the key/meta/body point to memory the Record doesn't own. */
+        bool isBorrowed() const {
+            return _keyRef.buf != _key.buf || _metaRef.buf != _meta.buf
+                || _bodyRef.buf != _body.buf;
+        }
 
         size_t bodySize() const                 {return _bodySize;}
 
@@ -43,16 +68,28 @@ namespace litecore {
         bool exists() const                     {return _exists;}
 
         template <typename T>
-            void setKey(const T &key)           {_key = key;}
+            void setKey(const T &key)           {_key = key; _keyRef = _key;}
         template <typename T>
-            void setMeta(const T &meta)         {_meta = meta;}
+            void setMeta(const T &meta)         {_meta = meta; _metaRef = _meta;}
         template <typename T>
-            void setBody(const T &body)         {_body = body; _bodySize = _body.size;}
+            void setBody(const T &body)         {_body = body; _bodyRef = _body; _bodySize = _body.size;}
+
+        /** These set the key/meta/body without copying; the caller is responsible for keeping
+            the memory valid until the Record is cleared or its data is reset. */
+        void setKeyNoCopy(slice key)            {_key = nullslice; _keyRef = key;}
+        void setMetaNoCopy(slice meta)          {_meta = nullslice; _metaRef = meta;}
+        void setBodyNoCopy(slice body)          {_body = nullslice; _bodyRef = body;
+                                                 _bodySize = body.size;}
 
         void setDeleted(bool deleted)           {_deleted = deleted; if (deleted) _exists = false;}
 
         /** Reallocs the 'meta' slice to the desired size. */
-        const alloc_slice& resizeMeta(size_t newSize)        {_meta.resize(newSize); return _meta;}
+        const alloc_slice& resizeMeta(size_t newSize) {
+            meta();
+            _meta.resize(newSize);
+            _metaRef = _meta;
+            return _meta;
+        }
 
         /** Clears/frees everything. */
         void clear() noexcept;
@@ -61,7 +98,7 @@ namespace litecore {
         void clearMetaAndBody() noexcept;
 
         void updateSequence(sequence_t s)       {_sequence = s;}
-        void setUnloadedBodySize(size_t size)   {_body = nullslice; _bodySize = size;}
+        void setUnloadedBodySize(size_t size)   {_body = _bodyRef = nullslice; _bodySize = size;}
 
         uint64_t bodyAsUInt() const noexcept;
         void setBodyAsUInt(uint64_t) noexcept;
@@ -76,7 +113,13 @@ namespace litecore {
             _sequence = sequence; _offset = offset; _deleted = deleted; _exists = !deleted;
         }
 
-        alloc_slice _key, _meta, _body;     // The key, metadata and body of the record
+        static const alloc_slice& adopt(alloc_slice &owned, slice &ref);
+
+        // The alloc_slices own the data; each slice points to the current data, which is either
+        // the same as its alloc_slice's, or borrowed memory. They're mutable because the const
+        // accessors copy a borrowed field on first use; that doesn't change the Record's value.
+        mutable alloc_slice _key, _meta, _body; // The key, metadata and body of the record
+        mutable slice _keyRef, _metaRef, _bodyRef;
         size_t      _bodySize {0};          // Size of body, if body wasn't loaded
         sequence_t  _sequence {0};          // Sequence number (if KeyStore supports sequences)
         uint64_t    _offset {0};            // File offset in db, if KeyStore supports that
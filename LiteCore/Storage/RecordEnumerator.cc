@@ -164,7 +164,7 @@ namespace litecore {
             close();
             return false;
         }
-        LogToAt(EnumLog, Debug, "enum:     --> [%s]", _record.key().hexCString());
+        LogToAt(EnumLog, Debug, "enum:     --> [%s]", _record.keySlice().hexCString());
         return true;
     }
 
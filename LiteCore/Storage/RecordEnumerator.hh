@@ -74,18 +74,19 @@ namespace litecore {
             next() must be called *before* accessing the first record! */
         bool next();
 
-        bool atEnd() const noexcept         {return !_record.key();}
+        bool atEnd() const noexcept         {return !_record.keySlice();}
 
         /** Stops the enumerator and frees its resources. (You only need to call this if the
             destructor might not be called soon enough.) */
         void close() noexcept;
 
-        /** The current record. */
+        /** The current record. It may be borrowed (see Record), so its slice accessors are only
+            valid until the next call to next(); copy the Record if you need to keep it. */
         const Record& record() const         {return _record;}
 
         // Can treat an enumerator as a record pointer:
-        operator const Record*() const    {return _record.key().buf ? &_record : nullptr;}
-        const Record* operator->() const  {return _record.key().buf ? &_record : nullptr;}
+        operator const Record*() const    {return _record.keySlice().buf ? &_record : nullptr;}
+        const Record* operator->() const  {return _record.keySlice().buf ? &_record : nullptr;}
 
         RecordEnumerator(const RecordEnumerator&) = delete;               // no copying allowed
         RecordEnumerator& operator=(const RecordEnumerator&) = delete;    // no assignment allowed
@@ -16,6 +16,7 @@
 #include "SQLiteDataFile.hh"
 #include "SQLiteKeyStore.hh"
 #include "SQLite_Internal.hh"
+#include "BodyCodec.hh"
 #include "Record.hh"
 #include "Error.hh"
 #include "FilePath.hh"
@@ -51,12 +52,25 @@ namespace litecore {
     // Amount of file to memory-map
     static const int64_t kMMapSize = 50 * MB;
 
+    // Maximum number of idle reader connections kept open
+    static const size_t kMaxIdleReaders = 4;
+
+    // Maximum number of reader connections checked out at once; beyond that, reads use the
+    // main connection instead of opening yet another one
+    static const size_t kMaxBusyReaders = 8;
+
     // If this fraction of the database is composed of free pages, vacuum it
     static const float kVacuumFractionThreshold = 0.25;
     // If the database has many bytes of free space, vacuum it
     static const int64_t kVacuumSizeThreshold = 50 * MB;
 
 
+    // kvmeta row that records the DataFile's BodyCodec, in its lastSeq column. (Its name can't
+    // collide with a KeyStore's, since those have to be valid SQL identifiers.) Files created
+    // without a codec, including those from older versions, don't have this row.
+    static const char* const kBodyCodecRow = ":bodyCodec";
+
+
     LogDomain SQL("SQL");
 
     void LogStatement(const SQLite::Statement &st) {
@@ -138,6 +152,8 @@ namespace litecore {
             error::_throw(error::UnsupportedEncryption);
 
         withFileLock([this]{
+            bool newFile = !tableExists("kvmeta");
+
             // http://www.sqlite.org/pragma.html
             stringstream sql;
             sql <<
@@ -146,10 +162,22 @@ namespace litecore {
             "PRAGMA journal_mode=WAL; "            // faster writes, better concurrency
             "PRAGMA journal_size_limit="<<kJournalSize<<"; "  // trim WAL file
             "PRAGMA auto_vacuum=incremental; "     // incremental vacuum mode
-            "PRAGMA synchronous=normal; "          // faster commits
+            "PRAGMA synchronous=" << (options().durableCommits ? "full" : "normal") << "; " // durable or faster commits
+            "PRAGMA recursive_triggers=1; "        // REPLACE fires delete triggers (FTS, kvold)
             "CREATE TABLE IF NOT EXISTS "          // Table of metadata about KeyStores
-            "kvmeta (name TEXT PRIMARY KEY, lastSeq INTEGER DEFAULT 0) WITHOUT ROWID";
+            "kvmeta (name TEXT PRIMARY KEY, lastSeq INTEGER DEFAULT 0, "
+                    "liveCount INTEGER, deletedCount INTEGER) WITHOUT ROWID";
             exec(sql.str());
+            upgradeKVMeta();
+
+            // The body codec is chosen when the file is created, and can't change afterwards:
+            if (newFile && options().compressBodies && options().writeable)
+                exec(string("INSERT INTO kvmeta (name, lastSeq) VALUES ('") + kBodyCodecRow
+                     + "', " + to_string(BodyCodec::kSnappy) + ")");
+            _bodyCodec = (BodyCodec::Type)intQuery((string("SELECT lastSeq FROM kvmeta WHERE name='")
+                                                    + kBodyCodecRow + "'").c_str());
+            if (_bodyCodec != BodyCodec::kNone && _bodyCodec != BodyCodec::kSnappy)
+                error::_throw(error::WrongFormat);     // written by a newer version
 
 #if DEBUG
             if (arc4random() % 1)              // deliberately make unordered queries unpredictable
@@ -170,13 +198,28 @@ namespace litecore {
     }
 
 
+    // Adds the record-count columns to a kvmeta table created by an older version.
+    // (Their NULL values tell the KeyStores to count their records the slow way, once.)
+    void SQLiteDataFile::upgradeKVMeta() {
+        SQLite::Statement info(*_sqlDb, "PRAGMA table_info(kvmeta)");
+        while (info.executeStep()) {
+            if (info.getColumn(1).getString() == "liveCount")
+                return;
+        }
+        if (options().writeable) {
+            exec("ALTER TABLE kvmeta ADD COLUMN liveCount INTEGER; "
+                 "ALTER TABLE kvmeta ADD COLUMN deletedCount INTEGER");
+        }
+    }
+
+
     void SQLiteDataFile::registerFleeceFunctions() {
         if (!_registeredFleeceFunctions) {
             auto sqlite = _sqlDb->getHandle();
-            RegisterFleeceFunctions    (sqlite, fleeceAccessor(), documentKeys());
-            RegisterFleeceEachFunctions(sqlite, fleeceAccessor(), documentKeys());
+            RegisterFleeceFunctions(sqlite, fleeceAccessor(), documentKeys(), _bodyCodec);
             RegisterFTSRankFunction(sqlite);
             register_unicodesn_tokenizer(sqlite);
+            RegisterFTSTokenizer(sqlite);
             _registeredFleeceFunctions = true;
         }
     }
@@ -191,6 +234,15 @@ namespace litecore {
         DataFile::close(); // closes all the KeyStores
         _getLastSeqStmt.reset();
         _setLastSeqStmt.reset();
+        _getCountsStmt.reset();
+        _dataVersionStmt.reset();
+        {
+            // Readers still checked out have the old file (and key); they're dropped on return
+            lock_guard<mutex> lock(_readersMutex);
+            _idleReaders.clear();
+            ++_readerGeneration;
+            _busyReaders = 0;
+        }
         if (_sqlDb) {
             maybeVacuum();
             _sqlDb.reset();
@@ -302,6 +354,8 @@ namespace litecore {
     void SQLiteDataFile::deleteKeyStore(const string &name) {
         execWithLock(string("DROP TABLE IF EXISTS kv_") + name);
         execWithLock(string("DROP TABLE IF EXISTS kvold_") + name);
+        execWithLock(string("DROP TABLE IF EXISTS kvexp_") + name);
+        execWithLock(string("DELETE FROM kvmeta WHERE name='") + name + "'");
     }
 
 
@@ -310,6 +364,7 @@ namespace litecore {
         Assert(_transaction == nullptr);
         LogTo(SQL, "BEGIN");
         _transaction = make_unique<SQLite::Transaction>(*_sqlDb);
+        _transactionThread = this_thread::get_id();
     }
 
 
@@ -327,6 +382,14 @@ namespace litecore {
             LogTo(SQL, "ROLLBACK");
         }
         _transaction.reset(); // destruct SQLite::Transaction, which will rollback if not committed
+        _transactionThread = thread::id();
+    }
+
+
+    void SQLiteDataFile::_transactionMovedToThread(Transaction*) {
+        // Reads on the new thread have to go through the writer to see uncommitted changes
+        Assert(_transaction != nullptr);
+        _transactionThread = this_thread::get_id();
     }
 
 
@@ -392,12 +455,53 @@ namespace litecore {
         return seq;
     }
 
-    void SQLiteDataFile::setLastSequence(SQLiteKeyStore &store, sequence seq) {
+    void SQLiteDataFile::getChangeStamp(int64_t &dataVersion, int64_t &totalChanges) const {
+        compile(_dataVersionStmt, "PRAGMA data_version");
+        UsingStatement u(_dataVersionStmt);
+        dataVersion = _dataVersionStmt->executeStep() ? (int64_t)_dataVersionStmt->getColumn(0) : 0;
+        totalChanges = sqlite3_total_changes(_sqlDb->getHandle());
+    }
+
+    // Reads the persistent record counts of a KeyStore; returns false if they're not known.
+    bool SQLiteDataFile::getRecordCounts(const string& keyStoreName,
+                                         int64_t &liveCount, int64_t &deletedCount) const
+    {
+        if (!_getCountsStmt) {
+            try {
+                compile(_getCountsStmt,
+                        "SELECT liveCount, deletedCount FROM kvmeta WHERE name=?");
+            } catch (const SQLite::Exception&) {
+                return false;       // read-only db with an old kvmeta schema
+            }
+        }
+        UsingStatement u(_getCountsStmt);
+        _getCountsStmt->bindNoCopy(1, keyStoreName);
+        if (!_getCountsStmt->executeStep()
+                || _getCountsStmt->getColumn(0).isNull()
+                || _getCountsStmt->getColumn(1).isNull())
+            return false;
+        liveCount = (int64_t)_getCountsStmt->getColumn(0);
+        deletedCount = (int64_t)_getCountsStmt->getColumn(1);
+        return true;
+    }
+
+    // Writes a KeyStore's row in kvmeta. Negative counts are stored as NULL (unknown.)
+    void SQLiteDataFile::setKeyStoreMeta(SQLiteKeyStore &store, sequence seq,
+                                         int64_t liveCount, int64_t deletedCount)
+    {
         compile(_setLastSeqStmt,
-                "INSERT OR REPLACE INTO kvmeta (name, lastSeq) VALUES (?, ?)");
+                "INSERT OR REPLACE INTO kvmeta (name, lastSeq, liveCount, deletedCount) "
+                "VALUES (?, ?, ?, ?)");
         UsingStatement u(_setLastSeqStmt);
         _setLastSeqStmt->bindNoCopy(1, store.name());
         _setLastSeqStmt->bind(2, (long long)seq);
+        if (liveCount >= 0 && deletedCount >= 0) {
+            _setLastSeqStmt->bind(3, (long long)liveCount);
+            _setLastSeqStmt->bind(4, (long long)deletedCount);
+        } else {
+            _setLastSeqStmt->bind(3);
+            _setLastSeqStmt->bind(4);
+        }
         _setLastSeqStmt->exec();
     }
 
@@ -445,4 +549,105 @@ namespace litecore {
         finishedCompacting();
     }
 
+
+#pragma mark - READERS:
+
+
+    SQLiteReader::SQLiteReader(const FilePath &path, const DataFile::Options &options,
+                               unsigned generation)
+    :_sqlDb(make_unique<SQLite::Database>(path.path().c_str(), SQLite::OPEN_READONLY))
+    ,_generation(generation)
+    {
+        if (options.encryptionAlgorithm != kNoEncryption) {
+            slice key = options.encryptionKey;
+            _sqlDb->exec(string("PRAGMA key = \"x'") + key.hexString() + "'\"");
+        }
+        stringstream sql;
+        sql << "PRAGMA mmap_size=" << kMMapSize;
+        _sqlDb->exec(sql.str());
+    }
+
+
+    SQLiteReader::~SQLiteReader() {
+        _statements.clear();    // statements must be finalized before the connection closes
+        _keyedStatements.clear();
+    }
+
+
+    SQLite::Statement& SQLiteReader::compile(const string &sql) {
+        auto &stmt = _statements[sql];
+        if (!stmt) {
+            try {
+                stmt = make_unique<SQLite::Statement>(*_sqlDb, sql);
+            } catch (const SQLite::Exception &x) {
+                Warn("SQLite error compiling statement \"%s\": %s", sql.c_str(), x.what());
+                _statements.erase(sql);
+                throw;
+            }
+        }
+        return *stmt;
+    }
+
+
+    SQLite::Statement* SQLiteReader::cachedStatement(const void *owner, unsigned key) {
+        auto i = _keyedStatements.find({owner, key});
+        return (i != _keyedStatements.end()) ? i->second.get() : nullptr;
+    }
+
+
+    SQLite::Statement& SQLiteReader::compile(const void *owner, unsigned key, const string &sql) {
+        try {
+            auto &stmt = _keyedStatements[{owner, key}];
+            stmt = make_unique<SQLite::Statement>(*_sqlDb, sql);
+            return *stmt;
+        } catch (const SQLite::Exception &x) {
+            Warn("SQLite error compiling statement \"%s\": %s", sql.c_str(), x.what());
+            _keyedStatements.erase({owner, key});
+            throw;
+        }
+    }
+
+
+    unique_ptr<SQLiteReader> SQLiteDataFile::checkOutReader() {
+        // Inside a transaction, reads have to see its uncommitted changes, so they must use
+        // the main connection:
+        if (_transactionThread == this_thread::get_id() || !isOpen())
+            return nullptr;
+        unsigned generation;
+        {
+            lock_guard<mutex> lock(_readersMutex);
+            if (!_idleReaders.empty()) {
+                auto reader = move(_idleReaders.back());
+                _idleReaders.pop_back();
+                ++_busyReaders;
+                return reader;
+            }
+            if (_busyReaders >= kMaxBusyReaders)
+                return nullptr;
+            ++_busyReaders;
+            generation = _readerGeneration;
+        }
+        try {
+            return make_unique<SQLiteReader>(filePath(), options(), generation);
+        } catch (const SQLite::Exception &x) {
+            Warn("Couldn't open SQLite reader connection: %s", x.what());
+            lock_guard<mutex> lock(_readersMutex);
+            if (generation == _readerGeneration)
+                --_busyReaders;
+            return nullptr;
+        }
+    }
+
+
+    void SQLiteDataFile::returnReader(unique_ptr<SQLiteReader> reader) {
+        if (!reader)
+            return;
+        lock_guard<mutex> lock(_readersMutex);
+        if (reader->generation() != _readerGeneration)
+            return;                 // File has been closed (or rekeyed) since; discard reader
+        --_busyReaders;
+        if (isOpen() && _idleReaders.size() < kMaxIdleReaders)
+            _idleReaders.push_back(move(reader));
+    }
+
 }
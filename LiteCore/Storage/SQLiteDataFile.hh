@@ -9,6 +9,15 @@
 #pragma once
 
 #include "DataFile.hh"
+#include "BodyCodec.hh"
+#include <map>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 namespace SQLite {
     class Database;
@@ -22,6 +31,37 @@ namespace litecore {
     class SQLiteKeyStore;
 
 
+    /** A read-only connection to a SQLiteDataFile's database file, with its own statement cache.
+        Reads that aren't part of a Transaction are made on these (see SQLiteDataFile::UsingReader)
+        so that multiple threads can read at once, and don't have to wait for a writer. */
+    class SQLiteReader {
+    public:
+        SQLiteReader(const FilePath&, const DataFile::Options&, unsigned generation);
+        ~SQLiteReader();
+
+        /** The SQLiteDataFile's reader generation when this was opened (see checkOutReader.) */
+        unsigned generation() const                         {return _generation;}
+
+        /** Returns a compiled statement for the SQL, compiling it the first time it's seen. */
+        SQLite::Statement& compile(const std::string &sql);
+
+        /** Returns the statement cached under an owner and a numeric key (like an enumerator's
+            shape), or nullptr. Saves building the SQL string just to look it up. */
+        SQLite::Statement* cachedStatement(const void *owner, unsigned key);
+
+        /** Compiles the SQL and caches it under the owner and key. */
+        SQLite::Statement& compile(const void *owner, unsigned key, const std::string &sql);
+
+    private:
+        using StatementKey = std::pair<const void*, unsigned>;
+
+        std::unique_ptr<SQLite::Database> _sqlDb;
+        std::unordered_map<std::string, std::unique_ptr<SQLite::Statement>> _statements;
+        std::map<StatementKey, std::unique_ptr<SQLite::Statement>> _keyedStatements;
+        unsigned const _generation;
+    };
+
+
     /** SQLite implementation of Database. */
     class SQLiteDataFile : public DataFile {
     public:
@@ -42,6 +82,14 @@ namespace litecore {
         bool keyStoreExists(const std::string &name);
         bool tableExists(const std::string &name) const;
 
+        /** The codec that record bodies in this file are stored with. */
+        BodyCodec::Type bodyCodec() const                   {return _bodyCodec;}
+
+        /** A cheap stamp of the file's contents: `dataVersion` changes when another connection
+            commits, `totalChanges` when this connection writes (including deletes & purges.)
+            If neither has changed, nothing in the file has. */
+        void getChangeStamp(int64_t &dataVersion, int64_t &totalChanges) const;
+
         class Factory : public DataFile::Factory {
         public:
             virtual const char* cname() override {return "SQLite";}
@@ -52,17 +100,40 @@ namespace litecore {
         };
 
         static Factory& factory();
+
+        /** Checks out a pooled reader connection, or returns nullptr if the caller should use the
+            main connection instead (because this thread is in a transaction, or too many readers
+            are already checked out.) */
+        std::unique_ptr<SQLiteReader> checkOutReader();
+
+        /** Returns a reader obtained from checkOutReader to the pool. */
+        void returnReader(std::unique_ptr<SQLiteReader>);
+
+        /** Checks out a reader (if possible) for the duration of a scope. */
+        class UsingReader {
+        public:
+            UsingReader(SQLiteDataFile &df)     :_df(df), _reader(df.checkOutReader()) { }
+            ~UsingReader()                      {_df.returnReader(std::move(_reader));}
+            SQLiteReader* get() const           {return _reader.get();}
+        private:
+            SQLiteDataFile &_df;
+            std::unique_ptr<SQLiteReader> _reader;
+        };
         
     protected:
         void reopen() override;
         void rekey(EncryptionAlgorithm, slice newKey) override;
         void _beginTransaction(Transaction*) override;
         void _endTransaction(Transaction*, bool commit) override;
+        void _transactionMovedToThread(Transaction*) override;
         KeyStore* newKeyStore(const std::string &name, KeyStore::Capabilities) override;
         void deleteKeyStore(const std::string &name) override;
 
         sequence lastSequence(const std::string& keyStoreName) const;
-        void setLastSequence(SQLiteKeyStore&, sequence);
+        bool getRecordCounts(const std::string& keyStoreName,
+                             int64_t &liveCount, int64_t &deletedCount) const;
+        void setKeyStoreMeta(SQLiteKeyStore&, sequence lastSeq,
+                             int64_t liveCount, int64_t deletedCount);
 
         SQLite::Statement& compile(const std::unique_ptr<SQLite::Statement>& ref,
                                    const char *sql) const;
@@ -70,6 +141,7 @@ namespace litecore {
         int execWithLock(const std::string &sql);
         int64_t intQuery(const char *query);
         void maybeVacuum();
+        void upgradeKVMeta();
         void registerFleeceFunctions();
 
     private:
@@ -79,8 +151,15 @@ namespace litecore {
 
         std::unique_ptr<SQLite::Database>    _sqlDb;         // SQLite database object
         std::unique_ptr<SQLite::Transaction> _transaction;   // Current SQLite transaction
-        std::unique_ptr<SQLite::Statement>   _getLastSeqStmt, _setLastSeqStmt;
+        std::unique_ptr<SQLite::Statement>   _getLastSeqStmt, _setLastSeqStmt, _getCountsStmt;
+        std::unique_ptr<SQLite::Statement>   _dataVersionStmt;
         bool _registeredFleeceFunctions {false};
+        BodyCodec::Type _bodyCodec {BodyCodec::kNone};      // How record bodies are stored
+        std::vector<std::unique_ptr<SQLiteReader>> _idleReaders; // Pool of reader connections
+        std::mutex _readersMutex;
+        unsigned _readerGeneration {0};     // Incremented by close(); older readers are dropped
+        size_t _busyReaders {0};            // Number of current-generation readers checked out
+        std::atomic<std::thread::id> _transactionThread {std::thread::id()}; // Thread in transaction
     };
 
 }
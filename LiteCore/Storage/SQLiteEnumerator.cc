@@ -23,51 +23,202 @@ using namespace fleece;
 
 namespace litecore {
 
-   class SQLiteEnumerator : public RecordEnumerator::Impl {
+    // Bits describing the shape of an enumerator's SQL query; used as a statement cache key.
+    enum EnumeratorShape : unsigned {
+        kBySequence     = 0x001,
+        kDescending     = 0x002,
+        kHasMin         = 0x004,
+        kHasMax         = 0x008,
+        kInclusiveMin   = 0x010,
+        kInclusiveMax   = 0x020,
+        kNoDeleted      = 0x040,
+        kMetaOnlyShape  = 0x080,
+        kLimitOffset    = 0x100,    // LIMIT and OFFSET are bound as the last two parameters
+    };
+
+    static const size_t kMaxCachedEnumStatements = 8;
+
+
+    // An enumerator's statement is either checked out of its KeyStore's statement cache, or
+    // (outside a transaction) belongs to a pooled reader connection that the enumerator holds.
+    // (Holding a reference to the KeyStore is safe: a DataFile never deletes its KeyStores
+    // before it's destructed, it only closes them.)
+    class SQLiteEnumerator : public RecordEnumerator::Impl {
     public:
-        SQLiteEnumerator(SQLite::Statement *stmt, bool descending, ContentOptions content)
-        :_stmt(stmt),
+        SQLiteEnumerator(SQLiteKeyStore &store, unsigned shape,
+                         SQLite::Statement &stmt,
+                         unique_ptr<SQLite::Statement> ownedStmt,
+                         unsigned stmtGeneration,
+                         unique_ptr<SQLiteReader> reader,
+                         ContentOptions content)
+        :_store(store),
+         _shape(shape),
+         _stmt(&stmt),
+         _ownedStmt(move(ownedStmt)),
+         _stmtGeneration(stmtGeneration),
+         _reader(move(reader)),
          _content(content)
         { }
 
+        virtual ~SQLiteEnumerator() {
+            if (_reader) {
+                try {
+                    _stmt->reset();
+                    _stmt->clearBindings();
+                    _store.db().returnReader(move(_reader));
+                } catch (const SQLite::Exception &x) {
+                    Warn("SQLite error resetting enumerator statement: %s", x.what());
+                }
+            } else {
+                _store.returnEnumeratorStatement(_shape, move(_ownedStmt), _stmtGeneration);
+            }
+        }
+
         virtual bool next() override {
             return _stmt->executeStep();
         }
 
+        // The Record borrows the statement's column memory, which stays valid until the
+        // next call to next(); RecordEnumerator clears the record before then.
         virtual bool read(Record &rec) override {
             updateDoc(rec, (int64_t)_stmt->getColumn(0), 0, (int)_stmt->getColumn(1));
-            rec.setKey(SQLiteKeyStore::columnAsSlice(_stmt->getColumn(2)));
-            SQLiteKeyStore::setRecordMetaAndBody(rec, *_stmt.get(), _content);
+            rec.setKeyNoCopy(SQLiteKeyStore::columnAsSlice(_stmt->getColumn(2)));
+            _store.setRecordMetaAndBody(rec, *_stmt, _content, false);
             return true;
         }
 
     private:
-        unique_ptr<SQLite::Statement> _stmt;
+        SQLiteKeyStore &_store;
+        unsigned _shape;
+        SQLite::Statement* _stmt;
+        unique_ptr<SQLite::Statement> _ownedStmt;
+        unsigned _stmtGeneration;
+        unique_ptr<SQLiteReader> _reader;
         ContentOptions _content;
     };
 
 
-    void SQLiteKeyStore::selectFrom(stringstream& in, const RecordEnumerator::Options &options) {
-        in << "SELECT sequence, deleted, key, meta";
-        if (options.contentOptions & kMetaOnly)
-            in << ", length(body)";
+#pragma mark - STATEMENT CACHE:
+
+
+    // Removes and returns an idle statement with the given shape, or compiles a new one.
+    // `generation` is set to the cache's current generation, which close() increments.
+    unique_ptr<SQLite::Statement> SQLiteKeyStore::checkOutEnumeratorStatement(unsigned shape,
+                                                                              unsigned &generation)
+    {
+        {
+            lock_guard<mutex> lock(_enumStmtMutex);
+            generation = _enumStmtGeneration;
+            for (auto i = _enumStmtCache.begin(); i != _enumStmtCache.end(); ++i) {
+                if (i->first == shape) {
+                    auto stmt = move(i->second);
+                    _enumStmtCache.erase(i);
+                    return stmt;
+                }
+            }
+        }
+        return unique_ptr<SQLite::Statement>(compile(enumeratorSQL(shape)));
+    }
+
+
+    // Called when an enumerator is done with its statement; keeps it for reuse. If the KeyStore
+    // has been closed since the statement was checked out, it's finalized instead.
+    void SQLiteKeyStore::returnEnumeratorStatement(unsigned shape,
+                                                   unique_ptr<SQLite::Statement> stmt,
+                                                   unsigned generation)
+    {
+        if (!stmt)
+            return;
+        lock_guard<mutex> lock(_enumStmtMutex);
+        if (generation != _enumStmtGeneration || !db().isOpen())
+            return;                             // `stmt` is finalized on return
+        try {
+            stmt->reset();
+            stmt->clearBindings();
+        } catch (const SQLite::Exception &x) {
+            Warn("SQLite error resetting enumerator statement: %s", x.what());
+            return;
+        }
+        _enumStmtCache.emplace_front(shape, move(stmt));
+        if (_enumStmtCache.size() > kMaxCachedEnumStatements)
+            _enumStmtCache.pop_back();
+    }
+
+
+#pragma mark - ENUMERATORS:
+
+
+    string SQLiteKeyStore::enumeratorSQL(unsigned shape) const {
+        stringstream sql;
+        sql << "SELECT sequence, deleted, key, meta";
+        if (shape & kMetaOnlyShape)
+            sql << ", length(body)";
         else
-            in << ", body";
-        in << " FROM kv_" << name();
+            sql << ", body";
+        sql << " FROM kv_" << name();
+
+        const char *col = (shape & kBySequence) ? "sequence" : "key";
+        bool writeAnd = false;
+        if (shape & (kHasMin | kHasMax | kNoDeleted))
+            sql << " WHERE ";
+        if (shape & kHasMin) {
+            sql << col << ((shape & kInclusiveMin) ? " >= ?" : " > ?");
+            writeAnd = true;
+        }
+        if (shape & kHasMax) {
+            if (writeAnd) sql << " AND "; else writeAnd = true;
+            sql << col << ((shape & kInclusiveMax) ? " <= ?" : " < ?");
+        }
+        if (shape & kNoDeleted) {
+            if (writeAnd) sql << " AND ";
+            sql << "deleted!=1";
+        }
+
+        sql << " ORDER BY " << col;
+        if (shape & kDescending)
+            sql << " DESC";
+        if (shape & kLimitOffset)
+            sql << " LIMIT ? OFFSET ?";
+        return sql.str();
     }
 
-    void SQLiteKeyStore::writeSQLOptions(stringstream &sql, RecordEnumerator::Options &options) {
+
+    // Common code of the newEnumeratorImpl methods. `bind` binds the range parameters.
+    RecordEnumerator::Impl* SQLiteKeyStore::newEnumerator(unsigned shape,
+                                                          RecordEnumerator::Options &options,
+                                                          function_ref<void(SQLite::Statement&)> bind)
+    {
         if (options.descending)
-            sql << " DESC";
-        if (options.limit < UINT_MAX)
-            sql << " LIMIT " << options.limit;
-        if (options.skip > 0) {
-            if (options.limit == UINT_MAX)
-                sql << " LIMIT -1";             // OFFSET has to have a LIMIT before it
-            sql << " OFFSET " << options.skip;
+            shape |= kDescending;
+        if (options.contentOptions & kMetaOnly)
+            shape |= kMetaOnlyShape;
+        if (_capabilities.softDeletes && !options.includeDeleted)
+            shape |= kNoDeleted;
+        if (options.limit < UINT_MAX || options.skip > 0)
+            shape |= kLimitOffset;
+
+        SQLite::Statement *stmt;
+        unique_ptr<SQLite::Statement> ownedStmt;
+        unsigned generation = 0;
+        auto reader = db().checkOutReader();
+        if (reader) {
+            stmt = reader->cachedStatement(this, shape);
+            if (!stmt)
+                stmt = &reader->compile(this, shape, enumeratorSQL(shape));
+        } else {
+            ownedStmt = checkOutEnumeratorStatement(shape, generation);
+            stmt = ownedStmt.get();
+        }
+        bind(*stmt);
+        if (shape & kLimitOffset) {
+            int param = 1 + !!(shape & kHasMin) + !!(shape & kHasMax);
+            stmt->bind(param,     (options.limit < UINT_MAX) ? (long long)options.limit : -1ll);
+            stmt->bind(param + 1, (long long)options.skip);
             options.skip = 0;                   // tells RecordEnumerator not to do skip on its own
         }
         options.limit = UINT_MAX;               // ditto for limit
+        return new SQLiteEnumerator(*this, shape, *stmt, move(ownedStmt), generation,
+                                    move(reader), options.contentOptions);
     }
 
 
@@ -75,35 +226,18 @@ namespace litecore {
     RecordEnumerator::Impl* SQLiteKeyStore::newEnumeratorImpl(slice minKey, slice maxKey,
                                                            RecordEnumerator::Options &options)
     {
-        stringstream sql;
-        selectFrom(sql, options);
-        bool noDeleted = _capabilities.softDeletes && !options.includeDeleted;
-        if (minKey.buf || maxKey.buf || noDeleted) {
-            sql << " WHERE ";
-            bool writeAnd = false;
-            if (minKey.buf) {
-                sql << (options.inclusiveMin() ? "key >= ?" : "key > ?");
-                writeAnd = true;
-            }
-            if (maxKey.buf) {
-                if (writeAnd) sql << " AND "; else writeAnd = true;
-                sql << (options.inclusiveMax() ? "key <= ?" : "key < ?");
-            }
-            if (_capabilities.softDeletes && noDeleted) {
-                if (writeAnd) sql << " AND "; //else writeAnd = true;
-                sql << "deleted!=1";
-            }
-        }
-        sql << " ORDER BY key";
-        writeSQLOptions(sql, options);
-
-        auto stmt = new SQLite::Statement(db(), sql.str());    //TODO: Cache a statement
-        int param = 1;
+        unsigned shape = 0;
         if (minKey.buf)
-            stmt->bind(param++, minKey.buf, (int)minKey.size);
+            shape |= kHasMin | (options.inclusiveMin() ? kInclusiveMin : 0);
         if (maxKey.buf)
-            stmt->bind(param++, maxKey.buf, (int)maxKey.size);
-        return new SQLiteEnumerator(stmt, options.descending, options.contentOptions);
+            shape |= kHasMax | (options.inclusiveMax() ? kInclusiveMax : 0);
+        return newEnumerator(shape, options, [&](SQLite::Statement &stmt) {
+            int param = 1;
+            if (minKey.buf)
+                stmt.bind(param++, minKey.buf, (int)minKey.size);
+            if (maxKey.buf)
+                stmt.bind(param++, maxKey.buf, (int)maxKey.size);
+        });
     }
 
     // iterate by sequence:
@@ -119,21 +253,14 @@ namespace litecore {
             _createdSeqIndex = true;
         }
 
-        stringstream sql;
-        selectFrom(sql, options);
-        sql << (options.inclusiveMin() ? " WHERE sequence >= ?" : " WHERE sequence > ?");
-        if (max < INT64_MAX)
-            sql << (options.inclusiveMax() ? " AND sequence <= ?"   : " AND sequence < ?");
-        if (_capabilities.softDeletes && !options.includeDeleted)
-            sql << " AND deleted!=1";
-        sql << " ORDER BY sequence";
-        writeSQLOptions(sql, options);
-
-        auto st = new SQLite::Statement(db(), sql.str());        // TODO: Cache a statement
-        st->bind(1, (long long)min);
+        unsigned shape = kBySequence | kHasMin | (options.inclusiveMin() ? kInclusiveMin : 0);
         if (max < INT64_MAX)
-            st->bind(2, (long long)max);
-        return new SQLiteEnumerator(st, options.descending, options.contentOptions);
+            shape |= kHasMax | (options.inclusiveMax() ? kInclusiveMax : 0);
+        return newEnumerator(shape, options, [&](SQLite::Statement &stmt) {
+            stmt.bind(1, (long long)min);
+            if (max < INT64_MAX)
+                stmt.bind(2, (long long)max);
+        });
     }
 
 }
@@ -9,6 +9,7 @@
 #include "SQLiteKeyStore.hh"
 #include "SQLiteDataFile.hh"
 #include "SQLite_Internal.hh"
+#include "BodyCodec.hh"
 #include "QueryParser.hh"
 #include "Record.hh"
 #include "RecordEnumerator.hh"
@@ -76,10 +77,28 @@ namespace litecore {
         _delByKeyStmt.reset();
         _delBySeqStmt.reset();
         _backupStmt.reset();
+        _getStateByKeyStmt.reset();
+        _getStateBySeqStmt.reset();
+        _setExpStmt.reset();
+        _delExpStmt.reset();
+        _getExpStmt.reset();
+        _nextExpStmt.reset();
+        _expiredKeysStmt.reset();
+        _expiredKeysAfterStmt.reset();
+        {
+            lock_guard<mutex> lock(_enumStmtMutex);
+            _enumStmtCache.clear();
+            ++_enumStmtGeneration;              // don't take back statements checked out before
+        }
         KeyStore::close();
     }
 
 
+    bool SQLiteKeyStore::inTransaction() const {
+        return db().inTransaction();
+    }
+
+
     string SQLiteKeyStore::subst(const char *sqlTemplate) const {
         string sql(sqlTemplate);
         size_t pos;
@@ -112,23 +131,109 @@ namespace litecore {
     }
 
 
-    uint64_t SQLiteKeyStore::recordCount() const {
-        if (!_recCountStmt) {
-            stringstream sql;
-            sql << "SELECT count(*) FROM kv_" << _name;
-            if (_capabilities.softDeletes)
-                sql << " WHERE deleted!=1";
-            compile(_recCountStmt, sql.str().c_str());
+#pragma mark - RECORD COUNTS:
+
+
+    // KeyStores with a TombstoneTest (i.e. the documents) keep their live and deleted record
+    // counts in kvmeta, updating them as records are written; inside a transaction they're
+    // cached in _liveCount and _deletedCount. Other KeyStores don't pay for a state lookup on
+    // every write, and count their records when asked.
+    void SQLiteKeyStore::getCounts(int64_t &liveCount, int64_t &deletedCount) const {
+        if (!_tombstoneTest) {
+            compile(_recCountStmt, "SELECT count(*) FROM kv_@ WHERE deleted!=1");
+            UsingStatement u(_recCountStmt);
+            liveCount = _recCountStmt->executeStep() ? (int64_t)_recCountStmt->getColumn(0) : 0;
+            deletedCount = 0;
+            return;
+        }
+        if (_liveCount >= 0) {
+            liveCount = _liveCount;
+            deletedCount = _deletedCount;
+            return;
         }
-        UsingStatement u(_recCountStmt);
-        if (_recCountStmt->executeStep()) {
-            auto count = (int64_t)_recCountStmt->getColumn(0);
-            return count;
+        bool changed = false;
+        if (!db().getRecordCounts(_name, liveCount, deletedCount)) {
+            // No saved counts (new KeyStore, or created by an older version), so count records.
+            // They're saved when the next transaction that writes to this KeyStore commits.
+            countRecords(liveCount, deletedCount);
+            changed = true;
         }
-        return 0;
+        if (db().inTransaction()) {
+            auto self = const_cast<SQLiteKeyStore*>(this);
+            self->_liveCount = liveCount;
+            self->_deletedCount = deletedCount;
+            self->_countsChanged = changed;
+        }
+    }
+
+
+    void SQLiteKeyStore::countRecords(int64_t &liveCount, int64_t &deletedCount) const {
+        liveCount = deletedCount = 0;
+        compile(_recCountStmt, "SELECT meta FROM kv_@ WHERE deleted!=1");
+        {
+            UsingStatement u(_recCountStmt);
+            while (_recCountStmt->executeStep()) {
+                if (stateForMeta(columnAsSlice(_recCountStmt->getColumn(0))) == kTombstone)
+                    ++deletedCount;
+                else
+                    ++liveCount;
+            }
+        }
+    }
+
+
+    void SQLiteKeyStore::updateCounts(RecordState oldState, RecordState newState) {
+        if (!_tombstoneTest || oldState == newState)
+            return;
+        Assert(_liveCount >= 0);        // loadCounts() must have been called before the write
+        if (oldState == kLiveRecord)
+            --_liveCount;
+        else if (oldState == kTombstone)
+            --_deletedCount;
+        if (newState == kLiveRecord)
+            ++_liveCount;
+        else if (newState == kTombstone)
+            ++_deletedCount;
+        _countsChanged = true;
+    }
+
+
+    // Returns the current state of the record with the given key (or sequence, if nonzero.)
+    // Only looked up if the KeyStore keeps counts; otherwise returns kNoRecord.
+    SQLiteKeyStore::RecordState SQLiteKeyStore::recordState(slice key, sequence seq) const {
+        if (!_tombstoneTest)
+            return kNoRecord;
+        auto &stmt = seq
+            ? compile(_getStateBySeqStmt, "SELECT deleted, meta FROM kv_@ WHERE sequence=?")
+            : compile(_getStateByKeyStmt, "SELECT deleted, meta FROM kv_@ WHERE key=?");
+        if (seq)
+            stmt.bind(1, (long long)seq);
+        else
+            stmt.bindNoCopy(1, key.buf, (int)key.size);
+        UsingStatement u(stmt);
+        if (!stmt.executeStep() || (int)stmt.getColumn(0) == 1)
+            return kNoRecord;
+        return stateForMeta(columnAsSlice(stmt.getColumn(1)));
     }
 
 
+    uint64_t SQLiteKeyStore::recordCount() const {
+        int64_t liveCount, deletedCount;
+        getCounts(liveCount, deletedCount);
+        return liveCount + deletedCount;
+    }
+
+
+    uint64_t SQLiteKeyStore::liveRecordCount() const {
+        int64_t liveCount, deletedCount;
+        getCounts(liveCount, deletedCount);
+        return liveCount;
+    }
+
+
+#pragma mark - SEQUENCES:
+
+
     sequence SQLiteKeyStore::lastSequence() const {
         if (_lastSequence >= 0)
             return _lastSequence;
@@ -148,12 +253,15 @@ namespace litecore {
 
 
     void SQLiteKeyStore::transactionWillEnd(bool commit) {
-        if (_lastSequenceChanged) {
+        if (_lastSequenceChanged || _countsChanged) {
             if (commit)
-                db().setLastSequence(*this, _lastSequence);
-            _lastSequenceChanged = false;
+                db().setKeyStoreMeta(*this, lastSequence(), _liveCount, _deletedCount);
+            _lastSequenceChanged = _countsChanged = false;
         }
         _lastSequence = -1;
+        _liveCount = _deletedCount = -1;
+        if (!commit)
+            _hasExpirationTable = false;    // in case the aborted transaction created it
     }
 
 
@@ -162,31 +270,84 @@ namespace litecore {
     }
 
 
-    // OPT: Would be nice to avoid copying key/meta/body here; this would require Record to
-    // know that the pointers are ephemeral, and create copies if they're accessed as
-    // alloc_slice (not just slice).
-
-
-    // Gets meta from column 3, and body (or its length) from column 4
-    /*static*/ void SQLiteKeyStore::setRecordMetaAndBody(Record &rec,
-                                                         SQLite::Statement &stmt,
-                                                         ContentOptions options)
+    // Gets meta from column 3, and body (or its length) from column 4.
+    // If `copy` is false, the Record will point into the statement's column memory, which is
+    // only valid until the statement is stepped or reset. (A compressed body is always copied.)
+    void SQLiteKeyStore::setRecordMetaAndBody(Record &rec,
+                                              SQLite::Statement &stmt,
+                                              ContentOptions options,
+                                              bool copy) const
     {
-        rec.setMeta(columnAsSlice(stmt.getColumn(3)));
-        if (options & kMetaOnly)
+        if (copy)
+            rec.setMeta(columnAsSlice(stmt.getColumn(3)));
+        else
+            rec.setMetaNoCopy(columnAsSlice(stmt.getColumn(3)));
+        if (options & kMetaOnly) {
+            // (With a body codec this is the stored size, which is close enough for callers)
             rec.setUnloadedBodySize((ssize_t)stmt.getColumn(4));
+            return;
+        }
+        slice body = columnAsSlice(stmt.getColumn(4));
+        if (db().bodyCodec() != BodyCodec::kNone) {
+            if (BodyCodec::isCompressed(body)) {
+                rec.setBody(BodyCodec::decodeCopy(body));
+                return;
+            }
+            alloc_slice unused;
+            body = BodyCodec::decode(body, unused);
+        }
+        if (copy)
+            rec.setBody(body);
         else
-            rec.setBody(columnAsSlice(stmt.getColumn(4)));
+            rec.setBodyNoCopy(body);
+    }
+
+
+    // Converts a record body to the form it's stored in the database, if that's different.
+    slice SQLiteKeyStore::encodeBody(slice body, alloc_slice &encoded) const {
+        if (db().bodyCodec() == BodyCodec::kNone)
+            return body;
+        encoded = BodyCodec::encode(body);
+        return encoded;
+    }
+
+
+    // These return the statement compiled on the given reader connection, if any, else on the
+    // main connection.
+    SQLite::Statement& SQLiteKeyStore::getByKeyStmt(ContentOptions options,
+                                                    SQLiteReader *reader) const
+    {
+        bool metaOnly = (options & kMetaOnly);
+        const char *sql = metaOnly
+            ? "SELECT sequence, deleted, 0, meta, length(body) FROM kv_@ WHERE key=?"
+            : "SELECT sequence, deleted, 0, meta, body FROM kv_@ WHERE key=?";
+        if (reader)
+            return reader->compile(subst(sql));
+        Assert(!inBorrowedGet());           // A get() callback may not re-enter this KeyStore
+        return compile((metaOnly ? _getMetaByKeyStmt : _getByKeyStmt), sql);
+    }
+
+
+    SQLite::Statement& SQLiteKeyStore::getBySeqStmt(ContentOptions options,
+                                                    SQLiteReader *reader) const
+    {
+        if (!_capabilities.sequences)
+            error::_throw(error::NoSequences);
+        bool metaOnly = (options & kMetaOnly);
+        const char *sql = metaOnly
+            ? "SELECT 0, deleted, key, meta, length(body) FROM kv_@ WHERE sequence=?"
+            : "SELECT 0, deleted, key, meta, body FROM kv_@ WHERE sequence=?";
+        if (reader)
+            return reader->compile(subst(sql));
+        Assert(!inBorrowedGet());           // A get() callback may not re-enter this KeyStore
+        return compile((metaOnly ? _getMetaBySeqStmt : _getBySeqStmt), sql);
     }
     
 
     bool SQLiteKeyStore::read(Record &rec, ContentOptions options) const {
-        auto &stmt = (options & kMetaOnly)
-            ? compile(_getMetaByKeyStmt,
-                      "SELECT sequence, deleted, 0, meta, length(body) FROM kv_@ WHERE key=?")
-            : compile(_getByKeyStmt,
-                      "SELECT sequence, deleted, 0, meta, body FROM kv_@ WHERE key=?");
-        stmt.bindNoCopy(1, rec.key().buf, (int)rec.key().size);
+        SQLiteDataFile::UsingReader reader(db());
+        auto &stmt = getByKeyStmt(options, reader.get());
+        stmt.bindNoCopy(1, rec.keySlice().buf, (int)rec.keySlice().size);
         UsingStatement u(stmt);
         if (!stmt.executeStep())
             return false;
@@ -200,15 +361,52 @@ namespace litecore {
     }
 
 
+    // Calls a get() callback with a Record that may point into `stmt`'s column memory. On the
+    // main connection the statement is shared, so re-entering this KeyStore from the callback
+    // would rebind it out from under the Record; flag that so getByKeyStmt/getBySeqStmt catch it.
+    // (The flag is the calling thread's ID, so that other threads aren't affected.)
+    void SQLiteKeyStore::callBorrowed(const Record &rec, SQLiteReader *reader,
+                                      function_ref<void(const Record&)> fn)
+    {
+        if (reader) {
+            fn(rec);                        // Statement belongs to a checked-out reader
+            return;
+        }
+        _borrowedGetThread = this_thread::get_id();
+        try {
+            fn(rec);
+        } catch (...) {
+            _borrowedGetThread = thread::id();
+            throw;
+        }
+        _borrowedGetThread = thread::id();
+    }
+
+
+    void SQLiteKeyStore::get(slice key, ContentOptions options,
+                             function_ref<void(const Record&)> fn)
+    {
+        Record rec;
+        rec.setKeyNoCopy(key);
+        SQLiteDataFile::UsingReader reader(db());
+        auto &stmt = getByKeyStmt(options, reader.get());
+        stmt.bindNoCopy(1, key.buf, (int)key.size);
+        UsingStatement u(stmt);
+        if (stmt.executeStep()) {
+            sequence seq = (int64_t)stmt.getColumn(0);
+            uint64_t offset = _capabilities.getByOffset ? seq : 0;
+            bool deleted = (int)stmt.getColumn(1);
+            updateDoc(rec, seq, offset, deleted);
+            setRecordMetaAndBody(rec, stmt, options, false);
+        }
+        callBorrowed(rec, reader.get(), fn);
+    }
+
+
     Record SQLiteKeyStore::get(sequence seq, ContentOptions options) const {
-        if (!_capabilities.sequences)
-            error::_throw(error::NoSequences);
         Record rec;
-        auto &stmt = (options & kMetaOnly)
-            ? compile(_getMetaBySeqStmt,
-                          "SELECT 0, deleted, key, meta, length(body) FROM kv_@ WHERE sequence=?")
-            : compile(_getBySeqStmt,
-                           "SELECT 0, deleted, key, meta, body FROM kv_@ WHERE sequence=?");
+        SQLiteDataFile::UsingReader reader(db());
+        auto &stmt = getBySeqStmt(options, reader.get());
         UsingStatement u(stmt);
         stmt.bind(1, (long long)seq);
         if (stmt.executeStep()) {
@@ -222,6 +420,25 @@ namespace litecore {
     }
 
 
+    void SQLiteKeyStore::get(sequence seq, ContentOptions options,
+                             function_ref<void(const Record&)> fn)
+    {
+        Record rec;
+        SQLiteDataFile::UsingReader reader(db());
+        auto &stmt = getBySeqStmt(options, reader.get());
+        UsingStatement u(stmt);
+        stmt.bind(1, (long long)seq);
+        if (stmt.executeStep()) {
+            uint64_t offset = _capabilities.getByOffset ? seq : 0;
+            bool deleted = (int)stmt.getColumn(1);
+            updateDoc(rec, seq, offset, deleted);
+            rec.setKeyNoCopy(columnAsSlice(stmt.getColumn(2)));
+            setRecordMetaAndBody(rec, stmt, options, false);
+        }
+        callBorrowed(rec, reader.get(), fn);
+    }
+
+
     Record SQLiteKeyStore::getByOffsetNoErrors(uint64_t offset, sequence seq) const {
         Assert(offset == seq);
         Record rec;
@@ -235,7 +452,11 @@ namespace litecore {
             updateDoc(rec, seq, seq);
             rec.setKey(columnAsSlice(stmt.getColumn(0)));
             rec.setMeta(columnAsSlice(stmt.getColumn(1)));
-            rec.setBody(columnAsSlice(stmt.getColumn(2)));
+            slice body = columnAsSlice(stmt.getColumn(2));
+            if (db().bodyCodec() != BodyCodec::kNone)
+                rec.setBody(BodyCodec::decodeCopy(body));
+            else
+                rec.setBody(body);
             return rec;
         } else {
             // Maybe the sequence is still current...
@@ -244,13 +465,22 @@ namespace litecore {
     }
 
 
+    SQLite::Statement& SQLiteKeyStore::setStmt() {
+        return compile(_setStmt,
+                "INSERT OR REPLACE INTO kv_@ (key, meta, body, sequence, deleted) VALUES (?, ?, ?, ?, 0)");
+    }
+
+
     KeyStore::setResult SQLiteKeyStore::set(slice key, slice meta, slice body, Transaction&) {
         LogTo(DBLog, "KeyStore(%s) set %s", name().c_str(), logSlice(key));
-        compile(_setStmt,
-                "INSERT OR REPLACE INTO kv_@ (key, meta, body, sequence, deleted) VALUES (?, ?, ?, ?, 0)");
+        loadCounts();
+        RecordState oldState = recordState(key, 0);
+        alloc_slice encoded;
+        slice storedBody = encodeBody(body, encoded);
+        setStmt();
         _setStmt->bindNoCopy(1, key.buf, (int)key.size);
         _setStmt->bindNoCopy(2, meta.buf, (int)meta.size);
-        _setStmt->bindNoCopy(3, body.buf, (int)body.size);
+        _setStmt->bindNoCopy(3, storedBody.buf, (int)storedBody.size);
 
         sequence seq = 0;
         if (_capabilities.sequences) {
@@ -262,10 +492,50 @@ namespace litecore {
         UsingStatement u(_setStmt);
         _setStmt->exec();
         setLastSequence(seq);
+        updateCounts(oldState, stateForMeta(meta));
         return {seq, (_capabilities.getByOffset ? seq : 0)};
     }
 
 
+    void SQLiteKeyStore::setMany(vector<Record> &records, Transaction &t) {
+        LogTo(DBLog, "KeyStore(%s) setMany: %zu records", name().c_str(), records.size());
+        loadCounts();
+        FTSPretokenizer pretokenizer;
+        pretokenizeFullText(records, pretokenizer);
+        auto &stmt = setStmt();
+        // Reserve sequences locally, instead of going through lastSequence() for each record:
+        sequence seq = _capabilities.sequences ? lastSequence() : 0;
+        for (auto &rec : records) {
+            if (rec.deleted()) {
+                // del() assigns its own sequence, so bring lastSequence up to date around it:
+                setLastSequence(seq);
+                del(rec, t);
+                if (_capabilities.sequences)
+                    seq = lastSequence();
+                continue;
+            }
+            slice key = rec.keySlice(), meta = rec.metaSlice();
+            alloc_slice encoded;
+            slice body = encodeBody(rec.bodySlice(), encoded);
+            RecordState oldState = recordState(key, 0);
+            stmt.bindNoCopy(1, key.buf, (int)key.size);
+            stmt.bindNoCopy(2, meta.buf, (int)meta.size);
+            stmt.bindNoCopy(3, body.buf, (int)body.size);
+            if (_capabilities.sequences)
+                stmt.bind(4, (long long)++seq);
+            else
+                stmt.bind(4);
+            {
+                UsingStatement u(stmt);
+                stmt.exec();
+            }
+            updateCounts(oldState, stateForMeta(meta));
+            updateDoc(rec, seq, (_capabilities.getByOffset ? seq : 0));
+        }
+        setLastSequence(seq);
+    }
+
+
     bool SQLiteKeyStore::_del(slice key, sequence delSeq, Transaction&) {
         auto& stmt = delSeq ? _delBySeqStmt : _delByKeyStmt;
         if (!stmt) {
@@ -281,6 +551,9 @@ namespace litecore {
             compile(stmt, sql.str().c_str());
         }
 
+        loadCounts();
+        RecordState oldState = recordState(key, delSeq);
+
         sequence newSeq = 0;
         int param = 1;
         if (_capabilities.softDeletes && _capabilities.sequences) {
@@ -296,6 +569,8 @@ namespace litecore {
         bool ok = stmt->exec() > 0;
         if (ok && newSeq > 0)
             setLastSequence(newSeq);
+        if (ok)
+            updateCounts(oldState, kNoRecord);
         return ok;
     }
 
@@ -303,11 +578,119 @@ namespace litecore {
     void SQLiteKeyStore::erase() {
         Transaction t(db());
         db().exec(string("DELETE FROM kv_"+name()));
+        if (hasExpirationTable())
+            db().exec(string("DELETE FROM kvexp_"+name()));
         setLastSequence(0);
+        if (_tombstoneTest) {
+            _liveCount = _deletedCount = 0;
+            _countsChanged = true;
+        }
         t.commit();
     }
 
 
+#pragma mark - EXPIRATION:
+
+
+    // Expiration times live in a separate compact table, kvexp_@, which is created the first
+    // time one is set. It has one row per expiring record and an index on the time, so setting
+    // a time is a single upsert and finding expired records is an index range scan.
+    bool SQLiteKeyStore::hasExpirationTable() const {
+        if (!_hasExpirationTable)
+            _hasExpirationTable = db().tableExists(string("kvexp_") + name());
+        return _hasExpirationTable;
+    }
+
+
+    void SQLiteKeyStore::setExpiration(slice key, expiration_t expiration, Transaction&) {
+        if (expiration == 0) {
+            if (!hasExpirationTable())
+                return;
+            auto &stmt = compile(_delExpStmt, "DELETE FROM kvexp_@ WHERE key=?");
+            stmt.bindNoCopy(1, key.buf, (int)key.size);
+            UsingStatement u(stmt);
+            stmt.exec();
+        } else {
+            if (!hasExpirationTable()) {
+                db().exec(subst("CREATE TABLE IF NOT EXISTS kvexp_@ "
+                                    "(key BLOB PRIMARY KEY, expiration INTEGER NOT NULL) "
+                                    "WITHOUT ROWID; "
+                                "CREATE INDEX IF NOT EXISTS kvexp_@_time ON kvexp_@ (expiration)"));
+                _hasExpirationTable = true;
+            }
+            auto &stmt = compile(_setExpStmt,
+                            "INSERT OR REPLACE INTO kvexp_@ (key, expiration) VALUES (?, ?)");
+            stmt.bindNoCopy(1, key.buf, (int)key.size);
+            stmt.bind(2, (long long)expiration);
+            UsingStatement u(stmt);
+            stmt.exec();
+        }
+    }
+
+
+    KeyStore::expiration_t SQLiteKeyStore::getExpiration(slice key) {
+        if (!hasExpirationTable())
+            return 0;
+        auto &stmt = compile(_getExpStmt, "SELECT expiration FROM kvexp_@ WHERE key=?");
+        stmt.bindNoCopy(1, key.buf, (int)key.size);
+        UsingStatement u(stmt);
+        if (!stmt.executeStep())
+            return 0;
+        return (int64_t)stmt.getColumn(0);
+    }
+
+
+    KeyStore::expiration_t SQLiteKeyStore::nextExpiration() {
+        if (!hasExpirationTable())
+            return 0;
+        auto &stmt = compile(_nextExpStmt, "SELECT min(expiration) FROM kvexp_@");
+        UsingStatement u(stmt);
+        if (!stmt.executeStep())
+            return 0;
+        return (int64_t)stmt.getColumn(0);      // NULL (empty table) reads as 0
+    }
+
+
+    vector<alloc_slice> SQLiteKeyStore::expiredKeys(expiration_t now, unsigned limit) {
+        vector<alloc_slice> keys;
+        if (!hasExpirationTable())
+            return keys;
+        auto &stmt = compile(_expiredKeysStmt,
+                             "SELECT key FROM kvexp_@ WHERE expiration <= ? "
+                             "ORDER BY expiration LIMIT ?");
+        stmt.bind(1, (long long)now);
+        stmt.bind(2, (long long)limit);
+        UsingStatement u(stmt);
+        while (stmt.executeStep())
+            keys.emplace_back(columnAsSlice(stmt.getColumn(0)));
+        return keys;
+    }
+
+
+    vector<pair<alloc_slice, KeyStore::expiration_t>>
+    SQLiteKeyStore::expiredKeysAfter(expiration_t now, expiration_t afterExpiration,
+                                     slice afterKey, unsigned limit)
+    {
+        vector<pair<alloc_slice, expiration_t>> keys;
+        if (!hasExpirationTable())
+            return keys;
+        // (The index on expiration includes the primary key, so it covers the ORDER BY.)
+        auto &stmt = compile(_expiredKeysAfterStmt,
+                             "SELECT key, expiration FROM kvexp_@ WHERE expiration <= ?1 "
+                             "AND (expiration > ?2 OR (expiration = ?2 AND key > ?3)) "
+                             "ORDER BY expiration, key LIMIT ?4");
+        stmt.bind(1, (long long)now);
+        stmt.bind(2, (long long)afterExpiration);
+        stmt.bindNoCopy(3, afterKey.buf ? afterKey.buf : "", (int)afterKey.size);
+        stmt.bind(4, (long long)limit);
+        UsingStatement u(stmt);
+        while (stmt.executeStep())
+            keys.emplace_back(columnAsSlice(stmt.getColumn(0)),
+                              (int64_t)stmt.getColumn(1));
+        return keys;
+    }
+
+
 #pragma mark - INDEXES:
 
 
@@ -361,44 +744,255 @@ namespace litecore {
         const Array *params;
         tie(expressionFleece, params) = parseIndexExpr(expression, type);
 
-        Transaction t(db());
         switch (type) {
             case  kValueIndex: {
+                // (SQLite builds the index in a single sorted pass, and won't use it until
+                // it's complete, so this can't be broken into chunks.)
+                Transaction t(db());
                 QueryParser qp(tableName());
                 qp.writeCreateIndex(params);
                 db().exec(qp.SQL());
+                t.commit();
                 break;
             }
             case kFullTextIndex: {
-                // Create the FTS4 virtual table: ( https://www.sqlite.org/fts3.html )
                 auto tableName = SQLIndexName(params, type);
-                stringstream sql;
-                sql << "CREATE VIRTUAL TABLE \"" << tableName << "\" USING fts4(text, tokenize=unicodesn";
-                if (options) {
-                    if (options->stemmer)
-                        sql << " \"stemmer=" << options->stemmer << "\"";
-                    if (options->ignoreDiacritics)
-                        sql << " \"remove_diacritics=1\"";
-                }
-                sql << ")";
-                db().exec(sql.str());
-
-                // Index existing records:
-                db().exec("INSERT INTO \"" + tableName + "\" (rowid, text) SELECT sequence, " + QueryParser::expressionSQL(params, "body") + " FROM kv_" + name());
-
-                // Set up triggers to keep the FTS5 table up to date:
-                string ins = "INSERT INTO \"" + tableName + "\" (rowid, text) VALUES (new.sequence, " + QueryParser::expressionSQL(params, "new.body") + "); ";
-                string del = "DELETE FROM \"" + tableName + "\" WHERE rowid = old.sequence; ";
-
-                db().exec(string("CREATE TRIGGER \"") + tableName + "::ins\" AFTER INSERT ON kv_" + name() + " BEGIN " + ins + " END");
-                db().exec(string("CREATE TRIGGER \"") + tableName + "::del\" AFTER DELETE ON kv_" + name() + " BEGIN " + del + " END");
-                db().exec(string("CREATE TRIGGER \"") + tableName + "::upd\" AFTER UPDATE ON kv_" + name() + " BEGIN " + del + ins + " END");
+                if (!db().tableExists(tableName))
+                    beginFTSIndex(tableName, params, options);
+                backfillIndex(tableName);
                 break;
             }
             default:
                 error::_throw(error::Unimplemented);
         }
+    }
+
+
+    // Registry of FTS indexes: the key-store each belongs to, the SQL expression (on `body`)
+    // giving the text it indexes, and its tokenizer arguments, so that writers can tokenize
+    // text ahead of time (see pretokenizeFullText). Also tracks online builds: `nextSeq` is the
+    // next sequence to backfill, or NULL once the build is done; `lastSeq` the last sequence
+    // that existed when the index's triggers were created. An index isn't queryable while
+    // it's being built.
+    static const char* const kFTSIndexesTable = "ftsindexes";
+
+    // Number of sequences backfilled per transaction:
+    static const sequence kIndexBuildChunkSize = 1000;
+
+
+    // The arguments to the unicodesn tokenizer for an FTS index.
+    static vector<string> tokenizerArgs(const KeyStore::IndexOptions *options) {
+        vector<string> args;
+        if (options) {
+            if (options->stemmer)
+                args.push_back(string("stemmer=") + options->stemmer);
+            if (options->ignoreDiacritics)
+                args.push_back("remove_diacritics=1");
+        }
+        return args;
+    }
+
+    // Tokenizer arguments are stored in kFTSIndexesTable separated by spaces.
+    static vector<string> splitTokenizerArgs(const string &str) {
+        vector<string> args;
+        stringstream in(str);
+        string arg;
+        while (in >> arg)
+            args.push_back(arg);
+        return args;
+    }
+
+
+    // Creates an FTS index's table and the triggers that keep it up to date, and records that
+    // the existing records still need to be indexed, by backfillIndex.
+    void SQLiteKeyStore::beginFTSIndex(const string &tableName,
+                                       const Array *params,
+                                       const IndexOptions *options)
+    {
+        Transaction t(db());
+
+        // Create the FTS4 virtual table: ( https://www.sqlite.org/fts3.html )
+        auto args = tokenizerArgs(options);
+        stringstream sql, argsStr;
+        sql << "CREATE VIRTUAL TABLE \"" << tableName << "\" USING fts4(text, tokenize=unicodesn";
+        for (auto &arg : args) {
+            sql << " \"" << arg << "\"";
+            argsStr << arg << " ";
+        }
+        sql << ")";
+        db().exec(sql.str());
+
+        // Set up triggers to keep the FTS5 table up to date:
+        string ins = "INSERT INTO \"" + tableName + "\" (rowid, text) VALUES (new.sequence, " + QueryParser::expressionSQL(params, "new.body") + "); ";
+        string del = "DELETE FROM \"" + tableName + "\" WHERE rowid = old.sequence; ";
+
+        db().exec(string("CREATE TRIGGER \"") + tableName + "::ins\" AFTER INSERT ON kv_" + name() + " BEGIN " + ins + " END");
+        db().exec(string("CREATE TRIGGER \"") + tableName + "::del\" AFTER DELETE ON kv_" + name() + " BEGIN " + del + " END");
+        db().exec(string("CREATE TRIGGER \"") + tableName + "::upd\" AFTER UPDATE ON kv_" + name() + " BEGIN " + del + ins + " END");
+
+        // Records written from now on get new sequences and are indexed by the triggers, so
+        // the backfill only has to cover the sequences that exist now:
+        db().exec(string("CREATE TABLE IF NOT EXISTS ") + kFTSIndexesTable +
+                  " (name TEXT PRIMARY KEY, keyStore TEXT, textSQL TEXT, tokenizer TEXT,"
+                  "  nextSeq INTEGER, lastSeq INTEGER) WITHOUT ROWID");
+        unique_ptr<SQLite::Statement> build(compile(string("INSERT INTO ") + kFTSIndexesTable +
+                                " (name, keyStore, textSQL, tokenizer, nextSeq, lastSeq)"
+                                " VALUES (?, ?, ?, ?, 1, ?)"));
+        build->bind(1, tableName);
+        build->bind(2, name());
+        build->bind(3, QueryParser::expressionSQL(params, "body"));
+        build->bind(4, argsStr.str());
+        build->bind(5, (long long)lastSequence());
+        build->exec();
+
+        // The backfill reads by sequence:
+        db().exec(string("CREATE UNIQUE INDEX IF NOT EXISTS kv_"+name()+"_seqs"
+                         " ON kv_"+name()+" (sequence)"));
         t.commit();
+        _createdSeqIndex = true;
+    }
+
+
+    // Indexes the records that existed when an FTS index was created, kIndexBuildChunkSize
+    // sequences at a time, each chunk in its own transaction so that other writers aren't
+    // blocked for the whole build. Also resumes a build that was interrupted.
+    // Each chunk's text is tokenized on multiple threads before it's inserted.
+    void SQLiteKeyStore::backfillIndex(const string &indexName) {
+        if (!db().tableExists(kFTSIndexesTable))
+            return;
+        bool done = false;
+        while (!done) {
+            Transaction t(db());
+            sequence nextSeq, lastSeq;
+            string textSQL, tokenizer;
+            {
+                unique_ptr<SQLite::Statement> get(compile(
+                                string("SELECT nextSeq, lastSeq, textSQL, tokenizer FROM ")
+                                + kFTSIndexesTable + " WHERE name=? AND nextSeq IS NOT NULL"));
+                get->bind(1, indexName);
+                if (!get->executeStep()) {
+                    t.abort();
+                    return;         // Nothing (left) to backfill
+                }
+                nextSeq = (int64_t)get->getColumn(0);
+                lastSeq = (int64_t)get->getColumn(1);
+                textSQL = get->getColumn(2).getString();
+                tokenizer = get->getColumn(3).getString();
+            }
+
+            sequence chunkEnd = min(lastSeq, nextSeq + kIndexBuildChunkSize - 1);
+            if (nextSeq <= chunkEnd) {
+                vector<long long> seqs;
+                vector<alloc_slice> texts;      // (null where the record has no text)
+                vector<slice> textsToTokenize;
+                {
+                    unique_ptr<SQLite::Statement> get(compile(string("SELECT sequence, ")
+                                    + textSQL + " FROM kv_" + name()
+                                    + " WHERE sequence BETWEEN ? AND ?"));
+                    get->bind(1, (long long)nextSeq);
+                    get->bind(2, (long long)chunkEnd);
+                    while (get->executeStep()) {
+                        seqs.push_back(get->getColumn(0));
+                        auto col = get->getColumn(1);
+                        if (col.isNull()) {
+                            texts.emplace_back();
+                        } else {
+                            texts.emplace_back(slice{col.getText(), (size_t)col.getBytes()});
+                            textsToTokenize.push_back(texts.back());
+                        }
+                    }
+                }
+
+                FTSPretokenizer pretokenizer;
+                pretokenizer.tokenize(splitTokenizerArgs(tokenizer), textsToTokenize);
+
+                unique_ptr<SQLite::Statement> insert(compile(string("INSERT INTO \"")
+                                    + indexName + "\" (rowid, text) VALUES (?, ?)"));
+                for (size_t i = 0; i < seqs.size(); ++i) {
+                    insert->bind(1, seqs[i]);
+                    if (texts[i])
+                        insert->bindNoCopy(2, (const char*)texts[i].buf, (int)texts[i].size);
+                    else
+                        insert->bind(2);
+                    insert->exec();
+                    insert->reset();
+                }
+            }
+
+            unique_ptr<SQLite::Statement> update;
+            done = (chunkEnd >= lastSeq);
+            if (done) {
+                // Finished; now the index can be queried:
+                update.reset(compile(string("UPDATE ") + kFTSIndexesTable +
+                                     " SET nextSeq=NULL WHERE name=?"));
+                update->bind(1, indexName);
+            } else {
+                update.reset(compile(string("UPDATE ") + kFTSIndexesTable +
+                                     " SET nextSeq=? WHERE name=?"));
+                update->bind(1, (long long)(chunkEnd + 1));
+                update->bind(2, indexName);
+            }
+            update->exec();
+            t.commit();
+            LogTo(DBLog, "KeyStore(%s) indexed sequences %llu-%llu of %llu into %s",
+                  name().c_str(), (unsigned long long)nextSeq, (unsigned long long)chunkEnd,
+                  (unsigned long long)lastSeq, indexName.c_str());
+        }
+    }
+
+
+    // Is this FTS index still being built by backfillIndex?
+    bool SQLiteKeyStore::indexIsBuilding(const string &indexName) const {
+        if (!db().tableExists(kFTSIndexesTable))
+            return false;
+        unique_ptr<SQLite::Statement> get(compile(string("SELECT 1 FROM ") + kFTSIndexesTable
+                                                  + " WHERE name=? AND nextSeq IS NOT NULL"));
+        get->bind(1, indexName);
+        return get->executeStep();
+    }
+
+
+    // Tokenizes the text that this store's FTS indexes will get from `records`, on multiple
+    // threads, so that the FTS triggers can reuse the results when the records are written.
+    void SQLiteKeyStore::pretokenizeFullText(const vector<Record> &records,
+                                             FTSPretokenizer &pretokenizer)
+    {
+        if (records.size() < 2 || !db().tableExists(kFTSIndexesTable))
+            return;
+        vector<pair<string,string>> indexes;   // textSQL, tokenizer
+        {
+            unique_ptr<SQLite::Statement> get(compile(string("SELECT textSQL, tokenizer FROM ")
+                                                      + kFTSIndexesTable + " WHERE keyStore=?"));
+            get->bind(1, name());
+            while (get->executeStep())
+                indexes.emplace_back(get->getColumn(0).getString(),
+                                     get->getColumn(1).getString());
+        }
+        if (indexes.empty())
+            return;
+
+        db().registerFleeceFunctions();
+        for (auto &index : indexes) {
+            // Evaluate the same expression the trigger will, so the text matches exactly:
+            unique_ptr<SQLite::Statement> getText(compile(string("SELECT ") + index.first
+                                                          + " FROM (SELECT ? AS body)"));
+            vector<alloc_slice> texts;
+            for (auto &rec : records) {
+                if (rec.deleted())
+                    continue;
+                alloc_slice encoded;
+                slice body = encodeBody(rec.bodySlice(), encoded);
+                getText->bindNoCopy(1, body.buf, (int)body.size);
+                if (getText->executeStep()) {
+                    auto col = getText->getColumn(0);
+                    if (!col.isNull())
+                        texts.emplace_back(slice{col.getText(), (size_t)col.getBytes()});
+                }
+                getText->reset();
+            }
+            pretokenizer.tokenize(splitTokenizerArgs(index.second),
+                                  vector<slice>(texts.begin(), texts.end()));
+        }
     }
 
 
@@ -415,7 +1009,16 @@ namespace litecore {
                 break;
             case kFullTextIndex: {
                 db().exec(string("DROP VIRTUAL TABLE ") + indexName);
-                // TODO: Do I have to explicitly delete the triggers too?
+                // The triggers aren't dropped along with the table they write to:
+                string tableName = SQLIndexName(params, type);
+                for (auto trigger : {"::ins", "::del", "::upd"})
+                    db().exec(string("DROP TRIGGER IF EXISTS \"") + tableName + trigger + "\"");
+                if (db().tableExists(kFTSIndexesTable)) {
+                    unique_ptr<SQLite::Statement> del(compile(string("DELETE FROM ")
+                                                              + kFTSIndexesTable + " WHERE name=?"));
+                    del->bind(1, tableName);
+                    del->exec();
+                }
                 break;
             }
             default:
@@ -433,7 +1036,7 @@ namespace litecore {
 
         switch (type) {
             case kFullTextIndex: {
-                return db().tableExists(indexName);
+                return db().tableExists(indexName) && !indexIsBuilding(indexName);
                 break;
             }
             default:
@@ -8,6 +8,10 @@
 
 #pragma once
 #include "KeyStore.hh"
+#include <atomic>
+#include <list>
+#include <mutex>
+#include <thread>
 
 namespace fleece {
     class Value;
@@ -22,22 +26,36 @@ namespace SQLite {
 namespace litecore {
 
     class SQLiteDataFile;
+    class SQLiteReader;
+    class FTSPretokenizer;
     
 
     /** SQLite implementation of KeyStore; corresponds to a SQL table. */
     class SQLiteKeyStore : public KeyStore {
     public:
         uint64_t recordCount() const override;
+        uint64_t liveRecordCount() const override;
         sequence lastSequence() const override;
 
         Record get(sequence, ContentOptions) const override;
+        void get(slice key, ContentOptions, function_ref<void(const Record&)>) override;
+        void get(sequence, ContentOptions, function_ref<void(const Record&)>) override;
         bool read(Record &rec, ContentOptions options) const override;
         Record getByOffsetNoErrors(uint64_t offset, sequence) const override;
 
         setResult set(slice key, slice meta, slice value, Transaction&) override;
+        void setMany(std::vector<Record> &records, Transaction&) override;
 
         void erase() override;
 
+        void setExpiration(slice key, expiration_t, Transaction&) override;
+        expiration_t getExpiration(slice key) override;
+        expiration_t nextExpiration() override;
+        std::vector<alloc_slice> expiredKeys(expiration_t now, unsigned limit =UINT_MAX) override;
+        std::vector<std::pair<alloc_slice, expiration_t>>
+            expiredKeysAfter(expiration_t now, expiration_t afterExpiration, slice afterKey,
+                             unsigned limit) override;
+
         bool supportsIndexes(IndexType t) const override               {return t == kValueIndex;}
         void createIndex(slice expressionJSON,
                          IndexType =kValueIndex,
@@ -64,9 +82,11 @@ namespace litecore {
         void close() override;
 
         static slice columnAsSlice(const SQLite::Column &col);
-        static void setRecordMetaAndBody(Record &rec,
-                                         SQLite::Statement &stmt,
-                                         ContentOptions options);
+        void setRecordMetaAndBody(Record &rec,
+                                  SQLite::Statement &stmt,
+                                  ContentOptions options,
+                                  bool copy =true) const;
+        slice encodeBody(slice body, alloc_slice &encoded) const;
 
     private:
         friend class SQLiteDataFile;
@@ -75,19 +95,60 @@ namespace litecore {
         
         SQLiteKeyStore(SQLiteDataFile&, const std::string &name, KeyStore::Capabilities options);
         SQLiteDataFile& db() const                    {return (SQLiteDataFile&)dataFile();}
+        bool inTransaction() const;
         std::string subst(const char *sqlTemplate) const;
-        void selectFrom(std::stringstream& in, const RecordEnumerator::Options &options);
-        void writeSQLOptions(std::stringstream &sql, RecordEnumerator::Options &options);
+        std::string enumeratorSQL(unsigned shape) const;
+        RecordEnumerator::Impl* newEnumerator(unsigned shape, RecordEnumerator::Options&,
+                                              function_ref<void(SQLite::Statement&)> bind);
         void setLastSequence(sequence seq);
+
+        enum RecordState {kNoRecord, kLiveRecord, kTombstone};
+        RecordState stateForMeta(slice meta) const {
+            return (_tombstoneTest && _tombstoneTest(meta)) ? kTombstone : kLiveRecord;
+        }
+        RecordState recordState(slice key, sequence seq) const;
+        void getCounts(int64_t &liveCount, int64_t &deletedCount) const;
+        void countRecords(int64_t &liveCount, int64_t &deletedCount) const;
+        void loadCounts()                   {int64_t l, d; if (_tombstoneTest) getCounts(l, d);}
+        void updateCounts(RecordState oldState, RecordState newState);
+        std::unique_ptr<SQLite::Statement> checkOutEnumeratorStatement(unsigned shape,
+                                                                       unsigned &generation);
+        void returnEnumeratorStatement(unsigned shape, std::unique_ptr<SQLite::Statement>,
+                                       unsigned generation);
+        SQLite::Statement& getByKeyStmt(ContentOptions, SQLiteReader* =nullptr) const;
+        SQLite::Statement& getBySeqStmt(ContentOptions, SQLiteReader* =nullptr) const;
+        SQLite::Statement& setStmt();
+        void callBorrowed(const Record&, SQLiteReader*, function_ref<void(const Record&)>);
+        bool inBorrowedGet() const {return _borrowedGetThread == std::this_thread::get_id();}
         std::string SQLIndexName(const fleece::Array*, IndexType, bool quoted =false);
+        void beginFTSIndex(const std::string &tableName, const fleece::Array*, const IndexOptions*);
+        void backfillIndex(const std::string &indexName);
+        bool indexIsBuilding(const std::string &indexName) const;
+        void pretokenizeFullText(const std::vector<Record>&, FTSPretokenizer&);
+        bool hasExpirationTable() const;
 
         std::unique_ptr<SQLite::Statement> _recCountStmt;
         std::unique_ptr<SQLite::Statement> _getByKeyStmt, _getMetaByKeyStmt, _getByOffStmt;
         std::unique_ptr<SQLite::Statement> _getBySeqStmt, _getMetaBySeqStmt;
         std::unique_ptr<SQLite::Statement> _setStmt, _backupStmt, _delByKeyStmt, _delBySeqStmt;
+        std::unique_ptr<SQLite::Statement> _getStateByKeyStmt, _getStateBySeqStmt;
+        std::unique_ptr<SQLite::Statement> _setExpStmt, _delExpStmt, _getExpStmt;
+        std::unique_ptr<SQLite::Statement> _nextExpStmt, _expiredKeysStmt, _expiredKeysAfterStmt;
+
+        // LRU cache of idle enumerator statements, keyed by the shape of their SQL:
+        using EnumStmtCache = std::list<std::pair<unsigned, std::unique_ptr<SQLite::Statement>>>;
+        EnumStmtCache _enumStmtCache;
+        unsigned _enumStmtGeneration {0};   // Incremented by close(), which empties the cache
+        std::mutex _enumStmtMutex;
+
+        // Thread running a get() callback that uses the main connection, if any:
+        std::atomic<std::thread::id> _borrowedGetThread {std::thread::id()};
         bool _createdSeqIndex {false};     // Created by-seq index yet?
         bool _lastSequenceChanged {false};
         int64_t _lastSequence {-1};
+        int64_t _liveCount {-1}, _deletedCount {-1};   // Record counts, if loaded (in a transaction)
+        bool _countsChanged {false};
+        mutable bool _hasExpirationTable {false};   // Known to have a kvexp_ table?
     };
 
 }
@@ -8,6 +8,7 @@
 
 #pragma once
 #include "DataFile.hh"
+#include "BodyCodec.hh"
 #include "Logging.hh"
 #include <memory>
 
@@ -46,8 +47,30 @@ namespace litecore {
     };
 
 
-    int RegisterFleeceFunctions(sqlite3 *db, DataFile::FleeceAccessor, fleece::SharedKeys*);
-    int RegisterFleeceEachFunctions(sqlite3 *db, DataFile::FleeceAccessor, fleece::SharedKeys*);
+    /** Registers the Fleece functions, and the fl_each table-valued function, on a connection. */
+    int RegisterFleeceFunctions(sqlite3 *db, DataFile::FleeceAccessor, fleece::SharedKeys*,
+                                BodyCodec::Type =BodyCodec::kNone);
     int RegisterFTSRankFunction(sqlite3 *db);
+    int RegisterFTSTokenizer(sqlite3 *db);
+
+
+    /** Runs the FTS tokenizer over a batch of texts on multiple threads, ahead of inserting them
+        into an FTS table. While this object is in scope, inserts of those texts on the calling
+        thread reuse the results instead of tokenizing inline. Small batches are left alone. */
+    class FTSPretokenizer {
+    public:
+        FTSPretokenizer() { }
+        ~FTSPretokenizer();
+
+        /** `tokenizerArgs` are the arguments the FTS table was declared with, after the
+            tokenizer name. */
+        void tokenize(const std::vector<std::string> &tokenizerArgs,
+                      const std::vector<slice> &texts);
+
+    private:
+        FTSPretokenizer(const FTSPretokenizer&) = delete;
+
+        std::vector<std::string> _keys;      // Cache entries added by this object
+    };
 
 }
@@ -0,0 +1,115 @@
+//
+//  MappedFile.cc
+//  LiteCore
+//
+//  Copyright © 2017 Couchbase. All rights reserved.
+//
+
+#include "MappedFile.hh"
+#include "Error.hh"
+#include "PlatformIO.hh"
+#include <stdio.h>
+#include <algorithm>
+
+#ifndef _MSC_VER
+#include <sys/mman.h>
+#include <unistd.h>
+#else
+#include <io.h>
+#include <Windows.h>
+#endif
+
+using namespace std;
+
+namespace litecore {
+
+    static const uint64_t kToEnd = UINT64_MAX;
+
+
+    MappedFile::MappedFile(const FilePath &path, uint64_t offset, uint64_t length) {
+        map(path, offset, length);
+    }
+
+
+    MappedFile::MappedFile(const FilePath &path) {
+        map(path, 0, kToEnd);
+    }
+
+
+    static size_t pageSize() {
+#ifndef _MSC_VER
+        static const size_t sPageSize = (size_t)sysconf(_SC_PAGESIZE);
+        return sPageSize;
+#else
+        // MapViewOfFile offsets have to be multiples of the allocation granularity:
+        static const size_t sPageSize = [] {
+            SYSTEM_INFO info;
+            GetSystemInfo(&info);
+            return (size_t)info.dwAllocationGranularity;
+        }();
+        return sPageSize;
+#endif
+    }
+
+
+    void MappedFile::map(const FilePath &path, uint64_t offset, uint64_t length) {
+        FILE *file = fopen_u8(path.path().c_str(), "rb");
+        if (!file)
+            error::_throwErrno();
+        try {
+            if (fseeko(file, 0, SEEK_END) != 0)
+                error::_throwErrno();
+            uint64_t fileSize = (uint64_t)ftello(file);
+            if (length == kToEnd)
+                length = fileSize - min(offset, fileSize);
+            if (offset > fileSize || length > fileSize - offset)
+                error::_throw(error::CorruptData);      // range extends past EOF
+            if (length > SIZE_MAX)    // overflow check for 32-bit
+                throw bad_alloc();
+
+            if (length > 0) {
+                // The mapping has to start on a page boundary:
+                uint64_t start = offset - (offset % pageSize());
+                _mappingSize = (size_t)(offset - start + length);
+#ifndef _MSC_VER
+                void *mapping = ::mmap(nullptr, _mappingSize, PROT_READ, MAP_PRIVATE,
+                                       fileno(file), (off_t)start);
+                if (mapping == MAP_FAILED)
+                    error::_throwErrno();
+                _mapping = mapping;
+#else
+                HANDLE fileHandle = (HANDLE)_get_osfhandle(_fileno(file));
+                _mappingHandle = CreateFileMappingW(fileHandle, nullptr, PAGE_READONLY,
+                                                    0, 0, nullptr);
+                if (!_mappingHandle)
+                    error::_throw(error::IOError);
+                _mapping = MapViewOfFile(_mappingHandle, FILE_MAP_READ,
+                                         (DWORD)(start >> 32), (DWORD)start, _mappingSize);
+                if (!_mapping) {
+                    CloseHandle(_mappingHandle);
+                    _mappingHandle = nullptr;
+                    error::_throw(error::IOError);
+                }
+#endif
+                _contents = slice((const uint8_t*)_mapping + (offset - start), (size_t)length);
+            }
+        } catch (...) {
+            fclose(file);
+            throw;
+        }
+        fclose(file);       // the mapping stays valid after the file is closed
+    }
+
+
+    MappedFile::~MappedFile() {
+        if (!_mapping)
+            return;
+#ifndef _MSC_VER
+        ::munmap(_mapping, _mappingSize);
+#else
+        UnmapViewOfFile(_mapping);
+        CloseHandle(_mappingHandle);
+#endif
+    }
+
+}
@@ -0,0 +1,43 @@
+//
+//  MappedFile.hh
+//  LiteCore
+//
+//  Copyright © 2017 Couchbase. All rights reserved.
+//
+
+#pragma once
+#include "Base.hh"
+#include "FilePath.hh"
+
+namespace litecore {
+
+    /** A read-only memory mapping of a file, or of a range of one. The mapped bytes stay valid
+        until the object is destroyed. (On Windows the file can't be deleted till then, either.) */
+    class MappedFile {
+    public:
+        /** Maps `length` bytes of a file starting at `offset`. */
+        MappedFile(const FilePath&, uint64_t offset, uint64_t length);
+
+        /** Maps an entire file. */
+        explicit MappedFile(const FilePath&);
+
+        ~MappedFile();
+
+        /** The mapped bytes. */
+        slice contents() const                  {return _contents;}
+
+    private:
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        void map(const FilePath&, uint64_t offset, uint64_t length);
+
+        slice _contents;                // The requested range
+        void* _mapping {nullptr};       // Start of the mapping (page-aligned)
+        size_t _mappingSize {0};
+#ifdef _MSC_VER
+        void* _mappingHandle {nullptr};
+#endif
+    };
+
+}
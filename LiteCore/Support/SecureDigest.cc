@@ -0,0 +1,84 @@
+//
+//  SecureDigest.cc
+//  LiteCore
+//
+//  Copyright © 2017 Couchbase. All rights reserved.
+//
+
+#include "SecureDigest.hh"
+#include <algorithm>
+#include <exception>
+#include <thread>
+#include <vector>
+
+#if SECURE_DIGEST_AVAILABLE
+
+using namespace std;
+
+namespace litecore {
+
+    // Below this much input per thread, spawning threads costs more than it saves:
+    static const size_t kMinBytesPerThread = 256 * 1024;
+
+    static const unsigned kMaxThreads = 8;
+
+
+    static void sha1Range(size_t begin, size_t end,
+                          function_ref<void(size_t, sha1Context*)> addInput,
+                          uint8_t *outDigests)
+    {
+        for (size_t i = begin; i < end; ++i) {
+            sha1Context ctx;
+            sha1_begin(&ctx);
+            addInput(i, &ctx);
+            sha1_end(&ctx, &outDigests[20 * i]);
+        }
+    }
+
+
+    void sha1_batch(size_t count,
+                    size_t totalBytes,
+                    function_ref<void(size_t, sha1Context*)> addInput,
+                    void *outDigests)
+    {
+        auto digests = (uint8_t*)outDigests;
+        size_t nThreads = min({(size_t)max(thread::hardware_concurrency(), 1u),
+                               (size_t)kMaxThreads,
+                               totalBytes / kMinBytesPerThread,
+                               count});
+        if (nThreads <= 1) {
+            sha1Range(0, count, addInput, digests);
+            return;
+        }
+
+        // Give each helper thread a contiguous range; the calling thread takes the last one:
+        size_t perThread = (count + nThreads - 1) / nThreads;
+        vector<thread> threads;
+        vector<exception_ptr> errors(nThreads);
+        size_t begin = 0;
+        for (size_t t = 0; t < nThreads - 1 && begin < count; ++t, begin += perThread) {
+            size_t end = min(begin + perThread, count);
+            threads.emplace_back([=, &errors] {
+                try {
+                    sha1Range(begin, end, addInput, digests);
+                } catch (...) {
+                    errors[t] = current_exception();
+                }
+            });
+        }
+        try {
+            sha1Range(begin, count, addInput, digests);
+        } catch (...) {
+            errors[nThreads - 1] = current_exception();
+        }
+        for (auto &t : threads)
+            t.join();
+        for (auto &error : errors) {
+            if (error)
+                rethrow_exception(error);
+        }
+    }
+
+}
+
+#endif
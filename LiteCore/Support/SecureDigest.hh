@@ -112,3 +112,25 @@
 
 #endif
 
+
+
+#if SECURE_DIGEST_AVAILABLE
+
+#include "function_ref.hh"
+
+namespace litecore {
+
+    /** Computes the SHA-1 digests of `count` independent inputs, spreading the work across
+        threads when there's enough data to be worth it. `addInput` is called once per input
+        with its index and a freshly begun context, and should sha1_add that input's data; it
+        may be called concurrently on different threads. `totalBytes` is the (approximate)
+        total input size. The digests are written consecutively to `outDigests`, 20 bytes each.
+        The platform SHA-1 implementations already use CPU SHA instructions when available. */
+    void sha1_batch(size_t count,
+                    size_t totalBytes,
+                    function_ref<void(size_t, sha1Context*)> addInput,
+                    void *outDigests);
+
+}
+
+#endif
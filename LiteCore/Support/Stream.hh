@@ -77,6 +77,9 @@ namespace litecore {
 
         virtual void write(slice) override;
         virtual void close() override                           {FileReadStream::close();}
+
+        /** Flushes buffered data and waits for the OS to write the file to disk. */
+        void sync();
     };
 
 }
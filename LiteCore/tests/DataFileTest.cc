@@ -15,6 +15,8 @@
 #include "Benchmark.hh"
 
 #include "LiteCoreTest.hh"
+#include <atomic>
+#include <thread>
 
 using namespace litecore;
 using namespace std;
@@ -194,6 +196,225 @@ N_WAY_TEST_CASE_METHOD (DataFileTestFixture, "DataFile EnumerateDocs", "[DataFil
 }
 
 
+N_WAY_TEST_CASE_METHOD (DataFileTestFixture, "DataFile BorrowedRecords", "[DataFile]") {
+    createNumberedDocs(store);
+
+    // Records returned by an enumerator may be borrowed; copies must survive advancing it:
+    vector<Record> kept;
+    {
+        RecordEnumerator e(*store);
+        for (int i = 1; e.next(); ++i) {
+            string expectedDocID = stringWithFormat("rec-%03d", i);
+            REQUIRE(e->keySlice() == slice(expectedDocID));
+            REQUIRE(e->bodySlice() == slice(expectedDocID));
+            if (i % 10 == 0)
+                kept.push_back(e.record());
+        }
+    }
+    REQUIRE(kept.size() == 10);
+    for (int i = 0; i < 10; ++i) {
+        string expectedDocID = stringWithFormat("rec-%03d", 10 * (i+1));
+        CHECK(!kept[i].isBorrowed());
+        CHECK(kept[i].key() == alloc_slice(expectedDocID));
+        CHECK(kept[i].body() == alloc_slice(expectedDocID));
+        CHECK(kept[i].sequence() == (sequence)(10 * (i+1)));
+    }
+
+    // Callback-based get:
+    bool called = false;
+    store->get("rec-042"_sl, kDefaultContent, [&](const Record &rec) {
+        called = true;
+        CHECK(rec.exists());
+        CHECK(rec.sequence() == 42);
+        CHECK(rec.bodySlice() == "rec-042"_sl);
+        // Getting one field as an alloc_slice copies only that field:
+        const void *keyBuf = rec.keySlice().buf;
+        CHECK(rec.body() == "rec-042"_sl);
+        CHECK(rec.bodySlice().buf == rec.body().buf);
+        CHECK(rec.keySlice().buf == keyBuf);
+        CHECK(rec.isBorrowed());
+    });
+    CHECK(called);
+    store->get((sequence)17, kDefaultContent, [&](const Record &rec) {
+        CHECK(rec.keySlice() == "rec-017"_sl);
+        Record copy = rec;
+        CHECK(!copy.isBorrowed());
+        CHECK(copy.body() == "rec-017"_sl);
+    });
+
+    // Inside a transaction the callback may not re-enter the store:
+    {
+        Transaction t(db);
+        store->get("rec-042"_sl, kDefaultContent, [&](const Record &rec) {
+            ExpectException(error::LiteCore, error::AssertionFailed, [&]{
+                store->get("rec-017"_sl);
+            });
+            CHECK(rec.bodySlice() == "rec-042"_sl);
+        });
+        CHECK(store->get("rec-017"_sl).body() == "rec-017"_sl);
+        t.abort();
+    }
+}
+
+
+N_WAY_TEST_CASE_METHOD (DataFileTestFixture, "DataFile EnumerateSkipLimit", "[DataFile]") {
+    createNumberedDocs(store);
+
+    // Run the same shapes of query repeatedly, so cached statements get reused with
+    // different bindings:
+    for (int pass = 0; pass < 3; ++pass) {
+        for (unsigned skip = 0; skip <= 20; skip += 10) {
+            RecordEnumerator::Options opts;
+            opts.skip = skip;
+            opts.limit = 5 + pass;
+            int i = 0;
+            RecordEnumerator e(*store, (sequence)0, UINT64_MAX, opts);
+            for (; e.next(); ++i)
+                REQUIRE(e->sequence() == (sequence)(skip + i + 1));
+            REQUIRE(i == 5 + pass);
+        }
+        RecordEnumerator::Options opts;
+        opts.skip = 95;
+        int i = 0;
+        RecordEnumerator e(*store, nullslice, nullslice, opts);
+        for (; e.next(); ++i)
+            REQUIRE(e->keySlice() == slice(stringWithFormat("rec-%03d", 96 + i)));
+        REQUIRE(i == 5);
+    }
+
+    // An enumerator still open when its KeyStore is closed must not return its statement to
+    // the (cleared) cache; the reopened store has to compile fresh ones:
+    {
+        Transaction t(db);
+        {
+            RecordEnumerator e(*store, (sequence)0, UINT64_MAX);
+            REQUIRE(e.next());
+            db->closeKeyStore(store->name());
+        }
+        store = &db->getKeyStore(store->name());
+        RecordEnumerator e(*store, (sequence)0, UINT64_MAX);
+        int i = 0;
+        for (; e.next(); ++i)
+            REQUIRE(e->sequence() == (sequence)(i + 1));
+        CHECK(i == 100);
+        t.commit();
+    }
+}
+
+
+static bool metaIsTombstone(slice meta) {
+    return meta.size > 0 && meta[0] == 'D';
+}
+
+N_WAY_TEST_CASE_METHOD (DataFileTestFixture, "DataFile RecordCounts", "[DataFile]") {
+    store->setTombstoneTest(&metaIsTombstone);
+    createNumberedDocs(store);
+    CHECK(store->recordCount() == 100);
+    CHECK(store->liveRecordCount() == 100);
+    {
+        Transaction t(db);
+        store->set("rec-001"_sl, "D"_sl, nullslice, t);     // live -> tombstone
+        store->set("rec-002"_sl, "D"_sl, nullslice, t);
+        store->set("rec-002"_sl, "L"_sl, "body"_sl, t);     // tombstone -> live
+        store->set("extra"_sl, "D"_sl, nullslice, t);       // new tombstone
+        store->del("rec-003"_sl, t);                         // purge a live record
+        store->del("nonexistent"_sl, t);
+        CHECK(store->recordCount() == 100);
+        CHECK(store->liveRecordCount() == 98);
+        t.commit();
+    }
+    CHECK(store->recordCount() == 100);
+    CHECK(store->liveRecordCount() == 98);
+
+    {
+        Transaction t(db);
+        store->set("rec-004"_sl, "D"_sl, nullslice, t);
+        t.abort();
+    }
+    CHECK(store->liveRecordCount() == 98);
+
+    // Counts persist across reopening:
+    reopenDatabase();
+    store->setTombstoneTest(&metaIsTombstone);
+    CHECK(store->recordCount() == 100);
+    CHECK(store->liveRecordCount() == 98);
+
+    store->erase();
+    CHECK(store->recordCount() == 0);
+    CHECK(store->liveRecordCount() == 0);
+}
+
+
+static bool metaIsAnything(slice) {
+    return true;
+}
+
+N_WAY_TEST_CASE_METHOD (DataFileTestFixture, "DataFile RecordCountsSaved", "[DataFile]") {
+    createNumberedDocs(store);                  // No TombstoneTest yet, so no counts are kept
+    store->setTombstoneTest(&metaIsTombstone);
+    CHECK(store->liveRecordCount() == 100);     // Counts by scanning; doesn't write
+    {
+        Transaction t(db);                      // The next write saves the counts
+        store->set("extra"_sl, "L"_sl, "body"_sl, t);
+        t.commit();
+    }
+
+    // A TombstoneTest that disagrees shows the counts now come from kvmeta, not a scan:
+    reopenDatabase();
+    store->setTombstoneTest(&metaIsAnything);
+    CHECK(store->recordCount() == 101);
+    CHECK(store->liveRecordCount() == 101);
+    {
+        // Counts read from kvmeta inside a transaction are cached, so writes can update them:
+        Transaction t(db);
+        store->set("extra2"_sl, "L"_sl, "body"_sl, t);  // (a tombstone, to metaIsAnything)
+        CHECK(store->recordCount() == 102);
+        CHECK(store->liveRecordCount() == 101);
+        t.commit();
+    }
+    CHECK(store->recordCount() == 102);
+}
+
+
+N_WAY_TEST_CASE_METHOD (DataFileTestFixture, "DataFile ConcurrentReads", "[DataFile]") {
+    createNumberedDocs(store);
+    atomic<int> failures {0};
+    auto reader = [&]{
+        try {
+            for (int round = 0; round < 5; ++round) {
+                for (int i = 1; i <= 100; i++) {
+                    string docID = stringWithFormat("rec-%03d", i);
+                    if (store->get(slice(docID)).body() != slice(docID))
+                        ++failures;
+                }
+                int n = 0;
+                for (RecordEnumerator e(*store); e.next(); )
+                    if (e->key().size >= 4 && memcmp(e->key().buf, "rec-", 4) == 0)
+                        ++n;
+                if (n != 100)
+                    ++failures;
+            }
+        } catch (...) {
+            ++failures;
+        }
+    };
+    thread t1(reader), t2(reader), t3(reader);
+    {
+        // Write while the readers are running; they shouldn't see these until commit,
+        // and shouldn't be blocked by the transaction.
+        Transaction t(db);
+        for (int i = 1; i <= 100; i++) {
+            string docID = stringWithFormat("new-%03d", i);
+            store->set(slice(docID), slice(docID), t);
+        }
+        t.commit();
+    }
+    t1.join(); t2.join(); t3.join();
+    CHECK(failures == 0);
+    CHECK(store->recordCount() == 200);
+}
+
+
 N_WAY_TEST_CASE_METHOD (DataFileTestFixture, "DataFile EnumerateDocsDescending", "[DataFile]") {
     RecordEnumerator::Options opts;
     opts.descending = true;
@@ -328,6 +549,48 @@ TEST_CASE_METHOD(DataFileTestFixture, "DataFile SELECT query", "[DataFile][Query
 }
 
 
+TEST_CASE_METHOD(DataFileTestFixture, "DataFile SELECT query cache", "[DataFile][Query]") {
+    addNumberedDocs(store);
+    unique_ptr<Query> query{ store->compileQuery(json5("['AND', ['>=', ['.', 'num'], 30], ['<=', ['.', 'num'], 40]]")) };
+    auto countRows = [&]() {
+        int n = 0;
+        for (QueryEnumerator e(query.get()); e.next(); ++n)
+            ;
+        return n;
+    };
+    CHECK(countRows() == 11);
+    CHECK(countRows() == 11);      // from the cache
+
+    // Changes to the KeyStore invalidate the cached result:
+    {
+        Transaction t(db);
+        fleece::Encoder enc;
+        enc.beginDictionary();
+        enc.writeKey("num");
+        enc.writeInt(35);
+        enc.endDictionary();
+        store->set("extra"_sl, litecore::nullslice, enc.extractOutput(), t);
+        t.commit();
+    }
+    CHECK(countRows() == 12);
+    {
+        Transaction t(db);
+        store->del("extra"_sl, t);
+        t.commit();
+    }
+    CHECK(countRows() == 11);
+
+    // Different skip/limit are cached separately:
+    QueryEnumerator::Options options;
+    options.limit = 5;
+    int n = 0;
+    for (QueryEnumerator e(query.get(), &options); e.next(); ++n)
+        ;
+    CHECK(n == 5);
+    CHECK(countRows() == 11);
+}
+
+
 TEST_CASE_METHOD(DataFileTestFixture, "DataFile SELECT WHAT query", "[DataFile][Query]") {
     addNumberedDocs(store);
     unique_ptr<Query> query{ store->compileQuery(json5(
@@ -399,6 +662,105 @@ TEST_CASE_METHOD(DataFileTestFixture, "DataFile FullTextQuery", "[DataFile][Quer
 }
 
 
+N_WAY_TEST_CASE_METHOD (DataFileTestFixture, "DataFile FTS Chunked Build", "[DataFile][Query]") {
+    // Enough records that the index is backfilled in several transactions:
+    static const int kNRecords = 2500;
+    auto writeRecord = [&](int i, const char *word, Transaction &t) {
+        string docID = stringWithFormat("rec-%04d", i);
+        fleece::Encoder enc;
+        enc.beginDictionary();
+        enc.writeKey("sentence");
+        enc.writeString(stringWithFormat("record number %d is %s", i, word));
+        enc.endDictionary();
+        alloc_slice body = enc.extractOutput();
+        store->set(slice(docID), litecore::nullslice, body, t);
+    };
+    {
+        Transaction t(store->dataFile());
+        for (int i = 0; i < kNRecords; i++)
+            writeRecord(i, (i % 10 == 0) ? "special" : "ordinary", t);
+        t.commit();
+    }
+
+    store->createIndex("[[\".sentence\"]]"_sl, KeyStore::kFullTextIndex);
+
+    auto countMatches = [&](const char *word) {
+        unique_ptr<Query> query{ store->compileQuery(json5(
+            stringWithFormat("['SELECT', {'WHERE': ['MATCH', ['.', 'sentence'], '%s']}]", word))) };
+        REQUIRE(query != nullptr);
+        unsigned rows = 0;
+        for (QueryEnumerator e(query.get()); e.next(); )
+            ++rows;
+        return rows;
+    };
+    CHECK(countMatches("special") == kNRecords / 10);
+    CHECK(countMatches("ordinary") == kNRecords - kNRecords / 10);
+
+    // Changes made after the build are indexed by the triggers:
+    {
+        Transaction t(store->dataFile());
+        writeRecord(1, "special", t);
+        writeRecord(kNRecords, "special", t);
+        t.commit();
+    }
+    CHECK(countMatches("special") == kNRecords / 10 + 2);
+    CHECK(countMatches("ordinary") == kNRecords - kNRecords / 10 - 1);
+
+    // Creating it again is a no-op:
+    store->createIndex("[[\".sentence\"]]"_sl, KeyStore::kFullTextIndex);
+    CHECK(countMatches("special") == kNRecords / 10 + 2);
+}
+
+
+N_WAY_TEST_CASE_METHOD (DataFileTestFixture, "DataFile FTS Bulk Import", "[DataFile][Query]") {
+    KeyStore::IndexOptions options = {"en", true};
+    store->createIndex("[[\".sentence\"]]"_sl, KeyStore::kFullTextIndex, &options);
+
+    // Enough text that setMany tokenizes it on several threads:
+    static const int kNRecords = 500;
+    string filler;
+    for (int i = 0; i < 100; i++)
+        filler += "and so on ";
+    vector<Record> records;
+    for (int i = 0; i < kNRecords; i++) {
+        Record rec(slice(stringWithFormat("rec-%04d", i)));
+        fleece::Encoder enc;
+        enc.beginDictionary();
+        enc.writeKey("sentence");
+        enc.writeString(stringWithFormat("record %d is %s %s", i,
+                                         (i % 5 == 0) ? "searching" : "waiting", filler.c_str()));
+        enc.endDictionary();
+        rec.setBody(enc.extractOutput());
+        records.push_back(move(rec));
+    }
+    {
+        Transaction t(store->dataFile());
+        store->setMany(records, t);
+        t.commit();
+    }
+
+    auto countMatches = [&](const char *word) {
+        unique_ptr<Query> query{ store->compileQuery(json5(
+            stringWithFormat("['SELECT', {'WHERE': ['MATCH', ['.', 'sentence'], '%s']}]", word))) };
+        REQUIRE(query != nullptr);
+        unsigned rows = 0;
+        for (QueryEnumerator e(query.get()); e.next(); )
+            ++rows;
+        return rows;
+    };
+    CHECK(countMatches("search") == kNRecords / 5);
+    CHECK(countMatches("wait") == kNRecords - kNRecords / 5);
+
+    // Updating a record replaces its terms:
+    {
+        Transaction t(store->dataFile());
+        store->set("rec-0000"_sl, litecore::nullslice, records[1].body(), t);
+        t.commit();
+    }
+    CHECK(countMatches("search") == kNRecords / 5 - 1);
+}
+
+
 N_WAY_TEST_CASE_METHOD (DataFileTestFixture, "DataFile AbortTransaction", "[DataFile]") {
     // Initial record:
     {
@@ -655,6 +1017,115 @@ N_WAY_TEST_CASE_METHOD (DataFileTestFixture, "DataFile ReadOnly", "[DataFile][!t
 }
 
 
+N_WAY_TEST_CASE_METHOD (DataFileTestFixture, "DataFile CompressBodies", "[DataFile][Query]") {
+    // Start over with a new file that compresses bodies:
+    auto dbPath = db->filePath();
+    auto options = db->options();
+    db->deleteDataFile();
+    delete db;
+    options.compressBodies = true;
+    db = newDatabase(dbPath, &options);
+    store = &db->defaultKeyStore();
+
+    auto makeBody = [](const char *size, const string &text) {
+        fleece::Encoder enc;
+        enc.beginDictionary();
+        enc.writeKey("size");
+        enc.writeString(size);
+        enc.writeKey("text");
+        enc.writeString(text);
+        enc.endDictionary();
+        return enc.extractOutput();
+    };
+    string longText;
+    for (int i = 0; i < 200; i++)
+        longText += "all work and no play makes jack a dull boy. ";
+    alloc_slice smallBody = makeBody("small", "tiny");
+    alloc_slice largeBody = makeBody("large", longText);
+    {
+        Transaction t(db);
+        store->set("small"_sl, litecore::nullslice, smallBody, t);
+        store->set("large"_sl, litecore::nullslice, largeBody, t);
+        vector<Record> records;
+        for (int i = 0; i < 10; i++) {
+            Record rec(slice(stringWithFormat("bulk-%d", i)));
+            rec.setBody(largeBody);
+            records.push_back(move(rec));
+        }
+        store->setMany(records, t);
+        t.commit();
+    }
+
+    auto checkBodies = [&]{
+        CHECK(store->get("small"_sl).body() == smallBody);
+        Record large = store->get("large"_sl);
+        CHECK(large.body() == largeBody);
+        CHECK(store->get(large.sequence()).body() == largeBody);
+        int n = 0;
+        for (RecordEnumerator e(*store); e.next(); ++n)
+            CHECK(e->body() == (e->key() == "small"_sl ? smallBody : largeBody));
+        CHECK(n == 12);
+
+        // Queries see the decompressed bodies too:
+        unique_ptr<Query> query{ store->compileQuery(json5(
+                                    "['SELECT', {'WHERE': ['=', ['.', 'size'], 'large']}]")) };
+        int rows = 0;
+        for (QueryEnumerator e(query.get()); e.next(); )
+            ++rows;
+        CHECK(rows == 11);
+    };
+    checkBodies();
+
+    // The codec is recorded in the file, so it still applies when reopened without the option:
+    options.compressBodies = false;
+    reopenDatabase(&options);
+    checkBodies();
+}
+
+
+N_WAY_TEST_CASE_METHOD (DataFileTestFixture, "DataFile Expiration", "[DataFile]") {
+    CHECK(store->nextExpiration() == 0);
+    CHECK(store->getExpiration("rec1"_sl) == 0);
+    CHECK(store->expiredKeys(2000).empty());
+    {
+        Transaction t(db);
+        store->set("rec1"_sl, "body1"_sl, t);
+        store->set("rec2"_sl, "body2"_sl, t);
+        store->set("rec3"_sl, "body3"_sl, t);
+        store->setExpiration("rec1"_sl, 1500, t);
+        store->setExpiration("rec2"_sl, 1000, t);
+        store->setExpiration("rec3"_sl, 3000, t);
+        store->setExpiration("rec3"_sl, 2500, t);     // overwrites
+        t.commit();
+    }
+    CHECK(store->getExpiration("rec1"_sl) == 1500);
+    CHECK(store->getExpiration("rec3"_sl) == 2500);
+    CHECK(store->nextExpiration() == 1000);
+
+    auto expired = store->expiredKeys(2000);
+    REQUIRE(expired.size() == 2);
+    CHECK(expired[0] == "rec2"_sl);
+    CHECK(expired[1] == "rec1"_sl);
+    CHECK(store->expiredKeys(2000, 1).size() == 1);
+
+    {
+        Transaction t(db);
+        store->setExpiration("rec2"_sl, 0, t);
+        t.commit();
+    }
+    CHECK(store->getExpiration("rec2"_sl) == 0);
+    CHECK(store->nextExpiration() == 1500);
+
+    // Expirations made in an aborted transaction don't stick:
+    {
+        Transaction t(db);
+        store->setExpiration("rec2"_sl, 500, t);
+        t.abort();
+    }
+    CHECK(store->nextExpiration() == 1500);
+}
+
+
 N_WAY_TEST_CASE_METHOD (DataFileTestFixture, "DataFile Compact", "[DataFile]") {
     createNumberedDocs(store);
 
@@ -733,7 +1204,19 @@ N_WAY_TEST_CASE_METHOD (DataFileTestFixture, "DataFile Rekey", "[DataFile]") {
     options.encryptionKey = alloc_slice(32);
     randomBytes(options.encryptionKey);
 
-    db->rekey(options.encryptionAlgorithm, options.encryptionKey);
+    {
+        RecordEnumerator e(*store);     // Holds a reader connection across the rekey
+        REQUIRE(e.next());
+        db->rekey(options.encryptionAlgorithm, options.encryptionKey);
+    }
+
+    // The reader opened before the rekey has the old file, so it mustn't be reused:
+    {
+        Transaction t(db);
+        store->set("after"_sl, "rekey"_sl, t);
+        t.commit();
+    }
+    CHECK(store->get("after"_sl).body() == "rekey"_sl);
 
     reopenDatabase(&options);
 
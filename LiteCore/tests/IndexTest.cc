@@ -195,3 +195,55 @@ N_WAY_TEST_CASE_METHOD (IndexTest, "Index DuplicateKeys", "[Index]") {
     Log("--- Second query");
     REQUIRE(doQuery() == 3);
 }
+
+
+N_WAY_TEST_CASE_METHOD (IndexTest, "Index UpdateBatch", "[Index]") {
+    // Each record's first string is the value, the rest are keys:
+    auto addRecord = [](std::vector<IndexWriter::RecordRows> &batch,
+                        const char *recordID, sequence seq, vector<string> body) {
+        IndexWriter::RecordRows rec {alloc_slice(recordID), seq, {}, {}};
+        for (unsigned i = 1; i < body.size(); i++) {
+            rec.keys.push_back(Collatable(CollatableBuilder(body[i])));
+            rec.values.emplace_back(body[0]);
+        }
+        batch.push_back(rec);
+    };
+
+    Log("--- Populate index");
+    {
+        Transaction trans(db);
+        IndexWriter writer(*index, trans);
+        std::vector<IndexWriter::RecordRows> batch;
+        addRecord(batch, "CA", 1, {"California", "San Jose", "San Francisco", "Cambria"});
+        addRecord(batch, "WA", 2, {"Washington", "Seattle", "Port Townsend", "Skookumchuk"});
+        addRecord(batch, "OR", 3, {"Oregon", "Portland", "Eugene"});
+        REQUIRE(writer.updateBatch(batch, _rowCount) == 3);
+        trans.commit();
+    }
+    REQUIRE(doQuery() == 8);
+
+    Log("--- Update, including a record that appears twice");
+    {
+        Transaction trans(db);
+        IndexWriter writer(*index, trans);
+        std::vector<IndexWriter::RecordRows> batch;
+        addRecord(batch, "OR", 4, {"Oregon", "Portland", "Walla Walla", "Salem"});
+        addRecord(batch, "CA", 5, {});
+        addRecord(batch, "WA", 6, {"Washington", "Seattle", "Port Townsend", "Skookumchuk"});
+        addRecord(batch, "OR", 7, {"Oregon", "Bend", "Walla Walla"});
+        REQUIRE(writer.updateBatch(batch, _rowCount) == 7);
+        trans.commit();
+    }
+    REQUIRE(doQuery() == 5);
+
+    Log("--- Update that changes nothing");
+    {
+        Transaction trans(db);
+        IndexWriter writer(*index, trans);
+        std::vector<IndexWriter::RecordRows> batch;
+        addRecord(batch, "WA", 8, {"Washington", "Seattle", "Port Townsend", "Skookumchuk"});
+        REQUIRE(writer.updateBatch(batch, _rowCount) == 0);
+        trans.commit();
+    }
+    REQUIRE(doQuery() == 5);
+}
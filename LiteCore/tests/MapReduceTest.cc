@@ -307,3 +307,22 @@ N_WAY_TEST_CASE_METHOD (MapReduceTest, "MapReduce Reopen", "[MapReduce]") {
     REQUIRE(index->lastSequenceIndexed() == lastIndexed);
     REQUIRE(index->lastSequenceChangedAt() == lastChangedAt);
 }
+
+
+TEST_CASE("ReduceAggregate", "[MapReduce][Reduce]") {
+    ReduceAggregate agg;
+    for (auto value : {"3", "-1.5", "2e1", "0", "0x10", " 7", "inf", "\"9\"", "01", "1."})
+        agg.add(slice(value));
+    CHECK(agg.count == 10);
+    CHECK(agg.numericCount == 4);       // Only the JSON numbers count
+    CHECK(agg.result(kSumReduce) == alloc_slice("21.5"));
+    CHECK(agg.result(kMinReduce) == alloc_slice("-1.5"));
+
+    // Removing the max makes min and max stale, but they survive encoding as such:
+    agg.remove("2e1"_sl);
+    CHECK(agg.minMaxStale);
+    ReduceAggregate decoded(agg.encode());
+    CHECK(decoded.minMaxStale);
+    CHECK(decoded.numericCount == 3);
+    CHECK(decoded.result(kSumReduce) == alloc_slice("1.5"));
+}
@@ -157,6 +157,25 @@ TEST_CASE("QueryParser SELECT WHAT", "[Query]") {
 }
 
 
+TEST_CASE("QueryParser record filter", "[Query]") {
+    auto parse = [](string json, bool filter) {
+        QueryParser qp("kv_default");
+        qp.setBaseResultColumns({"sequence"});
+        if (filter)
+            qp.setRecordFilter("$recordID");
+        qp.parseJSON(json5(json));
+        return make_pair(qp.SQL(), qp.rowsAreIndependent());
+    };
+    CHECK(parse("['=', ['.', 'last'], 'Smith']", true)
+          == make_pair(string("SELECT sequence FROM kv_default WHERE kv_default.key = $recordID AND (fl_value(body, 'last') = 'Smith')"), true));
+    CHECK(parse("['SELECT', {WHAT: ['._id'], WHERE: ['=', ['.', 'last'], 'Smith']}]", true)
+          == make_pair(string("SELECT sequence, key FROM kv_default WHERE kv_default.key = $recordID AND (fl_value(body, 'last') = 'Smith')"), true));
+    CHECK(!parse("['SELECT', {WHAT: ['._id'], ORDER_BY: [['.', 'first']]}]", false).second);
+    CHECK(!parse("['SELECT', {WHAT: [['MAX()', ['.weight']]]}]", false).second);
+    CHECK(!parse("['EXISTS', ['SELECT', {WHAT: ['._id']}]]", false).second);
+}
+
+
 TEST_CASE("QueryParser errors", "[Query][!throws]") {
     mustFail("['poop()', 1]");
     mustFail("['power()', 1]");
@@ -10,6 +10,7 @@
 #include "SQLite_Internal.hh"
 #include "Fleece.hh"
 #include "SQLiteCpp/SQLiteCpp.h"
+#include <sqlite3.h>
 
 using namespace litecore;
 using namespace fleece;
@@ -39,7 +40,6 @@ public:
         if (which & 1)
             sharedKeys = make_unique<SharedKeys>();
         RegisterFleeceFunctions(db.getHandle(), flip, sharedKeys.get());
-        RegisterFleeceEachFunctions(db.getHandle(), flip, sharedKeys.get());
         db.exec("CREATE TABLE kv (key TEXT, body BLOB)");
         insertStmt = make_unique<SQLite::Statement>(db, "INSERT INTO kv (key, body) VALUES (?, ?)");
     }
@@ -140,3 +140,47 @@ N_WAY_TEST_CASE_METHOD(SQLiteFunctionsTest, "SQLite fl_each with path", "[query]
     REQUIRE(query("SELECT DISTINCT kv.key FROM kv, fl_each(kv.body, 'hey') WHERE fl_each.value = 3")
             == (vector<string>{"one"}));
 }
+
+
+N_WAY_TEST_CASE_METHOD(SQLiteFunctionsTest, "SQLite fl_value cached paths", "[query]") {
+    // A constant path is compiled once per statement and reused on each row, so evaluate some
+    // over enough rows to be sure the reused path gives each row's own value:
+    vector<string> expectedN, expectedItem, expectedExists, expectedSum;
+    for (int i = 0; i < 200; ++i) {
+        string key = stringWithFormat("doc-%03d", i);
+        if (i % 10 == 0) {
+            insert(key.c_str(), "{\"other\": true}");
+            expectedN.push_back("");
+            expectedItem.push_back("");
+            expectedExists.push_back("0");
+            expectedSum.push_back("");
+        } else {
+            insert(key.c_str(),
+                   stringWithFormat("{\"n\": %d, \"hey\": [%d, %d]}", i, i, 2*i).c_str());
+            expectedN.push_back(to_string(i));
+            expectedItem.push_back(to_string(2*i));
+            expectedExists.push_back("1");
+            expectedSum.push_back(to_string(3*i));
+        }
+    }
+    CHECK(query("SELECT fl_value(body, 'n') FROM kv ORDER BY key") == expectedN);
+    CHECK(query("SELECT fl_value(body, 'hey[1]') FROM kv ORDER BY key") == expectedItem);
+    CHECK(query("SELECT fl_exists(body, 'n') FROM kv ORDER BY key") == expectedExists);
+    CHECK(query("SELECT fl_value(body, 'n') + fl_value(body, 'hey[1]') FROM kv ORDER BY key")
+          == expectedSum);
+
+    // A path that varies from row to row mustn't be served from the cache:
+    CHECK(query("SELECT fl_value(kv.body, p.path) FROM kv,"
+                " (SELECT 'n' AS path UNION ALL SELECT 'hey[1]') AS p"
+                " WHERE kv.key = 'doc-003' ORDER BY p.path")
+          == (vector<string>{"6", "3"}));
+
+    // A path that doesn't parse is reported as an error, not as a missing property:
+    ExpectException(error::SQLite, SQLITE_ERROR, [&]{
+        query("SELECT fl_value(body, 'hey[1') FROM kv");
+    });
+    ExpectException(error::SQLite, SQLITE_ERROR, [&]{
+        query("SELECT key FROM kv WHERE fl_exists(body, 'hey[1')");
+    });
+    CHECK(query("SELECT fl_value(body, 'n') FROM kv ORDER BY key") == expectedN);
+}
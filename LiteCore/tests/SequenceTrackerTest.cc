@@ -175,6 +175,48 @@ TEST_CASE_METHOD(litecore::SequenceTrackerTest, "SequenceTracker DocChangeNotifi
 }
 
 
+TEST_CASE_METHOD(litecore::SequenceTrackerTest, "SequenceTracker Purge", "[notification]") {
+    tracker.beginTransaction();
+    DatabaseChangeNotifier cn(tracker, nullptr);
+    tracker.documentChanged("A"_asl, ++seq);
+    tracker.documentChanged("B"_asl, ++seq);
+
+    int countA = 0;
+    sequence_t seqA = 999;
+    DocChangeNotifier cnA(tracker, "A"_sl, [&](DocChangeNotifier&, slice docID, sequence_t s) {
+        CHECK(docID == "A"_sl);
+        seqA = s;
+        ++countA;
+    });
+
+    tracker.documentPurged("A"_asl);
+    CHECK(countA == 1);
+    CHECK(seqA == 2);
+    CHECK(tracker.lastSequence() == seq);
+    REQUIRE_IF_DEBUG(dump() == "[(*, B@2, A@2)]");
+
+    // Sequences keep going up after a purge:
+    tracker.documentChanged("C"_asl, ++seq);
+    CHECK(tracker.lastSequence() == seq);
+    tracker.endTransaction(true);
+    REQUIRE_IF_DEBUG(dump() == "[*, B@2, A@2, C@3]");
+
+    // Observers starting from a sequence still see the right changes:
+    slice changes[5];
+    bool external;
+    DatabaseChangeNotifier cn1(tracker, nullptr, 1);
+    REQUIRE(cn1.readChanges(changes, 5, external) == 3);
+    CHECK(changes[0] == "B"_sl);
+    CHECK(changes[1] == "A"_sl);
+    CHECK(changes[2] == "C"_sl);
+    DatabaseChangeNotifier cn2(tracker, nullptr, 2);
+    REQUIRE(cn2.readChanges(changes, 5, external) == 1);
+    CHECK(changes[0] == "C"_sl);
+    DatabaseChangeNotifier cn3(tracker, nullptr, 3);
+    CHECK(!cn3.hasChanges());
+}
+
+
 TEST_CASE("SequenceTracker Transaction", "[notification]") {
     SequenceTracker tracker;
 
@@ -7,6 +7,7 @@
 //
 
 #include "VersionedDocument.hh"
+#include "RawRevTree.hh"
 #include "LiteCoreTest.hh"
 
 
@@ -168,3 +169,136 @@ N_WAY_TEST_CASE_METHOD (DataFileTestFixture, "VersionedDocument DocType", "[Vers
         REQUIRE(v.docType() == "moose"_sl);
     }
 }
+
+
+N_WAY_TEST_CASE_METHOD (DataFileTestFixture, "VersionedDocument SeparateRevBodies", "[VersionedDocument]") {
+    revidBuffer rev1ID("1-aaaa"_sl), rev2ID("2-bbbb"_sl), rev3ID("2-cccc"_sl);
+    litecore::slice rev1Data("body of revision"), rev2Data("second revision"),
+                    rev3Data("conflicting revision");
+    alloc_slice inlineBody;
+    {
+        // Without separate bodies, for comparison:
+        VersionedDocument v(*store, "bar"_sl);
+        int httpStatus;
+        v.insert(rev1ID, rev1Data, (Rev::Flags)0, revid(), false, httpStatus);
+        v.insert(rev2ID, rev2Data, (Rev::Flags)0, rev1ID, false, httpStatus);
+        v.insert(rev3ID, rev3Data, (Rev::Flags)0, rev1ID, true, httpStatus);
+        Transaction t(db);
+        v.save(t);
+        t.commit();
+        inlineBody = store->get("bar"_sl).body();
+    }
+    {
+        VersionedDocument v(*store, "foo"_sl);
+        v.setSeparateRevBodies(true);
+        int httpStatus;
+        v.insert(rev1ID, rev1Data, (Rev::Flags)0, revid(), false, httpStatus);
+        v.insert(rev2ID, rev2Data, (Rev::Flags)0, rev1ID, false, httpStatus);
+        v.insert(rev3ID, rev3Data, (Rev::Flags)0, rev1ID, true, httpStatus);
+        REQUIRE(httpStatus == 201);
+        Transaction t(db);
+        v.save(t);
+        t.commit();
+    }
+    KeyStore &bodies = db->getKeyStore(VersionedDocument::kRevBodyStoreName);
+    CHECK(bodies.recordCount() == 2);
+    {
+        VersionedDocument v(*store, "foo"_sl);
+        CHECK(v.record().body().size < inlineBody.size);
+        auto current = v.currentRevision();
+        CHECK(current->revID == rev3ID);
+        CHECK(current->body() == rev3Data);
+        CHECK_FALSE(current->hasExternalBody());
+
+        auto rev2 = v.get(rev2ID);
+        CHECK(rev2->body() == nullslice);
+        CHECK(rev2->hasExternalBody());
+        CHECK(rev2->isBodyAvailable());
+        CHECK(v.readBodyOfRevision(rev2) == rev2Data);
+        CHECK(v.readBodyOfRevision(v.get(rev1ID)) == rev1Data);
+
+        // Purging the conflict also removes the parent's body, since it's no longer a leaf:
+        v.setSeparateRevBodies(true);
+        REQUIRE(v.purge(rev2ID) == 1);
+        Transaction t(db);
+        v.save(t);
+        t.commit();
+    }
+    CHECK(bodies.recordCount() == 0);
+    {
+        VersionedDocument v(*store, "foo"_sl);
+        CHECK_FALSE(v.get(rev1ID)->isBodyAvailable());
+        CHECK(v.currentRevision()->body() == rev3Data);
+    }
+}
+
+
+N_WAY_TEST_CASE_METHOD (DataFileTestFixture, "VersionedDocument LazyDecode", "[VersionedDocument]") {
+    revidBuffer rev1ID("1-aaaa"_sl), rev2ID("2-bbbb"_sl);
+    {
+        VersionedDocument v(*store, "foo"_sl);
+        int httpStatus;
+        v.insert(rev1ID, "body of revision"_sl, Rev::kKeepBody, revid(), false, httpStatus);
+        v.insert(rev2ID, "second revision"_sl, (Rev::Flags)0, rev1ID, false, httpStatus);
+        Transaction t(db);
+        v.save(t);
+        t.commit();
+    }
+
+    VersionedDocument v(*store, "foo"_sl);
+    REQUIRE_FALSE(v.isExpanded());
+    RawRevTree raw = v.rawTree();
+    CHECK(raw.count() == 2);
+    auto current = raw.currentRevision();
+    CHECK(current.revID == rev2ID);
+    CHECK(current.body == "second revision"_sl);
+    CHECK(current.sequence == v.sequence());
+    CHECK((current.flags & Rev::kLeaf) != 0);
+
+    RawRevTree::Revision rev1;
+    REQUIRE(raw.get(rev1ID, rev1));
+    CHECK(rev1.body == "body of revision"_sl);
+    CHECK(rev1.parentIndex == UINT16_MAX);
+    CHECK_FALSE(raw.get(revidBuffer("3-cccc"_sl), rev1));
+    CHECK_FALSE(v.isExpanded());
+
+    // Accessing Revs expands the tree:
+    CHECK(v.currentRevision()->revID == rev2ID);
+    CHECK(v.isExpanded());
+    CHECK(v.get(rev1ID)->body() == "body of revision"_sl);
+}
+
+
+N_WAY_TEST_CASE_METHOD (DataFileTestFixture, "VersionedDocument LargeTreeLookup", "[VersionedDocument]") {
+    // Build a 100-rev history, big enough that lookups use the index:
+    vector<revidBuffer> history;
+    char revStr[32];
+    for (int gen = 100; gen >= 1; --gen) {
+        sprintf(revStr, "%d-%04x", gen, gen);
+        history.push_back(stringToRev(revStr));
+    }
+    RevTree tree;
+    REQUIRE(tree.insertHistory(history, "body"_sl, (Rev::Flags)0) == 100);
+    REQUIRE(tree.size() == 100);
+    for (auto &revID : history) {
+        auto rev = tree.get(revID);
+        REQUIRE(rev);
+        CHECK(rev->revID == revID);
+    }
+    CHECK(tree.get(stringToRev("101-0065")) == nullptr);
+
+    // Adding a branch and pruning have to keep the lookups consistent:
+    int httpStatus;
+    auto branch = stringToRev("51-ffff");
+    REQUIRE(tree.insert(branch, "branch"_sl, (Rev::Flags)0, history[50], true, httpStatus));
+    CHECK(tree.get(branch)->parent() == tree.get(history[50]));
+    CHECK(tree.getBySequence(0) != nullptr);
+
+    tree.sort();
+    CHECK(tree.prune(30) > 0);
+    CHECK(tree.get(history[99]) == nullptr);
+    REQUIRE(tree.get(history[0]));
+    CHECK(tree.get(history[0])->isLeaf());
+    REQUIRE(tree.get(branch));
+    CHECK(tree.get(branch)->body() == "branch"_sl);
+}